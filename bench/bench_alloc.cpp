@@ -0,0 +1,219 @@
+#include <proxything/app.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace proxything;
+
+// Counts heap allocations by interposing malloc() itself, which catches
+// operator new as well as anything Boost or libc allocate directly
+static std::atomic<std::size_t> allocations(0);
+
+extern "C" {
+	void* __libc_malloc(std::size_t size);
+	void* __libc_calloc(std::size_t n, std::size_t size);
+	void* __libc_realloc(void *p, std::size_t size);
+	void __libc_free(void *p);
+	
+	void* malloc(std::size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_malloc(size);
+	}
+	
+	void* calloc(std::size_t n, std::size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_calloc(n, size);
+	}
+	
+	void* realloc(void *p, std::size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		return __libc_realloc(p, size);
+	}
+	
+	void free(void *p)
+	{
+		__libc_free(p);
+	}
+}
+
+/**
+ * Connects to a local port, or returns -1.
+ */
+static int connect_to(unsigned short port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	
+	linger l = { 1, 0 };
+	::setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	
+	return fd;
+}
+
+/**
+ * Makes a request through the proxy and reads the whole response, without
+ * allocating anything itself.
+ */
+static bool fetch(unsigned short port, const char *cmd, std::size_t cmd_size, std::size_t size)
+{
+	int fd = connect_to(port);
+	if (fd == -1) {
+		return false;
+	}
+	
+	bool ok = ::write(fd, cmd, cmd_size) == static_cast<ssize_t>(cmd_size);
+	
+	static char buf[64 * 1024];
+	std::size_t received = 0;
+	while (ok && received < size) {
+		ssize_t n = ::read(fd, buf, sizeof(buf));
+		ok = n > 0;
+		received += ok ? n : 0;
+	}
+	
+	::shutdown(fd, SHUT_WR);
+	::close(fd);
+	return ok;
+}
+
+/**
+ * Serves the same object to every connection, until the socket is shut down.
+ */
+static void serve_upstream(int listener, const std::vector<char> &payload)
+{
+	int fd;
+	while ((fd = ::accept(listener, nullptr, nullptr)) != -1) {
+		std::size_t sent = 0;
+		while (sent < payload.size()) {
+			ssize_t n = ::write(fd, payload.data() + sent, payload.size() - sent);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		::close(fd);
+	}
+}
+
+/**
+ * Listens on an ephemeral loopback port, returning the socket.
+ */
+static int listen_any(unsigned short &port)
+{
+	int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	::listen(listener, 128);
+	::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+	port = ntohs(addr.sin_port);
+	return listener;
+}
+
+/**
+ * Measures heap allocations per request, for cache hits served from memory
+ * and from disk, one request per connection.
+ * 
+ * Every allocation in the process counts, including the proxy's background
+ * threads, so the numbers are an upper bound; the client side doesn't
+ * allocate. Each kind of request is warmed up first, so free lists and the
+ * like are filled before counting starts.
+ * 
+ * Usage: bench_alloc [requests]
+ */
+int main(int argc, char **argv)
+{
+	std::size_t requests = argc > 1 ? std::stoul(argv[1]) : 10000;
+	
+	// One object small enough for the memory cache, one only cached on disk
+	std::vector<char> small(1024, 'x');
+	std::vector<char> large(512 * 1024, 'y');
+	unsigned short small_port, large_port;
+	int small_listener = listen_any(small_port);
+	int large_listener = listen_any(large_port);
+	std::thread small_upstream(serve_upstream, small_listener, std::cref(small));
+	std::thread large_upstream(serve_upstream, large_listener, std::cref(large));
+	
+	unsigned short port = 23999;
+	std::vector<std::string> args = { "bench_alloc", "-q", "--threads", "1", "--port", std::to_string(port) };
+	std::vector<char*> app_argv;
+	for (auto &arg : args) {
+		app_argv.push_back(&arg[0]);
+	}
+	
+	app a;
+	std::thread runner([&]{ a.run(app_argv.size(), app_argv.data()); });
+	
+	int fd;
+	while ((fd = connect_to(port)) == -1) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	::close(fd);
+	
+	struct round
+	{
+		const char *name;
+		std::string cmd;
+		std::size_t size;
+	};
+	std::vector<round> rounds = {
+		{ "memory hit", "127.0.0.1:" + std::to_string(small_port) + "\r\n", small.size() },
+		{ "disk hit", "127.0.0.1:" + std::to_string(large_port) + "\r\n", large.size() },
+	};
+	
+	for (auto &r : rounds) {
+		// The first request is the miss that caches the object
+		fetch(port, r.cmd.data(), r.cmd.size(), r.size);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		for (std::size_t i = 0; i < requests / 10; i++) {
+			fetch(port, r.cmd.data(), r.cmd.size(), r.size);
+		}
+		
+		std::size_t failures = 0;
+		std::size_t before = allocations.load();
+		auto start = std::chrono::steady_clock::now();
+		for (std::size_t i = 0; i < requests; i++) {
+			failures += !fetch(port, r.cmd.data(), r.cmd.size(), r.size);
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::size_t counted = allocations.load() - before;
+		
+		std::cout << r.name << ": "
+			<< static_cast<double>(counted) / requests << " allocations/request, "
+			<< static_cast<std::size_t>(requests / elapsed) << " req/s"
+			<< (failures ? ", " + std::to_string(failures) + " failed" : "") << std::endl;
+	}
+	
+	a.stop();
+	runner.join();
+	
+	::shutdown(small_listener, SHUT_RDWR);
+	::shutdown(large_listener, SHUT_RDWR);
+	::close(small_listener);
+	::close(large_listener);
+	small_upstream.join();
+	large_upstream.join();
+	
+	return 0;
+}
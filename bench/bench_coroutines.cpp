@@ -0,0 +1,209 @@
+#include <proxything/app.h>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace proxything;
+
+/**
+ * Connects to a local port, or returns -1.
+ */
+static int connect_to(unsigned short port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/**
+ * Makes a request on an open connection and reads the whole response.
+ */
+static bool fetch(int fd, const std::string &cmd, std::size_t size)
+{
+	if (::write(fd, cmd.data(), cmd.size()) != static_cast<ssize_t>(cmd.size())) {
+		return false;
+	}
+	
+	static char buf[64 * 1024];
+	std::size_t received = 0;
+	while (received < size) {
+		ssize_t n = ::read(fd, buf, std::min(sizeof(buf), size - received));
+		if (n <= 0) {
+			return false;
+		}
+		received += n;
+	}
+	return true;
+}
+
+/**
+ * Serves the same object to every connection, until the socket is shut down.
+ */
+static void serve_upstream(int listener, const std::vector<char> &payload)
+{
+	int fd;
+	while ((fd = ::accept(listener, nullptr, nullptr)) != -1) {
+		std::size_t sent = 0;
+		while (sent < payload.size()) {
+			ssize_t n = ::write(fd, payload.data() + sent, payload.size() - sent);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		::close(fd);
+	}
+}
+
+/**
+ * Listens on an ephemeral loopback port, returning the socket.
+ */
+static int listen_any(unsigned short &port)
+{
+	int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	::listen(listener, 128);
+	::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+	port = ntohs(addr.sin_port);
+	return listener;
+}
+
+/**
+ * Returns the CPU time a thread has used, in seconds.
+ */
+static double cpu_time(std::thread &thread)
+{
+	clockid_t clock;
+	timespec ts = {};
+	if (::pthread_getcpuclockid(thread.native_handle(), &clock) == 0) {
+		::clock_gettime(clock, &ts);
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Compares the callback and coroutine connection pipelines, for cache hits
+ * served from memory and from disk, with requests made back to back on one
+ * connection.
+ * 
+ * Reports the 50th and 99th percentile latency of a request, and the CPU
+ * time the proxy's IO thread spends per request, which is where either
+ * pipeline runs; disk IO threads and the client aren't counted. The
+ * coroutine pipeline is only compared if it's been built in, with
+ * PROXYTHING_COROUTINES.
+ * 
+ * Usage: bench_coroutines [requests]
+ */
+int main(int argc, char **argv)
+{
+	std::size_t requests = argc > 1 ? std::stoul(argv[1]) : 10000;
+	
+	// One object small enough for the memory cache, one only cached on disk
+	std::vector<char> small(1024, 'x');
+	std::vector<char> large(512 * 1024, 'y');
+	unsigned short small_port, large_port;
+	int small_listener = listen_any(small_port);
+	int large_listener = listen_any(large_port);
+	std::thread small_upstream(serve_upstream, small_listener, std::cref(small));
+	std::thread large_upstream(serve_upstream, large_listener, std::cref(large));
+	
+	struct round
+	{
+		const char *name;
+		std::string cmd;
+		std::size_t size;
+	};
+	std::vector<round> rounds = {
+		{ "memory hit", "127.0.0.1:" + std::to_string(small_port) + "\r\n", small.size() },
+		{ "disk hit", "127.0.0.1:" + std::to_string(large_port) + "\r\n", large.size() },
+	};
+	
+	std::vector<std::string> modes = { "callbacks" };
+#ifdef PROXYTHING_HAVE_COROUTINES
+	modes.push_back("coroutines");
+#endif
+	
+	unsigned short port = 24999;
+	for (auto &mode : modes) {
+		port++;
+		std::vector<std::string> args = { "bench_coroutines", "-q", "--threads", "1", "--port", std::to_string(port) };
+		if (mode == "coroutines") {
+			args.push_back("--coroutines");
+		}
+		std::vector<char*> app_argv;
+		for (auto &arg : args) {
+			app_argv.push_back(&arg[0]);
+		}
+		
+		app a;
+		std::thread runner([&]{ a.run(app_argv.size(), app_argv.data()); });
+		
+		int fd;
+		while ((fd = connect_to(port)) == -1) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		
+		for (auto &r : rounds) {
+			// The first request is the miss that caches the object
+			fetch(fd, r.cmd, r.size);
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			for (std::size_t i = 0; i < requests / 10; i++) {
+				fetch(fd, r.cmd, r.size);
+			}
+			
+			std::size_t failures = 0;
+			std::vector<double> latencies;
+			latencies.reserve(requests);
+			double cpu_before = cpu_time(runner);
+			for (std::size_t i = 0; i < requests; i++) {
+				auto start = std::chrono::steady_clock::now();
+				failures += !fetch(fd, r.cmd, r.size);
+				latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+			}
+			double cpu = cpu_time(runner) - cpu_before;
+			
+			std::sort(latencies.begin(), latencies.end());
+			std::cout << std::fixed << std::setprecision(1) << mode << ", " << r.name << ": "
+				<< "p50 " << latencies[latencies.size() / 2] << " us, "
+				<< "p99 " << latencies[latencies.size() * 99 / 100] << " us, "
+				<< cpu / requests * 1e6 << " us CPU/request"
+				<< (failures ? ", " + std::to_string(failures) + " failed" : "") << std::endl;
+		}
+		
+		::close(fd);
+		a.stop();
+		runner.join();
+	}
+	
+	::shutdown(small_listener, SHUT_RDWR);
+	::shutdown(large_listener, SHUT_RDWR);
+	::close(small_listener);
+	::close(large_listener);
+	small_upstream.join();
+	large_upstream.join();
+	
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include <proxything/fs_entry.h>
+#include <proxything/util.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace proxything;
+
+/**
+ * Measures fs_entry throughput through asio::async_write and asio::async_read.
+ * 
+ * Usage: bench_fs_entry [megabytes] [chunk size in bytes]
+ */
+int main(int argc, char **argv)
+{
+	std::size_t total = (argc > 1 ? std::stoul(argv[1]) : 64) * 1024 * 1024;
+	std::size_t chunk = argc > 2 ? std::stoul(argv[2]) : 64 * 1024;
+	
+	std::string path = util::tmp_path();
+	std::vector<char> buf(chunk, 'x');
+	
+	typedef std::chrono::steady_clock clock;
+	auto report = [&](const char *what, clock::time_point start) {
+		double secs = std::chrono::duration<double>(clock::now() - start).count();
+		std::cout << what << ": " << (total / (1024.0 * 1024.0)) / secs << " MB/s"
+			<< " (" << total << " bytes in " << secs << "s, " << chunk << " byte chunks)" << std::endl;
+	};
+	
+	// Write the whole file in chunk-sized async_write calls
+	{
+		asio::io_service service;
+		fs_entry entry(service);
+		std::size_t written = 0;
+		std::function<void()> write_chunk;
+		write_chunk = [&]{
+			async_write(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+				written += size;
+				if (!ec && written < total) {
+					write_chunk();
+				} else {
+					entry.async_close();
+				}
+			});
+		};
+		
+		auto start = clock::now();
+		entry.async_open(path, std::ios_base::out|std::ios_base::binary, [&](const boost::system::error_code &ec) {
+			if (ec) {
+				std::cerr << "Couldn't open " << path << ": " << ec << std::endl;
+				return;
+			}
+			write_chunk();
+		});
+		service.run();
+		report("write", start);
+	}
+	
+	// Read it back in chunk-sized async_read calls, until EOF
+	{
+		asio::io_service service;
+		fs_entry entry(service);
+		std::size_t read = 0;
+		std::function<void()> read_chunk;
+		read_chunk = [&]{
+			async_read(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+				read += size;
+				if (!ec) {
+					read_chunk();
+				} else {
+					entry.async_close();
+				}
+			});
+		};
+		
+		auto start = clock::now();
+		entry.async_open(path, [&](const boost::system::error_code &ec) {
+			if (ec) {
+				std::cerr << "Couldn't open " << path << ": " << ec << std::endl;
+				return;
+			}
+			read_chunk();
+		});
+		service.run();
+		report("read", start);
+		
+		if (read != total) {
+			std::cerr << "Read " << read << " bytes, expected " << total << std::endl;
+		}
+	}
+	
+	fs::remove(path);
+	return 0;
+}
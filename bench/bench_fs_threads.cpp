@@ -0,0 +1,103 @@
+#include <proxything/fs_entry.h>
+#include <proxything/util.h>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace proxything;
+
+/**
+ * Drops a file from the page cache, so that reading it has to hit the disk.
+ */
+static void evict(const std::string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd != -1) {
+		::fdatasync(fd);
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(fd);
+	}
+}
+
+/**
+ * Measures concurrent cache hit throughput against the number of disk IO
+ * threads used by the threaded fs_service backend.
+ * 
+ * Every round evicts the files from the page cache, then opens all of them
+ * at once and reads them to the end in parallel, like concurrent cache hits.
+ * 
+ * Usage: bench_fs_threads [files] [kilobytes per file] [max threads]
+ */
+int main(int argc, char **argv)
+{
+	std::size_t num_files = argc > 1 ? std::stoul(argv[1]) : 64;
+	std::size_t file_size = (argc > 2 ? std::stoul(argv[2]) : 1024) * 1024;
+	std::size_t max_threads = argc > 3 ? std::stoul(argv[3]) : 16;
+	
+	std::vector<std::string> paths;
+	{
+		std::vector<char> content(file_size, 'x');
+		for (std::size_t i = 0; i < num_files; i++) {
+			paths.push_back(util::tmp_path());
+			std::ofstream f(paths.back(), std::ios_base::binary);
+			f.write(content.data(), content.size());
+		}
+	}
+	
+	typedef std::chrono::steady_clock clock;
+	for (std::size_t threads = 1; threads <= max_threads; threads *= 2) {
+		for (auto &path : paths) {
+			evict(path);
+		}
+		
+		asio::io_service service;
+		asio::add_service<fs_service>(service, new fs_service(service, fs_service::backend_type::threaded, threads));
+		
+		std::size_t total = 0;
+		std::vector<std::shared_ptr<fs_entry>> entries;
+		std::vector<std::vector<char>> bufs(num_files, std::vector<char>(64 * 1024));
+		std::vector<std::function<void()>> readers(num_files);
+		
+		auto start = clock::now();
+		for (std::size_t i = 0; i < num_files; i++) {
+			auto entry = std::make_shared<fs_entry>(service);
+			entries.push_back(entry);
+			
+			auto &buf = bufs[i];
+			auto &read_chunk = readers[i];
+			read_chunk = [&, entry]{
+				async_read(*entry, asio::buffer(buf), [&, entry](const boost::system::error_code &ec, std::size_t size) {
+					total += size;
+					if (!ec) {
+						read_chunk();
+					} else {
+						entry->async_close();
+					}
+				});
+			};
+			
+			entry->async_open(paths[i], [&, entry](const boost::system::error_code &ec) {
+				if (ec) {
+					std::cerr << "Couldn't open " << entry->filename() << ": " << ec << std::endl;
+					return;
+				}
+				read_chunk();
+			});
+		}
+		service.run();
+		
+		double secs = std::chrono::duration<double>(clock::now() - start).count();
+		std::cout << threads << " threads: " << (total / (1024.0 * 1024.0)) / secs << " MB/s, "
+			<< num_files / secs << " hits/s (" << num_files << " x " << file_size << " bytes in " << secs << "s)" << std::endl;
+	}
+	
+	for (auto &path : paths) {
+		fs::remove(path);
+	}
+	
+	return 0;
+}
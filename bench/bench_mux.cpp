@@ -0,0 +1,314 @@
+#include <proxything/app.h>
+#include <proxything/mux_session.h>
+#include <proxything/config.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace proxything;
+
+typedef std::chrono::steady_clock clock_type;
+typedef mux_session::frame_type frame_type;
+
+/**
+ * Connects to a local port, or returns -1.
+ */
+static int connect_to(unsigned short port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/**
+ * Writes all of a buffer, or returns false.
+ */
+static bool write_all(int fd, const char *data, std::size_t size)
+{
+	while (size) {
+		ssize_t n = ::write(fd, data, size);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Reads exactly a number of bytes, or returns false.
+ */
+static bool read_all(int fd, char *data, std::size_t size)
+{
+	while (size) {
+		ssize_t n = ::read(fd, data, size);
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/**
+ * Appends a frame to an output buffer.
+ */
+static void put_frame(std::string &out, std::uint32_t id, frame_type type, const std::string &payload)
+{
+	char header[mux_session::header_size];
+	mux_session::encode_header(header, id, type, payload.size());
+	out.append(header, sizeof(header));
+	out += payload;
+}
+
+/**
+ * Serves the same object to every connection, until the socket is shut down.
+ */
+static void serve_upstream(int listener, const std::vector<char> &payload)
+{
+	int fd;
+	while ((fd = ::accept(listener, nullptr, nullptr)) != -1) {
+		write_all(fd, payload.data(), payload.size());
+		::close(fd);
+	}
+}
+
+/**
+ * Makes requests over one text protocol connection, one at a time, until told
+ * to stop; returns false on failure.
+ */
+static bool run_text(unsigned short port, const std::string &target, std::size_t size, const std::atomic<bool> &running, std::vector<double> &latencies)
+{
+	int fd = connect_to(port);
+	if (fd == -1) {
+		return false;
+	}
+	
+	std::string cmd = target + "\r\n";
+	std::vector<char> response(size);
+	bool ok = true;
+	while (ok && running) {
+		auto t0 = clock_type::now();
+		ok = write_all(fd, cmd.data(), cmd.size()) && read_all(fd, response.data(), size);
+		if (ok) {
+			latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - t0).count());
+		}
+	}
+	
+	::close(fd);
+	return ok;
+}
+
+/**
+ * Makes requests over one multiplexed connection, keeping a number of streams
+ * open at all times, until told to stop; returns false on failure.
+ */
+static bool run_mux(unsigned short port, const std::string &target, std::size_t size, std::size_t depth, const std::atomic<bool> &running, std::vector<double> &latencies)
+{
+	int fd = connect_to(port);
+	if (fd == -1) {
+		return false;
+	}
+	
+	int one = 1;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	
+	static const std::string preamble = PROXYTHING_MUX_PREAMBLE "\r\n";
+	std::vector<char> ack(preamble.size());
+	if (!write_all(fd, preamble.data(), preamble.size()) || !read_all(fd, ack.data(), ack.size())) {
+		::close(fd);
+		return false;
+	}
+	
+	std::unordered_map<std::uint32_t, clock_type::time_point> started;
+	std::uint32_t next_id = 1;
+	std::size_t open = 0;
+	std::string out;
+	auto request = [&]{
+		started[next_id] = clock_type::now();
+		put_frame(out, next_id++, frame_type::request, target);
+		open++;
+	};
+	for (std::size_t i = 0; i < depth; i++) {
+		request();
+	}
+	
+	std::vector<char> in(256 * 1024);
+	std::size_t have = 0;
+	bool ok = true;
+	while (ok && (open || !out.empty())) {
+		ok = write_all(fd, out.data(), out.size());
+		out.clear();
+		
+		ssize_t n = ok ? ::read(fd, in.data() + have, in.size() - have) : 0;
+		ok = n > 0;
+		have += ok ? n : 0;
+		
+		std::size_t at = 0;
+		while (ok && have - at >= mux_session::header_size) {
+			std::uint32_t id, length;
+			frame_type type;
+			mux_session::decode_header(in.data() + at, id, type, length);
+			if (have - at < mux_session::header_size + length) {
+				break;
+			}
+			at += mux_session::header_size + length;
+			
+			if (type == frame_type::data) {
+				// Objects larger than a window need more granted as they go
+				if (size > PROXYTHING_MUX_WINDOW) {
+					std::string increment = { char(length >> 24), char(length >> 16), char(length >> 8), char(length) };
+					put_frame(out, id, frame_type::window, increment);
+				}
+			} else if (type == frame_type::end) {
+				latencies.push_back(std::chrono::duration<double, std::micro>(clock_type::now() - started[id]).count());
+				started.erase(id);
+				open--;
+				if (running) {
+					request();
+				}
+			} else {
+				ok = false;
+			}
+		}
+		
+		std::memmove(in.data(), in.data() + at, have - at);
+		have -= at;
+	}
+	
+	::close(fd);
+	return ok;
+}
+
+/**
+ * Measures request throughput and latency for the text protocol and the
+ * multiplexed one, with the same number of requests in flight.
+ * 
+ * Each round starts a proxy, warms its memory cache with one object from a
+ * local upstream, then keeps connections x depth requests in flight for a
+ * while: over as many text protocol connections, each making one request at
+ * a time, or over a few multiplexed connections, each with a number of
+ * streams open. Every request is a memory cache hit, so this measures the
+ * per-request overhead of each protocol, and what many connections cost
+ * compared to many streams.
+ * 
+ * Usage: bench_mux [seconds per round] [connections] [streams per connection] [object bytes] [threads]
+ */
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? std::stod(argv[1]) : 2.0;
+	std::size_t num_connections = argc > 2 ? std::stoul(argv[2]) : 4;
+	std::size_t depth = argc > 3 ? std::stoul(argv[3]) : 64;
+	std::size_t object_size = argc > 4 ? std::stoul(argv[4]) : 1024;
+	std::size_t num_threads = argc > 5 ? std::stoul(argv[5]) : 4;
+	
+	std::vector<char> payload(object_size, 'x');
+	int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	::listen(listener, 128);
+	::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+	std::thread upstream(serve_upstream, listener, std::cref(payload));
+	
+	std::string target = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+	unsigned short port = 24456;
+	
+	for (bool mux : { false, true }) {
+		port++;
+		
+		std::vector<std::string> args = { "bench_mux", "-q", "--threads", std::to_string(num_threads), "--port", std::to_string(port), "--memory-cache-bytes", std::to_string(64 * 1024 * 1024) };
+		std::vector<char*> app_argv;
+		for (auto &arg : args) {
+			app_argv.push_back(&arg[0]);
+		}
+		
+		app a;
+		std::thread runner([&]{ a.run(app_argv.size(), app_argv.data()); });
+		
+		// Wait for it to come up, and for the object to be cached
+		int fd;
+		while ((fd = connect_to(port)) == -1) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		std::string cmd = target + "\r\n";
+		std::vector<char> response(object_size);
+		write_all(fd, cmd.data(), cmd.size());
+		read_all(fd, response.data(), response.size());
+		::close(fd);
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		
+		std::size_t num_clients = mux ? num_connections : num_connections * depth;
+		std::atomic<bool> running(true);
+		std::atomic<std::size_t> failures(0);
+		std::vector<std::vector<double>> latencies(num_clients);
+		std::vector<std::thread> clients;
+		
+		auto start = clock_type::now();
+		for (std::size_t i = 0; i < num_clients; i++) {
+			clients.emplace_back([&, i]{
+				bool ok = mux ? run_mux(port, target, object_size, depth, running, latencies[i])
+					: run_text(port, target, object_size, running, latencies[i]);
+				if (!ok) {
+					failures++;
+				}
+			});
+		}
+		
+		std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+		running = false;
+		for (auto &client : clients) {
+			client.join();
+		}
+		double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+		
+		a.stop();
+		runner.join();
+		
+		std::vector<double> all;
+		for (auto &l : latencies) {
+			all.insert(all.end(), l.begin(), l.end());
+		}
+		std::sort(all.begin(), all.end());
+		
+		double p50 = all.empty() ? 0 : all[all.size() / 2];
+		double p99 = all.empty() ? 0 : all[std::min(all.size() - 1, all.size() * 99 / 100)];
+		
+		std::cout << (mux ? "mux:  " + std::to_string(num_connections) + " connections x " + std::to_string(depth) + " streams"
+				: "text: " + std::to_string(num_clients) + " connections") << ": "
+			<< static_cast<std::size_t>(all.size() / elapsed) << " req/s, "
+			<< "p50 " << static_cast<std::size_t>(p50) << " us, "
+			<< "p99 " << static_cast<std::size_t>(p99) << " us"
+			<< (failures ? ", " + std::to_string(failures) + " failed" : "") << std::endl;
+	}
+	
+	::shutdown(listener, SHUT_RDWR);
+	::close(listener);
+	upstream.join();
+	
+	return 0;
+}
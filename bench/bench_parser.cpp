@@ -0,0 +1,151 @@
+#include <proxything/parser.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <istream>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace proxything;
+
+// Counts heap allocations, to show which parser makes any
+static std::atomic<std::size_t> allocations(0);
+
+void* operator new(std::size_t size)
+{
+	allocations++;
+	if (void *p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, std::size_t size) noexcept
+{
+	std::free(p);
+}
+
+/**
+ * The way commands used to be parsed: a line at a time out of an istream,
+ * split with substr(), and parsed with from_string() and stoi(), throwing on
+ * errors.
+ */
+static bool parse_old(std::istream &in, asio::ip::tcp::endpoint &endpoint)
+{
+	std::string cmd;
+	std::getline(in, cmd);
+	if (!cmd.empty() && cmd.back() == '\r') {
+		cmd.pop_back();
+	}
+	
+	try {
+		std::size_t colon_at = cmd.rfind(':');
+		if (colon_at == std::string::npos) {
+			throw std::invalid_argument("Format: IP:port");
+		}
+		std::string address_s = cmd.substr(0, colon_at);
+		std::string port_s = cmd.substr(colon_at + 1);
+		if (!address_s.empty() && address_s[0] == '[' && address_s[address_s.size() - 1] == ']') {
+			address_s = address_s.substr(1, address_s.size() - 2);
+		}
+		
+		asio::ip::address address;
+		try {
+			address = asio::ip::address::from_string(address_s);
+		} catch (boost::system::system_error &e) {
+			throw std::invalid_argument("Given address is not valid");
+		}
+		
+		int port = std::stoi(port_s);
+		if (port < 1 || port > 65535) {
+			throw std::invalid_argument("Valid ports are 1-65535");
+		}
+		endpoint = asio::ip::tcp::endpoint(address, port);
+		return true;
+	} catch (std::invalid_argument &e) {
+		return false;
+	}
+}
+
+/**
+ * Measures command parsing, old and new, over a buffer of commands.
+ * 
+ * The buffer cycles through IPv4, [bracketed] IPv6 and invalid commands, in
+ * the given percentages, and is parsed over and over; the new parser scans it
+ * in place, the old one reads it through an istream.
+ * 
+ * Usage: bench_parser [commands] [rounds] [% IPv6] [% invalid]
+ */
+int main(int argc, char **argv)
+{
+	std::size_t num_commands = argc > 1 ? std::stoul(argv[1]) : 10000;
+	std::size_t rounds = argc > 2 ? std::stoul(argv[2]) : 100;
+	std::size_t v6_percent = argc > 3 ? std::stoul(argv[3]) : 10;
+	std::size_t invalid_percent = argc > 4 ? std::stoul(argv[4]) : 10;
+	
+	std::string buf;
+	for (std::size_t i = 0; i < num_commands; i++) {
+		std::size_t roll = i * 37 % 100;
+		if (roll < invalid_percent) {
+			buf += "not a command " + std::to_string(i) + "\r\n";
+		} else if (roll < invalid_percent + v6_percent) {
+			buf += "[2001:db8::" + std::to_string(i % 65536) + "]:" + std::to_string(1 + i % 65535) + "\r\n";
+		} else {
+			buf += "10." + std::to_string(i / 65536 % 256) + "." + std::to_string(i / 256 % 256) + "." + std::to_string(i % 256) + ":" + std::to_string(1 + i % 65535) + "\r\n";
+		}
+	}
+	
+	typedef std::chrono::steady_clock clock;
+	auto report = [&](const char *what, clock::time_point start, std::size_t allocs, std::size_t valid) {
+		double secs = std::chrono::duration<double>(clock::now() - start).count();
+		double total = static_cast<double>(num_commands) * rounds;
+		std::cout << what << ": " << secs * 1e9 / total << " ns/command, "
+			<< static_cast<std::size_t>(total / secs) << " commands/s, "
+			<< allocs / total << " allocations/command"
+			<< " (" << valid / rounds << " of " << num_commands << " valid)" << std::endl;
+	};
+	
+	// Scan the buffer in place, like client_connection::read_command() does
+	{
+		std::size_t valid = 0;
+		std::size_t allocs_before = allocations;
+		auto start = clock::now();
+		for (std::size_t r = 0; r < rounds; r++) {
+			const char *p = buf.data(), *end = buf.data() + buf.size();
+			while (const char *eol = parser::find_line_end(p, end)) {
+				boost::system::error_code ec;
+				auto endpoint = parser::parse_endpoint(p, eol - 1, ec);
+				valid += !ec && endpoint.port();
+				p = eol + 1;
+			}
+		}
+		report("new", start, allocations - allocs_before, valid);
+	}
+	
+	// Read lines out of a streambuf, like it used to
+	{
+		std::size_t valid = 0;
+		std::size_t allocs_before = allocations;
+		auto start = clock::now();
+		for (std::size_t r = 0; r < rounds; r++) {
+			asio::streambuf sbuf;
+			sbuf.commit(asio::buffer_copy(sbuf.prepare(buf.size()), asio::buffer(buf)));
+			std::istream in(&sbuf);
+			asio::ip::tcp::endpoint endpoint;
+			for (std::size_t i = 0; i < num_commands; i++) {
+				valid += parse_old(in, endpoint);
+			}
+		}
+		report("old", start, allocations - allocs_before, valid);
+	}
+	
+	return 0;
+}
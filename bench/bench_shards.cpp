@@ -0,0 +1,195 @@
+#include <proxything/app.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace proxything;
+
+typedef std::chrono::steady_clock clock_type;
+
+/**
+ * Connects to a local port, or returns -1.
+ */
+static int connect_to(unsigned short port)
+{
+	int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+	
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+		::close(fd);
+		return -1;
+	}
+	
+	// Reset instead of lingering in TIME_WAIT, or the rounds would run out
+	// of ephemeral ports long before the proxy runs out of steam
+	linger l = { 1, 0 };
+	::setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	
+	return fd;
+}
+
+/**
+ * Makes a request through the proxy and reads the whole response.
+ */
+static bool fetch(unsigned short port, const std::string &cmd, std::size_t size)
+{
+	int fd = connect_to(port);
+	if (fd == -1) {
+		return false;
+	}
+	
+	bool ok = ::write(fd, cmd.data(), cmd.size()) == static_cast<ssize_t>(cmd.size());
+	
+	char buf[64 * 1024];
+	std::size_t received = 0;
+	while (ok && received < size) {
+		ssize_t n = ::read(fd, buf, sizeof(buf));
+		ok = n > 0;
+		received += ok ? n : 0;
+	}
+	
+	// Hang up politely first, so the proxy sees a clean disconnect
+	::shutdown(fd, SHUT_WR);
+	::close(fd);
+	return ok;
+}
+
+/**
+ * Serves the same object to every connection, until the socket is shut down.
+ */
+static void serve_upstream(int listener, const std::vector<char> &payload)
+{
+	int fd;
+	while ((fd = ::accept(listener, nullptr, nullptr)) != -1) {
+		std::size_t sent = 0;
+		while (sent < payload.size()) {
+			ssize_t n = ::write(fd, payload.data() + sent, payload.size() - sent);
+			if (n <= 0) {
+				break;
+			}
+			sent += n;
+		}
+		::close(fd);
+	}
+}
+
+/**
+ * Measures connection throughput and latency against the number of threads,
+ * with all threads sharing one IO service, and with --shard-per-core.
+ * 
+ * Each round starts a proxy, warms its memory cache with one object from a
+ * local upstream, then has a number of clients make one request per
+ * connection, back to back, for a while. Every request after the first is a
+ * memory cache hit, so this measures accepting, parsing and responding, which
+ * is where the shared IO service's lock shows up.
+ * 
+ * Usage: bench_shards [seconds per round] [clients] [object bytes]
+ */
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? std::stod(argv[1]) : 2.0;
+	std::size_t num_clients = argc > 2 ? std::stoul(argv[2]) : 64;
+	std::size_t object_size = argc > 3 ? std::stoul(argv[3]) : 1024;
+	
+	std::vector<char> payload(object_size, 'x');
+	int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+	::listen(listener, 128);
+	::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &addr_len);
+	std::thread upstream(serve_upstream, listener, std::cref(payload));
+	
+	std::string cmd = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) + "\r\n";
+	unsigned short port = 23456;
+	
+	for (unsigned int threads : { 1, 4, 16, 64 }) {
+		for (bool sharded : { false, true }) {
+			port++;
+			
+			std::vector<std::string> args = { "bench_shards", "-q", "--threads", std::to_string(threads), "--port", std::to_string(port), "--memory-cache-bytes", std::to_string(64 * 1024 * 1024) };
+			if (sharded) {
+				args.push_back("--shard-per-core");
+			}
+			std::vector<char*> app_argv;
+			for (auto &arg : args) {
+				app_argv.push_back(&arg[0]);
+			}
+			
+			app a;
+			std::thread runner([&]{ a.run(app_argv.size(), app_argv.data()); });
+			
+			// Wait for it to come up, and for the object to be cached
+			int fd;
+			while ((fd = connect_to(port)) == -1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			::close(fd);
+			fetch(port, cmd, object_size);
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			
+			std::atomic<bool> running(true);
+			std::atomic<std::size_t> failures(0);
+			std::vector<std::vector<double>> latencies(num_clients);
+			std::vector<std::thread> clients;
+			
+			auto start = clock_type::now();
+			for (std::size_t i = 0; i < num_clients; i++) {
+				clients.emplace_back([&, i]{
+					while (running) {
+						auto t0 = clock_type::now();
+						if (!fetch(port, cmd, object_size)) {
+							failures++;
+							continue;
+						}
+						latencies[i].push_back(std::chrono::duration<double, std::micro>(clock_type::now() - t0).count());
+					}
+				});
+			}
+			
+			std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+			running = false;
+			for (auto &client : clients) {
+				client.join();
+			}
+			double elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+			
+			a.stop();
+			runner.join();
+			
+			std::vector<double> all;
+			for (auto &l : latencies) {
+				all.insert(all.end(), l.begin(), l.end());
+			}
+			std::sort(all.begin(), all.end());
+			
+			double p50 = all.empty() ? 0 : all[all.size() / 2];
+			double p99 = all.empty() ? 0 : all[std::min(all.size() - 1, all.size() * 99 / 100)];
+			
+			std::cout << threads << " threads, " << (sharded ? "sharded" : "shared ") << ": "
+				<< static_cast<std::size_t>(all.size() / elapsed) << " conn/s, "
+				<< "p50 " << static_cast<std::size_t>(p50) << " us, "
+				<< "p99 " << static_cast<std::size_t>(p99) << " us"
+				<< (failures ? ", " + std::to_string(failures) + " failed" : "") << std::endl;
+		}
+	}
+	
+	::shutdown(listener, SHUT_RDWR);
+	::close(listener);
+	upstream.join();
+	
+	return 0;
+}
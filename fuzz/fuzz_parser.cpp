@@ -0,0 +1,84 @@
+#include <proxything/parser.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace proxything;
+
+/**
+ * Feeds arbitrary bytes through the command scanner and parser.
+ * 
+ * Besides not crashing (or reading out of bounds, under ASan), every line
+ * that parses has to come out as a sane endpoint, which has to parse back
+ * to itself when printed. Lines are also parsed as targets, which have to
+ * agree with the endpoint parser on anything that isn't a hostname, and
+ * whose hostnames have to lie within the line and parse back to themselves.
+ */
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size)
+{
+	// Copy into an exactly sized buffer, so ASan catches reads past the end
+	std::vector<char> buf(data, data + size);
+	const char *p = buf.data(), *end = buf.data() + buf.size();
+	
+	for (;;) {
+		const char *eol = parser::find_line_end(p, end);
+		const char *line_end = eol ? eol : end;
+		if (line_end != p && *(line_end - 1) == '\r') {
+			line_end--;
+		}
+		
+		boost::system::error_code ec;
+		auto endpoint = parser::parse_endpoint(p, line_end, ec);
+		if (!ec) {
+			if (endpoint.port() == 0) {
+				std::abort();
+			}
+			
+			std::string address = endpoint.address().to_string();
+			if (endpoint.address().is_v6()) {
+				address = "[" + address + "]";
+			}
+			std::string printed = address + ":" + std::to_string(endpoint.port());
+			
+			boost::system::error_code reparsed_ec;
+			auto reparsed = parser::parse_endpoint(printed.data(), printed.data() + printed.size(), reparsed_ec);
+			if (reparsed_ec || reparsed != endpoint) {
+				std::abort();
+			}
+		} else if (ec.category() != parser::category() || ec.message().empty()) {
+			std::abort();
+		}
+		
+		boost::system::error_code target_ec;
+		auto target = parser::parse_target(p, line_end, target_ec);
+		if (!target_ec && target.has_host()) {
+			if (target.endpoint.port() == 0 || target.host_begin < p || target.host_end > line_end || target.host_begin > target.host_end) {
+				std::abort();
+			}
+			
+			std::string printed = std::string(target.host_begin, target.host_end) + ":" + std::to_string(target.endpoint.port());
+			
+			boost::system::error_code reparsed_ec;
+			auto reparsed = parser::parse_target(printed.data(), printed.data() + printed.size(), reparsed_ec);
+			if (reparsed_ec || !reparsed.has_host() || reparsed.endpoint.port() != target.endpoint.port() ||
+				std::string(reparsed.host_begin, reparsed.host_end) != std::string(target.host_begin, target.host_end)) {
+				std::abort();
+			}
+		} else if (!target_ec) {
+			if (ec || target.endpoint != endpoint) {
+				std::abort();
+			}
+		} else if (target_ec.category() != parser::category() || target_ec.message().empty()) {
+			std::abort();
+		}
+		
+		if (!eol) {
+			break;
+		}
+		p = eol + 1;
+	}
+	
+	return 0;
+}
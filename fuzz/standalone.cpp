@@ -0,0 +1,56 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size);
+
+/**
+ * Stands in for libFuzzer where it's not available.
+ * 
+ * Runs every file given on the command line through the fuzz target, or if
+ * there are none, a number of random inputs, built mostly out of characters
+ * that mean something to it.
+ * 
+ * Usage: fuzz_X [files...] or fuzz_X -runs=N
+ */
+int main(int argc, char **argv)
+{
+	std::size_t runs = 1000000;
+	std::vector<std::string> files;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg.compare(0, 6, "-runs=") == 0) {
+			runs = std::stoul(arg.substr(6));
+		} else {
+			files.push_back(arg);
+		}
+	}
+	
+	for (auto &file : files) {
+		std::ifstream in(file, std::ios_base::binary);
+		std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(data.data()), data.size());
+	}
+	if (!files.empty()) {
+		return 0;
+	}
+	
+	static const char alphabet[] = "0123456789abcdefABCDEF:.[]%\r\n -xyz";
+	std::mt19937 rng(1);
+	std::vector<std::uint8_t> data;
+	for (std::size_t run = 0; run < runs; run++) {
+		data.resize(rng() % 80);
+		for (auto &c : data) {
+			c = rng() % 16 ? alphabet[rng() % (sizeof(alphabet) - 1)] : rng();
+		}
+		LLVMFuzzerTestOneInput(data.data(), data.size());
+	}
+	
+	std::cout << "Ran " << runs << " random inputs" << std::endl;
+	return 0;
+}
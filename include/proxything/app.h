@@ -1,6 +1,7 @@
 #ifndef PROXYTHING_APP_H
 #define PROXYTHING_APP_H
 
+#include <proxything/fs_service.h>
 #include <boost/asio.hpp>
 #include <boost/program_options.hpp>
 #include <vector>
@@ -91,6 +92,11 @@ namespace proxything
 		 */
 		void init_threads(po::variables_map args);
 		
+		/**
+		 * Stops all IO services, making run() return.
+		 */
+		void stop();
+		
 		
 		
 		/// Returns the option definitions
@@ -105,11 +111,40 @@ namespace proxything
 		/// Returns the proxy server
 		inline std::shared_ptr<proxy_server> server() { return m_server; }
 		
+		/// Returns the number of shards, or 0 if not sharding
+		inline std::size_t num_shards() const { return m_shards.size() + (m_sharded ? 1 : 0); }
+		
+		/// Returns a shard's IO service; shard 0 is service()
+		inline asio::io_service& shard_service(std::size_t i) { return i ? *m_shards[i - 1].service : m_service; }
+		
+		/// Returns a shard's proxy server; shard 0's is server()
+		inline std::shared_ptr<proxy_server> shard_server(std::size_t i) { return i ? m_shards[i - 1].server : m_server; }
+		
 	protected:
+		/**
+		 * An additional IO service and server, with --shard-per-core.
+		 */
+		struct shard
+		{
+			std::unique_ptr<asio::io_service> service;	///< IO Service
+			std::shared_ptr<proxy_server> server;		///< Server
+		};
+		
+		/**
+		 * Registers a shard's services, sharing the cache and disk IO threads
+		 * with m_service's.
+		 * 
+		 * @param service The shard's IO service
+		 */
+		void init_shard_services(asio::io_service &service);
+		
+
 		po::options_description m_options;		///< Option definitions
 		asio::io_service m_service;					///< IO Service
 		std::vector<std::thread> m_threads;		///< Threads
 		std::shared_ptr<proxy_server> m_server;	///< Server
+		bool m_sharded;							///< Running one IO service per thread?
+		std::vector<shard> m_shards;			///< Shards other than m_service
 	};
 }
 
@@ -0,0 +1,113 @@
+#ifndef PROXYTHING_CACHE_INDEX_H
+#define PROXYTHING_CACHE_INDEX_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <array>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * In-memory index of the disk cache.
+	 * 
+	 * Maps endpoints to the cache files holding their data, so lookups never
+	 * have to touch the disk to find out whether something's cached. It's
+	 * split into shards with a lock each, so concurrent lookups rarely
+	 * contend with each other.
+	 */
+	class cache_index
+	{
+	public:
+		/**
+		 * A cache file.
+		 */
+		struct record
+		{
+			std::string filename;		///< Where it is
+			std::size_t size = 0;		///< Size
+			std::time_t mtime = 0;		///< When it was written
+		};
+		
+		/**
+		 * Looks up an endpoint.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @param  out      Receives the record, if found
+		 * @return          Whether it was found
+		 */
+		bool find(const asio::ip::tcp::endpoint &endpoint, record &out);
+		
+		/**
+		 * Adds or replaces an endpoint's record.
+		 * 
+		 * @param endpoint Endpoint
+		 * @param r        Record
+		 */
+		void insert(const asio::ip::tcp::endpoint &endpoint, record r);
+		
+		/**
+		 * Removes an endpoint's record.
+		 * 
+		 * @param endpoint Endpoint
+		 */
+		void erase(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Returns the number of records.
+		 */
+		std::size_t size();
+		
+	protected:
+		/**
+		 * Binary form of an endpoint.
+		 */
+		struct key
+		{
+			std::array<unsigned char, 16> address;	///< Address; IPv4 is mapped to IPv6
+			unsigned short port;					///< Port
+			bool v6;								///< Was it an IPv6 address?
+			
+			bool operator==(const key &other) const
+			{
+				return port == other.port && v6 == other.v6 && address == other.address;
+			}
+		};
+		
+		/**
+		 * FNV-1a hash over a key.
+		 */
+		struct key_hash
+		{
+			std::size_t operator()(const key &k) const;
+		};
+		
+		/**
+		 * A part of the index, with its own lock.
+		 */
+		struct shard
+		{
+			std::mutex mutex;								///< Guards records
+			std::unordered_map<key, record, key_hash> records;	///< Records
+		};
+		
+		/**
+		 * Converts an endpoint to a key.
+		 */
+		static key make_key(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Returns the shard a key belongs in.
+		 */
+		shard& shard_for(const key &k);
+		
+		std::array<shard, PROXYTHING_CACHE_INDEX_SHARDS> m_shards;	///< Shards
+	};
+}
+
+#endif
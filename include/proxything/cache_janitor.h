@@ -0,0 +1,160 @@
+#ifndef PROXYTHING_CACHE_JANITOR_H
+#define PROXYTHING_CACHE_JANITOR_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Keeps the disk cache within its limits.
+	 * 
+	 * Tracks cache files in a segmented LRU: new files go into a probationary
+	 * segment, and are moved to a protected segment when they're hit. Once
+	 * the cache is over its limits, victims are taken from the cold end of
+	 * the probationary segment first, then of the protected one, dropped
+	 * from the cache_manager's index, and deleted through fs_service; a few
+	 * at a time, so a large eviction never holds up the IO service for long.
+	 * 
+	 * When the server runs one IO service per core, each has its own
+	 * cache_janitor forwarding to the first one's, which does the evicting.
+	 */
+	class cache_janitor : public asio::io_service::service
+	{
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service     Parent IO service
+		 * @param  max_bytes   Maximum total size of cache files; 0 for no limit
+		 * @param  max_entries Maximum number of cache files; 0 for no limit
+		 */
+		explicit cache_janitor(asio::io_service &service, std::size_t max_bytes = PROXYTHING_CACHE_MAX_BYTES, std::size_t max_entries = PROXYTHING_CACHE_MAX_ENTRIES);
+		
+		/**
+		 * Constructs a janitor sharing another IO service's janitor.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Janitor to forward to; must outlive this one
+		 */
+		cache_janitor(asio::io_service &service, cache_janitor &primary);
+		
+		virtual ~cache_janitor() { }
+		
+		/**
+		 * Tracks a newly committed cache file, replacing any previous one.
+		 * 
+		 * @param filename Filename
+		 * @param size     Size
+		 */
+		void insert(const std::string &filename, std::size_t size);
+		
+		/**
+		 * Records a hit on a cache file.
+		 * 
+		 * @param filename Filename
+		 */
+		void touch(const std::string &filename);
+		
+		/**
+		 * Stops tracking a cache file, without deleting it.
+		 * 
+		 * @param filename Filename
+		 */
+		void erase(const std::string &filename);
+		
+		/// Returns the maximum total size of cache files
+		inline std::size_t max_bytes() const { return m_max_bytes; }
+		
+		/// Returns the maximum number of cache files
+		inline std::size_t max_entries() const { return m_max_entries; }
+		
+		/**
+		 * Returns the total size of tracked cache files.
+		 */
+		std::size_t size();
+		
+		/**
+		 * Returns the number of tracked cache files.
+		 */
+		std::size_t count();
+		
+		/**
+		 * Returns the number of cache files evicted so far.
+		 */
+		std::size_t evictions();
+		
+	protected:
+		/**
+		 * A tracked cache file.
+		 */
+		struct entry
+		{
+			std::string filename;		///< Filename
+			std::size_t size;			///< Size
+			bool is_protected = false;	///< Is it in the protected segment?
+		};
+		
+		typedef std::list<entry> segment_type;
+		
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service() { };
+		
+		/**
+		 * Checks if the cache is over a fraction of its limits. Must be called
+		 * with m_mutex held.
+		 * 
+		 * @param bytes   Bytes in use
+		 * @param entries Entries in use
+		 * @param percent Percentage of the limits to check against
+		 */
+		bool over(std::size_t bytes, std::size_t entries, std::size_t percent) const;
+		
+		/**
+		 * Removes an entry from the index. Must be called with m_mutex held.
+		 */
+		void remove(segment_type::iterator it);
+		
+		/**
+		 * Starts evicting, if over the limits and not already at it. Must be
+		 * called with m_mutex held.
+		 */
+		void schedule();
+		
+		/**
+		 * Evicts a batch of victims, and schedules the next batch once
+		 * they're deleted if still over the limits.
+		 */
+		void run_batch();
+		
+		
+		
+		std::size_t m_max_bytes;		///< Maximum total size
+		std::size_t m_max_entries;		///< Maximum number of entries
+		cache_janitor *m_primary;		///< Janitor to forward to, if sharing one
+		
+		std::mutex m_mutex;				///< Guards everything below
+		segment_type m_probation;		///< Probationary segment, coldest first
+		segment_type m_protected;		///< Protected segment, coldest first
+		std::size_t m_bytes;			///< Total size of all entries
+		std::size_t m_protected_bytes;	///< Total size of m_protected
+		bool m_running;					///< Is a batch in progress?
+		std::size_t m_evictions;		///< Entries evicted so far
+		
+		/// Index into m_probation and m_protected
+		std::map<std::string, segment_type::iterator> m_index;
+	};
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef PROXYTHING_CACHE_MANAGER_H
 #define PROXYTHING_CACHE_MANAGER_H
 
+#include <proxything/cache_index.h>
+#include <proxything/config.h>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
 #include <memory>
@@ -15,19 +17,46 @@ namespace proxything
 	
 	/**
 	 * Cache manager.
+	 * 
+	 * Keeps a cache_index of the cache files, so hits and misses are told
+	 * apart without touching the disk; the index is built by scan() at
+	 * startup, and kept up to date as fills are committed and files evicted.
+	 * 
+	 * When the server runs one IO service per core, each has its own
+	 * cache_manager sharing the first one's index; files are still opened on
+	 * the IO service doing the lookup.
 	 */
-	class cache_manager
+	class cache_manager : public asio::io_service::service
 	{
 	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
 		/**
 		 * Callback type for lookups.
 		 */
 		typedef std::function<void(bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f)> LookupHandler;
 		
+		/**
+		 * Callback type for creating entries.
+		 */
+		typedef std::function<void(const boost::system::error_code &ec, std::shared_ptr<fs_entry> f)> CreateHandler;
+		
 		/**
 		 * Constructs a cache manager.
+		 * 
+		 * @param service Parent IO service
+		 * @param path    Path for cache files
+		 */
+		explicit cache_manager(asio::io_service &service, fs::path path = fs::temp_directory_path());
+		
+		/**
+		 * Constructs a cache manager sharing another IO service's index.
+		 * 
+		 * @param service Parent IO service
+		 * @param primary Cache manager to share with; must outlive this one
 		 */
-		cache_manager(asio::io_service &service);
+		cache_manager(asio::io_service &service, cache_manager &primary);
 		
 		virtual ~cache_manager();
 		
@@ -38,12 +67,32 @@ namespace proxything
 		 */
 		std::string filename_for(const asio::ip::tcp::endpoint &endpoint);
 		
+		/**
+		 * Returns the endpoint a cache filename is for.
+		 * 
+		 * @param  filename Filename, with or without a path
+		 * @param  endpoint Receives the endpoint
+		 * @return          false if it's not a cache filename
+		 */
+		static bool endpoint_for(const std::string &filename, asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Indexes the existing cache files.
+		 * 
+		 * The files are stat()ed from a number of threads in parallel, and
+		 * handed to the cache_janitor oldest first. This blocks; it's meant to
+		 * be run once, before serving anything.
+		 * 
+		 * @param num_threads Number of threads to use
+		 */
+		void scan(std::size_t num_threads = PROXYTHING_FS_THREADS);
+		
 		/**
 		 * Look up a file in the cache.
 		 * 
-		 * If the file exists, the callback is called with hit=true and a file
-		 * opened for reading. Otherwise, it's called with hit=false and a file
-		 * opened for atomic writing.
+		 * If the file is in the index, the callback is called with hit=true
+		 * and the file opened for reading. Otherwise, it's called with
+		 * hit=false and no file; use async_create() to fill the entry.
 		 * 
 		 * The filename to open is determined by path() and filename_for().
 		 * 
@@ -52,13 +101,47 @@ namespace proxything
 		 */
 		void async_lookup(const asio::ip::tcp::endpoint &endpoint, LookupHandler cb);
 		
+		/**
+		 * Creates a cache entry.
+		 * 
+		 * The callback is called with a file opened for atomic writing, which
+		 * replaces any existing entry when it's closed; call insert() after.
+		 * 
+		 * @param endpoint Endpoint to create the cache for
+		 * @param cb       Callback
+		 */
+		void async_create(const asio::ip::tcp::endpoint &endpoint, CreateHandler cb);
+		
+		/**
+		 * Adds a committed cache file to the index.
+		 * 
+		 * @param endpoint Endpoint the file is for
+		 * @param size     The file's size
+		 */
+		void insert(const asio::ip::tcp::endpoint &endpoint, std::size_t size);
+		
+		/**
+		 * Removes a cache file from the index, without deleting it.
+		 * 
+		 * @param filename Filename
+		 */
+		void erase(const std::string &filename);
+		
 		/// Returns the path to the cache files.
 		const fs::path& path() const { return m_path; }
 		
+		/// Returns the index
+		cache_index& index() { return m_primary ? m_primary->index() : m_index; }
+		
 	protected:
-		asio::io_service &m_service;	///< IO Service
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service() { };
 		
 		fs::path m_path;				///< Path for cache files
+		cache_index m_index;			///< Index of cache files
+		cache_manager *m_primary;		///< Cache manager sharing its index, if any
 	};
 }
 
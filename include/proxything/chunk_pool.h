@@ -0,0 +1,300 @@
+#ifndef PROXYTHING_CHUNK_POOL_H
+#define PROXYTHING_CHUNK_POOL_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Service handing out reference counted, recycled buffers.
+	 * 
+	 * A chunk is filled once, and can then be handed to any number of
+	 * concurrent writers without copying it; it goes back to the pool when the
+	 * last reference to it is dropped, no matter which thread that happens on.
+	 * 
+	 * Chunks in use count towards a byte budget, which covers everything
+	 * received from upstreams that's still waiting to be written to a cache
+	 * file or sent to a client, and cache file reads on their way to one.
+	 * Fills and file_responder ask for chunks with try_acquire() or
+	 * async_acquire(), and so stop reading once it's used up, until writes
+	 * catch up and free some chunks.
+	 * 
+	 * Chunks come in power-of-two size classes, each with its own free list,
+	 * so connections can grow and shrink their buffers without fragmenting the
+	 * heap; see sizer.
+	 * 
+	 * When the server runs one IO service per core, each has its own pool,
+	 * but they all share the first one's budget and buffer sizes.
+	 */
+	class chunk_pool : public asio::io_service::service
+	{
+	protected:
+		struct state;
+		
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/**
+		 * A fixed-size buffer from the pool.
+		 */
+		class chunk
+		{
+		public:
+			/// Returns the chunk's memory
+			inline char* data() { return m_data.get(); }
+			
+			/// Returns the chunk's size
+			inline std::size_t capacity() const { return m_capacity; }
+			
+			/// Returns a buffer for filling the chunk
+			inline asio::mutable_buffers_1 buffer() { return asio::buffer(data(), capacity()); }
+			
+			/// Returns a buffer for the first size bytes of the chunk
+			inline asio::const_buffers_1 buffer(std::size_t size) { return asio::buffer(static_cast<const char*>(data()), size); }
+			
+		protected:
+			friend class chunk_pool;
+			friend void intrusive_ptr_add_ref(chunk *c);
+			friend void intrusive_ptr_release(chunk *c);
+			
+			/**
+			 * Constructor.
+			 */
+			chunk(std::shared_ptr<state> owner, std::size_t capacity):
+				m_refs(0), m_owner(owner), m_data(new char[capacity]), m_capacity(capacity) { }
+			
+			std::atomic<std::size_t> m_refs;	///< Reference count
+			std::shared_ptr<state> m_owner;		///< Pool to return to
+			std::unique_ptr<char[]> m_data;		///< Memory
+			std::size_t m_capacity;				///< Size of m_data
+		};
+		
+		/// Pointer to a chunk
+		typedef boost::intrusive_ptr<chunk> chunk_ptr;
+		
+		/**
+		 * Picks buffer sizes for a stream of reads.
+		 * 
+		 * Starts out at the pool's buffer size, doubles whenever a read fills
+		 * the buffer, up to the pool's maximum, and halves again after two
+		 * reads in a row used no more than a quarter of it.
+		 */
+		class sizer
+		{
+		public:
+			/**
+			 * Constructor.
+			 * 
+			 * @param  pool Pool to take the size limits from
+			 */
+			explicit sizer(const chunk_pool &pool);
+			
+			/// Returns the size to read into next
+			inline std::size_t size() const { return m_size; }
+			
+			/**
+			 * Adjusts the size after a read.
+			 * 
+			 * @param used Bytes read into a buffer of size()
+			 */
+			void update(std::size_t used);
+			
+		protected:
+			std::size_t m_size;				///< Current size
+			std::size_t m_min;				///< Smallest size
+			std::size_t m_max;				///< Largest size
+			bool m_shrink;					///< Was the last read a small one?
+		};
+		
+		/**
+		 * Callback type for async_acquire().
+		 * 
+		 * @param chunk The chunk
+		 */
+		typedef std::function<void(chunk_ptr chunk)> AcquireHandler;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service         Parent IO service
+		 * @param  budget          Bytes of chunks that may be in use at once;
+		 *                         0 for no limit
+		 * @param  buffer_size     Default chunk size, and the smallest a sizer
+		 *                         shrinks to
+		 * @param  max_buffer_size Largest a sizer grows to; buffer_size turns
+		 *                         growing off
+		 */
+		explicit chunk_pool(asio::io_service &service, std::size_t budget = PROXYTHING_BUFFER_BUDGET,
+			std::size_t buffer_size = PROXYTHING_REMOTE_BUFFER_SIZE, std::size_t max_buffer_size = PROXYTHING_REMOTE_MAX_BUFFER_SIZE);
+		
+		/**
+		 * Constructs a pool sharing another IO service's budget and sizes.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Pool to share the budget of
+		 */
+		chunk_pool(asio::io_service &service, chunk_pool &primary);
+		
+		virtual ~chunk_pool();
+		
+		/**
+		 * Returns a free chunk, allocating one if there are none.
+		 * 
+		 * It counts towards the budget, but is handed out even if that's used
+		 * up; use this for buffers that are bounded some other way.
+		 * 
+		 * @param  size Minimum size of the chunk; 0 for buffer_size()
+		 */
+		chunk_ptr acquire(std::size_t size = 0);
+		
+		/**
+		 * Returns a free chunk, if the budget allows for one.
+		 * 
+		 * @param  size Minimum size of the chunk; 0 for buffer_size()
+		 * @return The chunk, or nullptr if the budget's used up (or others
+		 *         are already waiting on it)
+		 */
+		chunk_ptr try_acquire(std::size_t size = 0);
+		
+		/**
+		 * Waits for the budget to allow for a chunk.
+		 * 
+		 * Waiters are served in order, as chunks are released. The callback is
+		 * called from this pool's IO service, never from within this call.
+		 * 
+		 * @param size Minimum size of the chunk; 0 for buffer_size()
+		 * @param cb   Callback
+		 */
+		void async_acquire(std::size_t size, AcquireHandler cb);
+		
+		/**
+		 * Returns the size class a chunk of a size is allocated from.
+		 * 
+		 * @param  size Minimum size of the chunk
+		 * @return The next power of two, no smaller than
+		 *         PROXYTHING_CHUNK_MIN_SIZE
+		 */
+		static std::size_t round_size(std::size_t size);
+		
+		/**
+		 * Returns the number of free chunks in the pool, of all sizes.
+		 */
+		std::size_t free_chunks() const;
+		
+		/**
+		 * Returns the default chunk size.
+		 */
+		std::size_t buffer_size() const;
+		
+		/**
+		 * Returns the largest size a sizer grows to.
+		 */
+		std::size_t max_buffer_size() const;
+		
+		/**
+		 * Returns the bytes of chunks in use, across all pools sharing the
+		 * budget.
+		 */
+		std::size_t buffered() const;
+		
+		/**
+		 * Returns the most bytes of chunks ever in use at once.
+		 */
+		std::size_t peak_buffered() const;
+		
+		/**
+		 * Returns the number of async_acquire()s waiting on the budget.
+		 */
+		std::size_t waiting() const;
+		
+		/**
+		 * Returns the budget, in bytes; 0 if there's no limit.
+		 */
+		std::size_t budget() const;
+		
+	protected:
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service();
+		
+		/**
+		 * An async_acquire() waiting on the budget.
+		 */
+		struct waiter
+		{
+			chunk_pool *pool;				///< Pool to take the chunk from
+			std::size_t size;				///< Size class wanted
+			AcquireHandler cb;				///< Callback
+		};
+		
+		/**
+		 * Byte budget and buffer sizes, shared between pools.
+		 */
+		struct accounting
+		{
+			mutable std::mutex mutex;			///< Guards used, peak and waiting
+			std::size_t limit = 0;				///< Budget; 0 for none
+			std::size_t buffer_size = 0;		///< Default chunk size
+			std::size_t max_buffer_size = 0;	///< Largest size sizers grow to
+			std::size_t used = 0;				///< Bytes in use
+			std::size_t peak = 0;				///< Most bytes ever in use
+			std::deque<waiter> waiting;			///< Waiting for room, in order
+			
+			/// Returns whether a chunk of a size fits; call with mutex held
+			bool fits(std::size_t size) const { return !limit || !used || used + size <= limit; }
+			
+			/// Counts a chunk as in use; call with mutex held
+			void charge(std::size_t size);
+			
+			/// Counts a chunk as released, and wakes waiters that now fit
+			void release(std::size_t size);
+		};
+		
+		/**
+		 * Shared with chunks, so they can outlive the service.
+		 */
+		struct state
+		{
+			mutable std::mutex mutex;	///< Guards everything below
+			bool open = true;			///< Is the pool still accepting chunks?
+			
+			/// Free chunks, by size class
+			std::vector<std::vector<chunk*>> free;
+			
+			/// Budget the pool's chunks count towards
+			std::shared_ptr<accounting> budget;
+		};
+		
+		/**
+		 * Takes a chunk from the free list, or allocates one, without
+		 * counting it towards the budget.
+		 * 
+		 * @param  size Size class
+		 */
+		chunk_ptr take(std::size_t size);
+		
+		std::shared_ptr<state> m_state;	///< Shared state
+		
+		friend void intrusive_ptr_release(chunk *c);
+	};
+	
+	/// Adds a reference to a chunk
+	void intrusive_ptr_add_ref(chunk_pool::chunk *c);
+	
+	/// Drops a reference to a chunk, returning it to its pool when it's unused
+	void intrusive_ptr_release(chunk_pool::chunk *c);
+}
+
+#endif
@@ -2,7 +2,13 @@
 #define PROXYTHING_CLIENT_CONNECTION_H
 
 #include <proxything/cache_manager.h>
+#include <proxything/memory_cache.h>
+#include <proxything/recycler.h>
+#include <proxything/task.h>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <functional>
+#include <map>
 #include <string>
 #include <memory>
 
@@ -11,9 +17,29 @@ namespace proxything
 	namespace asio = boost::asio;
 	
 	class proxy_server;
+	class remote_connection;
+	class dns_cache;
 	
 	/**
 	 * A connection from a client.
+	 * 
+	 * All handlers touching the connection, including those of the
+	 * remote_connection or file_responder sending it a response, run through
+	 * its strand, so the connection can be served from any number of threads.
+	 * 
+	 * By default, each command's response is sent as-is, as soon as it's
+	 * available; a client has to wait for one before sending the next. After
+	 * a PIPELINE command (sent first, and answered with OK), commands can be
+	 * sent back to back instead: they're all looked up and fetched right
+	 * away, but their responses are sent strictly in order, each framed as a
+	 * series of chunks (the size in hex, CRLF, the data, CRLF) ending in an
+	 * empty one, or cut short by an "ERROR: <message>" line.
+	 * 
+	 * Sending PROXYTHING_MUX_PREAMBLE first hands the connection over to a
+	 * mux_session instead.
+	 * 
+	 * When built with PROXYTHING_COROUTINES, a server can run its connections
+	 * as coroutines instead; see run().
 	 */
 	class client_connection : public std::enable_shared_from_this<client_connection>
 	{
@@ -31,6 +57,11 @@ namespace proxything
 		 */
 		void connected();
 		
+		/**
+		 * Switches the connection to pipelined mode.
+		 */
+		void pipeline();
+		
 		
 		
 		/**
@@ -43,21 +74,144 @@ namespace proxything
 		 */
 		asio::ip::tcp::endpoint parse(const std::string &cmd) const;
 		
+		/**
+		 * Parses a command into an endpoint, without allocating or throwing.
+		 * 
+		 * @param  begin Start of the command, without the CRLF
+		 * @param  end   End of the command
+		 * @param  ec    Set if the command is invalid
+		 * @return       A parsed endpoint
+		 */
+		asio::ip::tcp::endpoint parse(const char *begin, const char *end, boost::system::error_code &ec) const;
+		
+		/**
+		 * Resolves a hostname through the dns_cache, then responds with the
+		 * data for it.
+		 * 
+		 * @param host Hostname to resolve
+		 * @param port Port to connect to
+		 * @param seq  The response's place in line
+		 */
+		void resolve(const std::string &host, unsigned short port, std::size_t seq);
+		
+		/**
+		 * Responds with the data for an endpoint.
+		 * 
+		 * Serves it from the in-memory cache tier if it's there, else joins a
+		 * fetch already in flight for the endpoint if there is one, else serves
+		 * it from the disk cache, else fetches it.
+		 * 
+		 * @param endpoint Endpoint to respond with
+		 * @param seq      The response's place in line; see send_in_turn()
+		 */
+		void respond(asio::ip::tcp::endpoint endpoint, std::size_t seq);
+		
 		/**
 		 * Fetches remote data from the specified host.
 		 * 
-		 * @param endpoint   Endpoint to connect to
-		 * @param cache_file Cache file to write to
+		 * If another client has started fetching it in the meantime, that fetch
+		 * is joined instead; see join_fetch(). In pipelined mode, the fetch
+		 * is always joined, so the response can wait its turn in the cache
+		 * file while the fetch goes on.
+		 * 
+		 * Requests for an upstream that's been refusing connections are
+		 * rejected right away; see upstream_health.
+		 * 
+		 * @param endpoint Endpoint to connect to
+		 * @param seq      The response's place in line
 		 * @see proxything::remote_connection
 		 */
-		void connect_remote(asio::ip::tcp::endpoint endpoint, std::shared_ptr<fs_entry> cache_file);
+		void connect_remote(asio::ip::tcp::endpoint endpoint, std::size_t seq);
+		
+		/**
+		 * Serves a cache entry as it's being filled by another connection.
+		 * 
+		 * @param remote Fetch filling the entry
+		 * @param seq    The response's place in line
+		 * @see proxything::file_responder
+		 */
+		void join_fetch(std::shared_ptr<remote_connection> remote, std::size_t seq);
+		
+		/**
+		 * Serves an object from memory.
+		 * 
+		 * @param data Object to serve
+		 * @param seq  The response's place in line
+		 */
+		void serve_buffer(memory_cache::buffer_ptr data, std::size_t seq);
+		
+		/**
+		 * Reads a small cache file into the in-memory cache tier, and serves
+		 * it from there.
+		 * 
+		 * @param endpoint Endpoint the file is for
+		 * @param file     File to read
+		 * @param size     The file's size
+		 * @param seq      The response's place in line
+		 */
+		void promote_file(asio::ip::tcp::endpoint endpoint, std::shared_ptr<fs_entry> file, std::size_t size, std::size_t seq);
 		
 		/**
 		 * Serves the specified local file.
 		 * @param file File to serve
+		 * @param seq  The response's place in line
 		 * @see proxything::file_responder
 		 */
-		void serve_file(std::shared_ptr<fs_entry> file);
+		void serve_file(std::shared_ptr<fs_entry> file, std::size_t seq);
+		
+		/**
+		 * Runs a function once it's a response's turn to be sent.
+		 * 
+		 * Outside of pipelined mode, every response's turn is right away.
+		 * 
+		 * @param seq  The response's place in line
+		 * @param send Function starting to send the response
+		 */
+		void send_in_turn(std::size_t seq, std::function<void()> send);
+		
+		/**
+		 * Call when a response has been sent, to pass the turn on.
+		 * 
+		 * @param seq The response's place in line
+		 */
+		void finish(std::size_t seq);
+		
+		/**
+		 * Rejects a command with an error, before any response is sent.
+		 * 
+		 * In pipelined mode, this is the same as fail(); otherwise, an
+		 * "ERROR: <message>" line is sent, and the connection carries on.
+		 * 
+		 * @param seq The response's place in line
+		 * @param msg Error message
+		 */
+		void reject(std::size_t seq, const std::string &msg);
+		
+		/**
+		 * Ends a response with an error.
+		 * 
+		 * In pipelined mode, the error is sent in its turn, and the next
+		 * response follows; otherwise, the client is cut off.
+		 * 
+		 * @param seq The response's place in line
+		 * @param msg Error message
+		 */
+		void fail(std::size_t seq, const std::string &msg);
+		
+		/**
+		 * Call before starting a write to the socket, to give the client
+		 * PROXYTHING_CLIENT_WRITE_TIMEOUT to take it.
+		 * 
+		 * A client that stops reading is disconnected once that runs out,
+		 * failing the write, so whatever it was holding on to is let go of.
+		 * Calling this again moves the deadline along.
+		 */
+		void expect_write();
+		
+		/**
+		 * Call once a write started after expect_write() has completed.
+		 */
+		void wrote();
 		
 		
 		
@@ -67,24 +221,115 @@ namespace proxything
 		/// Returns the underlying socket
 		inline asio::ip::tcp::socket& socket() { return m_socket; }
 		
+		/// Returns the strand all handlers for the connection run through
+		inline asio::io_service::strand& strand() { return m_strand; }
+		
 		/// Returns the parent server
 		inline std::shared_ptr<proxy_server> server() { return m_server; }
 		
+		/// Returns whether the connection is in pipelined mode
+		inline bool pipelined() const { return m_pipelined; }
+	
 	protected:
 		/**
-		 * Read and execute a command from the socket.
+		 * A command taken off the buffer.
+		 */
+		struct command
+		{
+			/// Kinds of commands
+			enum class kind_type
+			{
+				target,		///< A target to respond with
+				pipeline,	///< PIPELINE
+				mux,		///< PROXYTHING_MUX_PREAMBLE
+			};
+			
+			kind_type kind = kind_type::target;	///< What it is
+			asio::ip::tcp::endpoint endpoint;	///< Target; only the port if there's a host
+			std::string host;					///< Target's hostname, if any
+			boost::system::error_code ec;		///< Set if the target is invalid
+		};
+		
+		/**
+		 * Takes the next buffered command off the buffer, if there is one.
+		 * 
+		 * Only what hasn't been scanned already is scanned for the end of it;
+		 * the target is parsed in place, and only a hostname is copied out.
 		 * 
-		 * Calls itself after receiving a command, until EOF or an error occurs.
+		 * @param  cmd Set to the command
+		 * @return     False if no complete command is buffered
+		 */
+		bool take_command(command &cmd);
+		
+		/**
+		 * Read and execute commands from the socket.
+		 * 
+		 * Commands already buffered are executed first, scanned for and parsed
+		 * in place. Keeps reading until EOF or an error occurs, or until
+		 * PROXYTHING_PIPELINE_DEPTH pipelined responses are outstanding;
+		 * finish() picks it back up then.
 		 */
 		void read_command();
 		
+		/**
+		 * Executes a command.
+		 * 
+		 * @param  cmd Command, from take_command()
+		 * @return     False if the connection was handed over to a
+		 *             mux_session, and mustn't read any further
+		 */
+		bool execute(const command &cmd);
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+		/**
+		 * Coroutine version of read_command(), execute() and respond().
+		 * 
+		 * Reads commands one at a time, and responds to each before reading
+		 * the next, looking it up and serving it from memory or disk in the
+		 * same coroutine; it runs in the strand throughout. Fetches are still
+		 * handed to remote_connection, and pipelined or multiplexed
+		 * connections to the callback-based code.
+		 * 
+		 * @param self The connection, kept alive while the coroutine runs
+		 */
+		task run(std::shared_ptr<client_connection> self);
+		
+		/**
+		 * Coroutine version of respond().
+		 * 
+		 * @param endpoint Endpoint to respond with
+		 */
+		task serve(asio::ip::tcp::endpoint endpoint);
+		
+		/**
+		 * Coroutine version of reject(); sends an "ERROR: <message>" line.
+		 * 
+		 * @param msg Error message
+		 */
+		task send_error(std::string msg);
+#endif
+		
 		asio::io_service &m_service;				///< IO Service
 		asio::ip::tcp::socket m_socket;				///< Socket
+		asio::io_service::strand m_strand;			///< Strand for handlers
+		asio::steady_timer m_write_timer;			///< Write deadline
 		
 		std::shared_ptr<proxy_server> m_server;		///< Parent server
-		cache_manager m_cache;						///< Cache manager
+		cache_manager &m_cache;						///< Cache manager
+		memory_cache &m_memory;						///< In-memory cache tier
+		dns_cache &m_dns;							///< Hostname resolver
 		
 		asio::streambuf m_buf;						///< Buffer for client commands
+		std::size_t m_scanned;						///< Bytes of m_buf known not to hold a LF
+		bool m_reading;								///< Is a command being read?
+		bool m_closed;								///< Has the client stopped sending?
+		
+		bool m_pipelined;							///< In pipelined mode?
+		std::size_t m_next_seq;						///< Place in line for the next response
+		std::size_t m_turn;							///< Place in line of the response being sent
+		
+		/// Responses ready to be sent, waiting for their turn
+		std::map<std::size_t, std::function<void()>> m_waiting;
 	};
 }
 
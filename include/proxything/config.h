@@ -4,10 +4,142 @@
 // Maximum size of the buffer used to read client commands
 #define PROXYTHING_CLIENT_BUFFER_SIZE 255
 
-// Maximum size of the receive buffer used to read from remote servers
-#define PROXYTHING_REMOTE_BUFFER_SIZE 2048
+// Default size of the buffers used to read from remote servers and files, and
+// the smallest they shrink back to
+#define PROXYTHING_REMOTE_BUFFER_SIZE 4096
 
-// Maximum size of the buffer used to serve local files
-#define PROXYTHING_FILE_BUFFER_SIZE 1024
+// Default size buffers grow to while reads keep filling them
+#define PROXYTHING_REMOTE_MAX_BUFFER_SIZE (1024 * 1024)
+
+// Bytes a client may fall behind the fill it's being sent straight from, before
+// it's switched over to catching up from the cache file instead
+#define PROXYTHING_CLIENT_BACKLOG (256 * 1024)
+
+// Default number of bytes received from remote servers that can be waiting to
+// be written to cache files or clients at once, before reads are held off
+#define PROXYTHING_BUFFER_BUDGET (64 * 1024 * 1024)
+
+// Smallest buffer size class; buffers are rounded up to powers of two from here
+#define PROXYTHING_CHUNK_MIN_SIZE 1024
+
+// Maximum bytes of unused buffers of each size class kept around for reuse
+#define PROXYTHING_CHUNK_POOL_BYTES (2 * 1024 * 1024)
+
+// Maximum number of bytes to send per sendfile() call when serving local files
+#define PROXYTHING_SENDFILE_CHUNK_SIZE (1024 * 1024)
+
+// Default number of worker threads for the threaded filesystem backend
+#define PROXYTHING_FS_THREADS 4
+
+// Relative shares of the threaded filesystem backend's workers given to reads
+// and opens for clients, cache fill writes, and eviction, while all of them
+// have operations queued
+#define PROXYTHING_FS_FOREGROUND_WEIGHT 8
+#define PROXYTHING_FS_BACKGROUND_WEIGHT 2
+#define PROXYTHING_FS_MAINTENANCE_WEIGHT 1
+
+// Maximum number of cache fill writes and eviction operations in flight at once
+// with the threaded filesystem backend; reads and opens can use every worker
+#define PROXYTHING_FS_BACKGROUND_DEPTH 2
+#define PROXYTHING_FS_MAINTENANCE_DEPTH 1
+
+// Number of cache fill writes and eviction operations that can queue up with the
+// threaded filesystem backend before fills stop reading from their upstreams
+// until their own writes catch up; 0 for no limit
+#define PROXYTHING_FS_BACKGROUND_QUEUE_LIMIT 64
+#define PROXYTHING_FS_MAINTENANCE_QUEUE_LIMIT 256
+
+// Number of submission queue entries for the io_uring filesystem backend
+#define PROXYTHING_URING_ENTRIES 256
+
+// Number of registered file slots for the io_uring filesystem backend
+#define PROXYTHING_URING_FILES 1024
+
+// Number of registered buffers for the io_uring filesystem backend
+#define PROXYTHING_URING_BUFFERS 64
+
+// Size of each registered buffer for the io_uring filesystem backend; bigger
+// reads go into ordinary memory
+#define PROXYTHING_URING_BUFFER_SIZE (16 * 1024)
+
+// Default byte budget for the in-memory cache tier
+#define PROXYTHING_MEMORY_CACHE_SIZE (64 * 1024 * 1024)
+
+// Largest object kept in the in-memory cache tier
+#define PROXYTHING_MEMORY_CACHE_MAX_OBJECT_SIZE (256 * 1024)
+
+// Filename prefix for cache files
+#define PROXYTHING_CACHE_PREFIX "proxything_cache_"
+
+// Default maximum total size of the disk cache
+#define PROXYTHING_CACHE_MAX_BYTES (1024 * 1024 * 1024)
+
+// Default maximum number of files in the disk cache
+#define PROXYTHING_CACHE_MAX_ENTRIES 100000
+
+// Maximum number of cache files deleted at once when evicting
+#define PROXYTHING_CACHE_EVICTION_BATCH 16
+
+// Number of independently locked shards in the in-memory cache index
+#define PROXYTHING_CACHE_INDEX_SHARDS 16
+
+// Maximum number of pipelined commands a client can have outstanding
+#define PROXYTHING_PIPELINE_DEPTH 32
+
+// Line a client sends to switch to the multiplexed binary protocol
+#define PROXYTHING_MUX_PREAMBLE "PROXYTHING-MUX/1"
+
+// Bytes of data a multiplexed stream can be sent before the client grants it
+// more with a window frame
+#define PROXYTHING_MUX_WINDOW (256 * 1024)
+
+// Largest data frame sent, so streams interleave finely; file reads start out
+// in chunk_pool sized frames, and grow up to this while they keep filling them
+#define PROXYTHING_MUX_FRAME_SIZE (16 * 1024)
+
+// Largest frame payload accepted from a client
+#define PROXYTHING_MUX_MAX_FRAME_SIZE (64 * 1024)
+
+// Maximum number of streams a multiplexed session can have open at once
+#define PROXYTHING_MUX_MAX_STREAMS 4096
+
+// Maximum number of frames gathered into a single socket write
+#define PROXYTHING_MUX_WRITE_BATCH 64
+
+// Default number of seconds to cache resolved hostnames for
+#define PROXYTHING_DNS_TTL 60
+
+// Default number of seconds to cache failed hostname lookups for
+#define PROXYTHING_DNS_NEGATIVE_TTL 5
+
+// Number of cached hostnames past which expired ones are swept out
+#define PROXYTHING_DNS_CACHE_SIZE 10000
+
+// Number of live hostnames evicted at once when the DNS cache is full, so a
+// run of misses doesn't scan the whole cache for each one
+#define PROXYTHING_DNS_CACHE_EVICT_BATCH (PROXYTHING_DNS_CACHE_SIZE / 10)
+
+// Time a client has to take a write before it's disconnected (ms)
+#define PROXYTHING_CLIENT_WRITE_TIMEOUT 30000
+
+// Time to wait for an upstream to accept a connection (ms)
+#define PROXYTHING_CONNECT_TIMEOUT 10000
+
+// Time an upstream is considered down for after failing to connect (ms);
+// doubles with every failure in a row
+#define PROXYTHING_UPSTREAM_BACKOFF 1000
+
+// Longest time an upstream can be considered down for at once (ms)
+#define PROXYTHING_UPSTREAM_MAX_BACKOFF 60000
+
+// Maximum number of failing upstreams to keep track of
+#define PROXYTHING_UPSTREAM_HEALTH_SIZE 10000
+
+// Largest block kept on the per-thread free lists for connection objects and
+// asio handlers; bigger ones go straight to the heap
+#define PROXYTHING_RECYCLER_MAX_SIZE 4096
+
+// Maximum bytes of freed blocks of each size a thread keeps around for reuse
+#define PROXYTHING_RECYCLER_BYTES (256 * 1024)
 
 #endif
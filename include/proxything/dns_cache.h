@@ -0,0 +1,175 @@
+#ifndef PROXYTHING_DNS_CACHE_H
+#define PROXYTHING_DNS_CACHE_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Resolves hostnames, behind an in-process cache.
+	 * 
+	 * Lookups go through asio::ip::tcp::resolver by default, which runs
+	 * getaddrinfo() on a background thread of its own. Successful lookups are
+	 * cached for a TTL, and failed ones for a (shorter) negative TTL; lookups
+	 * for a name that's already being looked up wait for that one instead of
+	 * starting another.
+	 * 
+	 * getaddrinfo() doesn't report record TTLs, so the system resolver's
+	 * results are kept for the configured TTL; a lookup function that does
+	 * know them can pass them along instead (see set_lookup()).
+	 * 
+	 * When the server runs one IO service per core, each has its own cache
+	 * forwarding to the first one's, so they share one set of entries.
+	 */
+	class dns_cache : public asio::io_service::service
+	{
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/// Clock used for expiry
+		typedef std::chrono::steady_clock clock;
+		
+		/**
+		 * Callback type for async_resolve().
+		 * 
+		 * Called from the primary's IO service, or from this one's on a hit;
+		 * wrap it in a strand to get back onto a connection's.
+		 * 
+		 * @param ec      Set if the name couldn't be resolved
+		 * @param address The first address it resolved to
+		 */
+		typedef std::function<void(const boost::system::error_code &ec, asio::ip::address address)> ResolveHandler;
+		
+		/**
+		 * Callback type for lookup functions.
+		 * 
+		 * @param ec        Set if the lookup failed
+		 * @param addresses Addresses found, in order of preference
+		 * @param ttl       How long the result may be cached; negative for the
+		 *                  cache's default
+		 */
+		typedef std::function<void(const boost::system::error_code &ec, std::vector<asio::ip::address> addresses, std::chrono::seconds ttl)> LookupHandler;
+		
+		/**
+		 * Lookup function type.
+		 * 
+		 * @param host Hostname to look up
+		 * @param cb   Callback, called exactly once
+		 */
+		typedef std::function<void(const std::string &host, LookupHandler cb)> LookupFunction;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service      Parent IO service
+		 * @param  ttl          How long to cache successful lookups; 0 to not
+		 *                      cache them at all
+		 * @param  negative_ttl How long to cache failed lookups
+		 */
+		explicit dns_cache(asio::io_service &service, std::chrono::seconds ttl = std::chrono::seconds(PROXYTHING_DNS_TTL), std::chrono::seconds negative_ttl = std::chrono::seconds(PROXYTHING_DNS_NEGATIVE_TTL));
+		
+		/**
+		 * Constructs a cache sharing another IO service's cache.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Cache to forward to; must outlive this one
+		 */
+		dns_cache(asio::io_service &service, dns_cache &primary);
+		
+		virtual ~dns_cache() { }
+		
+		/**
+		 * Resolves a hostname.
+		 * 
+		 * @param host Hostname to resolve
+		 * @param cb   Callback
+		 */
+		void async_resolve(const std::string &host, ResolveHandler cb);
+		
+		/**
+		 * Replaces the function used to look up names.
+		 * 
+		 * Used to stub out DNS in tests.
+		 * 
+		 * @param fn Lookup function
+		 */
+		void set_lookup(LookupFunction fn);
+		
+		/**
+		 * Drops all cached entries; lookups in flight carry on.
+		 */
+		void clear();
+		
+		/**
+		 * Returns the number of cached entries, including expired ones that
+		 * haven't been swept yet.
+		 */
+		std::size_t size();
+		
+		/// Returns how long successful lookups are cached
+		inline std::chrono::seconds ttl() const { return m_ttl; }
+		
+		/// Returns how long failed lookups are cached
+		inline std::chrono::seconds negative_ttl() const { return m_negative_ttl; }
+	
+	protected:
+		/**
+		 * A cached lookup, or one in flight.
+		 */
+		struct entry
+		{
+			boost::system::error_code ec;				///< Error, if it failed
+			asio::ip::address address;					///< First address found
+			clock::time_point expires;					///< When it goes stale
+			std::vector<ResolveHandler> waiting;		///< Callbacks waiting on a lookup
+		};
+		
+		/**
+		 * Looks a name up with the system resolver.
+		 */
+		void system_lookup(const std::string &host, LookupHandler cb);
+		
+		/**
+		 * Stores the result of a lookup, and calls everyone waiting on it.
+		 */
+		void complete(const std::string &host, const boost::system::error_code &ec, const std::vector<asio::ip::address> &addresses, std::chrono::seconds ttl);
+		
+		/**
+		 * Drops expired entries with no lookups in flight, then evicts the
+		 * oldest others until there's room for PROXYTHING_DNS_CACHE_EVICT_BATCH
+		 * more under PROXYTHING_DNS_CACHE_SIZE; call with m_mutex held.
+		 */
+		void sweep(clock::time_point now);
+		
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service();
+		
+		dns_cache *m_primary;					///< Cache to forward to, if sharing one
+		
+		std::chrono::seconds m_ttl;				///< How long to cache successful lookups
+		std::chrono::seconds m_negative_ttl;	///< How long to cache failed lookups
+		
+		LookupFunction m_lookup;				///< Looks names up
+		asio::ip::tcp::resolver m_resolver;		///< System resolver
+		
+		std::mutex m_mutex;						///< Guards m_entries and m_lookup
+		
+		/// Entries, by hostname
+		std::unordered_map<std::string, entry> m_entries;
+	};
+}
+
+#endif
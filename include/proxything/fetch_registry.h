@@ -0,0 +1,97 @@
+#ifndef PROXYTHING_FETCH_REGISTRY_H
+#define PROXYTHING_FETCH_REGISTRY_H
+
+#include <boost/asio.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	class remote_connection;
+	
+	/**
+	 * Registry of in-flight remote fetches, keyed by endpoint.
+	 * 
+	 * Used to coalesce concurrent cache misses for the same endpoint into a
+	 * single upstream connection and cache fill.
+	 * 
+	 * When the server runs one IO service per core, each has its own
+	 * registry forwarding to the first one's, so misses coalesce across
+	 * cores as well.
+	 */
+	class fetch_registry : public asio::io_service::service
+	{
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service Parent IO service
+		 */
+		explicit fetch_registry(asio::io_service &service):
+			asio::io_service::service(service), m_primary(nullptr) { }
+		
+		/**
+		 * Constructs a registry sharing another IO service's registry.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Registry to forward to; must outlive this one
+		 */
+		fetch_registry(asio::io_service &service, fetch_registry &primary):
+			asio::io_service::service(service), m_primary(&primary) { }
+		
+		virtual ~fetch_registry() { }
+		
+		/**
+		 * Returns the in-flight fetch for an endpoint, if any.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @return          The fetch, or nullptr
+		 */
+		std::shared_ptr<remote_connection> find(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Registers a fetch, unless one is already in flight.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @param  remote   Fetch to register
+		 * @return          The fetch in flight; remote if it was registered
+		 */
+		std::shared_ptr<remote_connection> insert(const asio::ip::tcp::endpoint &endpoint, std::shared_ptr<remote_connection> remote);
+		
+		/**
+		 * Unregisters a fetch, once it's done.
+		 * 
+		 * Does nothing if another fetch has taken its place.
+		 * 
+		 * @param endpoint Endpoint
+		 * @param remote   Fetch to unregister
+		 */
+		void erase(const asio::ip::tcp::endpoint &endpoint, const remote_connection *remote);
+		
+		/**
+		 * Returns the number of fetches in flight.
+		 */
+		std::size_t size();
+		
+	protected:
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service() { };
+		
+		fetch_registry *m_primary;	///< Registry to forward to, if sharing one
+		
+		std::mutex m_mutex;		///< Guards m_fetches
+		
+		/// Fetches in flight
+		std::map<asio::ip::tcp::endpoint, std::weak_ptr<remote_connection>> m_fetches;
+	};
+}
+
+#endif
@@ -1,26 +1,63 @@
 #ifndef PROXYTHING_FILE_RESPONDER_H
 #define PROXYTHING_FILE_RESPONDER_H
 
+#include <proxything/chunk_pool.h>
 #include <boost/asio.hpp>
+#include <functional>
 #include <memory>
+#include <string>
 
 namespace proxything
 {
 	namespace asio = boost::asio;
 	
 	class client_connection;
+	class remote_connection;
 	class fs_entry;
 	
 	/**
 	 * Sends the contents of a file to a client.
+	 * 
+	 * If the file has a native handle and its first page is in the page
+	 * cache (see fs_service::resident()), it's sent with sendfile() straight
+	 * from the page cache to the socket, whenever the socket is writable,
+	 * with either backend. Otherwise, it's read into chunks from chunk_pool,
+	 * within its budget, and written out from there; reads that would have
+	 * to wait for the disk go through fs_service, the rest are made right
+	 * away, from the page cache.
+	 * 
+	 * The file can be a cache entry that's still being filled, in which case
+	 * reaching the end of it waits for the fill to write more, and the
+	 * response only ends once the fill has been committed. It can also pick
+	 * up partway through, when a client that fell behind a fill is switched
+	 * over to reading from its cache file; see remote_connection.
+	 * 
+	 * If the client is pipelined, the file is framed as chunks; see
+	 * client_connection.
+	 * 
+	 * Handlers run through the client's strand, and writes are held to its
+	 * write deadline; see client_connection::expect_write().
 	 */
 	class file_responder : public std::enable_shared_from_this<file_responder>
 	{
 	public:
+		/**
+		 * Callback type for start().
+		 * 
+		 * @param ec Set if the response was cut short
+		 */
+		typedef std::function<void(const boost::system::error_code &ec)> DoneHandler;
+		
 		/**
 		 * Constructs a file responder.
+		 * 
+		 * @param service IO service
+		 * @param client  Client to send to
+		 * @param file    File to send
+		 * @param fill    Fill writing to the file, if it's still being written
+		 * @param offset  Bytes of the file already sent to the client
 		 */
-		file_responder(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> file);
+		file_responder(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> file, std::shared_ptr<remote_connection> fill = nullptr, off_t offset = 0);
 		
 		virtual ~file_responder();
 		
@@ -28,8 +65,10 @@ namespace proxything
 		
 		/**
 		 * Start sending the file.
+		 * 
+		 * @param cb Called once the response has been sent, or cut short
 		 */
-		void start();
+		void start(DoneHandler cb = nullptr);
 		
 		
 		
@@ -50,13 +89,78 @@ namespace proxything
 		 */
 		void read_and_deliver();
 		
+		/**
+		 * Reads a chunk of data through fs_service, and delivers it.
+		 */
+		void read_async();
+		
+		/**
+		 * Takes a chunk of m_sizer's size from the pool into m_chunk, waiting
+		 * for the budget to allow for one if need be.
+		 * 
+		 * @param next Called once m_chunk is set
+		 */
+		void acquire_chunk(std::function<void()> next);
+		
+		/**
+		 * Sends the data a read put into m_chunk.
+		 * 
+		 * @param ec   Result of the read
+		 * @param size Bytes read
+		 */
+		void deliver(const boost::system::error_code &ec, std::size_t size);
+		
+		/**
+		 * Sends a chunk of the file with sendfile().
+		 * 
+		 * Calls itself when the socket becomes writable, until EOF or an
+		 * error occurs. Falls back to read_and_deliver() if the file can't be
+		 * sent this way.
+		 */
+		void send_file();
+		
+		/**
+		 * Waits for the fill to write past what's been sent so far.
+		 * 
+		 * @param resume Called if there's more to send
+		 */
+		void wait_for_fill(std::function<void()> resume);
+		
+		/**
+		 * Ends the response, and calls the done handler.
+		 * 
+		 * When pipelined, this sends the final chunk, or an error in place of
+		 * the next chunk. Otherwise, errors cut the client off, rather than let
+		 * it take a truncated response for a complete one.
+		 * 
+		 * @param ec Why the response was cut short, if it was
+		 */
+		void finish(const boost::system::error_code &ec = boost::system::error_code());
+		
+		/**
+		 * Sets TCP_CORK on the client socket, to only send full packets.
+		 * 
+		 * @param cork Enable or disable corking
+		 */
+		void set_cork(bool cork);
+		
 		
 		
 		asio::io_service &m_service;					///< IO Service
 		std::shared_ptr<client_connection> m_client;	///< Parent connection
 		std::shared_ptr<fs_entry> m_file;				///< File handle
+		std::shared_ptr<remote_connection> m_fill;		///< Fill writing to m_file, if any
+		
+		DoneHandler m_done;								///< Called once the response is over
+		bool m_framed;									///< Framing the response as chunks?
+		bool m_chunk_open;								///< Sending the rest of the file as one chunk?
+		std::string m_header;							///< Chunk header or error being sent
 		
-		asio::streambuf m_buf;							///< Buffer
+		chunk_pool &m_pool;								///< Pool for read buffers
+		chunk_pool::chunk_ptr m_chunk;					///< Chunk being read into, or sent
+		chunk_pool::sizer m_sizer;						///< Picks read sizes
+		off_t m_start;									///< Offset the response started at
+		off_t m_offset;									///< Bytes sent so far; offset for sendfile()
 	};
 }
 
@@ -31,22 +31,26 @@ namespace proxything
 		 * 
 		 * @param filename Filename to open
 		 * @param mode     Open mode
-		 * @param cb       Callback
+		 * @param handler  Completion token for void(error_code)
 		 */
-		void async_open(const std::string &filename, std::ios_base::openmode mode, fs_service::OpenHandler cb)
+		template<typename OpenHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(OpenHandler, void(boost::system::error_code))
+		async_open(const std::string &filename, std::ios_base::openmode mode, BOOST_ASIO_MOVE_ARG(OpenHandler) handler)
 		{
-			get_service().async_open(get_implementation(), filename, mode, false, cb);
+			return get_service().async_open(get_implementation(), filename, mode, false, BOOST_ASIO_MOVE_CAST(OpenHandler)(handler));
 		}
 		
 		/**
 		 * Asynchronously opens the file for reading.
 		 * 
 		 * @param filename Filename to open
-		 * @param cb       Callback
+		 * @param handler  Completion token for void(error_code)
 		 */
-		void async_open(const std::string &filename, fs_service::OpenHandler cb)
+		template<typename OpenHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(OpenHandler, void(boost::system::error_code))
+		async_open(const std::string &filename, BOOST_ASIO_MOVE_ARG(OpenHandler) handler)
 		{
-			async_open(filename, std::ios_base::in|std::ios_base::binary, cb);
+			return async_open(filename, std::ios_base::in|std::ios_base::binary, BOOST_ASIO_MOVE_CAST(OpenHandler)(handler));
 		}
 		
 		/**
@@ -63,32 +67,67 @@ namespace proxything
 		 * 
 		 * @param filename Filename to open
 		 * @param mode     Open mode
-		 * @param cb       Callback
+		 * @param handler  Completion token for void(error_code)
 		 */
-		void async_open_atomic(const std::string &filename, std::ios_base::openmode mode, fs_service::OpenHandler cb)
+		template<typename OpenHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(OpenHandler, void(boost::system::error_code))
+		async_open_atomic(const std::string &filename, std::ios_base::openmode mode, BOOST_ASIO_MOVE_ARG(OpenHandler) handler)
 		{
-			get_service().async_open(get_implementation(), filename, mode, true, cb);
+			return get_service().async_open(get_implementation(), filename, mode, true, BOOST_ASIO_MOVE_CAST(OpenHandler)(handler));
 		}
 		
 		/**
 		 * Asynchronously opens a file writing, using atomic writes.
 		 * 
 		 * @param filename Filename to open
-		 * @param cb       Callback
+		 * @param handler  Completion token for void(error_code)
 		 */
-		void async_open_atomic(const std::string &filename, fs_service::OpenHandler cb)
+		template<typename OpenHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(OpenHandler, void(boost::system::error_code))
+		async_open_atomic(const std::string &filename, BOOST_ASIO_MOVE_ARG(OpenHandler) handler)
 		{
-			async_open_atomic(filename, std::ios_base::out|std::ios_base::trunc, cb);
+			return async_open_atomic(filename, std::ios_base::out|std::ios_base::trunc, BOOST_ASIO_MOVE_CAST(OpenHandler)(handler));
 		}
 		
 		/**
 		 * Asynchronously closes the file.
 		 * 
-		 * @param cb Callback
+		 * @param handler Completion token for void(error_code)
 		 */
-		void async_close(fs_service::CloseHandler cb = nullptr)
+		template<typename CloseHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(CloseHandler, void(boost::system::error_code))
+		async_close(BOOST_ASIO_MOVE_ARG(CloseHandler) handler)
 		{
-			get_service().async_close(get_implementation(), cb);
+			return get_service().async_close(get_implementation(), BOOST_ASIO_MOVE_CAST(CloseHandler)(handler));
+		}
+		
+		/**
+		 * Asynchronously closes the file, ignoring the outcome.
+		 */
+		void async_close()
+		{
+			async_close([](const boost::system::error_code &ec) { });
+		}
+		
+		/**
+		 * Asynchronously closes the file, throwing away an atomic write.
+		 * 
+		 * @param handler Completion token for void(error_code)
+		 */
+		template<typename CloseHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(CloseHandler, void(boost::system::error_code))
+		async_discard(BOOST_ASIO_MOVE_ARG(CloseHandler) handler)
+		{
+			return get_service().async_discard(get_implementation(), BOOST_ASIO_MOVE_CAST(CloseHandler)(handler));
+		}
+		
+		/**
+		 * Asynchronously closes the file, throwing away an atomic write and
+		 * ignoring the outcome.
+		 */
+		void async_discard()
+		{
+			async_discard([](const boost::system::error_code &ec) { });
 		}
 		
 		/**
@@ -96,12 +135,30 @@ namespace proxything
 		 * 
 		 * @tparam BufsT   Mutable buffer type
 		 * @param  buffers Buffers to read into
-		 * @param  cb      Callback
+		 * @param  handler Completion token for void(error_code, std::size_t)
+		 */
+		template<typename BufsT, typename ReadHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(boost::system::error_code, std::size_t))
+		async_read_some(const BufsT &buffers, BOOST_ASIO_MOVE_ARG(ReadHandler) handler)
+		{
+			return get_service().async_read_some(get_implementation(), buffers, BOOST_ASIO_MOVE_CAST(ReadHandler)(handler));
+		}
+		
+		/**
+		 * Reads some data, if it can be done without waiting for the disk.
+		 * 
+		 * @see fs_service::read_some_nowait()
+		 * 
+		 * @tparam BufsT   Mutable buffer type
+		 * @param  buffers Buffers to read into
+		 * @param  ec      Set to asio::error::would_block if the read should
+		 *                 be made with async_read_some() instead
+		 * @return         Bytes read
 		 */
 		template<typename BufsT>
-		void async_read_some(const BufsT &buffers, fs_service::ReadHandler cb)
+		std::size_t read_some_nowait(const BufsT &buffers, boost::system::error_code &ec)
 		{
-			get_service().async_read_some(get_implementation(), buffers, cb);
+			return get_service().read_some_nowait(get_implementation(), buffers, ec);
 		}
 		
 		/**
@@ -109,12 +166,13 @@ namespace proxything
 		 * 
 		 * @tparam BufsT   Constant buffer sequence type
 		 * @param  buffers Buffers to read from
-		 * @param  cb      Callback
+		 * @param  handler Completion token for void(error_code, std::size_t)
 		 */
-		template<typename BufsT>
-		void async_write_some(const BufsT &buffers, fs_service::WriteHandler cb)
+		template<typename BufsT, typename WriteHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(boost::system::error_code, std::size_t))
+		async_write_some(const BufsT &buffers, BOOST_ASIO_MOVE_ARG(WriteHandler) handler)
 		{
-			get_service().async_write_some(get_implementation(), buffers, cb);
+			return get_service().async_write_some(get_implementation(), buffers, BOOST_ASIO_MOVE_CAST(WriteHandler)(handler));
 		}
 		
 		/**
@@ -124,6 +182,56 @@ namespace proxything
 		{
 			return get_service().filename(get_implementation());
 		}
+		
+		/**
+		 * Returns the path the entry's data is at.
+		 * 
+		 * @see fs_service::path()
+		 */
+		std::string path() const
+		{
+			return get_service().path(get_implementation());
+		}
+		
+		/**
+		 * Sets the offset the next read or write starts at.
+		 * 
+		 * @see fs_service::seek()
+		 */
+		void seek(off_t offset)
+		{
+			get_service().seek(get_implementation(), offset);
+		}
+		
+		/**
+		 * Checks if the data at an offset is in the page cache.
+		 * 
+		 * @see fs_service::resident()
+		 */
+		bool resident(off_t offset) const
+		{
+			return get_service().resident(get_implementation(), offset);
+		}
+		
+		/**
+		 * Sets the priority class the entry's operations are scheduled as.
+		 * 
+		 * @see fs_service::set_io_class()
+		 */
+		void set_io_class(fs_service::io_class cls)
+		{
+			get_service().set_io_class(get_implementation(), cls);
+		}
+		
+		/**
+		 * Returns the underlying file descriptor, or -1 if there is none.
+		 * 
+		 * @see fs_service::native_handle()
+		 */
+		int native_handle() const
+		{
+			return get_service().native_handle(get_implementation());
+		}
 	};
 }
 
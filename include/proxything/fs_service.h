@@ -2,8 +2,14 @@
 #define PROXYTHING_FS_SERVICE_H
 
 #include <proxything/impl/fs_service_threaded.h>
+#ifdef PROXYTHING_HAVE_IO_URING
+#include <proxything/impl/fs_service_uring.h>
+#endif
 #include <proxything/util.h>
+#include <proxything/config.h>
 #include <boost/asio.hpp>
+#include <atomic>
+#include <functional>
 #include <thread>
 #include <memory>
 
@@ -16,70 +22,167 @@ namespace proxything
 	 * 
 	 * This is a very barebones implementation, but it has the basic design
 	 * down and is sufficient for our purposes.
+	 * 
+	 * Asynchronous operations take any asio completion token, eg. a plain
+	 * handler or asio::use_future. The threaded backend keeps the handler in
+	 * place for the operation's duration, and allocates through its hooks.
+	 * 
+	 * With the threaded backend, each entry's operations are also scheduled
+	 * by its priority class (see set_io_class()), so that cache fills and
+	 * eviction don't hold up reads for clients.
+	 * 
+	 * With a shard per core, the threaded backend's workers and scheduler are
+	 * shared between all shards. The io_uring backend can't be shared that
+	 * way, since completions are reaped from the IO service owning the ring:
+	 * each shard gets a ring of its own, with its own registered files and
+	 * buffers, and its operations aren't scheduled by priority at all.
 	 */
 	class fs_service : public asio::io_service::service
 	{
 		/**
-		 * The concrete implementation used.
-		 * 
-		 * Currently, only a thread-based implementation is provided, but it
-		 * would be trivial to add implementations using AIO or Windows OVERLAP
-		 * instead.
+		 * Thread-based implementation; the default.
 		 */
-		typedef impl::fs_service_threaded<std::thread> impl_type;
+		typedef impl::fs_service_threaded<std::thread> threaded_impl_type;
 		
-		/// An instance of impl_type
-		impl_type m_impl;
+#ifdef PROXYTHING_HAVE_IO_URING
+		/**
+		 * io_uring-based implementation; Linux only.
+		 */
+		typedef impl::fs_service_uring uring_impl_type;
+#endif
 		
 	public:
 		/// Service ID
 		static asio::io_service::id id;
 		
 		/**
-		 * Implementation-defined type for IO objects.
+		 * Available implementations.
 		 * 
-		 * @see proxything::fs_entry
+		 * The implementation is chosen when the service is constructed, so
+		 * IO objects carry state for each of them.
 		 */
-		typedef impl_type::implementation_type implementation_type;
+		enum class backend_type
+		{
+			threaded,	///< impl::fs_service_threaded
+			uring,		///< impl::fs_service_uring
+		};
 		
 		/**
-		 * Callback type for opening a file.
+		 * Priority classes for operations.
 		 * 
-		 * @param ec Error code
+		 * @see impl::fs_scheduler
 		 */
-		typedef std::function<void(const boost::system::error_code &ec)> OpenHandler;
+		typedef impl::fs_scheduler::io_class io_class;
 		
 		/**
-		 * Callback type for closing a file.
+		 * Implementation-defined type for IO objects.
 		 * 
-		 * @param ec Error code
+		 * @see proxything::fs_entry
 		 */
-		typedef std::function<void(const boost::system::error_code &ec)> CloseHandler;
+		struct implementation_type
+		{
+			/// State for the threaded implementation
+			threaded_impl_type::implementation_type threaded;
+			
+#ifdef PROXYTHING_HAVE_IO_URING
+			/// State for the io_uring implementation
+			uring_impl_type::implementation_type uring;
+#endif
+		};
 		
 		/**
-		 * Callback type for reading a file.
+		 * Constructor.
+		 * 
+		 * If the requested backend isn't available, this falls back to
+		 * backend_type::threaded; check backend() for the one in use.
 		 * 
-		 * @param ec Error code
+		 * @param  service     Parent IO service
+		 * @param  backend     Backend to use
+		 * @param  num_threads Worker threads for backend_type::threaded
 		 */
-		typedef std::function<void(const boost::system::error_code &ec, std::size_t size)> ReadHandler;
+		explicit fs_service(asio::io_service &service, backend_type backend = backend_type::threaded, std::size_t num_threads = PROXYTHING_FS_THREADS):
+			asio::io_service::service(service), m_backend(backend_type::threaded), m_num_threads(num_threads),
+			m_nowait_reads(0), m_fallback_reads(0)
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (backend == backend_type::uring && uring_impl_type::supported()) {
+				try {
+					m_uring.reset(new uring_impl_type(service));
+					m_backend = backend_type::uring;
+				} catch (boost::system::system_error &e) {
+					// Fall through to the threaded implementation
+				}
+			}
+#endif
+			
+			if (m_backend == backend_type::threaded) {
+				m_threaded.reset(new threaded_impl_type(num_threads));
+			}
+		}
 		
 		/**
-		 * Callback type for writing to a file.
+		 * Constructs a service sharing another IO service's disk IO threads.
+		 * 
+		 * With the io_uring backend, it gets a ring of its own instead, since
+		 * completions are reaped from the IO service that owns the ring. If
+		 * that can't be set up, it falls back to backend_type::threaded, with
+		 * as many threads as the primary was asked for; check backend().
 		 * 
-		 * @param ec   Error code
-		 * @param size Bytes written
+		 * @param  service Parent IO service
+		 * @param  primary Service to share with
 		 */
-		typedef std::function<void(const boost::system::error_code &ec, std::size_t size)> WriteHandler;
+		fs_service(asio::io_service &service, fs_service &primary):
+			asio::io_service::service(service), m_backend(primary.backend()), m_num_threads(primary.m_num_threads),
+			m_nowait_reads(0), m_fallback_reads(0), m_threaded(primary.m_threaded)
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_backend == backend_type::uring) {
+				try {
+					m_uring.reset(new uring_impl_type(service));
+				} catch (boost::system::system_error &e) {
+					m_backend = backend_type::threaded;
+				}
+			}
+#endif
+			
+			if (m_backend == backend_type::threaded && !m_threaded) {
+				m_threaded.reset(new threaded_impl_type(m_num_threads));
+			}
+		}
+		
+		virtual ~fs_service() { };
 		
 		/**
-		 * Constructor.
+		 * Checks if a backend is supported on this system.
 		 * 
-		 * @param  service Parent IO service
+		 * @param backend Backend to check
 		 */
-		explicit fs_service(asio::io_service &service):
-			asio::io_service::service(service) { }
+		static bool supported(backend_type backend)
+		{
+			switch (backend) {
+				case backend_type::threaded:
+					return true;
+				case backend_type::uring:
+#ifdef PROXYTHING_HAVE_IO_URING
+					return uring_impl_type::supported();
+#else
+					return false;
+#endif
+			}
+			return false;
+		}
 		
-		virtual ~fs_service() { };
+		/// Returns the backend in use
+		backend_type backend() const { return m_backend; }
+		
+		/// Returns the number of worker threads, if any
+		std::size_t num_threads() const { return m_threaded ? m_threaded->num_threads() : 0; }
+		
+		/**
+		 * Returns the threaded backend's scheduler, or nullptr with another
+		 * backend.
+		 */
+		impl::fs_scheduler* scheduler() { return m_threaded ? &m_threaded->scheduler() : nullptr; }
 		
 		/**
 		 * Constructs a new entry.
@@ -88,7 +191,13 @@ namespace proxything
 		 */
 		void construct(implementation_type &impl)
 		{
-			m_impl.construct(get_io_service(), impl);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->construct(util::owner(*this), impl.uring);
+				return;
+			}
+#endif
+			m_threaded->construct(util::owner(*this), impl.threaded);
 		}
 		
 		/**
@@ -98,7 +207,13 @@ namespace proxything
 		 */
 		void destroy(implementation_type &impl)
 		{
-			m_impl.destroy(get_io_service(), impl);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->destroy(util::owner(*this), impl.uring);
+				return;
+			}
+#endif
+			m_threaded->destroy(util::owner(*this), impl.threaded);
 		}
 		
 		/**
@@ -108,22 +223,69 @@ namespace proxything
 		 * @param filename Filename
 		 * @param mode     Open mode
 		 * @param atomic   Open for atomic writes
-		 * @param cb       Callback
+		 * @param handler  Completion token for void(error_code)
 		 */
-		void async_open(implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, OpenHandler cb)
+		template<typename OpenHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(OpenHandler, void(boost::system::error_code))
+		async_open(implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, BOOST_ASIO_MOVE_ARG(OpenHandler) handler)
 		{
-			m_impl.async_open(get_io_service(), impl, filename, mode, atomic, util::work_bound(get_io_service(), cb));
+			util::async_completion<OpenHandler, void(boost::system::error_code)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_open(util::owner(*this), impl.uring, filename, mode, atomic, uring_callback<void(const boost::system::error_code&)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_open(util::owner(*this), impl.threaded, filename, mode, atomic, std::move(init.completion_handler));
+			return init.result.get();
 		}
 		
 		/**
 		 * Asynchronously closes a file.
 		 * 
-		 * @param impl Implementation
-		 * @param cb   Callback
+		 * An atomic write that fails to close or be moved over the
+		 * destination is dropped, so its temporary file isn't left behind.
+		 * 
+		 * @param impl    Implementation
+		 * @param handler Completion token for void(error_code)
 		 */
-		void async_close(implementation_type &impl, CloseHandler cb)
+		template<typename CloseHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(CloseHandler, void(boost::system::error_code))
+		async_close(implementation_type &impl, BOOST_ASIO_MOVE_ARG(CloseHandler) handler)
 		{
-			m_impl.async_close(get_io_service(), impl, util::work_bound(get_io_service(), cb));
+			util::async_completion<CloseHandler, void(boost::system::error_code)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_close(util::owner(*this), impl.uring, uring_callback<void(const boost::system::error_code&)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_close(util::owner(*this), impl.threaded, std::move(init.completion_handler));
+			return init.result.get();
+		}
+		
+		/**
+		 * Asynchronously closes a file, dropping its atomic write.
+		 * 
+		 * The temporary file is removed instead of being moved over the
+		 * destination, which is left as it was.
+		 * 
+		 * @param impl    Implementation
+		 * @param handler Completion token for void(error_code)
+		 */
+		template<typename CloseHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(CloseHandler, void(boost::system::error_code))
+		async_discard(implementation_type &impl, BOOST_ASIO_MOVE_ARG(CloseHandler) handler)
+		{
+			util::async_completion<CloseHandler, void(boost::system::error_code)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_discard(util::owner(*this), impl.uring, uring_callback<void(const boost::system::error_code&)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_discard(util::owner(*this), impl.threaded, std::move(init.completion_handler));
+			return init.result.get();
 		}
 		
 		/**
@@ -131,12 +293,21 @@ namespace proxything
 		 * 
 		 * @param impl    Implementation
 		 * @param buffers Buffers
-		 * @param cb      Callback
+		 * @param handler Completion token for void(error_code, std::size_t)
 		 */
-		template<typename BufsT>
-		void async_read_some(implementation_type &impl, const BufsT &buffers, ReadHandler cb)
+		template<typename BufsT, typename ReadHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(ReadHandler, void(boost::system::error_code, std::size_t))
+		async_read_some(implementation_type &impl, const BufsT &buffers, BOOST_ASIO_MOVE_ARG(ReadHandler) handler)
 		{
-			m_impl.async_read_some(get_io_service(), impl, buffers, util::work_bound(get_io_service(), cb));
+			util::async_completion<ReadHandler, void(boost::system::error_code, std::size_t)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_read_some(util::owner(*this), impl.uring, buffers, uring_callback<void(const boost::system::error_code&, std::size_t)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_read_some(util::owner(*this), impl.threaded, buffers, std::move(init.completion_handler));
+			return init.result.get();
 		}
 		
 		/**
@@ -144,12 +315,116 @@ namespace proxything
 		 * 
 		 * @param impl    Implementation
 		 * @param buffers Buffers
-		 * @param cb      Callback
+		 * @param handler Completion token for void(error_code, std::size_t)
+		 */
+		template<typename BufsT, typename WriteHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(WriteHandler, void(boost::system::error_code, std::size_t))
+		async_write_some(implementation_type &impl, const BufsT &buffers, BOOST_ASIO_MOVE_ARG(WriteHandler) handler)
+		{
+			util::async_completion<WriteHandler, void(boost::system::error_code, std::size_t)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_write_some(util::owner(*this), impl.uring, buffers, uring_callback<void(const boost::system::error_code&, std::size_t)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_write_some(util::owner(*this), impl.threaded, buffers, std::move(init.completion_handler));
+			return init.result.get();
+		}
+		
+		/**
+		 * Reads a file on the calling thread, if it doesn't have to wait for
+		 * the disk.
+		 * 
+		 * With the threaded backend, this reads data that's already in the
+		 * page cache without handing the read to a worker; if any of it would
+		 * have to come from the disk, it fails with asio::error::would_block,
+		 * and the read should be made with async_read_some() instead. Other
+		 * backends always fail this way, and count every read as a fallback.
+		 * 
+		 * Mustn't be called while operations on the entry are in flight.
+		 * 
+		 * @param  impl    Implementation
+		 * @param  buffers Buffers
+		 * @param  ec      Set to asio::error::would_block, asio::error::eof,
+		 *                 or cleared if data was read
+		 * @return         Bytes read
 		 */
 		template<typename BufsT>
-		void async_write_some(implementation_type &impl, const BufsT &buffers, WriteHandler cb)
+		std::size_t read_some_nowait(implementation_type &impl, const BufsT &buffers, boost::system::error_code &ec)
 		{
-			m_impl.async_write_some(get_io_service(), impl, buffers, util::work_bound(get_io_service(), cb));
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_fallback_reads.fetch_add(1, std::memory_order_relaxed);
+				ec = asio::error::would_block;
+				return 0;
+			}
+#endif
+			std::size_t size = m_threaded->read_some_nowait(impl.threaded, buffers, ec);
+			if (ec == asio::error::would_block) {
+				m_fallback_reads.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				m_nowait_reads.fetch_add(1, std::memory_order_relaxed);
+			}
+			return size;
+		}
+		
+		/**
+		 * Checks if the data at an offset in a file is in the page cache.
+		 * 
+		 * A single byte is read with preadv2(RWF_NOWAIT), on any backend,
+		 * so nothing's copied and nothing's counted as a read. Where that's
+		 * not supported, the data is assumed to be resident.
+		 * 
+		 * @param  impl   Implementation
+		 * @param  offset Offset
+		 * @return        False if reading it would have to wait for the disk
+		 */
+		bool resident(const implementation_type &impl, off_t offset) const
+		{
+#ifdef RWF_NOWAIT
+			int fd = native_handle(impl);
+			if (fd != -1) {
+				char byte;
+				iovec iov = { &byte, 1 };
+				ssize_t res;
+				do {
+					res = ::preadv2(fd, &iov, 1, offset, RWF_NOWAIT);
+				} while (res == -1 && errno == EINTR);
+				return res != -1 || errno != EAGAIN;
+			}
+#endif
+			return true;
+		}
+		
+		/// Returns the number of reads read_some_nowait() completed itself
+		std::size_t nowait_reads() const { return m_nowait_reads.load(std::memory_order_relaxed); }
+		
+		/// Returns the number of reads read_some_nowait() left to the backend
+		std::size_t fallback_reads() const { return m_fallback_reads.load(std::memory_order_relaxed); }
+		
+		/**
+		 * Asynchronously removes a file.
+		 * 
+		 * Entries that have the file open can keep using it. Removals are
+		 * scheduled as io_class::maintenance.
+		 * 
+		 * @param filename Filename
+		 * @param handler  Completion token for void(error_code)
+		 */
+		template<typename RemoveHandler>
+		BOOST_ASIO_INITFN_RESULT_TYPE(RemoveHandler, void(boost::system::error_code))
+		async_remove(const std::string &filename, BOOST_ASIO_MOVE_ARG(RemoveHandler) handler)
+		{
+			util::async_completion<RemoveHandler, void(boost::system::error_code)> init(handler);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->async_remove(util::owner(*this), filename, uring_callback<void(const boost::system::error_code&)>(init.completion_handler));
+				return init.result.get();
+			}
+#endif
+			m_threaded->async_remove(util::owner(*this), filename, std::move(init.completion_handler));
+			return init.result.get();
 		}
 		
 		/**
@@ -159,14 +434,171 @@ namespace proxything
 		 */
 		std::string filename(const implementation_type &impl) const
 		{
-			return m_impl.filename(impl);
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				return m_uring->filename(impl.uring);
+			}
+#endif
+			return m_threaded->filename(impl.threaded);
+		}
+		
+		/**
+		 * Returns the path the entry's data is at.
+		 * 
+		 * This is the filename, unless the entry is open for atomic writing,
+		 * in which case it's the temporary file being written to; it can be
+		 * opened for reading while it's being written.
+		 * 
+		 * @param  impl Implementation
+		 */
+		std::string path(const implementation_type &impl) const
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				return m_uring->path(impl.uring);
+			}
+#endif
+			return m_threaded->path(impl.threaded);
+		}
+		
+		/**
+		 * Sets the offset the entry's next read or write starts at.
+		 * 
+		 * Mustn't be called while operations on the entry are in flight.
+		 * 
+		 * @param impl   Implementation
+		 * @param offset Offset
+		 */
+		void seek(implementation_type &impl, off_t offset)
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				m_uring->seek(impl.uring, offset);
+				return;
+			}
+#endif
+			m_threaded->seek(impl.threaded, offset);
+		}
+		
+		/**
+		 * Sets the priority class the entry's operations are scheduled as.
+		 * 
+		 * Only the threaded backend schedules operations; entries are
+		 * io_class::foreground by default. Mustn't be called while operations
+		 * on the entry are in flight, so they stay in order.
+		 * 
+		 * @param impl Implementation
+		 * @param cls  Class
+		 */
+		void set_io_class(implementation_type &impl, io_class cls)
+		{
+			if (m_threaded) {
+				m_threaded->set_io_class(impl.threaded, cls);
+			}
+		}
+		
+		/**
+		 * Returns the entry's underlying file descriptor.
+		 * 
+		 * This is meant for zero-copy IO, such as sendfile(); reading from or
+		 * writing to it directly bypasses the backend, and does not affect the
+		 * entry's offset.
+		 * 
+		 * @param  impl Implementation
+		 * @return      A file descriptor, or -1 if none is available
+		 */
+		int native_handle(const implementation_type &impl) const
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				return m_uring->native_handle(impl.uring);
+			}
+#endif
+			return m_threaded->native_handle(impl.threaded);
+		}
+		
+		/**
+		 * Allocates a buffer for reading files into.
+		 * 
+		 * Backends may hand out memory they can read into more efficiently,
+		 * eg. buffers registered with the kernel. Must be released with
+		 * deallocate_buffer().
+		 * 
+		 * @param  size Size of the buffer
+		 */
+		asio::mutable_buffer allocate_buffer(std::size_t size)
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring) {
+				asio::mutable_buffer buf = m_uring->allocate_buffer(size);
+				if (asio::buffer_size(buf)) {
+					return buf;
+				}
+			}
+#endif
+			return asio::mutable_buffer(new char[size], size);
+		}
+		
+		/**
+		 * Releases a buffer from allocate_buffer().
+		 * 
+		 * @param buf Buffer
+		 */
+		void deallocate_buffer(asio::mutable_buffer buf)
+		{
+#ifdef PROXYTHING_HAVE_IO_URING
+			if (m_uring && m_uring->deallocate_buffer(buf)) {
+				return;
+			}
+#endif
+			delete[] asio::buffer_cast<char*>(buf);
 		}
 		
 	protected:
+#ifdef PROXYTHING_HAVE_IO_URING
+		/**
+		 * Calls a handler through its invocation hook.
+		 */
+		template<typename Handler>
+		struct hooked_handler
+		{
+			Handler handler;	///< Wrapped handler
+			
+			template<typename... Args>
+			void operator()(const Args&... args)
+			{
+				using boost_asio_handler_invoke_helpers::invoke;
+				invoke(asio::detail::bind_handler(handler, args...), handler);
+			}
+		};
+		
+		/**
+		 * Adapts a handler to the std::function callbacks the io_uring
+		 * backend takes.
+		 * 
+		 * @tparam Signature Callback signature
+		 * @param  handler   Handler; moved from
+		 */
+		template<typename Signature, typename Handler>
+		std::function<Signature> uring_callback(Handler &handler)
+		{
+			return util::work_bound(util::owner(*this), std::function<Signature>(hooked_handler<Handler>{ std::move(handler) }));
+		}
+#endif
+		
 		/**
 		 * Free all user handlers.
 		 */
 		void shutdown_service() { };
+		
+		backend_type m_backend;							///< Backend in use
+		std::size_t m_num_threads;						///< Worker threads to fall back to
+		std::atomic<std::size_t> m_nowait_reads;		///< Reads read_some_nowait() completed
+		std::atomic<std::size_t> m_fallback_reads;		///< Reads read_some_nowait() gave up on
+		std::shared_ptr<threaded_impl_type> m_threaded;	///< Threaded implementation, maybe shared
+#ifdef PROXYTHING_HAVE_IO_URING
+		std::unique_ptr<uring_impl_type> m_uring;		///< io_uring implementation
+#endif
 	};
 }
 
@@ -0,0 +1,206 @@
+#ifndef PROXYTHING_IMPL_FS_OPERATION_H
+#define PROXYTHING_IMPL_FS_OPERATION_H
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	namespace impl
+	{
+		/**
+		 * A pending fs_service operation, holding the caller's handler in place.
+		 * 
+		 * The operation is allocated through the handler's allocation hook,
+		 * and carries a block of storage that the functions it posts along
+		 * the way - to a worker, then back to the parent service - are kept
+		 * in, one at a time. With a handler that recycles its memory, a warmed
+		 * up operation thus doesn't touch the heap at all.
+		 * 
+		 * It also keeps the parent service from running out of work until
+		 * the handler has been called.
+		 * 
+		 * @tparam Handler Completion handler type
+		 */
+		template<typename Handler>
+		class fs_operation
+		{
+		public:
+			/// Bytes of storage for functions posted on the operation's behalf
+			static const std::size_t storage_size = 256;
+			
+			/**
+			 * Frees an operation without calling its handler, for unique_ptr.
+			 */
+			struct destroyer
+			{
+				void operator()(fs_operation *op) const { op->destroy(); }
+			};
+			
+			/// Owning pointer to an operation
+			typedef std::unique_ptr<fs_operation, destroyer> pointer;
+			
+			/**
+			 * Function posted on behalf of an operation, stored in it.
+			 * 
+			 * It owns the operation until it's called, so one that's destroyed
+			 * without being called - eg. because the IO service it was posted
+			 * to is shut down first - frees the operation, handler and all.
+			 * Owning it, it can only be moved; see
+			 * BOOST_ASIO_DISABLE_HANDLER_TYPE_REQUIREMENTS in CMakeLists.txt.
+			 */
+			template<typename Function>
+			class stored_function
+			{
+			public:
+				stored_function(fs_operation *op, Function fn): m_op(op), m_fn(std::move(fn)) { }
+				
+				stored_function(stored_function&&) = default;
+				
+				/// Calls the function, which takes over the operation
+				void operator()()
+				{
+					m_op.release();
+					m_fn();
+				}
+				
+				/// Allocation hook for asio
+				friend void* asio_handler_allocate(std::size_t size, stored_function *f)
+				{
+					return f->allocate(size);
+				}
+				
+				/// Deallocation hook for asio
+				friend void asio_handler_deallocate(void *p, std::size_t size, stored_function *f)
+				{
+					f->deallocate(p);
+				}
+			
+			protected:
+				/// Allocates from the operation
+				void* allocate(std::size_t size) { return m_op->allocate(size); }
+				
+				/// Frees memory from allocate()
+				void deallocate(void *p) { m_op->deallocate(p); }
+				
+				pointer m_op;		///< Operation it's stored in, until called
+				Function m_fn;		///< Wrapped function
+			};
+			
+			/**
+			 * Allocates an operation.
+			 * 
+			 * @param  service Parent IO service, which the handler is called from
+			 * @param  handler Completion handler; moved from
+			 * @return         The operation
+			 */
+			static fs_operation* create(asio::io_service &service, Handler &handler)
+			{
+				void *p = boost_asio_handler_alloc_helpers::allocate(sizeof(fs_operation), handler);
+				return new (p) fs_operation(service, handler);
+			}
+			
+			/**
+			 * Wraps a function to be posted on behalf of the operation, so it's
+			 * stored in the operation.
+			 * 
+			 * @param  fn Function
+			 * @return    Wrapped function
+			 */
+			template<typename Function>
+			stored_function<Function> wrap(Function fn)
+			{
+				return stored_function<Function>(this, std::move(fn));
+			}
+			
+			/**
+			 * Completes the operation, from any thread.
+			 * 
+			 * The handler is called with the given arguments from the parent
+			 * service, through its invocation hook; the operation is freed
+			 * just before that.
+			 * 
+			 * @param args Arguments for the handler
+			 */
+			template<typename... Args>
+			void complete(const Args&... args)
+			{
+				m_service.post(wrap(asio::detail::bind_handler(completion(this), args...)));
+			}
+		
+		protected:
+			/**
+			 * Frees the operation and calls its handler.
+			 */
+			struct completion
+			{
+				explicit completion(fs_operation *op): op(op) { }
+				
+				template<typename... Args>
+				void operator()(const Args&... args)
+				{
+					Handler handler(std::move(op->m_handler));
+					op->~fs_operation();
+					boost_asio_handler_alloc_helpers::deallocate(op, sizeof(fs_operation), handler);
+					
+					using boost_asio_handler_invoke_helpers::invoke;
+					invoke(asio::detail::bind_handler(handler, args...), handler);
+				}
+				
+				fs_operation *op;	///< Operation to complete
+			};
+			
+			/**
+			 * Frees the operation without calling its handler.
+			 */
+			void destroy()
+			{
+				Handler handler(std::move(m_handler));
+				this->~fs_operation();
+				boost_asio_handler_alloc_helpers::deallocate(this, sizeof(fs_operation), handler);
+			}
+			
+			fs_operation(asio::io_service &service, Handler &handler):
+				m_service(service), m_work(service), m_handler(std::move(handler)), m_storage_used(false) { }
+			
+			/// Hands out the storage if it fits and is free, otherwise heap memory
+			void* allocate(std::size_t size)
+			{
+				if (!m_storage_used && size <= storage_size) {
+					m_storage_used = true;
+					return &m_storage;
+				}
+				return ::operator new(size);
+			}
+			
+			/// Releases memory from allocate()
+			void deallocate(void *p)
+			{
+				if (p == &m_storage) {
+					m_storage_used = false;
+					return;
+				}
+				::operator delete(p);
+			}
+			
+			asio::io_service &m_service;	///< Parent IO service
+			asio::io_service::work m_work;	///< Keeping the parent service alive
+			Handler m_handler;				///< Completion handler
+			
+			/// Storage for functions posted on the operation's behalf
+			typename std::aligned_storage<storage_size>::type m_storage;
+			bool m_storage_used;			///< Is m_storage handed out?
+		};
+		
+		template<typename Handler>
+		const std::size_t fs_operation<Handler>::storage_size;
+	}
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef PROXYTHING_IMPL_FS_SCHEDULER_H
+#define PROXYTHING_IMPL_FS_SCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace proxything
+{
+	namespace impl
+	{
+		/**
+		 * Decides which queued disk operation a worker of fs_service_threaded
+		 * runs next.
+		 * 
+		 * Operations are queued by priority class, in order within each. At
+		 * most one operation per worker is let through at a time, and at most
+		 * a class's depth limit of those from any one class; when several
+		 * classes have operations waiting, they're picked from in proportion
+		 * to their weights (stride scheduling), so a burst of fill writes
+		 * can't hold up cache hits, while still getting its share.
+		 * 
+		 * A class's queue can also be limited in length. Operations are never
+		 * turned away - a fill write or close that never happens would break
+		 * the entry it's for - and the depth limit always holds; instead, a
+		 * class past its queue limit reports itself backlogged(), for whoever
+		 * is submitting its operations to hold back on more (cache fills stop
+		 * reading from their upstreams until their writes catch up).
+		 * 
+		 * Tasks are started in the order they're picked, by one thread at a
+		 * time; others calling in meanwhile leave theirs to it.
+		 * 
+		 * The time each operation spends queued is recorded in a histogram
+		 * per class.
+		 * 
+		 * Operations are intrusive tasks, so queueing one doesn't allocate.
+		 */
+		class fs_scheduler
+		{
+		public:
+			/**
+			 * Priority classes.
+			 */
+			enum class io_class
+			{
+				foreground,		///< Reads and opens for clients waiting on them
+				background,		///< Cache fill writes and commits
+				maintenance,	///< Eviction and other housekeeping
+			};
+			
+			/// Number of priority classes
+			static const std::size_t num_classes = 3;
+			
+			/// Clock queue latencies are measured with
+			typedef std::chrono::steady_clock clock_type;
+			
+			/**
+			 * A queued operation.
+			 * 
+			 * Callers embed this in their own operation, and set cls and start
+			 * before submitting it.
+			 */
+			struct task
+			{
+				task *next = nullptr;					///< Next task in its queue
+				io_class cls = io_class::foreground;	///< Priority class
+				clock_type::time_point queued;			///< When it was submitted
+				
+				/// Starts the operation; the task may be destroyed by it
+				void (*start)(task *t) = nullptr;
+			};
+			
+			/**
+			 * Histogram of latencies, in power-of-two buckets of microseconds.
+			 * 
+			 * Bucket 0 counts latencies under 1us, bucket i those from 2^(i-1)
+			 * up to 2^i us; the last bucket also counts anything longer.
+			 */
+			class histogram
+			{
+			public:
+				/// Number of buckets
+				static const std::size_t num_buckets = 32;
+				
+				/**
+				 * Records a latency.
+				 */
+				void record(clock_type::duration latency);
+				
+				/**
+				 * Adds another histogram's counts to this one's.
+				 */
+				void merge(const histogram &other);
+				
+				/// Returns the number of latencies recorded
+				inline std::size_t count() const { return m_count; }
+				
+				/// Returns the number of latencies in a bucket
+				inline std::size_t bucket(std::size_t i) const { return m_buckets[i]; }
+				
+				/**
+				 * Returns the upper bound of the bucket a percentile falls into.
+				 * 
+				 * @param  q Percentile, from 0 to 1
+				 * @return   Upper bound, or 0 if nothing has been recorded
+				 */
+				std::chrono::microseconds percentile(double q) const;
+			
+			protected:
+				std::array<std::size_t, num_buckets> m_buckets = {};	///< Counts per bucket
+				std::size_t m_count = 0;								///< Total count
+			};
+			
+			/**
+			 * A snapshot of a class's state.
+			 */
+			struct class_stats
+			{
+				std::size_t queued = 0;		///< Operations waiting
+				std::size_t in_flight = 0;	///< Operations let through, not finished
+				std::size_t completed = 0;	///< Operations finished
+				std::size_t over_limit = 0;	///< Operations queued past the queue limit
+				histogram latency;			///< Time spent queued
+			};
+			
+			/**
+			 * Constructor.
+			 * 
+			 * Classes start out with the weights, depth and queue limits in
+			 * config.h; foreground operations are only limited by the number of
+			 * slots.
+			 * 
+			 * @param slots Operations let through at once; one per worker
+			 */
+			explicit fs_scheduler(std::size_t slots);
+			
+			/**
+			 * Sets the share of slots a class gets while others are waiting.
+			 * 
+			 * @param cls    Class
+			 * @param weight Weight, relative to the other classes'; at least 1
+			 */
+			void set_weight(io_class cls, unsigned int weight);
+			
+			/// Returns a class's weight
+			unsigned int weight(io_class cls);
+			
+			/**
+			 * Sets how many of a class's operations can be in flight at once.
+			 * 
+			 * @param cls   Class
+			 * @param depth Limit; at least 1
+			 */
+			void set_depth(io_class cls, std::size_t depth);
+			
+			/// Returns a class's depth limit
+			std::size_t depth(io_class cls);
+			
+			/**
+			 * Sets how many of a class's operations can be queued before it's
+			 * backlogged().
+			 * 
+			 * @param cls   Class
+			 * @param limit Limit, or 0 for none
+			 */
+			void set_queue_limit(io_class cls, std::size_t limit);
+			
+			/// Returns a class's queue limit
+			std::size_t queue_limit(io_class cls);
+			
+			/**
+			 * Returns whether a class has as many operations queued as its
+			 * queue limit allows, or more.
+			 */
+			bool backlogged(io_class cls);
+			
+			/**
+			 * Queues a task, and starts whatever can be started.
+			 * 
+			 * Tasks may be started from within this call, or from finish(), on
+			 * whichever thread is starting tasks at the time.
+			 * 
+			 * @param t Task; must stay alive until it's started
+			 */
+			void submit(task *t);
+			
+			/**
+			 * Marks an operation of a class finished, freeing its slot for the
+			 * next one.
+			 * 
+			 * @param cls Class of the finished operation
+			 */
+			void finish(io_class cls);
+			
+			/**
+			 * Starts every queued task, and every one submitted from now on,
+			 * regardless of limits; for shutting down.
+			 */
+			void drain();
+			
+			/**
+			 * Returns a snapshot of a class's state.
+			 */
+			class_stats stats(io_class cls);
+			
+			/**
+			 * Returns a class's name, for logging.
+			 */
+			static const char* name(io_class cls);
+		
+		protected:
+			/**
+			 * A class's queue and accounting.
+			 */
+			struct class_queue
+			{
+				task *head = nullptr;			///< First queued task
+				task *tail = nullptr;			///< Last queued task
+				unsigned int weight = 1;		///< Weight
+				std::size_t depth = 1;			///< Depth limit
+				std::size_t queue_limit = 0;	///< Queue limit, or 0
+				std::uint64_t pass = 0;			///< Virtual time of its next turn
+				class_stats stats;				///< Counts and latencies
+			};
+			
+			/**
+			 * Picks the next task to start and takes it off its queue, or
+			 * returns nullptr. Must be called with m_mutex held.
+			 */
+			task* pick(clock_type::time_point now);
+			
+			/**
+			 * Starts whatever can be started, unless another thread already is;
+			 * returns with the lock released.
+			 */
+			void pump(std::unique_lock<std::mutex> &lock);
+			
+			std::mutex m_mutex;								///< Guards everything below
+			std::array<class_queue, num_classes> m_classes;	///< Queues, by class
+			std::size_t m_slots;							///< Operations let through at once
+			std::size_t m_in_flight;						///< Operations let through
+			std::uint64_t m_vtime;							///< Pass of the last class picked
+			bool m_draining;								///< Ignoring limits?
+			bool m_pumping;									///< Is a thread starting tasks?
+		};
+	}
+}
+
+#endif
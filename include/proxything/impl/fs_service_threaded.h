@@ -1,12 +1,19 @@
 #ifndef PROXYTHING_IMPL_FS_SERVICE_THREADED_H
 #define PROXYTHING_IMPL_FS_SERVICE_THREADED_H
 
+#include <proxything/impl/fs_operation.h>
+#include <proxything/impl/fs_scheduler.h>
 #include <proxything/util.h>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
-#include <fstream>
+#include <atomic>
 #include <mutex>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/uio.h>
 
 namespace proxything
 {
@@ -18,9 +25,25 @@ namespace proxything
 		/**
 		 * Threaded implementation of fs_service.
 		 * 
-		 * This uses a worker thread an an asio::io_service to queue up synchronous
-		 * IO operations to be performed asynchronously. It uses strands to
-		 * ensure that reads and writes are performed sequentially.
+		 * This uses a pool of worker threads and an asio::io_service to queue up
+		 * synchronous IO operations to be performed asynchronously. It uses
+		 * strands to ensure that reads and writes on each entry are performed
+		 * sequentially, while operations on unrelated entries run in parallel.
+		 * 
+		 * Reads and writes are done with a single preadv()/pwritev() call per
+		 * operation, straight from/into the caller's buffer sequence, at an
+		 * explicitly tracked offset.
+		 * 
+		 * Handlers are kept in an fs_operation for the operation's duration,
+		 * which also stores the functions posted to the workers and back.
+		 * 
+		 * Operations don't go to the workers straight away, but through an
+		 * fs_scheduler, which lets through one per worker at a time, picking
+		 * from each entry's priority class in proportion to its weight.
+		 * 
+		 * Where preadv2() supports RWF_NOWAIT, read_some_nowait() can read data
+		 * that's already in the page cache on the calling thread, without a
+		 * round trip through the workers.
 		 * 
 		 * @tparam ThreadT Thread type to use (std::thread or boost::thread)
 		 */
@@ -33,12 +56,16 @@ namespace proxything
 			 */
 			struct implementation_type
 			{
-				std::fstream stream;		///< Underlying file stream
+				int fd = -1;				///< Underlying file descriptor
+				off_t offset = 0;			///< Current read/write offset
 				std::string filename;		///< Filename
 				
 				bool atomic = false;		///< Are we using atomic writes?
 				bool atomic_done = false;	///< Is the atomic write done?
 				
+				/// Priority class of the entry's operations
+				fs_scheduler::io_class cls = fs_scheduler::io_class::foreground;
+				
 				std::string temp_filename;	///< Temporary filename (atomic)
 				std::mutex final_mutex;		///< Finalization mutex
 				
@@ -48,12 +75,16 @@ namespace proxything
 			
 			/**
 			 * Constructor.
+			 * 
+			 * @param num_threads Number of worker threads
 			 */
-			fs_service_threaded():
-				m_iservice(), m_iwork(new asio::io_service::work(m_iservice)),
-				m_thread(boost::bind(&asio::io_service::run, &m_iservice))
+			explicit fs_service_threaded(std::size_t num_threads = 1):
+				m_iservice(), m_iwork(new asio::io_service::work(m_iservice)), m_nowait(true),
+				m_scheduler(std::max<std::size_t>(num_threads, 1))
 			{
-				
+				for (std::size_t i = 0; i < std::max<std::size_t>(num_threads, 1); i++) {
+					m_threads.emplace_back(boost::bind(&asio::io_service::run, &m_iservice));
+				}
 			}
 			
 			/**
@@ -61,12 +92,18 @@ namespace proxything
 			 */
 			virtual ~fs_service_threaded()
 			{
+				// Let anything still queued through, so it runs before the
+				// workers stop
+				m_scheduler.drain();
+				
 				// Delete the work object to let the IO Service shut down once
 				// it runs out of work
 				delete m_iwork;
 				
 				// Wait for it to do so
-				m_thread.join();
+				for (auto &thread : m_threads) {
+					thread.join();
+				}
 			}
 			
 			/**
@@ -82,103 +119,245 @@ namespace proxything
 			 */
 			void destroy(asio::io_service &service, implementation_type &impl)
 			{
-				impl.stream.close();
+				if (impl.fd != -1) {
+					::close(impl.fd);
+					impl.fd = -1;
+				}
 			}
 			
 			/**
 			 * Implementation for fs_service::async_open().
 			 */
-			void async_open(asio::io_service &service, implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, std::function<void(const boost::system::error_code &ec)> cb)
+			template<typename Handler>
+			void async_open(asio::io_service &service, implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, Handler handler)
 			{
-				impl.strand->post([=, &service, &impl]{
+				// Captured as a non-const copy, so the function can be moved on
+				// its way to a worker without copying it
+				std::string name(filename);
+				
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(impl.cls, *impl.strand, op->wrap([=, &impl]{
 					boost::system::error_code ec;
 					
-					impl.filename = filename;
+					impl.filename = name;
 					impl.atomic = atomic;
 					
 					if (impl.atomic) {
 						impl.temp_filename = util::tmp_path();
 					}
 					
-					impl.stream.open(!impl.atomic ? impl.filename : impl.temp_filename, mode);
-					if (!impl.stream) {
-						ec = boost::system::error_code(errno, boost::system::get_generic_category());
+					std::string path = !impl.atomic ? impl.filename : impl.temp_filename;
+					impl.fd = ::open(path.c_str(), util::open_flags(mode), 0666);
+					impl.offset = 0;
+					if (impl.fd == -1) {
+						ec = boost::system::error_code(errno, boost::system::generic_category());
+					} else if (mode & std::ios_base::ate) {
+						impl.offset = ::lseek(impl.fd, 0, SEEK_END);
 					}
 					
-					service.dispatch(boost::bind(cb, ec));
-				});
+					op->complete(ec);
+				}));
 			}
 			
 			/**
 			 * Implementation for fs_service::async_close().
 			 */
-			void async_close(asio::io_service &service, implementation_type &impl, std::function<void(const boost::system::error_code &ec)> cb)
+			template<typename Handler>
+			void async_close(asio::io_service &service, implementation_type &impl, Handler handler)
 			{
-				impl.strand->post([=, &service, &impl]{
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(impl.cls, *impl.strand, op->wrap([=, &impl]{
 					boost::system::error_code ec;
 					
-					impl.stream.close();
+					if (impl.fd != -1) {
+						if (::close(impl.fd) == -1) {
+							ec = boost::system::error_code(errno, boost::system::generic_category());
+						}
+						impl.fd = -1;
+					}
 					
-					if (impl.atomic) {
+					if (impl.atomic && !ec) {
 						fs::rename(impl.temp_filename, impl.filename, ec);
 					}
 					
-					service.dispatch(boost::bind(cb, ec));
-				});
+					// A write that can't be committed is dropped, rather than
+					// leave its temporary file behind
+					if (impl.atomic && ec) {
+						::unlink(impl.temp_filename.c_str());
+					}
+					
+					op->complete(ec);
+				}));
+			}
+			
+			/**
+			 * Implementation for fs_service::async_discard().
+			 */
+			template<typename Handler>
+			void async_discard(asio::io_service &service, implementation_type &impl, Handler handler)
+			{
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(impl.cls, *impl.strand, op->wrap([=, &impl]{
+					boost::system::error_code ec;
+					
+					if (impl.fd != -1) {
+						::close(impl.fd);
+						impl.fd = -1;
+					}
+					
+					if (impl.atomic && ::unlink(impl.temp_filename.c_str()) == -1) {
+						ec = boost::system::error_code(errno, boost::system::generic_category());
+					}
+					
+					op->complete(ec);
+				}));
+			}
+			
+			/**
+			 * Implementation for fs_service::async_remove().
+			 */
+			template<typename Handler>
+			void async_remove(asio::io_service &service, const std::string &filename, Handler handler)
+			{
+				// Not tied to an entry, so there's no strand to keep it in order;
+				// it's only ever housekeeping
+				std::string name(filename);
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(fs_scheduler::io_class::maintenance, m_iservice, op->wrap([=]{
+					boost::system::error_code ec;
+					if (::unlink(name.c_str()) == -1) {
+						ec = boost::system::error_code(errno, boost::system::generic_category());
+					}
+					
+					op->complete(ec);
+				}));
 			}
 			
 			/**
 			 * Implementation for fs_service::async_read_some().
 			 */
-			template<typename BufsT>
-			void async_read_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb)
+			template<typename BufsT, typename Handler>
+			void async_read_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, Handler handler)
 			{
-				impl.strand->post([=, &service, &impl]{
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(impl.cls, *impl.strand, op->wrap([=, &impl]{
 					boost::system::error_code ec;
 					std::size_t size = 0;
 					
-					for (auto it = buffers_begin(buffers); it != buffers_end(buffers); ++it) {
-						char val;
-						impl.stream.get(val);
-						
-						if (impl.stream.eof()) {
-							ec = asio::error::eof;
-							break;
-						} else if (!impl.stream) {
-							ec = boost::system::error_code(errno, boost::system::get_generic_category());
-							break;
-						}
-						
-						*it = val;
-						++size;
+					asio::detail::buffer_sequence_adapter<asio::mutable_buffer, BufsT> bufs(buffers);
+					ssize_t res = ::preadv(impl.fd, bufs.buffers(), bufs.count(), impl.offset);
+					if (res == -1) {
+						ec = boost::system::error_code(errno, boost::system::generic_category());
+					} else if (res == 0 && bufs.total_size() > 0) {
+						ec = asio::error::eof;
+					} else {
+						size = res;
+						impl.offset += res;
 					}
 					
-					service.dispatch(boost::bind(cb, ec, size));
-				});
+					op->complete(ec, size);
+				}));
 			}
 			
 			/**
-			 * Implementaiton for fs_service::async_write_some().
+			 * Implementation for fs_service::read_some_nowait().
+			 * 
+			 * Reads with preadv2(RWF_NOWAIT), which fails rather than wait for
+			 * the disk. Once the kernel turns out not to support the flag, this
+			 * stops trying.
 			 */
 			template<typename BufsT>
-			void async_write_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb)
+			std::size_t read_some_nowait(implementation_type &impl, const BufsT &buffers, boost::system::error_code &ec)
 			{
-				impl.strand->post([=, &service, &impl]{
+#ifdef RWF_NOWAIT
+				if (impl.fd != -1 && m_nowait.load(std::memory_order_relaxed)) {
+					asio::detail::buffer_sequence_adapter<asio::mutable_buffer, BufsT> bufs(buffers);
+					ssize_t res;
+					do {
+						res = ::preadv2(impl.fd, bufs.buffers(), bufs.count(), impl.offset, RWF_NOWAIT);
+					} while (res == -1 && errno == EINTR);
+					
+					if (res > 0) {
+						impl.offset += res;
+						ec = boost::system::error_code();
+						return res;
+					} else if (res == 0) {
+						ec = bufs.total_size() > 0 ? asio::error::eof : boost::system::error_code();
+						return 0;
+					} else if (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL) {
+						m_nowait = false;
+					}
+				}
+#endif
+				
+				// Would block, or can't tell; any real error is left for the
+				// workers to report
+				ec = asio::error::would_block;
+				return 0;
+			}
+			
+			/**
+			 * Implementaiton for fs_service::async_write_some().
+			 */
+			template<typename BufsT, typename Handler>
+			void async_write_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, Handler handler)
+			{
+				auto op = fs_operation<Handler>::create(service, handler);
+				schedule(impl.cls, *impl.strand, op->wrap([=, &impl]{
 					boost::system::error_code ec;
 					std::size_t size = 0;
 					
-					impl.stream.clear();
-					for (auto it = buffers_begin(buffers); it != buffers_end(buffers); ++it) {
-						impl.stream.put(*it);
-						if (!impl.stream) {
-							ec = boost::system::error_code(errno, boost::system::get_generic_category());
-							break;
-						}
-						++size;
+					asio::detail::buffer_sequence_adapter<asio::const_buffer, BufsT> bufs(buffers);
+					ssize_t res = ::pwritev(impl.fd, bufs.buffers(), bufs.count(), impl.offset);
+					if (res == -1) {
+						ec = boost::system::error_code(errno, boost::system::generic_category());
+					} else {
+						size = res;
+						impl.offset += res;
 					}
 					
-					service.dispatch(boost::bind(cb, ec, size));
-				});
+					op->complete(ec, size);
+				}));
+			}
+			
+			/**
+			 * Implementation for fs_service::seek().
+			 */
+			void seek(implementation_type &impl, off_t offset)
+			{
+				impl.offset = offset;
+			}
+			
+			/**
+			 * Implementation for fs_service::native_handle().
+			 */
+			int native_handle(const implementation_type &impl) const
+			{
+				return impl.fd;
+			}
+			
+			/**
+			 * Returns the number of worker threads.
+			 */
+			std::size_t num_threads() const
+			{
+				return m_threads.size();
+			}
+			
+			/**
+			 * Implementation for fs_service::set_io_class().
+			 */
+			void set_io_class(implementation_type &impl, fs_scheduler::io_class cls)
+			{
+				impl.cls = cls;
+			}
+			
+			/**
+			 * Returns the scheduler operations go through.
+			 */
+			fs_scheduler& scheduler()
+			{
+				return m_scheduler;
 			}
 			
 			/**
@@ -189,10 +368,111 @@ namespace proxything
 				return impl.filename;
 			}
 			
+			/**
+			 * Implementation for fs_service::path().
+			 */
+			std::string path(const implementation_type &impl) const
+			{
+				return !impl.atomic ? impl.filename : impl.temp_filename;
+			}
+			
 		protected:
+			/**
+			 * Tells the scheduler an operation is done, once it's run.
+			 * 
+			 * Its memory comes from the operation, like the wrapped function's.
+			 */
+			template<typename Function>
+			class finishing_function
+			{
+			public:
+				finishing_function(fs_scheduler &scheduler, fs_scheduler::io_class cls, Function fn):
+					m_scheduler(scheduler), m_cls(cls), m_fn(std::move(fn)) { }
+				
+				/// Calls the function, then frees up its slot
+				void operator()()
+				{
+					m_fn();
+					m_scheduler.finish(m_cls);
+				}
+				
+				/// Allocation hook for asio
+				friend void* asio_handler_allocate(std::size_t size, finishing_function *f)
+				{
+					return boost_asio_handler_alloc_helpers::allocate(size, f->m_fn);
+				}
+				
+				/// Deallocation hook for asio
+				friend void asio_handler_deallocate(void *p, std::size_t size, finishing_function *f)
+				{
+					boost_asio_handler_alloc_helpers::deallocate(p, size, f->m_fn);
+				}
+			
+			protected:
+				fs_scheduler &m_scheduler;		///< Scheduler to tell
+				fs_scheduler::io_class m_cls;	///< Class it was scheduled as
+				Function m_fn;					///< Wrapped function
+			};
+			
+			/**
+			 * A function waiting in the scheduler, to be posted to a strand (or
+			 * the workers) once it's let through.
+			 */
+			template<typename Target, typename Function>
+			class queued_function : public fs_scheduler::task
+			{
+			public:
+				queued_function(Target &target, fs_scheduler &scheduler, Function fn):
+					m_target(target), m_scheduler(scheduler), m_fn(std::move(fn)) { }
+				
+				/**
+				 * Posts the function, freeing the task first, so the post can
+				 * reuse its memory.
+				 */
+				static void launch(fs_scheduler::task *t)
+				{
+					auto self = static_cast<queued_function*>(t);
+					Target &target = self->m_target;
+					fs_scheduler &scheduler = self->m_scheduler;
+					fs_scheduler::io_class cls = self->cls;
+					Function fn(std::move(self->m_fn));
+					
+					self->~queued_function();
+					boost_asio_handler_alloc_helpers::deallocate(self, sizeof(queued_function), fn);
+					
+					target.post(finishing_function<Function>(scheduler, cls, std::move(fn)));
+				}
+			
+			protected:
+				Target &m_target;			///< Strand or IO service to post to
+				fs_scheduler &m_scheduler;	///< Scheduler it's queued in
+				Function m_fn;				///< Function to post
+			};
+			
+			/**
+			 * Queues a function in the scheduler, posting it once it's let
+			 * through.
+			 * 
+			 * @param cls    Priority class
+			 * @param target Strand or IO service to post to
+			 * @param fn     Function, from fs_operation::wrap()
+			 */
+			template<typename Target, typename Function>
+			void schedule(fs_scheduler::io_class cls, Target &target, Function fn)
+			{
+				typedef queued_function<Target, Function> queued_type;
+				void *p = boost_asio_handler_alloc_helpers::allocate(sizeof(queued_type), fn);
+				auto t = new (p) queued_type(target, m_scheduler, std::move(fn));
+				t->cls = cls;
+				t->start = &queued_type::launch;
+				m_scheduler.submit(t);
+			}
+			
 			asio::io_service m_iservice;		///< Internal IO service
 			asio::io_service::work *m_iwork;	///< Keeping the service alive
-			ThreadT m_thread; 					///< Worker thread
+			std::vector<ThreadT> m_threads;		///< Worker threads
+			std::atomic<bool> m_nowait;			///< Try RWF_NOWAIT reads?
+			fs_scheduler m_scheduler;			///< Decides what the workers run next
 		};
 	}
 }
@@ -0,0 +1,300 @@
+#ifndef PROXYTHING_IMPL_FS_SERVICE_URING_H
+#define PROXYTHING_IMPL_FS_SERVICE_URING_H
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	namespace impl
+	{
+		/**
+		 * io_uring implementation of fs_service.
+		 * 
+		 * Every operation is submitted as an SQE to a ring owned by the
+		 * service; completions are signalled through an eventfd registered
+		 * with the ring, which is read from the parent asio::io_service. As
+		 * such, there are no helper threads involved, and handlers are called
+		 * directly from the thread(s) running the parent service.
+		 * 
+		 * Open files are registered with the ring, and buffers obtained from
+		 * allocate_buffer() are read into with IORING_OP_READ_FIXED.
+		 * 
+		 * Operations on a single entry are queued up and submitted one at a
+		 * time, to match the sequential semantics of fs_service_threaded.
+		 */
+		class fs_service_uring
+		{
+		public:
+			/**
+			 * Implementation for IO Objects.
+			 */
+			struct implementation_type
+			{
+				int fd = -1;				///< Underlying file descriptor
+				int slot = -1;				///< Registered file index, or -1
+				off_t offset = 0;			///< Current read/write offset
+				std::string filename;		///< Filename
+				
+				bool atomic = false;		///< Are we using atomic writes?
+				std::string temp_filename;	///< Temporary filename (atomic)
+				
+				bool busy = false;						///< Is an operation in flight?
+				std::deque<std::function<void()>> queue;	///< Operations waiting to start
+			};
+			
+			/**
+			 * Completion callback for a single SQE.
+			 * 
+			 * @param res The CQE's result; a negated errno on failure
+			 */
+			typedef std::function<void(int res)> CompletionHandler;
+			
+			/**
+			 * Constructor.
+			 * 
+			 * @param  service Parent IO service, which will reap completions
+			 * @throws boost::system::system_error The ring couldn't be set up
+			 */
+			explicit fs_service_uring(asio::io_service &service);
+			
+			/**
+			 * Destructor.
+			 */
+			virtual ~fs_service_uring();
+			
+			/**
+			 * Checks if the running kernel supports everything we need.
+			 */
+			static bool supported();
+			
+			/**
+			 * Implementation for fs_service::construct().
+			 */
+			void construct(asio::io_service &service, implementation_type &impl) { }
+			
+			/**
+			 * Implementation for fs_service::destroy().
+			 */
+			void destroy(asio::io_service &service, implementation_type &impl);
+			
+			/**
+			 * Implementation for fs_service::async_open().
+			 */
+			void async_open(asio::io_service &service, implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, std::function<void(const boost::system::error_code &ec)> cb);
+			
+			/**
+			 * Implementation for fs_service::async_close().
+			 */
+			void async_close(asio::io_service &service, implementation_type &impl, std::function<void(const boost::system::error_code &ec)> cb);
+			
+			/**
+			 * Implementation for fs_service::async_discard().
+			 */
+			void async_discard(asio::io_service &service, implementation_type &impl, std::function<void(const boost::system::error_code &ec)> cb);
+			
+			/**
+			 * Implementation for fs_service::async_remove().
+			 */
+			void async_remove(asio::io_service &service, const std::string &filename, std::function<void(const boost::system::error_code &ec)> cb);
+			
+			/**
+			 * Implementation for fs_service::async_read_some().
+			 */
+			template<typename BufsT>
+			void async_read_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb)
+			{
+				asio::detail::buffer_sequence_adapter<asio::mutable_buffer, BufsT> bufs(buffers);
+				std::vector<iovec> iov(bufs.buffers(), bufs.buffers() + bufs.count());
+				async_rw(impl, true, std::move(iov), cb);
+			}
+			
+			/**
+			 * Implementation for fs_service::async_write_some().
+			 */
+			template<typename BufsT>
+			void async_write_some(asio::io_service &service, implementation_type &impl, const BufsT &buffers, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb)
+			{
+				asio::detail::buffer_sequence_adapter<asio::const_buffer, BufsT> bufs(buffers);
+				std::vector<iovec> iov(bufs.buffers(), bufs.buffers() + bufs.count());
+				async_rw(impl, false, std::move(iov), cb);
+			}
+			
+			/**
+			 * Implementation for fs_service::filename().
+			 */
+			std::string filename(const implementation_type &impl) const
+			{
+				return impl.filename;
+			}
+			
+			/**
+			 * Implementation for fs_service::path().
+			 */
+			std::string path(const implementation_type &impl) const
+			{
+				return !impl.atomic ? impl.filename : impl.temp_filename;
+			}
+			
+			/**
+			 * Implementation for fs_service::seek().
+			 */
+			void seek(implementation_type &impl, off_t offset)
+			{
+				impl.offset = offset;
+			}
+			
+			/**
+			 * Implementation for fs_service::native_handle().
+			 */
+			int native_handle(const implementation_type &impl) const
+			{
+				return impl.fd;
+			}
+			
+			/**
+			 * Implementation for fs_service::allocate_buffer().
+			 * 
+			 * Returns a slice of the registered buffer area if one is free and
+			 * large enough, otherwise an empty buffer.
+			 */
+			asio::mutable_buffer allocate_buffer(std::size_t size);
+			
+			/**
+			 * Implementation for fs_service::deallocate_buffer().
+			 * 
+			 * @return false if the buffer isn't one of ours
+			 */
+			bool deallocate_buffer(asio::mutable_buffer buf);
+			
+		protected:
+			/**
+			 * Unmaps and closes the ring.
+			 */
+			void close_ring();
+			
+			/**
+			 * Closes an entry, then commits its atomic write, or drops it.
+			 */
+			void close(implementation_type &impl, bool keep, std::function<void(const boost::system::error_code &ec)> cb);
+			
+			/**
+			 * Starts a read or write on an entry.
+			 */
+			void async_rw(implementation_type &impl, bool read, std::vector<iovec> iov, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb);
+			
+			/**
+			 * Runs an operation on an entry once all operations queued before
+			 * it have completed.
+			 */
+			void enqueue(implementation_type &impl, std::function<void()> start);
+			
+			/**
+			 * Marks an entry's current operation as done, and starts the next.
+			 */
+			void finish(implementation_type &impl);
+			
+			/**
+			 * Prepares and submits an SQE.
+			 * 
+			 * If the ring is full, it's parked until completions make room.
+			 * 
+			 * @param prep Fills in the SQE; it's zeroed beforehand
+			 * @param cb   Called with the result from the parent IO service; a
+			 *             negated errno if it couldn't be submitted either
+			 */
+			void submit(std::function<void(io_uring_sqe &sqe)> prep, CompletionHandler cb);
+			
+			/**
+			 * Moves parked SQEs into the ring, and submits all the kernel hasn't
+			 * consumed yet. Must be called with m_mutex held.
+			 * 
+			 * If the kernel refuses them and has nothing in flight to wait for,
+			 * they're failed with the error.
+			 */
+			void flush();
+			
+			/**
+			 * Fails every SQE the kernel hasn't consumed, and every parked one,
+			 * with an error; their callbacks are called from reap(). Must be
+			 * called with m_mutex held.
+			 */
+			void fail(int err);
+			
+			/**
+			 * Waits for the eventfd to signal completions, if not already
+			 * waiting. Must be called with m_mutex held.
+			 */
+			void arm();
+			
+			/**
+			 * Reaps completions from the completion queue.
+			 */
+			void reap();
+			
+			/**
+			 * Puts a file descriptor into a free registered file slot.
+			 * 
+			 * @return The slot, or -1 if none are available
+			 */
+			int register_file(int fd);
+			
+			/**
+			 * Releases a registered file slot.
+			 */
+			void unregister_file(int slot);
+			
+			
+			
+			asio::io_service &m_service;				///< Parent IO service
+			asio::posix::stream_descriptor m_eventfd;	///< Completion notifications
+			uint64_t m_eventfd_value;					///< Read target for m_eventfd
+			
+			int m_ring_fd;					///< io_uring file descriptor
+			void *m_sq_ptr;					///< Mapped submission ring
+			std::size_t m_sq_size;			///< Size of m_sq_ptr
+			void *m_cq_ptr;					///< Mapped completion ring
+			std::size_t m_cq_size;			///< Size of m_cq_ptr
+			io_uring_sqe *m_sqes;			///< Mapped SQE array
+			std::size_t m_sqes_size;		///< Size of m_sqes
+			
+			unsigned *m_sq_head;			///< Submission queue head
+			unsigned *m_sq_tail;			///< Submission queue tail
+			unsigned *m_sq_mask;			///< Submission queue mask
+			unsigned *m_sq_flags;			///< Submission queue flags
+			unsigned *m_sq_array;			///< Submission queue index array
+			unsigned *m_cq_head;			///< Completion queue head
+			unsigned *m_cq_tail;			///< Completion queue tail
+			unsigned *m_cq_mask;			///< Completion queue mask
+			io_uring_cqe *m_cqes;			///< Completion queue entries
+			
+			std::mutex m_mutex;				///< Guards the rings and all queues
+			bool m_armed;					///< Are we waiting on m_eventfd?
+			std::size_t m_inflight;			///< Submitted, unreaped SQEs
+			
+			/// SQEs waiting for room in the ring
+			std::deque<std::pair<std::function<void(io_uring_sqe &sqe)>, CompletionHandler*>> m_backlog;
+			
+			/// SQEs that couldn't be submitted, and their errors
+			std::vector<std::pair<CompletionHandler*, int>> m_failed;
+			
+			std::vector<int> m_free_files;	///< Free registered file slots
+			
+			std::vector<char> m_buffers;	///< Registered buffer area
+			std::vector<char*> m_free_buffers;	///< Free slices of m_buffers
+		};
+	}
+}
+
+#endif
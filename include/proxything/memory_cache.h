@@ -0,0 +1,158 @@
+#ifndef PROXYTHING_MEMORY_CACHE_H
+#define PROXYTHING_MEMORY_CACHE_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * In-memory tier for small, hot objects, in front of the disk cache.
+	 * 
+	 * Objects are immutable, reference counted buffers, which can be written
+	 * to any number of sockets at once, and outlive their eviction for as
+	 * long as anyone's still sending them.
+	 * 
+	 * Eviction follows S3-FIFO: new objects go into a small FIFO queue, and
+	 * are only promoted to the main queue if they're hit again before they
+	 * reach its end; objects seen recently enough to be in the ghost queue
+	 * go straight to the main queue. This keeps one-off scans from flushing
+	 * out the objects that are actually hot.
+	 * 
+	 * When the server runs one IO service per core, each has its own
+	 * memory_cache forwarding to the first one's, so there's one budget and
+	 * one copy of each object however many cores there are.
+	 */
+	class memory_cache : public asio::io_service::service
+	{
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/// An object's data
+		typedef std::shared_ptr<const std::vector<char>> buffer_ptr;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service  Parent IO service
+		 * @param  capacity Byte budget; 0 disables the cache
+		 */
+		explicit memory_cache(asio::io_service &service, std::size_t capacity = PROXYTHING_MEMORY_CACHE_SIZE);
+		
+		/**
+		 * Constructs a cache sharing another IO service's cache.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Cache to forward to; must outlive this one
+		 */
+		memory_cache(asio::io_service &service, memory_cache &primary);
+		
+		virtual ~memory_cache() { }
+		
+		/**
+		 * Looks up an object, counting it as a hit.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @return          The object's data, or nullptr
+		 */
+		buffer_ptr find(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Inserts or replaces an object, evicting others to make room.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @param  data     Data
+		 * @return          false if the object's too large to be cached
+		 */
+		bool insert(const asio::ip::tcp::endpoint &endpoint, buffer_ptr data);
+		
+		/**
+		 * Removes an object.
+		 * 
+		 * @param endpoint Endpoint
+		 */
+		void erase(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Returns whether objects of a size would be cached.
+		 */
+		bool admits(std::size_t size) const;
+		
+		/// Returns the byte budget
+		inline std::size_t capacity() const { return m_capacity; }
+		
+		/**
+		 * Returns the number of bytes cached.
+		 */
+		std::size_t size();
+		
+		/**
+		 * Returns the number of objects cached.
+		 */
+		std::size_t count();
+		
+	protected:
+		/**
+		 * A cached object.
+		 */
+		struct entry
+		{
+			asio::ip::tcp::endpoint endpoint;	///< Key
+			buffer_ptr data;					///< Data
+			uint8_t freq = 0;					///< Hits since insertion (capped)
+			bool main = false;					///< Is it in the main queue?
+		};
+		
+		typedef std::list<entry> queue_type;
+		
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service() { };
+		
+		/**
+		 * Evicts one object, from whichever queue is due. Must be called with
+		 * m_mutex held.
+		 */
+		void evict();
+		
+		/**
+		 * Remembers an evicted object's key. Must be called with m_mutex held.
+		 */
+		void remember(const asio::ip::tcp::endpoint &endpoint);
+		
+		
+		
+		std::size_t m_capacity;			///< Byte budget
+		memory_cache *m_primary;		///< Cache to forward to, if sharing one
+		
+		std::mutex m_mutex;				///< Guards everything below
+		queue_type m_small;				///< Small queue, for new objects
+		queue_type m_main;				///< Main queue, for objects hit while in m_small
+		std::size_t m_small_size;		///< Bytes in m_small
+		std::size_t m_main_size;		///< Bytes in m_main
+		
+		/// Index into m_small and m_main
+		std::map<asio::ip::tcp::endpoint, queue_type::iterator> m_index;
+		
+		/// Ghost queue; recently evicted keys, and when they were
+		std::deque<std::pair<asio::ip::tcp::endpoint, std::uint64_t>> m_ghost;
+		
+		/// Key -> when it was last remembered; older entries in m_ghost are stale
+		std::map<asio::ip::tcp::endpoint, std::uint64_t> m_ghost_index;
+		std::uint64_t m_ghost_seq;		///< Keys remembered so far
+	};
+}
+
+#endif
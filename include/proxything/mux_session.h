@@ -0,0 +1,267 @@
+#ifndef PROXYTHING_MUX_SESSION_H
+#define PROXYTHING_MUX_SESSION_H
+
+#include <proxything/memory_cache.h>
+#include <proxything/chunk_pool.h>
+#include <boost/asio.hpp>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	class client_connection;
+	class remote_connection;
+	class cache_manager;
+	class dns_cache;
+	class fs_entry;
+	
+	/**
+	 * A multiplexed session, taking over a client connection that sent
+	 * PROXYTHING_MUX_PREAMBLE as its first line.
+	 * 
+	 * The preamble is echoed back, and from then on, both sides send frames:
+	 * a 9 byte header (a 4 byte stream ID, a 1 byte type and a 4 byte payload
+	 * length, all big-endian), followed by the payload.
+	 * 
+	 * The client opens a stream with a request frame carrying a target (like
+	 * a text command, without the CRLF), under an ID of its choosing. The
+	 * response comes back as data frames, followed by an end frame, or an
+	 * error frame carrying a message. Each stream can be sent
+	 * PROXYTHING_MUX_WINDOW bytes before the client has to grant it more with
+	 * a window frame (a 4 byte increment); a cancel frame closes it early.
+	 * 
+	 * Streams take turns sending a frame at a time, so any number of cache
+	 * hits and misses can be in flight and interleave on the one socket.
+	 * 
+	 * Handlers run through the client's strand.
+	 */
+	class mux_session : public std::enable_shared_from_this<mux_session>
+	{
+	public:
+		/**
+		 * Frame types.
+		 */
+		enum class frame_type : std::uint8_t
+		{
+			request = 1,	///< Opens a stream (client)
+			data = 2,		///< Response data (server)
+			end = 3,		///< Ends a response (server)
+			error = 4,		///< Ends a response with an error (server)
+			window = 5,		///< Grants a stream more data (client)
+			cancel = 6,		///< Closes a stream early (client)
+		};
+		
+		/// Size of a frame header
+		static const std::size_t header_size = 9;
+		
+		/**
+		 * Constructs a session.
+		 * 
+		 * @param client Connection to take over
+		 */
+		mux_session(std::shared_ptr<client_connection> client);
+		
+		virtual ~mux_session();
+		
+		
+		
+		/**
+		 * Acknowledges the preamble and starts reading frames.
+		 * 
+		 * @param buf Anything received after the preamble; consumed
+		 */
+		void start(asio::streambuf &buf);
+		
+		/**
+		 * Encodes a frame header.
+		 * 
+		 * @param header Buffer to encode into
+		 * @param id     Stream ID
+		 * @param type   Frame type
+		 * @param size   Payload length
+		 */
+		static void encode_header(char *header, std::uint32_t id, frame_type type, std::uint32_t size);
+		
+		/**
+		 * Decodes a frame header.
+		 * 
+		 * @param header Buffer to decode from
+		 * @param id     Stream ID
+		 * @param type   Frame type
+		 * @param size   Payload length
+		 */
+		static void decode_header(const char *header, std::uint32_t &id, frame_type &type, std::uint32_t &size);
+		
+		
+		
+		/// Returns the number of open streams
+		inline std::size_t num_streams() const { return m_streams.size(); }
+	
+	protected:
+		/**
+		 * A stream, and where its response comes from.
+		 */
+		struct stream
+		{
+			explicit stream(const chunk_pool &pool): sizer(pool) { }
+			
+			std::uint32_t id;							///< Stream ID
+			std::size_t window;							///< Bytes it may still be sent
+			bool closed = false;						///< Ended or cancelled?
+			bool busy = false;							///< Frame or read in flight?
+			
+			memory_cache::buffer_ptr data;				///< Object in memory, or nullptr
+			std::shared_ptr<fs_entry> file;				///< Cache file, or nullptr
+			std::shared_ptr<remote_connection> fill;	///< Fill writing the file, or nullptr
+			std::size_t offset = 0;						///< Bytes sent so far
+			chunk_pool::sizer sizer;					///< Picks file read sizes
+		};
+		typedef std::shared_ptr<stream> stream_ptr;
+		
+		/**
+		 * A frame waiting to be written.
+		 */
+		struct frame
+		{
+			std::array<char, header_size> header;		///< Encoded header
+			asio::const_buffer payload;					///< Payload
+			
+			memory_cache::buffer_ptr data;				///< Keeps the payload alive
+			chunk_pool::chunk_ptr chunk;				///< Keeps the payload alive
+			std::shared_ptr<std::string> text;			///< Keeps the payload alive
+			
+			stream_ptr s;								///< Stream to resume once written
+		};
+		
+		/**
+		 * Reads frames from the client, until EOF or an error.
+		 */
+		void read_frames();
+		
+		/**
+		 * Handles all complete frames in the input buffer.
+		 * 
+		 * @return False if the client violated the protocol
+		 */
+		bool handle_frames();
+		
+		/**
+		 * Opens a stream.
+		 * 
+		 * @param  id    Stream ID
+		 * @param  first Start of the requested target
+		 * @param  last  End of the requested target
+		 * @return       False if the ID is invalid or in use
+		 */
+		bool open(std::uint32_t id, const char *first, const char *last);
+		
+		/**
+		 * Serves a stream from the in-memory cache tier, a fill in flight,
+		 * the disk cache, or a new fetch, in that order of preference.
+		 * 
+		 * @param s        Stream
+		 * @param endpoint Endpoint requested
+		 */
+		void serve(stream_ptr s, asio::ip::tcp::endpoint endpoint);
+		
+		/**
+		 * Serves a stream from a fill in flight.
+		 * 
+		 * @param s      Stream
+		 * @param remote Fill to join
+		 */
+		void join(stream_ptr s, std::shared_ptr<remote_connection> remote);
+		
+		/**
+		 * Sends a stream's next frame, if it's got a source, some window left,
+		 * and no frame in flight already.
+		 * 
+		 * @param s Stream
+		 */
+		void pump(stream_ptr s);
+		
+		/**
+		 * Reads a stream's next frame from its file, or waits for its fill to
+		 * write more.
+		 * 
+		 * The chunk it's read into counts towards chunk_pool's budget; once
+		 * that's used up, the stream waits for it.
+		 * 
+		 * @param s Stream
+		 */
+		void read_file(stream_ptr s);
+		
+		/**
+		 * Reads a stream's next frame from its file into a chunk.
+		 * 
+		 * Data that's in the page cache is read right here; only reads that
+		 * would have to wait for the disk go through fs_service.
+		 * 
+		 * @param s     Stream
+		 * @param chunk Chunk to read into
+		 */
+		void read_into(stream_ptr s, chunk_pool::chunk_ptr chunk);
+		
+		/**
+		 * Sends what a read from a stream's file put into a chunk.
+		 * 
+		 * @param s     Stream
+		 * @param chunk Chunk read into
+		 * @param ec    Result of the read
+		 * @param size  Bytes read
+		 */
+		void file_read(stream_ptr s, chunk_pool::chunk_ptr chunk, const boost::system::error_code &ec, std::size_t size);
+		
+		/**
+		 * Ends a stream, with an end or error frame.
+		 * 
+		 * @param s     Stream
+		 * @param error Error message, or empty
+		 */
+		void end(stream_ptr s, const std::string &error = "");
+		
+		/**
+		 * Queues a frame, and starts writing if not already.
+		 * 
+		 * @param f Frame
+		 */
+		void send(frame f);
+		
+		/**
+		 * Writes out queued frames, a batch at a time.
+		 */
+		void flush();
+		
+		/**
+		 * Closes the session, dropping all streams.
+		 */
+		void close();
+		
+		std::shared_ptr<client_connection> m_client;	///< Connection taken over
+		asio::io_service &m_service;					///< IO Service
+		asio::io_service::strand m_strand;				///< The client's strand
+		cache_manager &m_cache;							///< Cache manager
+		memory_cache &m_memory;							///< In-memory cache tier
+		chunk_pool &m_pool;								///< Pool to read files into
+		dns_cache &m_dns;								///< Hostname resolver
+		
+		asio::streambuf m_in;							///< Received, unhandled data
+		bool m_closed;									///< Has the session been closed?
+		
+		/// Open streams, by ID
+		std::unordered_map<std::uint32_t, stream_ptr> m_streams;
+		
+		std::deque<frame> m_queue;						///< Frames waiting to be written
+		std::vector<frame> m_sending;					///< Frames being written
+		bool m_writing;									///< Is a batch being written?
+	};
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef PROXYTHING_PARSER_H
+#define PROXYTHING_PARSER_H
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+#include <cstring>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Parsing of commands, in place and without allocating.
+	 * 
+	 * Commands are scanned straight out of the read buffer, and errors are
+	 * reported through error codes rather than exceptions, so that a flood of
+	 * commands (or of garbage) costs as little as possible.
+	 */
+	namespace parser
+	{
+		/**
+		 * Parse errors.
+		 */
+		enum error
+		{
+			missing_port = 1,		///< No : delimiting a port
+			invalid_address,		///< Not an IPv4 or IPv6 address
+			invalid_port,			///< Port isn't a number
+			port_out_of_range,		///< Port isn't within 1-65535
+		};
+		
+		/**
+		 * Returns the error category for parse errors.
+		 */
+		const boost::system::error_category& category();
+		
+		/**
+		 * Makes an error code for a parse error.
+		 */
+		inline boost::system::error_code make_error_code(error e)
+		{
+			return boost::system::error_code(static_cast<int>(e), category());
+		}
+		
+		/**
+		 * Finds the end of a line.
+		 * 
+		 * @param  begin Start of the data
+		 * @param  end   End of the data
+		 * @return       The LF ending the first line, or nullptr if none
+		 */
+		inline const char* find_line_end(const char *begin, const char *end)
+		{
+			// glibc's memchr() is vectorized, comparing 16-32 bytes at a time;
+			// it mustn't be given a null pointer, even with a zero size
+			if (begin == end) {
+				return nullptr;
+			}
+			return static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+		}
+		
+		/**
+		 * A parsed target: an endpoint, or a hostname yet to be resolved.
+		 */
+		struct target
+		{
+			/// The endpoint; only its port is set if there's a hostname
+			asio::ip::tcp::endpoint endpoint;
+			
+			const char *host_begin = nullptr;	///< Start of the hostname, in the parsed data
+			const char *host_end = nullptr;		///< End of the hostname
+			
+			/// Returns whether the hostname has to be resolved
+			inline bool has_host() const { return host_begin != host_end; }
+		};
+		
+		/**
+		 * Parses an "IP:port" or "hostname:port" target.
+		 * 
+		 * IPv6 addresses may be [bracketed]. Hostnames follow RFC 1123, except
+		 * that all-numeric ones (like a mistyped IPv4 address) are rejected.
+		 * 
+		 * @param  begin Start of the target
+		 * @param  end   End of the target
+		 * @param  ec    Set on failure
+		 * @return       The parsed target
+		 */
+		target parse_target(const char *begin, const char *end, boost::system::error_code &ec);
+		
+		/**
+		 * Parses an "IP:port" target into an endpoint.
+		 * 
+		 * IPv6 addresses may be [bracketed]; hostnames aren't accepted.
+		 * 
+		 * @param  begin Start of the target
+		 * @param  end   End of the target
+		 * @param  ec    Set on failure
+		 * @return       The parsed endpoint
+		 */
+		asio::ip::tcp::endpoint parse_endpoint(const char *begin, const char *end, boost::system::error_code &ec);
+	}
+}
+
+namespace boost
+{
+	namespace system
+	{
+		template<> struct is_error_code_enum<proxything::parser::error>
+		{
+			static const bool value = true;
+		};
+	}
+}
+
+#endif
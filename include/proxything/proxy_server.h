@@ -28,10 +28,14 @@ namespace proxything
 		/**
 		 * Listen on the specified port.
 		 * 
-		 * @param host Host to bind to
-		 * @param port Port to bind to
+		 * With reuse_port, any number of servers can listen on the same port
+		 * (SO_REUSEPORT), and the kernel balances new connections over them.
+		 * 
+		 * @param host       Host to bind to
+		 * @param port       Port to bind to
+		 * @param reuse_port Share the port with other servers?
 		 */
-		void listen(const std::string &host, unsigned short port);
+		void listen(const std::string &host, unsigned short port, bool reuse_port = false);
 		
 		/**
 		 * Start accepting connections.
@@ -46,10 +50,21 @@ namespace proxything
 		/// Returns the acceptor
 		inline asio::ip::tcp::acceptor& acceptor() { return m_acceptor; }
 		
+#ifdef PROXYTHING_HAVE_COROUTINES
+		/// Returns whether connections run as coroutines
+		inline bool coroutines() const { return m_coroutines; }
+		
+		/// Sets whether connections accepted from now on run as coroutines
+		inline void set_coroutines(bool coroutines) { m_coroutines = coroutines; }
+#endif
+		
 	protected:
 		
 		asio::io_service &m_service;			///< IO Service
 		asio::ip::tcp::acceptor m_acceptor;		///< Acceptor for new connections
+#ifdef PROXYTHING_HAVE_COROUTINES
+		bool m_coroutines = false;				///< Run connections as coroutines?
+#endif
 	};
 }
 
@@ -0,0 +1,157 @@
+#ifndef PROXYTHING_RECYCLER_H
+#define PROXYTHING_RECYCLER_H
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <utility>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Per-thread free lists of small memory blocks.
+	 * 
+	 * Connection objects and asio handlers are allocated and freed at the rate
+	 * of new connections and socket operations, in a handful of sizes; rather
+	 * than go to the heap every time, freed blocks are kept on a free list for
+	 * their size on the thread that freed them, and handed out again from
+	 * there. Nothing is shared between threads, so nothing is locked.
+	 * 
+	 * Blocks are rounded up to a multiple of granularity bytes; those bigger
+	 * than PROXYTHING_RECYCLER_MAX_SIZE go straight to the heap, and each
+	 * thread keeps at most PROXYTHING_RECYCLER_BYTES of each size.
+	 */
+	class recycler
+	{
+	public:
+		/// Blocks are rounded up to a multiple of this
+		static const std::size_t granularity = 64;
+		
+		/**
+		 * Allocates a block, reusing a freed one if there is one.
+		 * 
+		 * @param  size Size of the block
+		 * @return      The block
+		 */
+		static void* allocate(std::size_t size);
+		
+		/**
+		 * Frees a block from allocate(), on any thread.
+		 * 
+		 * @param p    The block
+		 * @param size Size it was allocated with
+		 */
+		static void deallocate(void *p, std::size_t size);
+		
+		/**
+		 * Returns the number of freed blocks kept on the calling thread.
+		 */
+		static std::size_t cached();
+	};
+	
+	/**
+	 * Standard allocator handing out recycler blocks, eg. for
+	 * std::allocate_shared().
+	 */
+	template<typename T>
+	class recycling_allocator
+	{
+	public:
+		typedef T value_type;
+		
+		recycling_allocator() noexcept { }
+		
+		template<typename U>
+		recycling_allocator(const recycling_allocator<U> &other) noexcept { }
+		
+		/// Allocates space for n objects
+		T* allocate(std::size_t n) { return static_cast<T*>(recycler::allocate(n * sizeof(T))); }
+		
+		/// Frees space for n objects
+		void deallocate(T *p, std::size_t n) noexcept { recycler::deallocate(p, n * sizeof(T)); }
+		
+		template<typename U>
+		bool operator==(const recycling_allocator<U> &other) const noexcept { return true; }
+		
+		template<typename U>
+		bool operator!=(const recycling_allocator<U> &other) const noexcept { return false; }
+	};
+	
+	/**
+	 * Handler wrapper making asio allocate the handler's operation from the
+	 * recycler; see recycle().
+	 */
+	template<typename Handler>
+	class recycled_handler
+	{
+	public:
+		/**
+		 * Constructor.
+		 * 
+		 * @param  handler Handler to wrap
+		 */
+		explicit recycled_handler(Handler handler): m_handler(std::move(handler)) { }
+		
+		/// Calls the wrapped handler
+		template<typename... Args>
+		void operator()(Args&&... args)
+		{
+			m_handler(std::forward<Args>(args)...);
+		}
+		
+		/// Allocation hook for asio
+		friend void* asio_handler_allocate(std::size_t size, recycled_handler *h)
+		{
+			return recycler::allocate(size);
+		}
+		
+		/// Deallocation hook for asio
+		friend void asio_handler_deallocate(void *p, std::size_t size, recycled_handler *h)
+		{
+			recycler::deallocate(p, size);
+		}
+		
+		/// Continuation hook for asio; forwards to the wrapped handler
+		friend bool asio_handler_is_continuation(recycled_handler *h)
+		{
+			using boost_asio_handler_cont_helpers::is_continuation;
+			return is_continuation(h->m_handler);
+		}
+		
+		/// Invocation hook for asio; forwards to the wrapped handler, so eg.
+		/// strand-wrapped handlers still run in their strand
+		template<typename Function>
+		friend void asio_handler_invoke(Function &f, recycled_handler *h)
+		{
+			using boost_asio_handler_invoke_helpers::invoke;
+			invoke(f, h->m_handler);
+		}
+		
+		/// Invocation hook for asio; forwards to the wrapped handler
+		template<typename Function>
+		friend void asio_handler_invoke(const Function &f, recycled_handler *h)
+		{
+			using boost_asio_handler_invoke_helpers::invoke;
+			invoke(f, h->m_handler);
+		}
+	
+	protected:
+		Handler m_handler;	///< Wrapped handler
+	};
+	
+	/**
+	 * Wraps a handler, so the memory for the operation it completes comes
+	 * from the recycler.
+	 * 
+	 * @param  handler Handler
+	 * @return         Wrapped handler
+	 */
+	template<typename Handler>
+	inline recycled_handler<Handler> recycle(Handler handler)
+	{
+		return recycled_handler<Handler>(std::move(handler));
+	}
+}
+
+#endif
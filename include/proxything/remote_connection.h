@@ -1,8 +1,16 @@
 #ifndef PROXYTHING_REMOTE_CONNECTION_H
 #define PROXYTHING_REMOTE_CONNECTION_H
 
+#include <proxything/chunk_pool.h>
+#include <proxything/memory_cache.h>
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 namespace proxything
 {
@@ -10,27 +18,120 @@ namespace proxything
 	
 	class client_connection;
 	class fs_entry;
+	class upstream_health;
 	
 	/**
-	 * A remote connection on a client's behalf.
+	 * A remote connection, filling a cache entry.
+	 * 
+	 * Each chunk received is written to both the client that started the
+	 * fetch and the cache file, straight from a single chunk_pool::chunk
+	 * referenced by both writes. The upstream is read from as fast as it
+	 * sends, whatever the client's speed; if the client falls more than
+	 * PROXYTHING_CLIENT_BACKLOG behind, the chunks queued up for it are
+	 * dropped, and it's handed a file_responder to catch up from the cache
+	 * file instead, as if it had joined the fetch. The same goes for a client
+	 * with chunks queued up when the buffer budget runs out, so stalled
+	 * clients can't keep every other fill waiting on it; one that stops
+	 * reading altogether is cut off after PROXYTHING_CLIENT_WRITE_TIMEOUT.
+	 * Likewise, while fill writes are backed up past
+	 * PROXYTHING_FS_BACKGROUND_QUEUE_LIMIT, the upstream is only read from
+	 * as fast as the fill's own writes go through.
+	 * 
+	 * Other clients can read the cache file while it's being filled; see
+	 * async_open_reader() and async_wait(). Fills in flight are registered
+	 * with fetch_registry.
+	 * 
+	 * Responses small enough for memory_cache are kept, and inserted into it
+	 * once the cache file has been committed. Fills that fail, including
+	 * failures to connect, are never committed; connect failures are also
+	 * reported to upstream_health.
+	 * 
+	 * Handlers run through the strand of the client that started the fetch,
+	 * since they write to its socket; waiters are called back through
+	 * whatever they wrapped their callbacks in.
 	 */
 	class remote_connection : public std::enable_shared_from_this<remote_connection>
 	{
 	public:
+		/**
+		 * Callback type for async_wait().
+		 * 
+		 * @param ec        Set if the fill failed
+		 * @param available Bytes in the cache file so far
+		 * @param done      Has the cache file been committed?
+		 */
+		typedef std::function<void(const boost::system::error_code &ec, std::size_t available, bool done)> WaitHandler;
+		
+		/**
+		 * Callback type for async_open_reader().
+		 */
+		typedef std::function<void(const boost::system::error_code &ec, std::shared_ptr<fs_entry> f)> OpenHandler;
+		
 		/**
 		 * Constructs a remote connection.
+		 * 
+		 * @param service  IO service
+		 * @param endpoint Endpoint to fetch
+		 * @param client   Client to send the response to, or nullptr
 		 */
-		remote_connection(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> cache_file);
+		remote_connection(asio::io_service &service, asio::ip::tcp::endpoint endpoint, std::shared_ptr<client_connection> client);
 		
 		virtual ~remote_connection();
 		
+		/**
+		 * Starts fetching an endpoint into the cache, unless it's already
+		 * being fetched.
+		 * 
+		 * @param  service  IO service
+		 * @param  endpoint Endpoint to fetch
+		 * @param  client   Client to send the response to, or nullptr
+		 * @return          The fetch in flight; check its client() to see if
+		 *                  it's a new one. nullptr if the upstream is down.
+		 */
+		static std::shared_ptr<remote_connection> fetch(asio::io_service &service, asio::ip::tcp::endpoint endpoint, std::shared_ptr<client_connection> client = nullptr);
+		
 		
 		
+		/**
+		 * Connects to the endpoint and starts fetching.
+		 * 
+		 * Gives up if the connection isn't accepted within
+		 * PROXYTHING_CONNECT_TIMEOUT.
+		 * 
+		 * @param cache_file Cache file to write to, opened for atomic writing
+		 */
+		void start(std::shared_ptr<fs_entry> cache_file);
+		
 		/**
 		 * Call when a connection has been established.
 		 */
 		void connected();
 		
+		/**
+		 * Waits for the cache file to grow past an offset.
+		 * 
+		 * The callback is called once more than offset bytes have been
+		 * written to the cache file, or once the fill is over; whichever
+		 * comes first.
+		 * 
+		 * @param offset Offset to wait for data beyond
+		 * @param cb     Callback
+		 */
+		void async_wait(std::size_t offset, WaitHandler cb);
+		
+		/**
+		 * Opens the cache file for reading, while it's being filled.
+		 * 
+		 * Use async_wait() on hitting the end of the file, to wait for more.
+		 * 
+		 * The reader may be on another IO service than the fill, eg. when
+		 * joining a fetch started from another core.
+		 * 
+		 * @param service IO service to open the file on, and call cb from
+		 * @param cb      Callback
+		 */
+		void async_open_reader(asio::io_service &service, OpenHandler cb);
+		
 		
 		
 		/// Returns the IO service
@@ -39,29 +140,145 @@ namespace proxything
 		/// Returns the underlying socket
 		inline asio::ip::tcp::socket& socket() { return m_socket; }
 		
-		/// Returns the parent client
+		/// Returns the strand handlers run through; the client's, if any
+		inline asio::io_service::strand& strand() { return m_strand; }
+		
+		/// Returns the endpoint being fetched
+		inline const asio::ip::tcp::endpoint& endpoint() const { return m_endpoint; }
+		
+		/// Returns the client the response is sent to
 		inline std::shared_ptr<client_connection> client() { return m_client; }
 		
 		/// Returns the cache file handle
 		inline std::shared_ptr<fs_entry> cache_file() { return m_cache_file; }
 		
 	protected:
+		/**
+		 * A received chunk of data.
+		 */
+		struct piece
+		{
+			chunk_pool::chunk_ptr chunk;	///< Chunk
+			std::size_t size;				///< Bytes used
+		};
+		
+		/**
+		 * A pending async_wait().
+		 */
+		struct waiter
+		{
+			std::size_t offset;				///< Offset waited for
+			WaitHandler cb;					///< Callback
+		};
+		
 		/**
 		 * Reads and delivers a chunk of data.
 		 * 
+		 * Waits for a chunk if the buffer budget is used up, handing the
+		 * client off to the cache file first if it has chunks queued up, or
+		 * for a cache write if fill writes are backlogged.
 		 * Calls itself upon completion, until EOF or an error occurs.
 		 */
 		void read_and_deliver();
 		
+		/**
+		 * Reads into a chunk, and delivers what was read.
+		 * 
+		 * @param chunk Chunk to read into, counted towards the budget
+		 */
+		void read_into(chunk_pool::chunk_ptr chunk);
+		
+		/**
+		 * Writes the next queued piece to the cache file, if not already
+		 * writing one.
+		 * 
+		 * Calls itself upon completion, until the queue is empty; then
+		 * commits, if the remote's done sending.
+		 */
+		void write_cache();
+		
+		/**
+		 * Sends the client the next queued piece, if not already sending one.
+		 * 
+		 * Calls itself upon completion, until the queue is empty.
+		 */
+		void deliver();
+		
+		/**
+		 * Switches a client that's fallen behind over to reading from the
+		 * cache file, from where it left off.
+		 * 
+		 * @param client Client
+		 * @param offset Bytes sent to it so far
+		 */
+		void hand_off(std::shared_ptr<client_connection> client, std::size_t offset);
+		
+		/**
+		 * Calls back waiters that can proceed. Must be called with m_mutex
+		 * held.
+		 */
+		void notify();
+		
+		/**
+		 * Fails the fetch, when the upstream couldn't be connected to.
+		 * 
+		 * @param ec Why
+		 */
+		void refused(const boost::system::error_code &ec);
+		
+		/**
+		 * Fails the fetch before anything's been sent, and unregisters it.
+		 * 
+		 * Waiters get the error, and the client is told why, or cut off if
+		 * it's since switched to pipelining.
+		 * 
+		 * @param ec  Why
+		 * @param msg Error to reject the client's request with
+		 */
+		void fail(const boost::system::error_code &ec, const std::string &msg);
+		
+		/**
+		 * Commits the cache file, or drops it if the fill failed, and
+		 * unregisters the fetch.
+		 */
+		void commit();
+		
 		
 		
 		asio::io_service &m_service;					///< IO Service
 		asio::ip::tcp::socket m_socket;					///< Socket
+		asio::io_service::strand m_strand;				///< Strand for handlers
+		asio::ip::tcp::endpoint m_endpoint;				///< Endpoint being fetched
+		asio::steady_timer m_timer;						///< Connect timeout
+		upstream_health &m_health;						///< Upstream health tracker
 		
-		std::shared_ptr<client_connection> m_client;	///< Parent connection
 		std::shared_ptr<fs_entry> m_cache_file;			///< Cache file handle
+		bool m_committed;								///< Has the cache been committed?
+		std::deque<piece> m_cache_queue;				///< Pieces not yet written to m_cache_file
+		bool m_cache_writing;							///< Is a cache write in flight?
+		bool m_finished;								///< Is the remote done sending?
+		bool m_throttled;								///< Waiting on cache writes to read more?
+		
+		chunk_pool &m_pool;								///< Pool for receive buffers
+		chunk_pool::sizer m_sizer;						///< Picks receive buffer sizes
+		memory_cache &m_memory;							///< In-memory cache tier
+		
+		std::mutex m_mutex;								///< Guards everything below
+		std::shared_ptr<client_connection> m_client;	///< Client, until it goes away
+		std::deque<piece> m_queue;						///< Pieces not yet sent to m_client
+		std::size_t m_backlog;							///< Bytes in m_queue
+		std::size_t m_sent;								///< Bytes sent to m_client
+		bool m_writing;									///< Is a client write in flight?
+		bool m_behind;									///< Has m_client fallen too far behind?
+		
+		std::size_t m_received;							///< Bytes received
+		std::vector<piece> m_body;						///< Everything received, if it fits in m_memory
+		bool m_keep_body;								///< Does it still fit in m_memory?
 		
-		asio::streambuf m_buf;							///< Buffer
+		std::size_t m_filled;							///< Bytes written to m_cache_file
+		bool m_done;									///< Is the fill over?
+		boost::system::error_code m_error;				///< Why the fill failed, if it did
+		std::vector<waiter> m_waiters;					///< Pending async_wait()s
 	};
 }
 
@@ -0,0 +1,211 @@
+#ifndef PROXYTHING_TASK_H
+#define PROXYTHING_TASK_H
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+
+#include <proxything/recycler.h>
+#include <boost/asio.hpp>
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <utility>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * A C++20 coroutine, which other tasks can co_await.
+	 * 
+	 * A task doesn't run until it's awaited, or started with start(); a
+	 * started one runs on its own, and frees itself when it's done. Frames
+	 * are allocated from the recycler, like the handlers of the callbacks
+	 * they replace.
+	 * 
+	 * An exception escaping a started task propagates out of whatever
+	 * resumed it last, like one thrown from a handler; an awaited task's
+	 * goes to the awaiting one.
+	 */
+	class task
+	{
+	public:
+		class promise_type;
+		typedef std::coroutine_handle<promise_type> handle_type;
+		
+		/**
+		 * Resumes the awaiting task, or frees the frame of a started one.
+		 */
+		struct final_awaiter
+		{
+			bool await_ready() noexcept { return false; }
+			
+			std::coroutine_handle<> await_suspend(handle_type h) noexcept
+			{
+				if (auto continuation = h.promise().m_continuation) {
+					return continuation;
+				}
+				
+				h.destroy();
+				return std::noop_coroutine();
+			}
+			
+			void await_resume() noexcept { }
+		};
+		
+		/**
+		 * Promise of a task.
+		 */
+		class promise_type
+		{
+		public:
+			task get_return_object() { return task(handle_type::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			final_awaiter final_suspend() noexcept { return {}; }
+			void return_void() { }
+			
+			void unhandled_exception()
+			{
+				if (!m_continuation) {
+					throw;
+				}
+				m_exception = std::current_exception();
+			}
+			
+			/// Allocates a frame
+			void* operator new(std::size_t size) { return recycler::allocate(size); }
+			
+			/// Frees a frame
+			void operator delete(void *p, std::size_t size) { recycler::deallocate(p, size); }
+		
+		protected:
+			friend class task;
+			friend struct final_awaiter;
+			
+			std::coroutine_handle<> m_continuation;	///< Task awaiting this one, if any
+			std::exception_ptr m_exception;			///< Exception to pass on to it
+		};
+		
+		/**
+		 * Awaits a task, resuming the awaiting one once it's done.
+		 */
+		struct awaiter
+		{
+			handle_type handle;	///< Task being awaited
+			
+			bool await_ready() noexcept { return false; }
+			
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+			{
+				handle.promise().m_continuation = continuation;
+				return handle;
+			}
+			
+			void await_resume()
+			{
+				if (handle.promise().m_exception) {
+					std::rethrow_exception(handle.promise().m_exception);
+				}
+			}
+		};
+		
+		task(task &&other) noexcept: m_handle(std::exchange(other.m_handle, nullptr)) { }
+		
+		~task()
+		{
+			if (m_handle) {
+				m_handle.destroy();
+			}
+		}
+		
+		/**
+		 * Starts the task, which carries on by itself from then on.
+		 */
+		void start() &&
+		{
+			std::exchange(m_handle, nullptr).resume();
+		}
+		
+		/// Awaits the task
+		awaiter operator co_await() && noexcept { return awaiter{ m_handle }; }
+	
+	protected:
+		explicit task(handle_type handle): m_handle(handle) { }
+		
+		handle_type m_handle;	///< The coroutine, until it's started
+	};
+	
+	/**
+	 * Awaits an asynchronous operation, resuming in a strand.
+	 * 
+	 * The operation is started with a handler wrapped in the strand, whose
+	 * memory comes from the recycler; it may be an asio operation, or one
+	 * taking a std::function. co_await-ing it returns a tuple of the
+	 * arguments the handler was called with, eg.:
+	 * 
+	 *     auto [ec, size] = co_await async_in_strand<boost::system::error_code, std::size_t>(strand, [&](auto handler) {
+	 *         socket.async_read_some(buffers, handler);
+	 *     });
+	 * 
+	 * @tparam Results    Types of the handler's arguments
+	 * @tparam Initiation Type of the function starting the operation
+	 */
+	template<typename Initiation, typename... Results>
+	class strand_awaiter
+	{
+	public:
+		/**
+		 * Resumes the awaiting coroutine with the results.
+		 */
+		struct handler
+		{
+			strand_awaiter *awaiter;			///< Awaiter to pass the results to
+			std::coroutine_handle<> coroutine;	///< Coroutine to resume
+			
+			template<typename... Args>
+			void operator()(Args&&... args)
+			{
+				awaiter->m_results = std::tuple<Results...>(std::forward<Args>(args)...);
+				coroutine.resume();
+			}
+		};
+		
+		strand_awaiter(asio::io_service::strand &strand, Initiation initiation):
+			m_strand(strand), m_initiation(std::move(initiation)) { }
+		
+		bool await_ready() noexcept { return false; }
+		
+		void await_suspend(std::coroutine_handle<> coroutine)
+		{
+			// The handler may resume the coroutine, which destroys the awaiter,
+			// before the initiation returns, so it's moved out and run from here
+			Initiation initiation(std::move(m_initiation));
+			auto wrapped = m_strand.wrap(recycle(handler{ this, coroutine }));
+			initiation(std::move(wrapped));
+		}
+		
+		std::tuple<Results...> await_resume() { return std::move(m_results); }
+	
+	protected:
+		asio::io_service::strand &m_strand;	///< Strand to resume in
+		Initiation m_initiation;			///< Starts the operation
+		std::tuple<Results...> m_results;	///< The handler's arguments
+	};
+	
+	/**
+	 * Awaits an asynchronous operation, resuming in a strand; see
+	 * strand_awaiter.
+	 * 
+	 * @tparam Results    Types of the handler's arguments
+	 * @param  strand     Strand to resume in
+	 * @param  initiation Function starting the operation, given the handler
+	 */
+	template<typename... Results, typename Initiation>
+	inline strand_awaiter<Initiation, Results...> async_in_strand(asio::io_service::strand &strand, Initiation initiation)
+	{
+		return strand_awaiter<Initiation, Results...>(strand, std::move(initiation));
+	}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef PROXYTHING_UPSTREAM_HEALTH_H
+#define PROXYTHING_UPSTREAM_HEALTH_H
+
+#include <proxything/config.h>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+namespace proxything
+{
+	namespace asio = boost::asio;
+	
+	/**
+	 * Tracks which upstreams are refusing connections.
+	 * 
+	 * An upstream that fails to accept a connection is considered down for a
+	 * while, during which requests for it are failed right away rather than
+	 * sent off to try (and tie up a socket and a cache file) again. The time
+	 * doubles with each failure in a row, up to a limit.
+	 * 
+	 * Once it's up, the next request tries connecting again; concurrent
+	 * requests join that fetch through fetch_registry, so there's only ever
+	 * the one probe. It either clears the upstream's record, or puts it back
+	 * down for longer.
+	 * 
+	 * When the server runs one IO service per core, each has its own tracker
+	 * forwarding to the first one's.
+	 */
+	class upstream_health : public asio::io_service::service
+	{
+	public:
+		/// Service ID
+		static asio::io_service::id id;
+		
+		/// Clock used for backoff
+		typedef std::chrono::steady_clock clock;
+		
+		/**
+		 * Constructor.
+		 * 
+		 * @param  service     Parent IO service
+		 * @param  backoff     Time to consider an upstream down for, the
+		 *                     first time it fails
+		 * @param  max_backoff Longest time to consider one down for
+		 */
+		explicit upstream_health(asio::io_service &service, std::chrono::milliseconds backoff = std::chrono::milliseconds(PROXYTHING_UPSTREAM_BACKOFF), std::chrono::milliseconds max_backoff = std::chrono::milliseconds(PROXYTHING_UPSTREAM_MAX_BACKOFF));
+		
+		/**
+		 * Constructs a tracker sharing another IO service's tracker.
+		 * 
+		 * @param  service Parent IO service
+		 * @param  primary Tracker to forward to; must outlive this one
+		 */
+		upstream_health(asio::io_service &service, upstream_health &primary);
+		
+		virtual ~upstream_health() { }
+		
+		/**
+		 * Returns whether an upstream may be connected to.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @return          false while it's considered down
+		 */
+		bool available(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Records a failure to connect to an upstream.
+		 * 
+		 * @param  endpoint Endpoint
+		 * @return          How long it's now considered down for
+		 */
+		std::chrono::milliseconds failed(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Records a successful connection to an upstream.
+		 * 
+		 * @param endpoint Endpoint
+		 */
+		void succeeded(const asio::ip::tcp::endpoint &endpoint);
+		
+		/**
+		 * Returns the number of upstreams with failures on record.
+		 */
+		std::size_t size();
+		
+	protected:
+		/**
+		 * A failing upstream.
+		 */
+		struct entry
+		{
+			unsigned int failures;			///< Failures in a row
+			clock::time_point down_until;	///< When to try it again
+		};
+		
+		/**
+		 * Free all user handlers.
+		 */
+		void shutdown_service() { };
+		
+		upstream_health *m_primary;					///< Tracker to forward to, if sharing one
+		
+		std::chrono::milliseconds m_backoff;		///< Time down after the first failure
+		std::chrono::milliseconds m_max_backoff;	///< Longest time down
+		
+		std::mutex m_mutex;							///< Guards m_entries
+		
+		/// Failing upstreams
+		std::map<asio::ip::tcp::endpoint, entry> m_entries;
+	};
+}
+
+#endif
@@ -1,12 +1,17 @@
 #ifndef PROXYTHING_UTIL_H
 #define PROXYTHING_UTIL_H
 
+#include <proxything/recycler.h>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/version.hpp>
 #include <stdexcept>
 #include <sstream>
+#include <fstream>
 #include <functional>
 #include <memory>
+#include <ios>
+#include <fcntl.h>
 
 namespace proxything
 {
@@ -25,7 +30,7 @@ namespace proxything
 		template<typename R, typename... Args>
 		inline std::function<R(Args...)> work_bound(asio::io_service& service, std::function<R(Args...)> fn)
 		{
-			auto work = std::make_shared<asio::io_service::work>(service);
+			auto work = std::allocate_shared<asio::io_service::work>(recycling_allocator<asio::io_service::work>(), service);
 			return [work, fn](Args&&... args) {
 				if (fn) {
 					return fn(std::forward<Args>(args)...);
@@ -33,6 +38,80 @@ namespace proxything
 			};
 		}
 		
+		/**
+		 * Returns the IO service a service belongs to.
+		 * 
+		 * Boost 1.66 renamed get_io_service() to get_io_context(), and 1.70
+		 * dropped the old name.
+		 */
+		inline asio::io_service& owner(asio::io_service::service &service)
+		{
+#if BOOST_VERSION >= 106600
+			return service.get_io_context();
+#else
+			return service.get_io_service();
+#endif
+		}
+		
+#if BOOST_VERSION >= 106600
+		/**
+		 * Turns a completion token into a handler, and the initiating
+		 * function's result.
+		 */
+		template<typename Token, typename Signature>
+		using async_completion = asio::async_completion<Token, Signature>;
+#else
+		/**
+		 * Turns a completion token into a handler, and the initiating
+		 * function's result; stand-in for asio::async_completion, which
+		 * Boost only has since 1.66.
+		 */
+		template<typename Token, typename Signature>
+		struct async_completion: asio::detail::async_result_init<Token, Signature>
+		{
+			explicit async_completion(Token &token):
+				asio::detail::async_result_init<Token, Signature>(static_cast<Token&&>(token)),
+				completion_handler(this->handler) { }
+			
+			/// The handler
+			typename asio::handler_type<Token, Signature>::type &completion_handler;
+		};
+#endif
+		
+		/**
+		 * Translates an iostream open mode into open(2) flags.
+		 * 
+		 * Follows the same rules as std::basic_filebuf::open(), so that eg. a
+		 * plain std::ios_base::out truncates the file.
+		 */
+		inline int open_flags(std::ios_base::openmode mode)
+		{
+			bool in = mode & std::ios_base::in;
+			bool out = mode & std::ios_base::out;
+			bool app = mode & std::ios_base::app;
+			bool trunc = mode & std::ios_base::trunc;
+			
+			int flags = O_CLOEXEC;
+			if (in && (out || app)) {
+				flags |= O_RDWR;
+			} else if (out || app) {
+				flags |= O_WRONLY;
+			} else {
+				flags |= O_RDONLY;
+			}
+			
+			if (out || app) {
+				flags |= O_CREAT;
+			}
+			if (app) {
+				flags |= O_APPEND;
+			} else if (trunc || (out && !in)) {
+				flags |= O_TRUNC;
+			}
+			
+			return flags;
+		}
+		
 		/**
 		 * Returns a path to a temporary file.
 		 * 
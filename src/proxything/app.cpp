@@ -1,15 +1,29 @@
 #include <proxything/app.h>
 #include <proxything/proxy_server.h>
 #include <proxything/fs_service.h>
+#include <proxything/chunk_pool.h>
+#include <proxything/memory_cache.h>
+#include <proxything/cache_janitor.h>
+#include <proxything/cache_manager.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/dns_cache.h>
+#include <proxything/upstream_health.h>
+#include <proxything/config.h>
 #include <boost/log/core.hpp>
 #include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
+#include <algorithm>
 #include <iostream>
 #include <string>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 using namespace proxything;
 
-app::app()
+app::app():
+	m_sharded(false)
 {
 	m_options.add_options()
 		("help,?", "print a help message")
@@ -17,9 +31,29 @@ app::app()
 		("verbose,v", "show more output")
 		("debug,V", "show even more output")
 		("threads,t", po::value<unsigned int>()->default_value(1), "number of threads to use")
+		("shard-per-core", "give each thread its own IO service and listening socket (SO_REUSEPORT)")
 		("host,h", po::value<std::string>()->default_value("127.0.0.1"), "host to bind to")
 		("port,p", po::value<unsigned short>()->default_value(12345), "port to bind to")
+		("fs-backend", po::value<std::string>()->default_value("threaded")->notifier([](const std::string &v) {
+			if (v != "threaded" && v != "uring") {
+				throw po::invalid_option_value(v);
+			}
+		}), "filesystem backend to use (threaded, uring)")
+		("fs-threads", po::value<unsigned int>()->default_value(PROXYTHING_FS_THREADS), "number of disk IO threads to use (threaded backend)")
+		("buffer-size", po::value<std::size_t>()->default_value(PROXYTHING_REMOTE_BUFFER_SIZE), "initial size of the buffers used to read from remote servers and files")
+		("max-buffer-size", po::value<std::size_t>()->default_value(PROXYTHING_REMOTE_MAX_BUFFER_SIZE), "size buffers grow to while reads keep filling them (buffer-size to keep them fixed)")
+		("max-buffered-bytes", po::value<std::size_t>()->default_value(PROXYTHING_BUFFER_BUDGET), "bytes received from remote servers that can be waiting to be written at once (0 for no limit)")
+		("memory-cache-bytes", po::value<std::size_t>()->default_value(PROXYTHING_MEMORY_CACHE_SIZE), "bytes of memory to cache hot objects in (0 to disable)")
+		("cache-max-bytes", po::value<std::size_t>()->default_value(PROXYTHING_CACHE_MAX_BYTES), "maximum size of the disk cache (0 for no limit)")
+		("cache-max-entries", po::value<std::size_t>()->default_value(PROXYTHING_CACHE_MAX_ENTRIES), "maximum number of files in the disk cache (0 for no limit)")
+		("dns-ttl", po::value<unsigned int>()->default_value(PROXYTHING_DNS_TTL), "seconds to cache resolved hostnames for (0 to not cache them)")
+		("dns-negative-ttl", po::value<unsigned int>()->default_value(PROXYTHING_DNS_NEGATIVE_TTL), "seconds to cache failed hostname lookups for")
 	;
+#ifdef PROXYTHING_HAVE_COROUTINES
+	m_options.add_options()
+		("coroutines", "serve connections with coroutines instead of callbacks")
+	;
+#endif
 }
 
 app::~app()
@@ -61,6 +95,9 @@ int app::run(po::variables_map args)
 	
 	init_server(args);
 	m_server->accept();
+	for (auto &shard : m_shards) {
+		shard.server->accept();
+	}
 	
 	BOOST_LOG_TRIVIAL(trace) << "Starting...";
 	
@@ -69,6 +106,32 @@ int app::run(po::variables_map args)
 	
 	BOOST_LOG_TRIVIAL(trace) << "Stopped!";
 	
+	std::size_t nowait_reads = 0, fallback_reads = 0;
+	for (std::size_t i = 0; i < std::max<std::size_t>(num_shards(), 1); i++) {
+		auto &service = asio::use_service<fs_service>(shard_service(i));
+		nowait_reads += service.nowait_reads();
+		fallback_reads += service.fallback_reads();
+	}
+	
+	// Shards share the primary's disk IO threads, and so its scheduler
+	impl::fs_scheduler::class_stats stats[impl::fs_scheduler::num_classes];
+	if (auto scheduler = asio::use_service<fs_service>(m_service).scheduler()) {
+		for (std::size_t c = 0; c < impl::fs_scheduler::num_classes; c++) {
+			stats[c] = scheduler->stats(static_cast<fs_service::io_class>(c));
+		}
+	}
+	BOOST_LOG_TRIVIAL(debug) << "File reads served from the page cache: " << nowait_reads << ", left to disk IO threads: " << fallback_reads;
+	for (std::size_t c = 0; c < impl::fs_scheduler::num_classes; c++) {
+		auto &latency = stats[c].latency;
+		if (latency.count()) {
+			BOOST_LOG_TRIVIAL(debug) << "Disk IO queue latency, " << impl::fs_scheduler::name(static_cast<fs_service::io_class>(c)) << ": "
+				<< "p50 <= " << latency.percentile(0.5).count() << "us, "
+				<< "p99 <= " << latency.percentile(0.99).count() << "us, "
+				<< "over " << latency.count() << " operations, "
+				<< stats[c].over_limit << " queued past the queue limit";
+		}
+	}
+	
 	return 0;
 }
 
@@ -110,7 +173,86 @@ void app::init_logging(po::variables_map args)
 
 void app::init_services(po::variables_map args)
 {
-	asio::add_service<fs_service>(m_service, new fs_service(m_service));
+	std::string backend_name = args.count("fs-backend") ? args["fs-backend"].as<std::string>() : "threaded";
+	auto backend = backend_name == "uring" ? fs_service::backend_type::uring : fs_service::backend_type::threaded;
+	
+	unsigned int num_threads = args.count("fs-threads") ? args["fs-threads"].as<unsigned int>() : PROXYTHING_FS_THREADS;
+	
+	// The disk's still the same disk with a shard per core, so the shards
+	// share these threads rather than have their own
+	m_sharded = args.count("shard-per-core") > 0;
+	unsigned int num_shards = m_sharded ? std::max(args["threads"].as<unsigned int>(), 1u) : 1;
+	
+	auto service = new fs_service(m_service, backend, num_threads);
+	asio::add_service<fs_service>(m_service, service);
+	
+	if (service->backend() != backend) {
+		BOOST_LOG_TRIVIAL(warning) << "io_uring is not supported, falling back to threaded disk IO";
+	} else {
+		BOOST_LOG_TRIVIAL(debug) << "Filesystem backend: " << backend_name;
+	}
+	
+	if (service->num_threads()) {
+		BOOST_LOG_TRIVIAL(trace) << "Started " << service->num_threads() << " disk IO threads";
+	}
+	
+	std::size_t max_buffered_bytes = args.count("max-buffered-bytes") ? args["max-buffered-bytes"].as<std::size_t>() : PROXYTHING_BUFFER_BUDGET;
+	std::size_t buffer_size = args.count("buffer-size") ? args["buffer-size"].as<std::size_t>() : PROXYTHING_REMOTE_BUFFER_SIZE;
+	std::size_t max_buffer_size = args.count("max-buffer-size") ? args["max-buffer-size"].as<std::size_t>() : PROXYTHING_REMOTE_MAX_BUFFER_SIZE;
+	auto pool = new chunk_pool(m_service, max_buffered_bytes, buffer_size, max_buffer_size);
+	asio::add_service<chunk_pool>(m_service, pool);
+	BOOST_LOG_TRIVIAL(debug) << "Buffer budget: " << max_buffered_bytes << " bytes";
+	BOOST_LOG_TRIVIAL(debug) << "Buffer sizes: " << pool->buffer_size() << " to " << pool->max_buffer_size() << " bytes";
+	
+	std::size_t memory_cache_bytes = args.count("memory-cache-bytes") ? args["memory-cache-bytes"].as<std::size_t>() : PROXYTHING_MEMORY_CACHE_SIZE;
+	asio::add_service<memory_cache>(m_service, new memory_cache(m_service, memory_cache_bytes));
+	BOOST_LOG_TRIVIAL(debug) << "In-memory cache: " << memory_cache_bytes << " bytes";
+	
+	std::size_t cache_max_bytes = args.count("cache-max-bytes") ? args["cache-max-bytes"].as<std::size_t>() : PROXYTHING_CACHE_MAX_BYTES;
+	std::size_t cache_max_entries = args.count("cache-max-entries") ? args["cache-max-entries"].as<std::size_t>() : PROXYTHING_CACHE_MAX_ENTRIES;
+	auto janitor = new cache_janitor(m_service, cache_max_bytes, cache_max_entries);
+	asio::add_service<cache_janitor>(m_service, janitor);
+	BOOST_LOG_TRIVIAL(debug) << "Disk cache limits: " << cache_max_bytes << " bytes, " << cache_max_entries << " files";
+	
+	unsigned int dns_ttl = args.count("dns-ttl") ? args["dns-ttl"].as<unsigned int>() : PROXYTHING_DNS_TTL;
+	unsigned int dns_negative_ttl = args.count("dns-negative-ttl") ? args["dns-negative-ttl"].as<unsigned int>() : PROXYTHING_DNS_NEGATIVE_TTL;
+	asio::add_service<dns_cache>(m_service, new dns_cache(m_service, std::chrono::seconds(dns_ttl), std::chrono::seconds(dns_negative_ttl)));
+	BOOST_LOG_TRIVIAL(debug) << "DNS cache TTLs: " << dns_ttl << "s, " << dns_negative_ttl << "s for failures";
+	
+	// Existing cache files count towards the limits too
+	asio::use_service<cache_manager>(m_service).scan(num_threads);
+	
+	// The other shards share the cache with this one
+	if (m_sharded) {
+		BOOST_LOG_TRIVIAL(debug) << "Running " << num_shards << " shards";
+		for (unsigned int i = 1; i < num_shards; i++) {
+			shard s;
+			s.service.reset(new asio::io_service(1));
+			init_shard_services(*s.service);
+			
+			// A shard can fail to set up a ring of its own, eg. on ENOMEM
+			auto &shard_fs = asio::use_service<fs_service>(*s.service);
+			if (shard_fs.backend() != service->backend()) {
+				BOOST_LOG_TRIVIAL(warning) << "Shard " << i << " couldn't use io_uring, falling back to " << shard_fs.num_threads() << " disk IO threads";
+			} else {
+				BOOST_LOG_TRIVIAL(debug) << "Shard " << i << " filesystem backend: " << (shard_fs.backend() == fs_service::backend_type::uring ? "uring" : "threaded");
+			}
+			
+			m_shards.push_back(std::move(s));
+		}
+	}
+}
+
+void app::init_shard_services(asio::io_service &service)
+{
+	asio::add_service<fs_service>(service, new fs_service(service, asio::use_service<fs_service>(m_service)));
+	asio::add_service<chunk_pool>(service, new chunk_pool(service, asio::use_service<chunk_pool>(m_service)));
+	asio::add_service<memory_cache>(service, new memory_cache(service, asio::use_service<memory_cache>(m_service)));
+	asio::add_service<cache_janitor>(service, new cache_janitor(service, asio::use_service<cache_janitor>(m_service)));
+	asio::add_service<cache_manager>(service, new cache_manager(service, asio::use_service<cache_manager>(m_service)));
+	asio::add_service<fetch_registry>(service, new fetch_registry(service, asio::use_service<fetch_registry>(m_service)));
+	asio::add_service<dns_cache>(service, new dns_cache(service, asio::use_service<dns_cache>(m_service)));
+	asio::add_service<upstream_health>(service, new upstream_health(service, asio::use_service<upstream_health>(m_service)));
 }
 
 void app::init_server(po::variables_map args)
@@ -120,7 +262,22 @@ void app::init_server(po::variables_map args)
 	
 	BOOST_LOG_TRIVIAL(trace) << "Creating a server...";
 	m_server = std::make_shared<proxy_server>(m_service);
-	m_server->listen(host, port);
+	m_server->listen(host, port, m_sharded);
+	
+	for (auto &shard : m_shards) {
+		shard.server = std::make_shared<proxy_server>(*shard.service);
+		shard.server->listen(host, port, true);
+	}
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+	if (args.count("coroutines")) {
+		BOOST_LOG_TRIVIAL(trace) << "Serving connections with coroutines";
+		m_server->set_coroutines(true);
+		for (auto &shard : m_shards) {
+			shard.server->set_coroutines(true);
+		}
+	}
+#endif
 }
 
 void app::init_threads(po::variables_map args)
@@ -130,7 +287,33 @@ void app::init_threads(po::variables_map args)
 	if (num_threads > 0) {
 		BOOST_LOG_TRIVIAL(trace) << "Starting " << num_threads - 1 << " background threads...";
 		for (unsigned int i = 0; i < num_threads - 1; i++) {
-			m_threads.emplace_back([this]{ m_service.run(); });
+			if (m_sharded) {
+				m_threads.emplace_back([this, i]{ m_shards[i].service->run(); });
+			} else {
+				m_threads.emplace_back([this]{ m_service.run(); });
+			}
+		}
+	}
+
+#ifdef __linux__
+	// Keep each shard on its own core, so its connections stay in its caches;
+	// shard 0 runs on the calling thread, which is left where it is
+	if (m_sharded) {
+		unsigned int num_cores = std::max(std::thread::hardware_concurrency(), 1u);
+		for (std::size_t i = 0; i < m_threads.size(); i++) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET((i + 1) % num_cores, &cpus);
+			::pthread_setaffinity_np(m_threads[i].native_handle(), sizeof(cpus), &cpus);
 		}
 	}
+#endif
+}
+
+void app::stop()
+{
+	m_service.stop();
+	for (auto &shard : m_shards) {
+		shard.service->stop();
+	}
 }
@@ -0,0 +1,76 @@
+#include <proxything/cache_index.h>
+
+using namespace proxything;
+
+bool cache_index::find(const asio::ip::tcp::endpoint &endpoint, record &out)
+{
+	key k = make_key(endpoint);
+	shard &s = shard_for(k);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	
+	auto it = s.records.find(k);
+	if (it == s.records.end()) {
+		return false;
+	}
+	
+	out = it->second;
+	return true;
+}
+
+void cache_index::insert(const asio::ip::tcp::endpoint &endpoint, record r)
+{
+	key k = make_key(endpoint);
+	shard &s = shard_for(k);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.records[k] = std::move(r);
+}
+
+void cache_index::erase(const asio::ip::tcp::endpoint &endpoint)
+{
+	key k = make_key(endpoint);
+	shard &s = shard_for(k);
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.records.erase(k);
+}
+
+std::size_t cache_index::size()
+{
+	std::size_t n = 0;
+	for (auto &s : m_shards) {
+		std::lock_guard<std::mutex> lock(s.mutex);
+		n += s.records.size();
+	}
+	return n;
+}
+
+std::size_t cache_index::key_hash::operator()(const key &k) const
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (unsigned char c : k.address) {
+		h = (h ^ c) * 1099511628211ULL;
+	}
+	h = (h ^ (k.port & 0xff)) * 1099511628211ULL;
+	h = (h ^ (k.port >> 8)) * 1099511628211ULL;
+	h = (h ^ k.v6) * 1099511628211ULL;
+	return static_cast<std::size_t>(h);
+}
+
+cache_index::key cache_index::make_key(const asio::ip::tcp::endpoint &endpoint)
+{
+	key k;
+	auto address = endpoint.address();
+	if (address.is_v4()) {
+		k.address = asio::ip::address_v6::v4_mapped(address.to_v4()).to_bytes();
+	} else {
+		k.address = address.to_v6().to_bytes();
+	}
+	k.port = endpoint.port();
+	k.v6 = address.is_v6();
+	return k;
+}
+
+cache_index::shard& cache_index::shard_for(const key &k)
+{
+	// The low bits go to picking a bucket within the shard
+	return m_shards[(key_hash()(k) >> 16) % m_shards.size()];
+}
@@ -0,0 +1,198 @@
+#include <proxything/cache_janitor.h>
+#include <proxything/cache_manager.h>
+#include <proxything/fs_service.h>
+#include <proxything/util.h>
+#include <boost/log/trivial.hpp>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+using namespace proxything;
+
+asio::io_service::id cache_janitor::id;
+
+cache_janitor::cache_janitor(asio::io_service &service, std::size_t max_bytes, std::size_t max_entries):
+	asio::io_service::service(service), m_max_bytes(max_bytes), m_max_entries(max_entries),
+	m_primary(nullptr), m_bytes(0), m_protected_bytes(0), m_running(false), m_evictions(0) { }
+
+cache_janitor::cache_janitor(asio::io_service &service, cache_janitor &primary):
+	asio::io_service::service(service), m_max_bytes(primary.max_bytes()), m_max_entries(primary.max_entries()),
+	m_primary(&primary), m_bytes(0), m_protected_bytes(0), m_running(false), m_evictions(0) { }
+
+void cache_janitor::insert(const std::string &filename, std::size_t size)
+{
+	if (m_primary) {
+		m_primary->insert(filename, size);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(filename);
+	if (it != m_index.end()) {
+		remove(it->second);
+	}
+	
+	entry e;
+	e.filename = filename;
+	e.size = size;
+	m_index[filename] = m_probation.insert(m_probation.end(), e);
+	m_bytes += size;
+	
+	schedule();
+}
+
+void cache_janitor::touch(const std::string &filename)
+{
+	if (m_primary) {
+		m_primary->touch(filename);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(filename);
+	if (it == m_index.end()) {
+		return;
+	}
+	
+	auto eit = it->second;
+	if (eit->is_protected) {
+		m_protected.splice(m_protected.end(), m_protected, eit);
+		return;
+	}
+	
+	eit->is_protected = true;
+	m_protected_bytes += eit->size;
+	m_protected.splice(m_protected.end(), m_probation, eit);
+	
+	// Keep the protected segment to 80% of the cache, demoting its coldest
+	// entries back to probation
+	while (m_protected.size() > 1 && over(m_protected_bytes, m_protected.size(), 80)) {
+		auto demoted = m_protected.begin();
+		demoted->is_protected = false;
+		m_protected_bytes -= demoted->size;
+		m_probation.splice(m_probation.end(), m_protected, demoted);
+	}
+}
+
+void cache_janitor::erase(const std::string &filename)
+{
+	if (m_primary) {
+		m_primary->erase(filename);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(filename);
+	if (it != m_index.end()) {
+		remove(it->second);
+	}
+}
+
+std::size_t cache_janitor::size()
+{
+	if (m_primary) {
+		return m_primary->size();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_bytes;
+}
+
+std::size_t cache_janitor::count()
+{
+	if (m_primary) {
+		return m_primary->count();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_index.size();
+}
+
+std::size_t cache_janitor::evictions()
+{
+	if (m_primary) {
+		return m_primary->evictions();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_evictions;
+}
+
+bool cache_janitor::over(std::size_t bytes, std::size_t entries, std::size_t percent) const
+{
+	return (m_max_bytes && bytes * 100 > m_max_bytes * percent)
+		|| (m_max_entries && entries * 100 > m_max_entries * percent);
+}
+
+void cache_janitor::remove(segment_type::iterator it)
+{
+	m_bytes -= it->size;
+	m_index.erase(it->filename);
+	
+	if (it->is_protected) {
+		m_protected_bytes -= it->size;
+		m_protected.erase(it);
+	} else {
+		m_probation.erase(it);
+	}
+}
+
+void cache_janitor::schedule()
+{
+	if (m_running || !over(m_bytes, m_index.size(), 100)) {
+		return;
+	}
+	
+	m_running = true;
+	util::owner(*this).post([this]{ run_batch(); });
+}
+
+void cache_janitor::run_batch()
+{
+	std::vector<std::string> victims;
+	
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		while (victims.size() < PROXYTHING_CACHE_EVICTION_BATCH && over(m_bytes, m_index.size(), 100)) {
+			auto it = !m_probation.empty() ? m_probation.begin() : m_protected.begin();
+			victims.push_back(it->filename);
+			remove(it);
+			m_evictions++;
+		}
+		
+		if (victims.empty()) {
+			m_running = false;
+			return;
+		}
+	}
+	
+	BOOST_LOG_TRIVIAL(debug) << "Evicting " << victims.size() << " cache files";
+	
+	// Stop serving them before they're gone
+	auto &cache = asio::use_service<cache_manager>(util::owner(*this));
+	for (auto &filename : victims) {
+		cache.erase(filename);
+	}
+	
+	auto &service = asio::use_service<fs_service>(util::owner(*this));
+	auto pending = std::make_shared<std::atomic<std::size_t>>(victims.size());
+	for (auto &filename : victims) {
+		service.async_remove(filename, [this, filename, pending](const boost::system::error_code &ec) {
+			if (ec && ec != boost::system::errc::no_such_file_or_directory) {
+				BOOST_LOG_TRIVIAL(warning) << "Couldn't evict " << filename << ": " << ec;
+			} else {
+				BOOST_LOG_TRIVIAL(trace) << "Evicted " << filename;
+			}
+			
+			// Only move on to the next batch once this one's done, so there's
+			// never more than a batch's worth of deletions queued up
+			if (--*pending == 0) {
+				run_batch();
+			}
+		});
+	}
+}
@@ -1,40 +1,221 @@
 #include <proxything/fs_entry.h>
 #include <proxything/cache_manager.h>
+#include <proxything/cache_janitor.h>
+#include <proxything/util.h>
+#include <proxything/config.h>
 #include <boost/algorithm/string.hpp>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
 
 using namespace proxything;
 
-cache_manager::cache_manager(asio::io_service &service):
-	m_service(service), m_path(fs::temp_directory_path()) { }
+asio::io_service::id cache_manager::id;
+
+cache_manager::cache_manager(asio::io_service &service, fs::path path):
+	asio::io_service::service(service), m_path(path), m_primary(nullptr) { }
+
+cache_manager::cache_manager(asio::io_service &service, cache_manager &primary):
+	asio::io_service::service(service), m_path(primary.path()), m_primary(&primary) { }
 
 cache_manager::~cache_manager() { }
 
 std::string cache_manager::filename_for(const asio::ip::tcp::endpoint &endpoint)
 {
+	// Colons can't go in filenames everywhere; IPv6 addresses are tagged as
+	// such, and keep any dots they have, so they can't be mistaken for IPv4
+	// ones (::ffff:1.2.3.4 vs ::ffff:1:2:3:4)
 	std::string address_str = endpoint.address().to_string();
-	boost::replace_all(address_str, ".", "-");
+	std::string family;
+	if (endpoint.address().is_v6()) {
+		family = "v6-";
+	} else {
+		boost::replace_all(address_str, ".", "-");
+	}
 	boost::replace_all(address_str, ":", "-");
 	
 	std::stringstream ss;
-	ss << "proxything_cache_" << address_str << "_" << endpoint.port();
+	ss << PROXYTHING_CACHE_PREFIX << family << address_str << "_" << endpoint.port();
 	std::string filename = ss.str();
 	
 	return filename;
 }
 
+bool cache_manager::endpoint_for(const std::string &filename, asio::ip::tcp::endpoint &endpoint)
+{
+	std::string name = fs::path(filename).filename().string();
+	std::string prefix(PROXYTHING_CACHE_PREFIX);
+	if (name.compare(0, prefix.size(), prefix) != 0) {
+		return false;
+	}
+	
+	std::size_t underscore_at = name.rfind('_');
+	if (underscore_at == std::string::npos || underscore_at < prefix.size()) {
+		return false;
+	}
+	
+	std::string address_s = name.substr(prefix.size(), underscore_at - prefix.size());
+	std::string port_s = name.substr(underscore_at + 1);
+	if (port_s.empty() || port_s.find_first_not_of("0123456789") != std::string::npos || port_s.size() > 5) {
+		return false;
+	}
+	
+	// Untagged names are IPv4 addresses, or IPv6 ones from before they were
+	// tagged, which had their dots flattened too; either way, the result has
+	// to actually parse as an address of that family
+	boost::system::error_code ec;
+	asio::ip::address address;
+	std::string tag("v6-");
+	if (address_s.compare(0, tag.size(), tag) == 0) {
+		address_s = address_s.substr(tag.size());
+		boost::replace_all(address_s, "-", ":");
+		address = asio::ip::address::from_string(address_s, ec);
+		if (!ec && !address.is_v6()) {
+			ec = asio::error::invalid_argument;
+		}
+	} else {
+		address = asio::ip::address::from_string(boost::replace_all_copy(address_s, "-", "."), ec);
+		if (ec || !address.is_v4()) {
+			boost::replace_all(address_s, "-", ":");
+			address = asio::ip::address::from_string(address_s, ec);
+			if (!ec && !address.is_v6()) {
+				ec = asio::error::invalid_argument;
+			}
+		}
+	}
+	
+	int port = std::stoi(port_s);
+	if (ec || port < 1 || port > 65535) {
+		return false;
+	}
+	
+	endpoint = asio::ip::tcp::endpoint(address, port);
+	return true;
+}
+
+void cache_manager::scan(std::size_t num_threads)
+{
+	struct found
+	{
+		asio::ip::tcp::endpoint endpoint;
+		cache_index::record record;
+	};
+	
+	// Listing the directory is cheap; it's stat()ing every file in it that
+	// isn't, so that's what's spread out over threads
+	std::vector<std::string> filenames;
+	boost::system::error_code ec;
+	for (fs::directory_iterator it(m_path, ec), end; !ec && it != end; it.increment(ec)) {
+		asio::ip::tcp::endpoint endpoint;
+		if (endpoint_for(it->path().filename().string(), endpoint)) {
+			filenames.push_back(it->path().string());
+		}
+	}
+	
+	if (ec) {
+		BOOST_LOG_TRIVIAL(warning) << "Couldn't scan " << m_path << ": " << ec;
+	}
+	
+	num_threads = std::max<std::size_t>(1, std::min(num_threads, filenames.size()));
+	std::vector<std::vector<found>> results(num_threads);
+	std::vector<std::thread> threads;
+	for (std::size_t t = 0; t < num_threads; t++) {
+		threads.emplace_back([&, t]{
+			for (std::size_t i = t; i < filenames.size(); i += num_threads) {
+				struct stat st;
+				if (::stat(filenames[i].c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+					continue;
+				}
+				
+				found f;
+				endpoint_for(filenames[i], f.endpoint);
+				f.record.filename = filenames[i];
+				f.record.size = st.st_size;
+				f.record.mtime = st.st_mtime;
+				results[t].push_back(f);
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	
+	std::vector<found> files;
+	for (auto &result : results) {
+		files.insert(files.end(), result.begin(), result.end());
+	}
+	
+	// Going by modification time is the best we can do for access order
+	std::sort(files.begin(), files.end(), [](const found &a, const found &b) {
+		return a.record.mtime < b.record.mtime;
+	});
+	
+	auto &janitor = asio::use_service<cache_janitor>(util::owner(*this));
+	for (auto &f : files) {
+		index().insert(f.endpoint, f.record);
+		janitor.insert(f.record.filename, f.record.size);
+	}
+	
+	BOOST_LOG_TRIVIAL(debug) << "Indexed " << files.size() << " cache files in " << m_path << " using " << num_threads << " threads";
+}
+
 void cache_manager::async_lookup(const asio::ip::tcp::endpoint &endpoint, LookupHandler cb)
 {
-	std::string filename = (m_path / filename_for(endpoint)).string();
+	cache_index::record record;
+	if (!index().find(endpoint, record)) {
+		util::owner(*this).post([cb]{
+			cb(false, boost::system::error_code(), nullptr);
+		});
+		return;
+	}
 	
-	auto f = std::make_shared<fs_entry>(m_service);
-	f->async_open(filename, [=](const boost::system::error_code &ec) {
+	auto f = std::make_shared<fs_entry>(util::owner(*this));
+	f->async_open(record.filename, [this, record, f, cb](const boost::system::error_code &ec) {
 		if (!ec) {
+			asio::use_service<cache_janitor>(util::owner(*this)).touch(record.filename);
 			cb(true, ec, f);
+		} else if (ec == boost::system::errc::no_such_file_or_directory) {
+			// Deleted behind our back; forget about it
+			erase(record.filename);
+			cb(false, boost::system::error_code(), nullptr);
 		} else {
-			f->async_open_atomic(filename, [=](const boost::system::error_code &ec) {
-				cb(false, ec, f);
-			});
+			cb(false, ec, nullptr);
 		}
 	});
 }
+
+void cache_manager::async_create(const asio::ip::tcp::endpoint &endpoint, CreateHandler cb)
+{
+	std::string filename = (m_path / filename_for(endpoint)).string();
+	
+	// A fill's writes only hold up the clients joined to it, so a burst of
+	// them mustn't hold up every cache hit's reads as well
+	auto f = std::make_shared<fs_entry>(util::owner(*this));
+	f->set_io_class(fs_service::io_class::background);
+	f->async_open_atomic(filename, [=](const boost::system::error_code &ec) {
+		cb(ec, f);
+	});
+}
+
+void cache_manager::insert(const asio::ip::tcp::endpoint &endpoint, std::size_t size)
+{
+	cache_index::record record;
+	record.filename = (m_path / filename_for(endpoint)).string();
+	record.size = size;
+	record.mtime = std::time(nullptr);
+	
+	index().insert(endpoint, record);
+	asio::use_service<cache_janitor>(util::owner(*this)).insert(record.filename, size);
+}
+
+void cache_manager::erase(const std::string &filename)
+{
+	asio::ip::tcp::endpoint endpoint;
+	if (endpoint_for(filename, endpoint)) {
+		index().erase(endpoint);
+	}
+	asio::use_service<cache_janitor>(util::owner(*this)).erase(filename);
+}
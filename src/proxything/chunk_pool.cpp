@@ -0,0 +1,281 @@
+#include <proxything/chunk_pool.h>
+#include <proxything/util.h>
+#include <proxything/config.h>
+#include <algorithm>
+#include <iterator>
+
+using namespace proxything;
+
+asio::io_service::id chunk_pool::id;
+
+namespace
+{
+	/// Returns the index of a size class in the free lists
+	std::size_t class_index(std::size_t size)
+	{
+		std::size_t index = 0;
+		for (std::size_t s = PROXYTHING_CHUNK_MIN_SIZE; s < size; s <<= 1) {
+			index++;
+		}
+		return index;
+	}
+}
+
+chunk_pool::sizer::sizer(const chunk_pool &pool):
+	m_size(pool.buffer_size()), m_min(pool.buffer_size()), m_max(pool.max_buffer_size()), m_shrink(false)
+{
+	
+}
+
+void chunk_pool::sizer::update(std::size_t used)
+{
+	// A full buffer means there was probably more to read
+	if (used >= m_size) {
+		m_shrink = false;
+		if (m_size * 2 <= m_max) {
+			m_size *= 2;
+		}
+		return;
+	}
+	
+	// One small read might just be the tail of a burst; two in a row means
+	// the connection has slowed down
+	if (used <= m_size / 4 && m_size > m_min) {
+		if (m_shrink) {
+			m_size /= 2;
+			m_shrink = false;
+		} else {
+			m_shrink = true;
+		}
+		return;
+	}
+	
+	m_shrink = false;
+}
+
+chunk_pool::chunk_pool(asio::io_service &service, std::size_t budget, std::size_t buffer_size, std::size_t max_buffer_size):
+	asio::io_service::service(service), m_state(std::make_shared<state>())
+{
+	m_state->budget = std::make_shared<accounting>();
+	m_state->budget->limit = budget;
+	m_state->budget->buffer_size = round_size(buffer_size);
+	m_state->budget->max_buffer_size = std::max(max_buffer_size, m_state->budget->buffer_size);
+}
+
+chunk_pool::chunk_pool(asio::io_service &service, chunk_pool &primary):
+	asio::io_service::service(service), m_state(std::make_shared<state>())
+{
+	m_state->budget = primary.m_state->budget;
+}
+
+chunk_pool::~chunk_pool()
+{
+	shutdown_service();
+	
+	// Chunks still in use are deleted when they're released
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	m_state->open = false;
+	for (auto &free : m_state->free) {
+		for (chunk *c : free) {
+			delete c;
+		}
+	}
+	m_state->free.clear();
+}
+
+void chunk_pool::shutdown_service()
+{
+	// Drop our waiters, so nobody tries to hand them chunks; they're destroyed
+	// outside the lock, as they may be holding on to chunks themselves
+	std::deque<waiter> dropped;
+	{
+		accounting &budget = *m_state->budget;
+		std::lock_guard<std::mutex> lock(budget.mutex);
+		auto mine = std::stable_partition(budget.waiting.begin(), budget.waiting.end(),
+			[this](const waiter &w) { return w.pool != this; });
+		std::move(mine, budget.waiting.end(), std::back_inserter(dropped));
+		budget.waiting.erase(mine, budget.waiting.end());
+	}
+}
+
+chunk_pool::chunk_ptr chunk_pool::acquire(std::size_t size)
+{
+	size = round_size(size ? size : buffer_size());
+	
+	{
+		std::lock_guard<std::mutex> lock(m_state->budget->mutex);
+		m_state->budget->charge(size);
+	}
+	
+	return take(size);
+}
+
+chunk_pool::chunk_ptr chunk_pool::try_acquire(std::size_t size)
+{
+	size = round_size(size ? size : buffer_size());
+	
+	{
+		accounting &budget = *m_state->budget;
+		std::lock_guard<std::mutex> lock(budget.mutex);
+		if (!budget.waiting.empty() || !budget.fits(size)) {
+			return nullptr;
+		}
+		
+		budget.charge(size);
+	}
+	
+	return take(size);
+}
+
+void chunk_pool::async_acquire(std::size_t size, AcquireHandler cb)
+{
+	size = round_size(size ? size : buffer_size());
+	
+	{
+		accounting &budget = *m_state->budget;
+		std::lock_guard<std::mutex> lock(budget.mutex);
+		if (!budget.waiting.empty() || !budget.fits(size)) {
+			budget.waiting.push_back(waiter{ this, size, cb });
+			return;
+		}
+		
+		budget.charge(size);
+	}
+	
+	chunk_ptr c = take(size);
+	util::owner(*this).post([cb, c]() { cb(c); });
+}
+
+std::size_t chunk_pool::round_size(std::size_t size)
+{
+	std::size_t rounded = PROXYTHING_CHUNK_MIN_SIZE;
+	while (rounded < size) {
+		rounded <<= 1;
+	}
+	return rounded;
+}
+
+chunk_pool::chunk_ptr chunk_pool::take(std::size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_state->mutex);
+		std::size_t index = class_index(size);
+		if (index < m_state->free.size() && !m_state->free[index].empty()) {
+			chunk *c = m_state->free[index].back();
+			m_state->free[index].pop_back();
+			return chunk_ptr(c);
+		}
+	}
+	
+	return chunk_ptr(new chunk(m_state, size));
+}
+
+std::size_t chunk_pool::free_chunks() const
+{
+	std::lock_guard<std::mutex> lock(m_state->mutex);
+	std::size_t count = 0;
+	for (auto &free : m_state->free) {
+		count += free.size();
+	}
+	return count;
+}
+
+std::size_t chunk_pool::buffer_size() const
+{
+	return m_state->budget->buffer_size;
+}
+
+std::size_t chunk_pool::max_buffer_size() const
+{
+	return m_state->budget->max_buffer_size;
+}
+
+std::size_t chunk_pool::buffered() const
+{
+	std::lock_guard<std::mutex> lock(m_state->budget->mutex);
+	return m_state->budget->used;
+}
+
+std::size_t chunk_pool::peak_buffered() const
+{
+	std::lock_guard<std::mutex> lock(m_state->budget->mutex);
+	return m_state->budget->peak;
+}
+
+std::size_t chunk_pool::waiting() const
+{
+	std::lock_guard<std::mutex> lock(m_state->budget->mutex);
+	return m_state->budget->waiting.size();
+}
+
+std::size_t chunk_pool::budget() const
+{
+	return m_state->budget->limit;
+}
+
+void chunk_pool::accounting::charge(std::size_t size)
+{
+	used += size;
+	peak = std::max(peak, used);
+}
+
+void chunk_pool::accounting::release(std::size_t size)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	used -= size;
+	
+	// Waiting pools are still alive, as they remove their waiters under this
+	// lock when they're destroyed
+	while (!waiting.empty() && fits(waiting.front().size)) {
+		waiter w = std::move(waiting.front());
+		waiting.pop_front();
+		
+		charge(w.size);
+		chunk_ptr c = w.pool->take(w.size);
+		AcquireHandler cb = std::move(w.cb);
+		util::owner(*w.pool).post([cb, c]() { cb(c); });
+	}
+}
+
+void proxything::intrusive_ptr_add_ref(chunk_pool::chunk *c)
+{
+	c->m_refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void proxything::intrusive_ptr_release(chunk_pool::chunk *c)
+{
+	if (c->m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+		return;
+	}
+	
+	// Keep the budget around, in case the chunk gets deleted
+	std::shared_ptr<chunk_pool::accounting> budget = c->m_owner->budget;
+	std::size_t size = c->capacity();
+	
+	// Bigger chunks are kept around in smaller numbers, but at least one of
+	// each size is, so a growing connection doesn't reallocate every read
+	std::size_t keep = std::max<std::size_t>(PROXYTHING_CHUNK_POOL_BYTES / size, 1);
+	
+	bool kept = false;
+	{
+		std::lock_guard<std::mutex> lock(c->m_owner->mutex);
+		auto &free = c->m_owner->free;
+		std::size_t index = class_index(size);
+		if (c->m_owner->open) {
+			if (index >= free.size()) {
+				free.resize(index + 1);
+			}
+			if (free[index].size() < keep) {
+				free[index].push_back(c);
+				kept = true;
+			}
+		}
+	}
+	
+	if (!kept) {
+		delete c;
+	}
+	
+	// Only once the chunk's back in the pool, so a waiter can reuse it
+	budget->release(size);
+}
@@ -1,19 +1,29 @@
 #include <proxything/client_connection.h>
 #include <proxything/remote_connection.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/dns_cache.h>
 #include <proxything/file_responder.h>
+#include <proxything/parser.h>
+#include <proxything/mux_session.h>
 #include <proxything/proxy_server.h>
 #include <proxything/fs_entry.h>
+#include <proxything/recycler.h>
 #include <proxything/config.h>
 #include <boost/log/trivial.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <cstring>
 #include <sstream>
-#include <iostream>
+#include <sys/stat.h>
 
 using namespace proxything;
 
 client_connection::client_connection(asio::io_service &service, std::shared_ptr<proxy_server> server):
-	m_service(service), m_socket(m_service),
-	m_server(server), m_cache(m_service),
-	m_buf(PROXYTHING_CLIENT_BUFFER_SIZE)
+	m_service(service), m_socket(m_service), m_strand(m_service), m_write_timer(m_service),
+	m_server(server), m_cache(asio::use_service<cache_manager>(m_service)),
+	m_memory(asio::use_service<memory_cache>(m_service)),
+	m_dns(asio::use_service<dns_cache>(m_service)),
+	m_buf(PROXYTHING_CLIENT_BUFFER_SIZE), m_scanned(0), m_reading(false), m_closed(false),
+	m_pipelined(false), m_next_seq(0), m_turn(0)
 {
 	BOOST_LOG_TRIVIAL(trace) << "Client Connection created";
 }
@@ -26,69 +36,289 @@ client_connection::~client_connection()
 void client_connection::connected()
 {
 	BOOST_LOG_TRIVIAL(trace) << "Connection acknowledged";
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+	if (m_server->coroutines()) {
+		run(shared_from_this()).start();
+		return;
+	}
+#endif
+	
 	read_command();
 }
 
+void client_connection::pipeline()
+{
+	BOOST_LOG_TRIVIAL(debug) << "Switching to pipelined mode";
+	
+	// Responses sent so far weren't waiting in line
+	m_pipelined = true;
+	m_turn = m_next_seq;
+	
+	auto self = shared_from_this();
+	std::size_t seq = m_next_seq++;
+	send_in_turn(seq, [this, self, seq]{
+		static const std::string ok = "OK\r\n";
+		async_write(m_socket, asio::buffer(ok), m_strand.wrap(recycle([this, self, seq](const boost::system::error_code &ec, std::size_t size) {
+			finish(seq);
+		})));
+	});
+}
+
 asio::ip::tcp::endpoint client_connection::parse(const std::string &cmd) const
 {
-	// Find the : delimiting the address and port
-	int colon_at = cmd.rfind(':');
-	if (colon_at == std::string::npos) {
-		throw std::invalid_argument("Format: IP:port");
+	boost::system::error_code ec;
+	auto endpoint = parse(cmd.data(), cmd.data() + cmd.size(), ec);
+	if (ec) {
+		throw std::invalid_argument(ec.message());
 	}
 	
-	// Split the command into host and port
-	std::string address_s = cmd.substr(0, colon_at);
-	std::string port_s = cmd.substr(colon_at + 1);
-	BOOST_LOG_TRIVIAL(trace) << "Split: host=" << address_s << ", port=" << port_s;
+	return endpoint;
+}
+
+asio::ip::tcp::endpoint client_connection::parse(const char *begin, const char *end, boost::system::error_code &ec) const
+{
+	return parser::parse_endpoint(begin, end, ec);
+}
+
+void client_connection::resolve(const std::string &host, unsigned short port, std::size_t seq)
+{
+	auto self = shared_from_this();
+	m_dns.async_resolve(host, m_strand.wrap([this, self, host, port, seq](const boost::system::error_code &ec, asio::ip::address address) {
+		if (ec) {
+			reject(seq, "Couldn't resolve " + host);
+			return;
+		}
+		
+		respond(asio::ip::tcp::endpoint(address, port), seq);
+	}));
+}
+
+void client_connection::respond(asio::ip::tcp::endpoint endpoint, std::size_t seq)
+{
+	auto self = shared_from_this();
 	
-	// Handle [bracketed] IPv6 addresses
-	if (address_s[0] == '[' && address_s[address_s.size() - 1] == ']') {
-		address_s = address_s.substr(1, address_s.size() - 2);
-		BOOST_LOG_TRIVIAL(trace) << "Bracketed IPv6 address: " << address_s;
+	if (auto data = m_memory.find(endpoint)) {
+		serve_buffer(data, seq);
+		return;
 	}
 	
-	// Parse the address
-	asio::ip::address address;
-	try {
-		address = asio::ip::address::from_string(address_s);
-	} catch (boost::system::system_error &e) {
-		throw std::invalid_argument("Given address is not valid");
+	if (auto remote = asio::use_service<fetch_registry>(m_service).find(endpoint)) {
+		join_fetch(remote, seq);
+		return;
 	}
-	BOOST_LOG_TRIVIAL(trace) << "Address: " << address.to_string();
 	
-	// Parse the port
-	int port;
-	try {
-		port = stoi(port_s);
-	} catch (std::invalid_argument) {
-		throw std::invalid_argument("Port is not a valid number");
+	m_cache.async_lookup(endpoint, m_strand.wrap([this, self, endpoint, seq](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		if (ec) {
+			// Log the error, but try to proceed anyways; at worst, it'll cause performance
+			// degradation, which is better than ceasing to function
+			BOOST_LOG_TRIVIAL(error) << "Cache error: " << ec;
+		}
+		
+		if (!hit) {
+			connect_remote(endpoint, seq);
+			return;
+		}
+		
+		struct stat st;
+		int fd = f->native_handle();
+		if (fd != -1 && ::fstat(fd, &st) == 0 && m_memory.admits(st.st_size)) {
+			promote_file(endpoint, f, st.st_size, seq);
+		} else {
+			serve_file(f, seq);
+		}
+	}));
+}
+
+void client_connection::connect_remote(asio::ip::tcp::endpoint endpoint, std::size_t seq)
+{
+	auto self = shared_from_this();
+	
+	auto remote = remote_connection::fetch(m_service, endpoint, m_pipelined ? nullptr : self);
+	if (!remote) {
+		reject(seq, "Upstream unavailable");
+		return;
 	}
-	BOOST_LOG_TRIVIAL(trace) << "Port: " << port;
 	
-	// Validate the port range
-	if (port < 1 || port > 65535) {
-		throw std::invalid_argument("Valid ports are 1-65535");
+	if (m_pipelined || remote->client() != self) {
+		join_fetch(remote, seq);
 	}
+}
+
+void client_connection::join_fetch(std::shared_ptr<remote_connection> remote, std::size_t seq)
+{
+	BOOST_LOG_TRIVIAL(info) << "Joining fetch in progress";
 	
-	return asio::ip::tcp::endpoint(address, port);
+	auto self = shared_from_this();
+	remote->async_open_reader(m_service, m_strand.wrap([this, self, remote, seq](const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't join fetch: " << ec;
+			fail(seq, "Fetch failed");
+			return;
+		}
+		
+		auto responder = std::allocate_shared<file_responder>(recycling_allocator<file_responder>(), m_service, self, f, remote);
+		send_in_turn(seq, [this, self, responder, seq]{
+			responder->start([this, self, seq](const boost::system::error_code &ec) {
+				finish(seq);
+			});
+		});
+	}));
 }
 
-void client_connection::connect_remote(asio::ip::tcp::endpoint endpoint, std::shared_ptr<fs_entry> cache_file)
+void client_connection::serve_buffer(memory_cache::buffer_ptr data, std::size_t seq)
 {
-	BOOST_LOG_TRIVIAL(info) << "Connecting to remote: " << endpoint.address().to_string() << ":" << endpoint.port();
-	BOOST_LOG_TRIVIAL(debug) << "Caching to: " << cache_file->filename();
-	auto remote = std::make_shared<remote_connection>(m_service, shared_from_this(), cache_file);
-	remote->socket().async_connect(endpoint, [=](const boost::system::error_code &ec) {
-		remote->connected();
+	BOOST_LOG_TRIVIAL(info) << "Serving response from memory";
+	
+	// The buffer's immutable, so it can be written from as-is; holding a
+	// reference keeps it around even if it's evicted mid-write
+	auto self = shared_from_this();
+	send_in_turn(seq, [this, self, data, seq]{
+		// In pipelined mode, it goes out as a single chunk, then the end
+		static const std::string chunk_end = "\r\n";
+		static const std::string end = "0\r\n\r\n";
+		
+		auto header = std::make_shared<std::string>();
+		std::vector<asio::const_buffer> buffers;
+		if (m_pipelined && !data->empty()) {
+			std::stringstream header_s;
+			header_s << std::hex << data->size() << "\r\n";
+			*header = header_s.str();
+			buffers.push_back(asio::buffer(*header));
+			buffers.push_back(asio::buffer(*data));
+			buffers.push_back(asio::buffer(chunk_end));
+		} else if (!m_pipelined) {
+			buffers.push_back(asio::buffer(*data));
+		}
+		if (m_pipelined) {
+			buffers.push_back(asio::buffer(end));
+		}
+		
+		async_write(m_socket, buffers, m_strand.wrap(recycle([this, self, data, header, seq](const boost::system::error_code &ec, std::size_t size) {
+			if (ec) {
+				BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+			} else {
+				BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
+			}
+			
+			finish(seq);
+		})));
 	});
 }
 
-void client_connection::serve_file(std::shared_ptr<fs_entry> file)
+void client_connection::promote_file(asio::ip::tcp::endpoint endpoint, std::shared_ptr<fs_entry> file, std::size_t size, std::size_t seq)
+{
+	BOOST_LOG_TRIVIAL(debug) << "Reading " << file->filename() << " into memory";
+	
+	auto self = shared_from_this();
+	auto data = std::make_shared<std::vector<char>>(size);
+	async_read(*file, asio::buffer(*data), m_strand.wrap([this, self, endpoint, file, data, seq](const boost::system::error_code &ec, std::size_t size) {
+		if (size != data->size()) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't read " << file->filename() << ": " << ec;
+			fail(seq, "Cache read failed");
+			return;
+		}
+		
+		m_memory.insert(endpoint, data);
+		serve_buffer(data, seq);
+	}));
+}
+
+void client_connection::serve_file(std::shared_ptr<fs_entry> file, std::size_t seq)
 {
 	BOOST_LOG_TRIVIAL(info) << "Serving local response";
-	auto responder = std::make_shared<file_responder>(m_service, shared_from_this(), file);
-	responder->start();
+	
+	auto self = shared_from_this();
+	auto responder = std::allocate_shared<file_responder>(recycling_allocator<file_responder>(), m_service, self, file);
+	send_in_turn(seq, [this, self, responder, seq]{
+		responder->start([this, self, seq](const boost::system::error_code &ec) {
+			finish(seq);
+		});
+	});
+}
+
+void client_connection::send_in_turn(std::size_t seq, std::function<void()> send)
+{
+	if (!m_pipelined || seq == m_turn) {
+		send();
+	} else {
+		m_waiting[seq] = send;
+	}
+}
+
+void client_connection::finish(std::size_t seq)
+{
+	if (!m_pipelined) {
+		return;
+	}
+	
+	m_turn = seq + 1;
+	
+	auto it = m_waiting.find(m_turn);
+	if (it != m_waiting.end()) {
+		auto send = it->second;
+		m_waiting.erase(it);
+		send();
+	}
+	
+	// Pick reading back up if it was held off by the pipeline depth
+	if (!m_reading && !m_closed) {
+		read_command();
+	}
+}
+
+void client_connection::fail(std::size_t seq, const std::string &msg)
+{
+	if (!m_pipelined) {
+		boost::system::error_code ignored;
+		m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+		return;
+	}
+	
+	auto self = shared_from_this();
+	send_in_turn(seq, [this, self, seq, msg]{
+		auto line = std::make_shared<std::string>("ERROR: " + msg + "\r\n");
+		async_write(m_socket, asio::buffer(*line), m_strand.wrap([this, self, line, seq](const boost::system::error_code &ec, std::size_t size) {
+			finish(seq);
+		}));
+	});
+}
+
+void client_connection::reject(std::size_t seq, const std::string &msg)
+{
+	if (m_pipelined) {
+		fail(seq, msg);
+		return;
+	}
+	
+	// The message has to outlive the write
+	auto self = shared_from_this();
+	auto line = std::make_shared<std::string>("ERROR: " + msg + "\r\n");
+	async_write(m_socket, asio::buffer(*line), m_strand.wrap([self, line](const boost::system::error_code &ec, std::size_t size) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't write error to client: " << ec;
+		}
+	}));
+}
+
+void client_connection::expect_write()
+{
+	auto self = shared_from_this();
+	m_write_timer.expires_from_now(std::chrono::milliseconds(PROXYTHING_CLIENT_WRITE_TIMEOUT));
+	m_write_timer.async_wait(m_strand.wrap(recycle([this, self](const boost::system::error_code &ec) {
+		// The deadline's moved out of the way once the write is done, even if
+		// this was already queued up to run by then
+		if (m_write_timer.expires_at() <= asio::steady_timer::clock_type::now()) {
+			BOOST_LOG_TRIVIAL(info) << "Client stopped reading, disconnecting";
+			boost::system::error_code ignored;
+			m_socket.close(ignored);
+		}
+	})));
+}
+
+void client_connection::wrote()
+{
+	m_write_timer.expires_at(asio::steady_timer::time_point::max());
 }
 
 void client_connection::read_command()
@@ -96,8 +326,33 @@ void client_connection::read_command()
 	// Retain the connection to keep it from getting deleted mid-transaction
 	auto self = shared_from_this();
 	
+	for (;;) {
+		if (m_pipelined && m_next_seq - m_turn >= PROXYTHING_PIPELINE_DEPTH) {
+			BOOST_LOG_TRIVIAL(trace) << "Pipeline full, holding off on reading";
+			return;
+		}
+		
+		command cmd;
+		if (!take_command(cmd)) {
+			break;
+		}
+		
+		if (!execute(cmd)) {
+			return;
+		}
+	}
+	
+	if (m_buf.size() == m_buf.max_size()) {
+		BOOST_LOG_TRIVIAL(warning) << "Command too long, giving up on the connection";
+		m_closed = true;
+		return;
+	}
+	
 	BOOST_LOG_TRIVIAL(trace) << "Awaiting command...";
-	async_read_until(m_socket, m_buf, "\r\n", [&, self](const boost::system::error_code &ec, std::size_t size) {
+	m_reading = true;
+	m_socket.async_read_some(m_buf.prepare(m_buf.max_size() - m_buf.size()), m_strand.wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+		m_reading = false;
+		
 		if (ec) {
 			if (ec == asio::error::eof) {
 				BOOST_LOG_TRIVIAL(info) << "Connection closed";
@@ -105,46 +360,225 @@ void client_connection::read_command()
 				BOOST_LOG_TRIVIAL(warning) << "Failed to read command: " << ec;
 			}
 			
+			m_closed = true;
 			return;
 		}
 		
-		BOOST_LOG_TRIVIAL(trace) << "Parsing command...";
-		
-		std::istream cmd_s(&m_buf);
-		std::string cmd;
-		std::getline(cmd_s, cmd);
+		m_buf.commit(size);
+		read_command();
+	})));
+}
+
+bool client_connection::take_command(command &cmd)
+{
+	// Only scan what hasn't been scanned already
+	const char *begin = asio::buffer_cast<const char*>(m_buf.data());
+	const char *eol = parser::find_line_end(begin + m_scanned, begin + m_buf.size());
+	if (!eol) {
+		m_scanned = m_buf.size();
+		return false;
+	}
+	m_scanned = 0;
+	
+	const char *end = eol;
+	if (end != begin && *(end - 1) == '\r') {
+		end--;
+	}
+	
+	BOOST_LOG_TRIVIAL(debug) << "Command received: " << boost::string_ref(begin, end - begin);
+	
+	static const char pipeline_cmd[] = "PIPELINE";
+	static const char mux_cmd[] = PROXYTHING_MUX_PREAMBLE;
+	if (end - begin == sizeof(pipeline_cmd) - 1 && std::memcmp(begin, pipeline_cmd, end - begin) == 0) {
+		cmd.kind = command::kind_type::pipeline;
+	} else if (m_next_seq == 0 && end - begin == sizeof(mux_cmd) - 1 && std::memcmp(begin, mux_cmd, end - begin) == 0) {
+		cmd.kind = command::kind_type::mux;
+	} else {
+		// The endpoint doesn't point into the buffer, so the command can go; a
+		// hostname does, so it's copied out first
+		cmd.kind = command::kind_type::target;
+		auto target = parser::parse_target(begin, end, cmd.ec);
+		cmd.endpoint = target.endpoint;
+		if (target.has_host()) {
+			cmd.host.assign(target.host_begin, target.host_end);
+		}
+	}
+	
+	m_buf.consume(eol + 1 - begin);
+	return true;
+}
+
+bool client_connection::execute(const command &cmd)
+{
+	switch (cmd.kind) {
+		case command::kind_type::pipeline:
+			pipeline();
+			return true;
 		
-		BOOST_LOG_TRIVIAL(info) << "Command received: " << cmd;
+		case command::kind_type::mux:
+			// The session takes over the socket, and whatever else was received
+			std::allocate_shared<mux_session>(recycling_allocator<mux_session>(), shared_from_this())->start(m_buf);
+			return false;
 		
-		asio::ip::tcp::endpoint endpoint;
-		try {
-			endpoint = parse(cmd);
-			m_cache.async_lookup(endpoint, [=](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
-				if (ec) {
-					// Log the error, but try to proceed anyways; at worst, it'll cause performance
-					// degradation, which is better than ceasing to function
-					BOOST_LOG_TRIVIAL(error) << "Cache error: " << ec;
-				}
-				
-				if (hit) {
-					serve_file(f);
+		case command::kind_type::target:
+			break;
+	}
+	
+	std::size_t seq = m_next_seq++;
+	if (cmd.ec) {
+		BOOST_LOG_TRIVIAL(error) << "Invalid command: " << cmd.ec.message();
+		reject(seq, cmd.ec.message());
+	} else if (!cmd.host.empty()) {
+		resolve(cmd.host, cmd.endpoint.port(), seq);
+	} else {
+		respond(cmd.endpoint, seq);
+	}
+	
+	return true;
+}
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+task client_connection::run(std::shared_ptr<client_connection> self)
+{
+	// Everything from here on runs in the strand
+	co_await async_in_strand<>(m_strand, [this](auto handler) {
+		m_service.post(handler);
+	});
+	
+	for (;;) {
+		command cmd;
+		if (!take_command(cmd)) {
+			if (m_buf.size() == m_buf.max_size()) {
+				BOOST_LOG_TRIVIAL(warning) << "Command too long, giving up on the connection";
+				m_closed = true;
+				co_return;
+			}
+			
+			BOOST_LOG_TRIVIAL(trace) << "Awaiting command...";
+			m_reading = true;
+			auto [ec, size] = co_await async_in_strand<boost::system::error_code, std::size_t>(m_strand, [this](auto handler) {
+				m_socket.async_read_some(m_buf.prepare(m_buf.max_size() - m_buf.size()), handler);
+			});
+			m_reading = false;
+			
+			if (ec) {
+				if (ec == asio::error::eof) {
+					BOOST_LOG_TRIVIAL(info) << "Connection closed";
 				} else {
-					connect_remote(endpoint, f);
+					BOOST_LOG_TRIVIAL(warning) << "Failed to read command: " << ec;
 				}
+				
+				m_closed = true;
+				co_return;
+			}
+			
+			m_buf.commit(size);
+			continue;
+		}
+		
+		// Pipelined and multiplexed connections are left to the callbacks
+		if (cmd.kind != command::kind_type::target) {
+			if (execute(cmd)) {
+				read_command();
+			}
+			co_return;
+		}
+		
+		m_next_seq++;
+		if (cmd.ec) {
+			BOOST_LOG_TRIVIAL(error) << "Invalid command: " << cmd.ec.message();
+			co_await send_error(cmd.ec.message());
+			continue;
+		}
+		
+		if (!cmd.host.empty()) {
+			auto [ec, address] = co_await async_in_strand<boost::system::error_code, asio::ip::address>(m_strand, [&](auto handler) {
+				m_dns.async_resolve(cmd.host, handler);
 			});
-		} catch (std::invalid_argument &e) {
-			BOOST_LOG_TRIVIAL(error) << "Invalid command: " << e.what();
 			
-			std::stringstream msg_s;
-			msg_s << "ERROR: " << e.what() << "\r\n";
-			std::string msg = msg_s.str();
-			async_write(m_socket, asio::buffer(msg), [&, self](const boost::system::error_code &ec, std::size_t size) {
-				if (ec) {
-					BOOST_LOG_TRIVIAL(error) << "Couldn't write error to client: " << ec;
-				}
+			if (ec) {
+				co_await send_error("Couldn't resolve " + cmd.host);
+				continue;
+			}
+			cmd.endpoint.address(address);
+		}
+		
+		co_await serve(cmd.endpoint);
+	}
+}
+
+task client_connection::serve(asio::ip::tcp::endpoint endpoint)
+{
+	std::size_t seq = m_next_seq - 1;
+	
+	auto data = m_memory.find(endpoint);
+	
+	if (!data) {
+		// The fetch writes to the client by itself, like in respond()
+		if (auto remote = asio::use_service<fetch_registry>(m_service).find(endpoint)) {
+			join_fetch(remote, seq);
+			co_return;
+		}
+		
+		auto [hit, ec, f] = co_await async_in_strand<bool, boost::system::error_code, std::shared_ptr<fs_entry>>(m_strand, [&](auto handler) {
+			m_cache.async_lookup(endpoint, handler);
+		});
+		
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Cache error: " << ec;
+		}
+		
+		if (!hit) {
+			connect_remote(endpoint, seq);
+			co_return;
+		}
+		
+		struct stat st;
+		int fd = f->native_handle();
+		if (fd == -1 || ::fstat(fd, &st) != 0 || !m_memory.admits(st.st_size)) {
+			BOOST_LOG_TRIVIAL(info) << "Serving local response";
+			auto responder = std::allocate_shared<file_responder>(recycling_allocator<file_responder>(), m_service, shared_from_this(), f);
+			co_await async_in_strand<boost::system::error_code>(m_strand, [&](auto handler) {
+				responder->start(handler);
 			});
+			co_return;
 		}
 		
-		read_command();
+		BOOST_LOG_TRIVIAL(debug) << "Reading " << f->filename() << " into memory";
+		auto promoted = std::make_shared<std::vector<char>>(st.st_size);
+		auto [read_ec, size] = co_await async_in_strand<boost::system::error_code, std::size_t>(m_strand, [&](auto handler) {
+			async_read(*f, asio::buffer(*promoted), handler);
+		});
+		if (size != promoted->size()) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't read " << f->filename() << ": " << read_ec;
+			fail(seq, "Cache read failed");
+			co_return;
+		}
+		
+		m_memory.insert(endpoint, promoted);
+		data = promoted;
+	}
+	
+	BOOST_LOG_TRIVIAL(info) << "Serving response from memory";
+	auto [ec, size] = co_await async_in_strand<boost::system::error_code, std::size_t>(m_strand, [&](auto handler) {
+		async_write(m_socket, asio::buffer(*data), handler);
 	});
+	if (ec) {
+		BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+	} else {
+		BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
+	}
+}
+
+task client_connection::send_error(std::string msg)
+{
+	// The frame keeps the line alive for the write
+	std::string line = "ERROR: " + msg + "\r\n";
+	auto [ec, size] = co_await async_in_strand<boost::system::error_code, std::size_t>(m_strand, [&](auto handler) {
+		async_write(m_socket, asio::buffer(line), handler);
+	});
+	if (ec) {
+		BOOST_LOG_TRIVIAL(error) << "Couldn't write error to client: " << ec;
+	}
 }
+#endif
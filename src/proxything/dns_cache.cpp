@@ -0,0 +1,189 @@
+#include <proxything/dns_cache.h>
+#include <proxything/util.h>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+
+using namespace proxything;
+
+asio::io_service::id dns_cache::id;
+
+dns_cache::dns_cache(asio::io_service &service, std::chrono::seconds ttl, std::chrono::seconds negative_ttl):
+	asio::io_service::service(service), m_primary(nullptr),
+	m_ttl(ttl), m_negative_ttl(negative_ttl), m_resolver(service)
+{
+	using namespace std::placeholders;
+	m_lookup = std::bind(&dns_cache::system_lookup, this, _1, _2);
+}
+
+dns_cache::dns_cache(asio::io_service &service, dns_cache &primary):
+	asio::io_service::service(service), m_primary(&primary),
+	m_ttl(primary.ttl()), m_negative_ttl(primary.negative_ttl()), m_resolver(service) { }
+
+void dns_cache::async_resolve(const std::string &host, ResolveHandler cb)
+{
+	// Hits are answered from this IO service, misses from the primary's
+	dns_cache &owner = m_primary ? *m_primary : *this;
+	auto now = clock::now();
+	
+	std::unique_lock<std::mutex> lock(owner.m_mutex);
+	
+	auto it = owner.m_entries.find(host);
+	if (it != owner.m_entries.end() && it->second.waiting.empty() && it->second.expires > now) {
+		auto ec = it->second.ec;
+		auto address = it->second.address;
+		lock.unlock();
+		
+		BOOST_LOG_TRIVIAL(trace) << "DNS cache hit: " << host;
+		util::owner(*this).post(std::bind(cb, ec, address));
+		return;
+	}
+	
+	if (it == owner.m_entries.end()) {
+		if (owner.m_entries.size() >= PROXYTHING_DNS_CACHE_SIZE) {
+			owner.sweep(now);
+		}
+		it = owner.m_entries.emplace(host, entry()).first;
+	}
+	
+	// Only the first one to miss looks it up; everyone else waits for it
+	auto &e = it->second;
+	e.waiting.push_back(cb);
+	if (e.waiting.size() > 1) {
+		BOOST_LOG_TRIVIAL(trace) << "Joining DNS lookup in progress: " << host;
+		return;
+	}
+	
+	// set_lookup() may swap it out from under us once we let go of the lock
+	LookupFunction lookup = owner.m_lookup;
+	lock.unlock();
+	
+	BOOST_LOG_TRIVIAL(debug) << "Looking up " << host;
+	lookup(host, [&owner, host](const boost::system::error_code &ec, std::vector<asio::ip::address> addresses, std::chrono::seconds ttl) {
+		owner.complete(host, ec, addresses, ttl);
+	});
+}
+
+void dns_cache::set_lookup(LookupFunction fn)
+{
+	if (m_primary) {
+		m_primary->set_lookup(fn);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lookup = fn;
+}
+
+void dns_cache::clear()
+{
+	if (m_primary) {
+		m_primary->clear();
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		if (it->second.waiting.empty()) {
+			it = m_entries.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+std::size_t dns_cache::size()
+{
+	if (m_primary) {
+		return m_primary->size();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+void dns_cache::system_lookup(const std::string &host, LookupHandler cb)
+{
+	asio::ip::tcp::resolver::query query(host, "");
+	m_resolver.async_resolve(query, [cb](const boost::system::error_code &ec, asio::ip::tcp::resolver::iterator it) {
+		std::vector<asio::ip::address> addresses;
+		for (; it != asio::ip::tcp::resolver::iterator(); ++it) {
+			addresses.push_back(it->endpoint().address());
+		}
+		
+		cb(ec, addresses, std::chrono::seconds(-1));
+	});
+}
+
+void dns_cache::complete(const std::string &host, const boost::system::error_code &ec, const std::vector<asio::ip::address> &addresses, std::chrono::seconds ttl)
+{
+	boost::system::error_code result = ec;
+	if (!result && addresses.empty()) {
+		result = asio::error::host_not_found;
+	}
+	asio::ip::address address = result ? asio::ip::address() : addresses.front();
+	
+	if (result) {
+		BOOST_LOG_TRIVIAL(warning) << "Couldn't resolve " << host << ": " << result.message();
+	} else {
+		BOOST_LOG_TRIVIAL(debug) << "Resolved " << host << " to " << address.to_string();
+	}
+	
+	std::vector<ResolveHandler> waiting;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		auto &e = m_entries[host];
+		e.ec = result;
+		e.address = address;
+		e.expires = clock::now() + (ttl.count() >= 0 ? ttl : result ? m_negative_ttl : m_ttl);
+		waiting.swap(e.waiting);
+	}
+	
+	// Lookup functions may complete right away; never run callbacks inline
+	for (auto &cb : waiting) {
+		util::owner(*this).post(std::bind(cb, result, address));
+	}
+}
+
+void dns_cache::sweep(clock::time_point now)
+{
+	typedef std::unordered_map<std::string, entry>::iterator iterator;
+	
+	std::vector<iterator> idle;
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		if (!it->second.waiting.empty()) {
+			++it;
+		} else if (it->second.expires <= now) {
+			it = m_entries.erase(it);
+		} else {
+			idle.push_back(it++);
+		}
+	}
+	
+	// Still full of live entries; make room by evicting the ones closest to
+	// expiring, which are the oldest ones for their TTL. A whole batch goes
+	// at once, so the next misses don't have to sweep again right away
+	if (m_entries.size() < PROXYTHING_DNS_CACHE_SIZE || idle.empty()) {
+		return;
+	}
+	
+	std::size_t batch = std::max<std::size_t>(PROXYTHING_DNS_CACHE_EVICT_BATCH, 1);
+	std::size_t excess = std::min(m_entries.size() - PROXYTHING_DNS_CACHE_SIZE + batch, idle.size());
+	std::nth_element(idle.begin(), idle.begin() + (excess - 1), idle.end(), [](const iterator &a, const iterator &b) {
+		return a->second.expires < b->second.expires;
+	});
+	for (std::size_t i = 0; i < excess; i++) {
+		m_entries.erase(idle[i]);
+	}
+	
+	BOOST_LOG_TRIVIAL(debug) << "DNS cache full; evicted " << excess << " entries";
+}
+
+void dns_cache::shutdown_service()
+{
+	m_resolver.cancel();
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.clear();
+}
@@ -0,0 +1,65 @@
+#include <proxything/fetch_registry.h>
+#include <proxything/remote_connection.h>
+
+using namespace proxything;
+
+asio::io_service::id fetch_registry::id;
+
+std::shared_ptr<remote_connection> fetch_registry::find(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		return m_primary->find(endpoint);
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_fetches.find(endpoint);
+	return it != m_fetches.end() ? it->second.lock() : nullptr;
+}
+
+std::shared_ptr<remote_connection> fetch_registry::insert(const asio::ip::tcp::endpoint &endpoint, std::shared_ptr<remote_connection> remote)
+{
+	if (m_primary) {
+		return m_primary->insert(endpoint, remote);
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto &slot = m_fetches[endpoint];
+	if (auto existing = slot.lock()) {
+		return existing;
+	}
+	
+	slot = remote;
+	return remote;
+}
+
+void fetch_registry::erase(const asio::ip::tcp::endpoint &endpoint, const remote_connection *remote)
+{
+	if (m_primary) {
+		m_primary->erase(endpoint, remote);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_fetches.find(endpoint);
+	if (it == m_fetches.end()) {
+		return;
+	}
+	
+	auto existing = it->second.lock();
+	if (!existing || existing.get() == remote) {
+		m_fetches.erase(it);
+	}
+}
+
+std::size_t fetch_registry::size()
+{
+	if (m_primary) {
+		return m_primary->size();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_fetches.size();
+}
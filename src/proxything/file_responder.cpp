@@ -1,14 +1,26 @@
 #include <proxything/file_responder.h>
 #include <proxything/client_connection.h>
+#include <proxything/remote_connection.h>
 #include <proxything/fs_entry.h>
+#include <proxything/chunk_pool.h>
+#include <proxything/recycler.h>
 #include <proxything/config.h>
 #include <boost/log/trivial.hpp>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 
 using namespace proxything;
 
-file_responder::file_responder(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> file):
-	m_service(service), m_client(client), m_file(file),
-	m_buf(PROXYTHING_FILE_BUFFER_SIZE)
+file_responder::file_responder(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> file, std::shared_ptr<remote_connection> fill, off_t offset):
+	m_service(service), m_client(client), m_file(file), m_fill(fill),
+	m_framed(false), m_chunk_open(false), m_pool(asio::use_service<chunk_pool>(service)), m_sizer(m_pool),
+	m_start(offset), m_offset(offset)
 {
 	
 }
@@ -18,10 +30,64 @@ file_responder::~file_responder()
 	
 }
 
-void file_responder::start()
+void file_responder::start(DoneHandler cb)
 {
 	BOOST_LOG_TRIVIAL(trace) << "Serving file: " << m_file->filename();
 	
+	m_done = cb;
+	m_framed = m_client->pipelined();
+	
+	// sendfile() takes the offset explicitly, reads need the file put there
+	if (m_offset) {
+		m_file->seek(m_offset);
+	}
+	
+#ifdef __linux__
+	// sendfile() would block the network thread on pages that have to come
+	// from the disk, so files that aren't in the page cache are read instead;
+	// if the first page is, the rest of the file most likely is too
+	if (m_file->native_handle() != -1 && !m_file->resident(m_offset)) {
+		read_async();
+		return;
+	}
+	
+	if (m_file->native_handle() != -1 && !m_framed) {
+		set_cork(true);
+		send_file();
+		return;
+	}
+	
+	// A complete file can be framed as a single chunk, and still be sent
+	// with sendfile(); one that's still growing is framed a read at a time
+	struct stat st;
+	if (m_file->native_handle() != -1 && !m_fill && ::fstat(m_file->native_handle(), &st) == 0) {
+		if (!st.st_size) {
+			finish();
+			return;
+		}
+		
+		std::stringstream header_s;
+		header_s << std::hex << st.st_size << "\r\n";
+		m_header = header_s.str();
+		m_chunk_open = true;
+		
+		set_cork(true);
+		auto self = shared_from_this();
+		m_client->expect_write();
+		async_write(m_client->socket(), asio::buffer(m_header), m_client->strand().wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+			m_client->wrote();
+			if (ec) {
+				BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+				finish(ec);
+				return;
+			}
+			
+			send_file();
+		})));
+		return;
+	}
+#endif
+	
 	read_and_deliver();
 }
 
@@ -30,38 +96,242 @@ void file_responder::read_and_deliver()
 	BOOST_LOG_TRIVIAL(debug) << "Reading from file...";
 	
 	auto self = shared_from_this();
+	acquire_chunk([this, self]{
+		// Data that's in the page cache can be read right here; only reads
+		// that would have to wait for the disk go through fs_service
+		boost::system::error_code ec;
+		std::size_t size = m_file->read_some_nowait(asio::buffer(m_chunk->data(), m_sizer.size()), ec);
+		if (ec != asio::error::would_block) {
+			deliver(ec, size);
+			return;
+		}
+		
+		read_async();
+	});
+}
+
+void file_responder::read_async()
+{
+	auto self = shared_from_this();
+	acquire_chunk([this, self]{
+		async_read(*m_file, asio::buffer(m_chunk->data(), m_sizer.size()), m_client->strand().wrap([this, self](const boost::system::error_code &ec, std::size_t size) {
+			deliver(ec, size);
+		}));
+	});
+}
+
+void file_responder::acquire_chunk(std::function<void()> next)
+{
+	if (m_chunk) {
+		next();
+		return;
+	}
 	
-	async_read(*m_file, m_buf, [this, self](const boost::system::error_code &ec, std::size_t size) {
-		if (ec) {
-			if (ec == asio::error::eof) {
-				BOOST_LOG_TRIVIAL(debug) << "Hit the end of the file";
-			} else {
-				BOOST_LOG_TRIVIAL(error) << "Couldn't read from remote: " << ec;
-			}
+	m_chunk = m_pool.try_acquire(m_sizer.size());
+	if (m_chunk) {
+		next();
+		return;
+	}
+	
+	// Reads from cache files count towards the same budget as fills do, so
+	// a burst of hits can't run the server out of memory either
+	BOOST_LOG_TRIVIAL(trace) << "Buffer budget used up, waiting...";
+	auto self = shared_from_this();
+	m_pool.async_acquire(m_sizer.size(), m_client->strand().wrap([this, self, next](chunk_pool::chunk_ptr chunk) {
+		m_chunk = chunk;
+		next();
+	}));
+}
+
+void file_responder::deliver(const boost::system::error_code &ec, std::size_t size)
+{
+	auto self = shared_from_this();
+	
+	if (ec) {
+		if (ec == asio::error::eof) {
+			BOOST_LOG_TRIVIAL(debug) << "Hit the end of the file";
+		} else {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't read from file: " << ec;
 		}
+	}
+	
+	BOOST_LOG_TRIVIAL(trace) << "Read " << size << " bytes";
+	
+	// The chunk's only held on to while there's data in it to send
+	if (!size) {
+		m_chunk = nullptr;
+	}
+	
+	if (ec == asio::error::eof && !size && m_fill) {
+		wait_for_fill([this, self]{ read_and_deliver(); });
+	} else if (size) {
+		m_offset += size;
 		
-		BOOST_LOG_TRIVIAL(trace) << "Read " << size << " bytes";
-		BOOST_LOG_TRIVIAL(trace) << "Buffer size: " << m_buf.size();
+		// Reads that keep filling the buffer get bigger ones, and so do the
+		// writes they're sent in
+		m_sizer.update(size);
 		
-		if (size) {
-			async_write(m_client->socket(), m_buf, [this, self](const boost::system::error_code &ec, std::size_t size) {
-				if (ec) {
-					if (ec == asio::error::eof) {
-						BOOST_LOG_TRIVIAL(debug) << "Client connection closed during write";
-					} else {
-						BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
-					}
+		// Frame each read as a chunk, unless already inside one
+		static const std::string chunk_end = "\r\n";
+		std::vector<asio::const_buffer> buffers;
+		if (m_framed && !m_chunk_open) {
+			std::stringstream header_s;
+			header_s << std::hex << size << "\r\n";
+			m_header = header_s.str();
+			buffers.push_back(asio::buffer(m_header));
+		}
+		buffers.push_back(m_chunk->buffer(size));
+		if (m_framed && !m_chunk_open) {
+			buffers.push_back(asio::buffer(chunk_end));
+		}
+		
+		m_client->expect_write();
+		async_write(m_client->socket(), buffers, m_client->strand().wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+			m_client->wrote();
+			m_chunk = nullptr;
+			if (ec) {
+				if (ec == asio::error::eof) {
+					BOOST_LOG_TRIVIAL(debug) << "Client connection closed during write";
+				} else {
+					BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
 				}
 				
-				BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
-				BOOST_LOG_TRIVIAL(trace) << "Buffer size: " << m_buf.size();
-				
-				if (!ec) {
-					read_and_deliver();
-				}
-			});
-		} else if (!ec) {
+				finish(ec);
+				return;
+			}
+			
+			BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
+			read_and_deliver();
+		})));
+	} else if (!ec) {
+		read_and_deliver();
+	} else if (ec == asio::error::eof) {
+		finish();
+	} else {
+		finish(ec);
+	}
+}
+
+void file_responder::send_file()
+{
+#ifdef __linux__
+	auto self = shared_from_this();
+	auto &socket = m_client->socket();
+	
+	boost::system::error_code ec;
+	socket.non_blocking(true, ec);
+	
+	ssize_t res;
+	do {
+		res = ::sendfile(socket.native_handle(), m_file->native_handle(), &m_offset, PROXYTHING_SENDFILE_CHUNK_SIZE);
+	} while (res == -1 && errno == EINTR);
+	
+	if (res == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		if ((errno == EINVAL || errno == ENOSYS) && m_offset == m_start) {
+			// The file (or the filesystem it's on) doesn't support it
+			BOOST_LOG_TRIVIAL(debug) << "sendfile() unsupported, falling back to reading";
+			set_cork(false);
 			read_and_deliver();
+		} else {
+			boost::system::error_code ec(errno, boost::system::generic_category());
+			BOOST_LOG_TRIVIAL(error) << "Couldn't send file: " << ec;
+			set_cork(false);
+			finish(ec);
 		}
-	});
+		return;
+	}
+	
+	if (res == 0) {
+		BOOST_LOG_TRIVIAL(debug) << "Hit the end of the file";
+		set_cork(false);
+		if (m_fill) {
+			wait_for_fill([this, self]{ set_cork(true); send_file(); });
+		} else {
+			finish();
+		}
+		return;
+	}
+	
+	if (res > 0) {
+		BOOST_LOG_TRIVIAL(trace) << "Sent " << res << " bytes";
+	}
+	
+	// Wait for the socket to become writable again; this also yields to other
+	// connections between chunks
+	m_client->expect_write();
+	socket.async_write_some(asio::null_buffers(), m_client->strand().wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+		m_client->wrote();
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+			finish(ec);
+			return;
+		}
+		
+		send_file();
+	})));
+#endif
+}
+
+void file_responder::wait_for_fill(std::function<void()> resume)
+{
+	BOOST_LOG_TRIVIAL(trace) << "Waiting for the fill to write more...";
+	
+	// The fill may belong to another core's IO service; resume on this one,
+	// in the client's strand
+	auto self = shared_from_this();
+	m_fill->async_wait(m_offset, m_client->strand().wrap([this, self, resume](const boost::system::error_code &ec, std::size_t available, bool done) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Fill failed: " << ec;
+			finish(ec);
+			return;
+		}
+		
+		if (available > static_cast<std::size_t>(m_offset)) {
+			resume();
+		} else {
+			BOOST_LOG_TRIVIAL(debug) << "Fill committed";
+			finish();
+		}
+	}));
+}
+
+void file_responder::finish(const boost::system::error_code &ec)
+{
+	auto self = shared_from_this();
+	auto done = [this, self, ec](const boost::system::error_code &write_ec, std::size_t size) {
+		if (m_done) {
+			m_done(ec);
+		}
+	};
+	
+	if (!ec) {
+		static const std::string end = "0\r\n\r\n";
+		static const std::string chunk_end_and_end = "\r\n0\r\n\r\n";
+		if (m_framed) {
+			async_write(m_client->socket(), asio::buffer(m_chunk_open ? chunk_end_and_end : end), m_client->strand().wrap(recycle(done)));
+		} else {
+			done(ec, 0);
+		}
+		return;
+	}
+	
+	if (m_framed && !m_chunk_open) {
+		// Between chunks, the error can be framed like any other
+		m_header = "ERROR: " + ec.message() + "\r\n";
+		async_write(m_client->socket(), asio::buffer(m_header), m_client->strand().wrap(recycle(done)));
+	} else {
+		// Cut the client off, rather than let it take a truncated response
+		// for a complete one
+		boost::system::error_code ignored;
+		m_client->socket().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+		done(ec, 0);
+	}
+}
+
+void file_responder::set_cork(bool cork)
+{
+#ifdef __linux__
+	int val = cork ? 1 : 0;
+	::setsockopt(m_client->socket().native_handle(), IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+#endif
 }
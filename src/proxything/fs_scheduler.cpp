@@ -0,0 +1,249 @@
+#include <proxything/impl/fs_scheduler.h>
+#include <proxything/config.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace proxything::impl;
+
+namespace
+{
+	/// Virtual time a class with a weight of 1 advances by per operation
+	const std::uint64_t stride_base = 1 << 20;
+}
+
+const std::size_t fs_scheduler::num_classes;
+const std::size_t fs_scheduler::histogram::num_buckets;
+
+void fs_scheduler::histogram::record(clock_type::duration latency)
+{
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+	std::size_t i = 0;
+	while (us > 0 && i < num_buckets - 1) {
+		us >>= 1;
+		i++;
+	}
+	
+	m_buckets[i]++;
+	m_count++;
+}
+
+void fs_scheduler::histogram::merge(const histogram &other)
+{
+	for (std::size_t i = 0; i < num_buckets; i++) {
+		m_buckets[i] += other.m_buckets[i];
+	}
+	m_count += other.m_count;
+}
+
+std::chrono::microseconds fs_scheduler::histogram::percentile(double q) const
+{
+	if (!m_count) {
+		return std::chrono::microseconds(0);
+	}
+	
+	std::size_t target = std::max<std::size_t>(std::ceil(q * m_count), 1);
+	std::size_t seen = 0;
+	std::size_t i = 0;
+	for (; i < num_buckets - 1; i++) {
+		seen += m_buckets[i];
+		if (seen >= target) {
+			break;
+		}
+	}
+	
+	return std::chrono::microseconds(std::int64_t(1) << i);
+}
+
+fs_scheduler::fs_scheduler(std::size_t slots):
+	m_slots(std::max<std::size_t>(slots, 1)), m_in_flight(0), m_vtime(0), m_draining(false), m_pumping(false)
+{
+	auto &foreground = m_classes[static_cast<std::size_t>(io_class::foreground)];
+	foreground.weight = PROXYTHING_FS_FOREGROUND_WEIGHT;
+	foreground.depth = m_slots;
+	
+	auto &background = m_classes[static_cast<std::size_t>(io_class::background)];
+	background.weight = PROXYTHING_FS_BACKGROUND_WEIGHT;
+	background.depth = PROXYTHING_FS_BACKGROUND_DEPTH;
+	background.queue_limit = PROXYTHING_FS_BACKGROUND_QUEUE_LIMIT;
+	
+	auto &maintenance = m_classes[static_cast<std::size_t>(io_class::maintenance)];
+	maintenance.weight = PROXYTHING_FS_MAINTENANCE_WEIGHT;
+	maintenance.depth = PROXYTHING_FS_MAINTENANCE_DEPTH;
+	maintenance.queue_limit = PROXYTHING_FS_MAINTENANCE_QUEUE_LIMIT;
+}
+
+void fs_scheduler::set_weight(io_class cls, unsigned int weight)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_classes[static_cast<std::size_t>(cls)].weight = std::max(weight, 1u);
+}
+
+unsigned int fs_scheduler::weight(io_class cls)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_classes[static_cast<std::size_t>(cls)].weight;
+}
+
+void fs_scheduler::set_depth(io_class cls, std::size_t depth)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_classes[static_cast<std::size_t>(cls)].depth = std::max<std::size_t>(depth, 1);
+	
+	// A raised limit may let more through right away
+	pump(lock);
+}
+
+std::size_t fs_scheduler::depth(io_class cls)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_classes[static_cast<std::size_t>(cls)].depth;
+}
+
+void fs_scheduler::set_queue_limit(io_class cls, std::size_t limit)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_classes[static_cast<std::size_t>(cls)].queue_limit = limit;
+}
+
+std::size_t fs_scheduler::queue_limit(io_class cls)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_classes[static_cast<std::size_t>(cls)].queue_limit;
+}
+
+bool fs_scheduler::backlogged(io_class cls)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto &c = m_classes[static_cast<std::size_t>(cls)];
+	return c.queue_limit && c.stats.queued >= c.queue_limit;
+}
+
+void fs_scheduler::submit(task *t)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	
+	auto &c = m_classes[static_cast<std::size_t>(t->cls)];
+	
+	// Still queued; whoever's submitting them should've held back by now
+	if (c.queue_limit && c.stats.queued >= c.queue_limit) {
+		c.stats.over_limit++;
+	}
+	
+	// A class that's been idle picks up from the current virtual time, rather
+	// than catch up on the turns it didn't need
+	if (!c.head && !c.stats.in_flight) {
+		c.pass = std::max(c.pass, m_vtime);
+	}
+	
+	t->next = nullptr;
+	t->queued = clock_type::now();
+	if (c.tail) {
+		c.tail->next = t;
+	} else {
+		c.head = t;
+	}
+	c.tail = t;
+	c.stats.queued++;
+	
+	pump(lock);
+}
+
+void fs_scheduler::finish(io_class cls)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	
+	auto &c = m_classes[static_cast<std::size_t>(cls)];
+	c.stats.in_flight--;
+	c.stats.completed++;
+	m_in_flight--;
+	
+	pump(lock);
+}
+
+void fs_scheduler::drain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_draining = true;
+	pump(lock);
+}
+
+fs_scheduler::class_stats fs_scheduler::stats(io_class cls)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_classes[static_cast<std::size_t>(cls)].stats;
+}
+
+const char* fs_scheduler::name(io_class cls)
+{
+	switch (cls) {
+		case io_class::foreground:
+			return "foreground";
+		case io_class::background:
+			return "background";
+		case io_class::maintenance:
+			return "maintenance";
+	}
+	return "unknown";
+}
+
+fs_scheduler::task* fs_scheduler::pick(clock_type::time_point now)
+{
+	// The class furthest behind on its share goes next; ties go to the more
+	// important one
+	class_queue *next = nullptr;
+	for (auto &c : m_classes) {
+		if (!c.head || (!m_draining && c.stats.in_flight >= c.depth)) {
+			continue;
+		}
+		if (!next || c.pass < next->pass) {
+			next = &c;
+		}
+	}
+	
+	if (!next) {
+		return nullptr;
+	}
+	
+	m_vtime = next->pass;
+	next->pass += stride_base / next->weight;
+	
+	task *t = next->head;
+	next->head = t->next;
+	if (!next->head) {
+		next->tail = nullptr;
+	}
+	
+	next->stats.queued--;
+	next->stats.in_flight++;
+	next->stats.latency.record(now - t->queued);
+	m_in_flight++;
+	
+	return t;
+}
+
+void fs_scheduler::pump(std::unique_lock<std::mutex> &lock)
+{
+	// Whoever's already starting tasks picks up whatever this made startable,
+	// so they're all started in the order they're picked
+	if (m_pumping) {
+		lock.unlock();
+		return;
+	}
+	m_pumping = true;
+	
+	// Start tasks without holding the lock; starting one may well finish
+	// another, or submit one, from another thread
+	while (m_draining || m_in_flight < m_slots) {
+		task *t = pick(clock_type::now());
+		if (!t) {
+			break;
+		}
+		
+		lock.unlock();
+		t->start(t);
+		lock.lock();
+	}
+	
+	m_pumping = false;
+	lock.unlock();
+}
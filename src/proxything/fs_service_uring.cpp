@@ -0,0 +1,633 @@
+#ifdef PROXYTHING_HAVE_IO_URING
+
+#include <proxything/impl/fs_service_uring.h>
+#include <proxything/config.h>
+#include <proxything/util.h>
+#include <boost/log/trivial.hpp>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <algorithm>
+
+using namespace proxything;
+using namespace proxything::impl;
+
+namespace
+{
+	int io_uring_setup(unsigned entries, io_uring_params *p)
+	{
+		return syscall(__NR_io_uring_setup, entries, p);
+	}
+	
+	int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+	}
+	
+	int io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+	{
+		return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+	}
+	
+	boost::system::error_code errno_code(int err = errno)
+	{
+		return boost::system::error_code(err, boost::system::generic_category());
+	}
+	
+	/// Opcodes that must be supported for us to be usable at all
+	const int required_ops[] = {
+		IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_READ_FIXED,
+		IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT,
+	};
+}
+
+fs_service_uring::fs_service_uring(asio::io_service &service):
+	m_service(service), m_eventfd(service), m_eventfd_value(0),
+	m_ring_fd(-1), m_sq_ptr(MAP_FAILED), m_sq_size(0), m_cq_ptr(MAP_FAILED), m_cq_size(0),
+	m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), m_sqes_size(0),
+	m_armed(false), m_inflight(0)
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	m_ring_fd = io_uring_setup(PROXYTHING_URING_ENTRIES, &p);
+	if (m_ring_fd == -1) {
+		throw boost::system::system_error(errno_code(), "io_uring_setup");
+	}
+	
+	// Map the rings; newer kernels let us do it with a single mmap()
+	m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+	}
+	
+	m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+	if (m_sq_ptr == MAP_FAILED) {
+		auto ec = errno_code();
+		close_ring();
+		throw boost::system::system_error(ec, "mmap (SQ)");
+	}
+	
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cq_ptr = m_sq_ptr;
+	} else {
+		m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+		if (m_cq_ptr == MAP_FAILED) {
+			auto ec = errno_code();
+			close_ring();
+			throw boost::system::system_error(ec, "mmap (CQ)");
+		}
+	}
+	
+	m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_ring_fd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED) {
+		auto ec = errno_code();
+		close_ring();
+		throw boost::system::system_error(ec, "mmap (SQEs)");
+	}
+	
+	char *sq = static_cast<char*>(m_sq_ptr);
+	m_sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	m_sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	m_sq_flags = reinterpret_cast<unsigned*>(sq + p.sq_off.flags);
+	m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	
+	char *cq = static_cast<char*>(m_cq_ptr);
+	m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	m_cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+	
+	// Completions are signalled through an eventfd, which the parent service
+	// can wait on like any other descriptor
+	int efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+	if (efd == -1) {
+		auto ec = errno_code();
+		close_ring();
+		throw boost::system::system_error(ec, "eventfd");
+	}
+	m_eventfd.assign(efd);
+	if (io_uring_register(m_ring_fd, IORING_REGISTER_EVENTFD, &efd, 1) == -1) {
+		auto ec = errno_code();
+		close_ring();
+		throw boost::system::system_error(ec, "IORING_REGISTER_EVENTFD");
+	}
+	
+	// Register a sparse file table, which open files are slotted into. This
+	// is an optimization, so failures just mean we use plain descriptors.
+	std::vector<int> files(PROXYTHING_URING_FILES, -1);
+	if (io_uring_register(m_ring_fd, IORING_REGISTER_FILES, files.data(), files.size()) == 0) {
+		for (int i = files.size() - 1; i >= 0; i--) {
+			m_free_files.push_back(i);
+		}
+	}
+	
+	// Same goes for the fixed buffer area, which can run into RLIMIT_MEMLOCK
+	m_buffers.resize(PROXYTHING_URING_BUFFERS * PROXYTHING_URING_BUFFER_SIZE);
+	iovec area = { m_buffers.data(), m_buffers.size() };
+	if (io_uring_register(m_ring_fd, IORING_REGISTER_BUFFERS, &area, 1) == 0) {
+		for (int i = PROXYTHING_URING_BUFFERS - 1; i >= 0; i--) {
+			m_free_buffers.push_back(m_buffers.data() + i * PROXYTHING_URING_BUFFER_SIZE);
+		}
+	} else {
+		m_buffers.clear();
+		m_buffers.shrink_to_fit();
+	}
+}
+
+fs_service_uring::~fs_service_uring()
+{
+	for (auto &parked : m_backlog) {
+		delete parked.second;
+	}
+	for (auto &failed : m_failed) {
+		delete failed.first;
+	}
+	
+	close_ring();
+}
+
+void fs_service_uring::close_ring()
+{
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqes_size);
+		m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	}
+	if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr) {
+		munmap(m_cq_ptr, m_cq_size);
+	}
+	m_cq_ptr = MAP_FAILED;
+	if (m_sq_ptr != MAP_FAILED) {
+		munmap(m_sq_ptr, m_sq_size);
+		m_sq_ptr = MAP_FAILED;
+	}
+	if (m_ring_fd != -1) {
+		::close(m_ring_fd);
+		m_ring_fd = -1;
+	}
+}
+
+bool fs_service_uring::supported()
+{
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	int fd = io_uring_setup(1, &p);
+	if (fd == -1) {
+		return false;
+	}
+	
+	// Ask the kernel which opcodes it knows about
+	std::size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::vector<char> probe_buf(probe_size, 0);
+	auto probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+	bool ok = io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+	::close(fd);
+	
+	if (ok) {
+		for (int op : required_ops) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+				ok = false;
+			}
+		}
+	}
+	
+	return ok;
+}
+
+void fs_service_uring::destroy(asio::io_service &service, implementation_type &impl)
+{
+	if (impl.slot != -1) {
+		unregister_file(impl.slot);
+		impl.slot = -1;
+	}
+	if (impl.fd != -1) {
+		::close(impl.fd);
+		impl.fd = -1;
+	}
+}
+
+void fs_service_uring::async_open(asio::io_service &service, implementation_type &impl, const std::string &filename, std::ios_base::openmode mode, bool atomic, std::function<void(const boost::system::error_code &ec)> cb)
+{
+	enqueue(impl, [this, &impl, filename, atomic, mode, cb]{
+		impl.filename = filename;
+		impl.atomic = atomic;
+		impl.offset = 0;
+		
+		if (impl.atomic) {
+			impl.temp_filename = util::tmp_path();
+		}
+		
+		// The path needs to stay alive until the operation completes
+		auto path = std::make_shared<std::string>(!impl.atomic ? impl.filename : impl.temp_filename);
+		submit([=](io_uring_sqe &sqe) {
+			sqe.opcode = IORING_OP_OPENAT;
+			sqe.fd = AT_FDCWD;
+			sqe.addr = reinterpret_cast<uint64_t>(path->c_str());
+			sqe.len = 0666;
+			sqe.open_flags = util::open_flags(mode);
+		}, [this, &impl, path, mode, cb](int res) {
+			(void)path;
+			
+			boost::system::error_code ec;
+			if (res < 0) {
+				ec = errno_code(-res);
+			} else {
+				impl.fd = res;
+				impl.slot = register_file(impl.fd);
+				if (mode & std::ios_base::ate) {
+					impl.offset = ::lseek(impl.fd, 0, SEEK_END);
+				}
+			}
+			
+			finish(impl);
+			cb(ec);
+		});
+	});
+}
+
+void fs_service_uring::async_close(asio::io_service &service, implementation_type &impl, std::function<void(const boost::system::error_code &ec)> cb)
+{
+	close(impl, true, cb);
+}
+
+void fs_service_uring::async_discard(asio::io_service &service, implementation_type &impl, std::function<void(const boost::system::error_code &ec)> cb)
+{
+	close(impl, false, cb);
+}
+
+void fs_service_uring::close(implementation_type &impl, bool keep, std::function<void(const boost::system::error_code &ec)> cb)
+{
+	enqueue(impl, [this, &impl, keep, cb]{
+		// Commits (or drops) an atomic write, once the descriptor is closed;
+		// one that fails to close is dropped too, so the temporary file
+		// doesn't outlive it
+		auto commit = [this, &impl, keep, cb](boost::system::error_code ec) {
+			if (!impl.atomic) {
+				finish(impl);
+				cb(ec);
+				return;
+			}
+			
+			bool rename = keep && !ec;
+			auto from = std::make_shared<std::string>(impl.temp_filename);
+			auto to = std::make_shared<std::string>(impl.filename);
+			submit([=](io_uring_sqe &sqe) {
+				if (rename) {
+					sqe.opcode = IORING_OP_RENAMEAT;
+					sqe.fd = AT_FDCWD;
+					sqe.addr = reinterpret_cast<uint64_t>(from->c_str());
+					sqe.len = AT_FDCWD;
+					sqe.addr2 = reinterpret_cast<uint64_t>(to->c_str());
+				} else {
+					sqe.opcode = IORING_OP_UNLINKAT;
+					sqe.fd = AT_FDCWD;
+					sqe.addr = reinterpret_cast<uint64_t>(from->c_str());
+				}
+			}, [this, &impl, from, to, rename, ec, cb](int res) {
+				(void)to;
+				
+				// A failed close is what's reported, whether or not the
+				// temporary file could be removed after it
+				boost::system::error_code result = ec;
+				if (res < 0 && !result) {
+					result = errno_code(-res);
+				}
+				
+				// A rename that failed leaves it behind as well; this is rare
+				// enough not to bother with the ring for
+				if (res < 0 && rename) {
+					::unlink(from->c_str());
+				}
+				
+				finish(impl);
+				cb(result);
+			});
+		};
+		
+		if (impl.fd == -1) {
+			commit(boost::system::error_code());
+			return;
+		}
+		
+		if (impl.slot != -1) {
+			unregister_file(impl.slot);
+			impl.slot = -1;
+		}
+		
+		int fd = impl.fd;
+		impl.fd = -1;
+		submit([=](io_uring_sqe &sqe) {
+			sqe.opcode = IORING_OP_CLOSE;
+			sqe.fd = fd;
+		}, [=](int res) {
+			commit(res < 0 ? errno_code(-res) : boost::system::error_code());
+		});
+	});
+}
+
+void fs_service_uring::async_remove(asio::io_service &service, const std::string &filename, std::function<void(const boost::system::error_code &ec)> cb)
+{
+	// The path needs to stay alive until the operation completes
+	auto path = std::make_shared<std::string>(filename);
+	submit([=](io_uring_sqe &sqe) {
+		sqe.opcode = IORING_OP_UNLINKAT;
+		sqe.fd = AT_FDCWD;
+		sqe.addr = reinterpret_cast<uint64_t>(path->c_str());
+	}, [=](int res) {
+		(void)path;
+		cb(res < 0 ? errno_code(-res) : boost::system::error_code());
+	});
+}
+
+asio::mutable_buffer fs_service_uring::allocate_buffer(std::size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	if (size > PROXYTHING_URING_BUFFER_SIZE || m_free_buffers.empty()) {
+		return asio::mutable_buffer();
+	}
+	
+	char *data = m_free_buffers.back();
+	m_free_buffers.pop_back();
+	return asio::mutable_buffer(data, size);
+}
+
+bool fs_service_uring::deallocate_buffer(asio::mutable_buffer buf)
+{
+	char *data = asio::buffer_cast<char*>(buf);
+	if (m_buffers.empty() || data < m_buffers.data() || data >= m_buffers.data() + m_buffers.size()) {
+		return false;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_free_buffers.push_back(data);
+	return true;
+}
+
+void fs_service_uring::async_rw(implementation_type &impl, bool read, std::vector<iovec> iov, std::function<void(const boost::system::error_code &ec, std::size_t size)> cb)
+{
+	auto iov_ptr = std::make_shared<std::vector<iovec>>(std::move(iov));
+	enqueue(impl, [this, &impl, read, iov_ptr, cb]{
+		std::size_t total = 0;
+		for (auto &v : *iov_ptr) {
+			total += v.iov_len;
+		}
+		
+		// A single buffer in the registered area can be read into directly
+		char *base = static_cast<char*>(iov_ptr->empty() ? nullptr : (*iov_ptr)[0].iov_base);
+		bool fixed = read && iov_ptr->size() == 1 && !m_buffers.empty() &&
+			base >= m_buffers.data() && base + total <= m_buffers.data() + m_buffers.size();
+		
+		int fd = impl.slot != -1 ? impl.slot : impl.fd;
+		bool fixed_file = impl.slot != -1;
+		off_t offset = impl.offset;
+		submit([=](io_uring_sqe &sqe) {
+			if (fixed) {
+				sqe.opcode = IORING_OP_READ_FIXED;
+				sqe.addr = reinterpret_cast<uint64_t>(base);
+				sqe.len = total;
+				sqe.buf_index = 0;
+			} else {
+				sqe.opcode = read ? IORING_OP_READV : IORING_OP_WRITEV;
+				sqe.addr = reinterpret_cast<uint64_t>(iov_ptr->data());
+				sqe.len = iov_ptr->size();
+			}
+			sqe.fd = fd;
+			sqe.off = offset;
+			if (fixed_file) {
+				sqe.flags |= IOSQE_FIXED_FILE;
+			}
+		}, [this, &impl, read, total, iov_ptr, cb](int res) {
+			(void)iov_ptr;
+			
+			boost::system::error_code ec;
+			std::size_t size = 0;
+			if (res < 0) {
+				ec = errno_code(-res);
+			} else if (read && res == 0 && total > 0) {
+				ec = asio::error::eof;
+			} else {
+				size = res;
+				impl.offset += res;
+			}
+			
+			finish(impl);
+			cb(ec, size);
+		});
+	});
+}
+
+void fs_service_uring::enqueue(implementation_type &impl, std::function<void()> start)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (impl.busy) {
+			impl.queue.push_back(start);
+			return;
+		}
+		impl.busy = true;
+	}
+	
+	start();
+}
+
+void fs_service_uring::finish(implementation_type &impl)
+{
+	std::function<void()> next;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (impl.queue.empty()) {
+			impl.busy = false;
+			return;
+		}
+		next = std::move(impl.queue.front());
+		impl.queue.pop_front();
+	}
+	
+	next();
+}
+
+void fs_service_uring::submit(std::function<void(io_uring_sqe &sqe)> prep, CompletionHandler cb)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	// Everything goes through the backlog, so SQEs stay in order; never wait
+	// for room in the ring here, only reap() can make some
+	m_backlog.emplace_back(std::move(prep), new CompletionHandler(std::move(cb)));
+	++m_inflight;
+	
+	flush();
+	arm();
+}
+
+void fs_service_uring::flush()
+{
+	for (;;) {
+		// Move parked SQEs into the ring, as far as there's room
+		unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+		unsigned tail = *m_sq_tail;
+		for (; !m_backlog.empty() && tail - head <= *m_sq_mask; ++tail) {
+			unsigned index = tail & *m_sq_mask;
+			io_uring_sqe &sqe = m_sqes[index];
+			std::memset(&sqe, 0, sizeof(sqe));
+			m_backlog.front().first(sqe);
+			sqe.user_data = reinterpret_cast<uint64_t>(m_backlog.front().second);
+			m_sq_array[index] = index;
+			m_backlog.pop_front();
+		}
+		__atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+		
+		unsigned pending = tail - head;
+		if (pending == 0) {
+			return;
+		}
+		
+		int res = io_uring_enter(m_ring_fd, pending, 0, 0);
+		if (res > 0) {
+			// Consumed entries made room for more parked ones
+			continue;
+		}
+		
+		int err = res == 0 ? EAGAIN : errno;
+		if (err == EINTR) {
+			continue;
+		}
+		
+		// The kernel is out of room for completions (EBUSY) or memory (EAGAIN);
+		// if anything it already has completes, reap() will try again
+		std::size_t submitted = m_inflight - m_failed.size() - m_backlog.size() - pending;
+		if ((err == EBUSY || err == EAGAIN) && submitted > 0) {
+			return;
+		}
+		
+		fail(err);
+		return;
+	}
+}
+
+void fs_service_uring::fail(int err)
+{
+	// Take back whatever the kernel hasn't consumed; it only looks at the
+	// tail when we enter the ring, so it never saw them
+	unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *m_sq_tail;
+	for (unsigned i = head; i != tail; ++i) {
+		io_uring_sqe &sqe = m_sqes[m_sq_array[i & *m_sq_mask]];
+		m_failed.emplace_back(reinterpret_cast<CompletionHandler*>(sqe.user_data), -err);
+	}
+	__atomic_store_n(m_sq_tail, head, __ATOMIC_RELEASE);
+	
+	for (auto &parked : m_backlog) {
+		m_failed.emplace_back(parked.second, -err);
+	}
+	m_backlog.clear();
+	
+	BOOST_LOG_TRIVIAL(warning) << "Couldn't submit " << m_failed.size() << " disk operations: " << errno_code(err).message();
+	
+	// Have reap() call them from the parent service, like any completion
+	::eventfd_write(m_eventfd.native_handle(), 1);
+}
+
+void fs_service_uring::arm()
+{
+	if (m_armed || m_inflight == 0) {
+		return;
+	}
+	
+	// Only wait while there's something to wait for, or the parent service
+	// would never run out of work
+	m_armed = true;
+	m_eventfd.async_read_some(asio::buffer(&m_eventfd_value, sizeof(m_eventfd_value)), [this](const boost::system::error_code &ec, std::size_t size) {
+		if (ec == asio::error::operation_aborted) {
+			return;
+		}
+		reap();
+	});
+}
+
+void fs_service_uring::reap()
+{
+	std::vector<std::pair<CompletionHandler*, int>> done;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		done.swap(m_failed);
+		
+		for (;;) {
+			unsigned head = *m_cq_head;
+			unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head) {
+				io_uring_cqe &cqe = m_cqes[head & *m_cq_mask];
+				done.emplace_back(reinterpret_cast<CompletionHandler*>(cqe.user_data), cqe.res);
+			}
+			__atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+			
+			// Completions that didn't fit in the CQ are held by the kernel, which
+			// only hands them over (without signalling again) when asked to
+			if (!(__atomic_load_n(m_sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+				break;
+			}
+			while (io_uring_enter(m_ring_fd, 0, 0, IORING_ENTER_GETEVENTS) == -1 && errno == EINTR);
+		}
+		
+		m_inflight -= done.size();
+		
+		// Anything parked or refused while the CQ was full can go in now
+		flush();
+		
+		m_armed = false;
+		arm();
+	}
+	
+	// Handlers may submit more work, so call them without holding the lock
+	for (auto &pair : done) {
+		std::unique_ptr<CompletionHandler> cb(pair.first);
+		(*cb)(pair.second);
+	}
+}
+
+int fs_service_uring::register_file(int fd)
+{
+	int slot;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free_files.empty()) {
+			return -1;
+		}
+		slot = m_free_files.back();
+		m_free_files.pop_back();
+	}
+	
+	io_uring_files_update update;
+	std::memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds = reinterpret_cast<uint64_t>(&fd);
+	if (io_uring_register(m_ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_free_files.push_back(slot);
+		return -1;
+	}
+	
+	return slot;
+}
+
+void fs_service_uring::unregister_file(int slot)
+{
+	int fd = -1;
+	io_uring_files_update update;
+	std::memset(&update, 0, sizeof(update));
+	update.offset = slot;
+	update.fds = reinterpret_cast<uint64_t>(&fd);
+	io_uring_register(m_ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_free_files.push_back(slot);
+}
+
+#endif
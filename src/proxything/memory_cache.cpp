@@ -0,0 +1,181 @@
+#include <proxything/memory_cache.h>
+#include <algorithm>
+
+using namespace proxything;
+
+asio::io_service::id memory_cache::id;
+
+memory_cache::memory_cache(asio::io_service &service, std::size_t capacity):
+	asio::io_service::service(service), m_capacity(capacity), m_primary(nullptr),
+	m_small_size(0), m_main_size(0), m_ghost_seq(0) { }
+
+memory_cache::memory_cache(asio::io_service &service, memory_cache &primary):
+	asio::io_service::service(service), m_capacity(primary.capacity()), m_primary(&primary),
+	m_small_size(0), m_main_size(0), m_ghost_seq(0) { }
+
+memory_cache::buffer_ptr memory_cache::find(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		return m_primary->find(endpoint);
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(endpoint);
+	if (it == m_index.end()) {
+		return nullptr;
+	}
+	
+	auto &e = *it->second;
+	if (e.freq < 3) {
+		e.freq++;
+	}
+	
+	return e.data;
+}
+
+bool memory_cache::insert(const asio::ip::tcp::endpoint &endpoint, buffer_ptr data)
+{
+	if (m_primary) {
+		return m_primary->insert(endpoint, data);
+	}
+	
+	if (!admits(data->size())) {
+		erase(endpoint);
+		return false;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(endpoint);
+	if (it != m_index.end()) {
+		// Replace the data, but keep its place in the queues
+		auto &e = *it->second;
+		std::size_t &queue_size = e.main ? m_main_size : m_small_size;
+		queue_size = queue_size - e.data->size() + data->size();
+		e.data = data;
+	} else {
+		entry e;
+		e.endpoint = endpoint;
+		e.data = data;
+		
+		// Objects evicted recently go straight into the main queue; this
+		// leaves their key in m_ghost, but marks it as stale there
+		auto ghost_it = m_ghost_index.find(endpoint);
+		if (ghost_it != m_ghost_index.end()) {
+			m_ghost_index.erase(ghost_it);
+			e.main = true;
+			m_main_size += data->size();
+			m_index[endpoint] = m_main.insert(m_main.end(), e);
+		} else {
+			m_small_size += data->size();
+			m_index[endpoint] = m_small.insert(m_small.end(), e);
+		}
+	}
+	
+	while (m_small_size + m_main_size > m_capacity) {
+		evict();
+	}
+	
+	return true;
+}
+
+void memory_cache::erase(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		m_primary->erase(endpoint);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_index.find(endpoint);
+	if (it == m_index.end()) {
+		return;
+	}
+	
+	auto qit = it->second;
+	if (qit->main) {
+		m_main_size -= qit->data->size();
+		m_main.erase(qit);
+	} else {
+		m_small_size -= qit->data->size();
+		m_small.erase(qit);
+	}
+	m_index.erase(it);
+}
+
+bool memory_cache::admits(std::size_t size) const
+{
+	// Anything larger than the small queue would be evicted right away
+	return m_capacity && size <= PROXYTHING_MEMORY_CACHE_MAX_OBJECT_SIZE && size <= m_capacity / 10;
+}
+
+std::size_t memory_cache::size()
+{
+	if (m_primary) {
+		return m_primary->size();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_small_size + m_main_size;
+}
+
+std::size_t memory_cache::count()
+{
+	if (m_primary) {
+		return m_primary->count();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_index.size();
+}
+
+void memory_cache::evict()
+{
+	if (!m_small.empty() && (m_small_size > m_capacity / 10 || m_main.empty())) {
+		auto it = m_small.begin();
+		m_small_size -= it->data->size();
+		
+		if (it->freq > 0) {
+			// Hit while in the small queue; promote it
+			it->freq = 0;
+			it->main = true;
+			m_main_size += it->data->size();
+			m_main.splice(m_main.end(), m_small, it);
+		} else {
+			remember(it->endpoint);
+			m_index.erase(it->endpoint);
+			m_small.erase(it);
+		}
+	} else {
+		auto it = m_main.begin();
+		
+		if (it->freq > 0) {
+			// Hit since it was last here; give it another round
+			it->freq--;
+			m_main.splice(m_main.end(), m_main, it);
+		} else {
+			m_main_size -= it->data->size();
+			m_index.erase(it->endpoint);
+			m_main.erase(it);
+		}
+	}
+}
+
+void memory_cache::remember(const asio::ip::tcp::endpoint &endpoint)
+{
+	m_ghost.emplace_back(endpoint, m_ghost_seq);
+	m_ghost_index[endpoint] = m_ghost_seq++;
+	
+	// Remember about as many keys as there are objects cached; only a key's
+	// latest entry counts, older ones are left over from before it was hit,
+	// or remembered again
+	while (m_ghost.size() > std::max<std::size_t>(m_index.size(), 1)) {
+		auto it = m_ghost_index.find(m_ghost.front().first);
+		if (it != m_ghost_index.end() && it->second == m_ghost.front().second) {
+			m_ghost_index.erase(it);
+		}
+		m_ghost.pop_front();
+	}
+}
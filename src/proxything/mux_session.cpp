@@ -0,0 +1,497 @@
+#include <proxything/mux_session.h>
+#include <proxything/client_connection.h>
+#include <proxything/remote_connection.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/dns_cache.h>
+#include <proxything/parser.h>
+#include <proxything/cache_manager.h>
+#include <proxything/fs_entry.h>
+#include <proxything/recycler.h>
+#include <proxything/config.h>
+#include <boost/log/trivial.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <algorithm>
+
+using namespace proxything;
+
+const std::size_t mux_session::header_size;
+
+mux_session::mux_session(std::shared_ptr<client_connection> client):
+	m_client(client), m_service(client->service()), m_strand(client->strand()),
+	m_cache(asio::use_service<cache_manager>(m_service)),
+	m_memory(asio::use_service<memory_cache>(m_service)),
+	m_pool(asio::use_service<chunk_pool>(m_service)),
+	m_dns(asio::use_service<dns_cache>(m_service)),
+	m_in(header_size + PROXYTHING_MUX_MAX_FRAME_SIZE), m_closed(false),
+	m_writing(false)
+{
+	BOOST_LOG_TRIVIAL(trace) << "Mux Session created";
+}
+
+mux_session::~mux_session()
+{
+	BOOST_LOG_TRIVIAL(trace) << "Mux Session destroyed";
+}
+
+void mux_session::start(asio::streambuf &buf)
+{
+	BOOST_LOG_TRIVIAL(debug) << "Switching to multiplexed mode";
+	
+	std::size_t size = asio::buffer_copy(m_in.prepare(buf.size()), buf.data());
+	m_in.commit(size);
+	buf.consume(size);
+	
+	// Frames are already gathered into batches; holding small ones back for
+	// more would only stall the streams waiting on them
+	boost::system::error_code ec;
+	m_client->socket().set_option(asio::ip::tcp::no_delay(true), ec);
+	
+	// Nothing else is written until the acknowledgement is out
+	auto self = shared_from_this();
+	static const std::string ack = PROXYTHING_MUX_PREAMBLE "\r\n";
+	async_write(m_client->socket(), asio::buffer(ack), m_strand.wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't acknowledge multiplexing: " << ec;
+			close();
+			return;
+		}
+		
+		if (!handle_frames()) {
+			close();
+			return;
+		}
+		read_frames();
+	})));
+}
+
+void mux_session::encode_header(char *header, std::uint32_t id, frame_type type, std::uint32_t size)
+{
+	auto p = reinterpret_cast<unsigned char*>(header);
+	p[0] = id >> 24; p[1] = id >> 16; p[2] = id >> 8; p[3] = id;
+	p[4] = static_cast<std::uint8_t>(type);
+	p[5] = size >> 24; p[6] = size >> 16; p[7] = size >> 8; p[8] = size;
+}
+
+void mux_session::decode_header(const char *header, std::uint32_t &id, frame_type &type, std::uint32_t &size)
+{
+	auto p = reinterpret_cast<const unsigned char*>(header);
+	id = std::uint32_t(p[0]) << 24 | std::uint32_t(p[1]) << 16 | std::uint32_t(p[2]) << 8 | p[3];
+	type = static_cast<frame_type>(p[4]);
+	size = std::uint32_t(p[5]) << 24 | std::uint32_t(p[6]) << 16 | std::uint32_t(p[7]) << 8 | p[8];
+}
+
+void mux_session::read_frames()
+{
+	auto self = shared_from_this();
+	async_read(m_client->socket(), m_in, asio::transfer_at_least(1), m_strand.wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+		if (m_closed) {
+			return;
+		}
+		
+		if (ec) {
+			// Streams already requested are still answered after a clean EOF
+			if (ec == asio::error::eof) {
+				BOOST_LOG_TRIVIAL(info) << "Connection closed";
+			} else {
+				BOOST_LOG_TRIVIAL(warning) << "Failed to read frame: " << ec;
+				close();
+			}
+			return;
+		}
+		
+		if (!handle_frames()) {
+			close();
+			return;
+		}
+		read_frames();
+	})));
+}
+
+bool mux_session::handle_frames()
+{
+	while (m_in.size() >= header_size) {
+		const char *p = asio::buffer_cast<const char*>(m_in.data());
+		
+		std::uint32_t id, size;
+		frame_type type;
+		decode_header(p, id, type, size);
+		if (size > PROXYTHING_MUX_MAX_FRAME_SIZE) {
+			BOOST_LOG_TRIVIAL(error) << "Frame too large: " << size << " bytes";
+			return false;
+		}
+		if (m_in.size() < header_size + size) {
+			break;
+		}
+		
+		// Frames are handled in place, and only consumed afterwards
+		const char *payload = p + header_size;
+		switch (type) {
+			case frame_type::request:
+				if (!open(id, payload, payload + size)) {
+					return false;
+				}
+				break;
+			
+			case frame_type::window: {
+				if (size != 4) {
+					BOOST_LOG_TRIVIAL(error) << "Malformed window frame";
+					return false;
+				}
+				
+				// Streams may have ended while the frame was on its way
+				auto it = m_streams.find(id);
+				if (it != m_streams.end()) {
+					auto q = reinterpret_cast<const unsigned char*>(payload);
+					it->second->window += std::uint32_t(q[0]) << 24 | std::uint32_t(q[1]) << 16 | std::uint32_t(q[2]) << 8 | q[3];
+					pump(it->second);
+				}
+				break;
+			}
+			
+			case frame_type::cancel: {
+				auto it = m_streams.find(id);
+				if (it != m_streams.end()) {
+					BOOST_LOG_TRIVIAL(debug) << "Stream " << id << " cancelled";
+					it->second->closed = true;
+					m_streams.erase(it);
+				}
+				break;
+			}
+			
+			default:
+				BOOST_LOG_TRIVIAL(error) << "Unexpected frame type: " << static_cast<int>(type);
+				return false;
+		}
+		
+		m_in.consume(header_size + size);
+	}
+	
+	return true;
+}
+
+bool mux_session::open(std::uint32_t id, const char *first, const char *last)
+{
+	if (id == 0 || m_streams.count(id)) {
+		BOOST_LOG_TRIVIAL(error) << "Invalid stream ID: " << id;
+		return false;
+	}
+	
+	BOOST_LOG_TRIVIAL(info) << "Stream " << id << " requested: " << boost::string_ref(first, last - first);
+	
+	auto s = std::make_shared<stream>(m_pool);
+	s->id = id;
+	s->window = PROXYTHING_MUX_WINDOW;
+	if (m_streams.size() >= PROXYTHING_MUX_MAX_STREAMS) {
+		end(s, "Too many streams");
+		return true;
+	}
+	m_streams[id] = s;
+	
+	boost::system::error_code ec;
+	auto target = parser::parse_target(first, last, ec);
+	if (ec) {
+		BOOST_LOG_TRIVIAL(error) << "Invalid target: " << ec.message();
+		end(s, ec.message());
+		return true;
+	}
+	
+	if (!target.has_host()) {
+		serve(s, target.endpoint);
+		return true;
+	}
+	
+	auto self = shared_from_this();
+	std::string host(target.host_begin, target.host_end);
+	unsigned short port = target.endpoint.port();
+	m_dns.async_resolve(host, m_strand.wrap([this, self, s, host, port](const boost::system::error_code &ec, asio::ip::address address) {
+		if (s->closed) {
+			return;
+		}
+		
+		if (ec) {
+			end(s, "Couldn't resolve " + host);
+			return;
+		}
+		
+		serve(s, asio::ip::tcp::endpoint(address, port));
+	}));
+	
+	return true;
+}
+
+void mux_session::serve(stream_ptr s, asio::ip::tcp::endpoint endpoint)
+{
+	// Same order as client_connection::respond()
+	if (auto data = m_memory.find(endpoint)) {
+		s->data = data;
+		pump(s);
+		return;
+	}
+	
+	if (auto remote = asio::use_service<fetch_registry>(m_service).find(endpoint)) {
+		join(s, remote);
+		return;
+	}
+	
+	auto self = shared_from_this();
+	m_cache.async_lookup(endpoint, m_strand.wrap([this, self, s, endpoint](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Cache error: " << ec;
+		}
+		
+		if (s->closed) {
+			return;
+		}
+		
+		if (!hit) {
+			if (auto remote = remote_connection::fetch(m_service, endpoint)) {
+				join(s, remote);
+			} else {
+				end(s, "Upstream unavailable");
+			}
+			return;
+		}
+		
+		s->file = f;
+		pump(s);
+	}));
+}
+
+void mux_session::join(stream_ptr s, std::shared_ptr<remote_connection> remote)
+{
+	auto self = shared_from_this();
+	remote->async_open_reader(m_service, m_strand.wrap([this, self, s, remote](const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		if (s->closed) {
+			return;
+		}
+		
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't join fetch: " << ec;
+			end(s, "Fetch failed");
+			return;
+		}
+		
+		s->file = f;
+		s->fill = remote;
+		pump(s);
+	}));
+}
+
+void mux_session::pump(stream_ptr s)
+{
+	if (m_closed || s->closed || s->busy) {
+		return;
+	}
+	
+	if (s->data) {
+		std::size_t left = s->data->size() - s->offset;
+		if (!left) {
+			end(s);
+			return;
+		}
+		if (!s->window) {
+			return;
+		}
+		
+		// The buffer's immutable, so frames can point straight into it
+		std::size_t size = std::min({ left, s->window, std::size_t(PROXYTHING_MUX_FRAME_SIZE) });
+		frame f;
+		encode_header(f.header.data(), s->id, frame_type::data, size);
+		f.payload = asio::buffer(s->data->data() + s->offset, size);
+		f.data = s->data;
+		f.s = s;
+		
+		s->offset += size;
+		s->window -= size;
+		s->busy = true;
+		send(std::move(f));
+	} else if (s->file && s->window) {
+		read_file(s);
+	}
+}
+
+void mux_session::read_file(stream_ptr s)
+{
+	s->busy = true;
+	
+	auto chunk = m_pool.try_acquire(s->sizer.size());
+	if (chunk) {
+		read_into(s, chunk);
+		return;
+	}
+	
+	// Hold the stream back until writes free up some of the budget; streams
+	// sent from memory carry on in the meantime
+	BOOST_LOG_TRIVIAL(trace) << "Buffer budget used up, stream " << s->id << " waiting...";
+	auto self = shared_from_this();
+	m_pool.async_acquire(s->sizer.size(), m_strand.wrap([this, self, s](chunk_pool::chunk_ptr chunk) {
+		if (m_closed || s->closed) {
+			return;
+		}
+		
+		read_into(s, chunk);
+	}));
+}
+
+void mux_session::read_into(stream_ptr s, chunk_pool::chunk_ptr chunk)
+{
+	auto self = shared_from_this();
+	std::size_t size = std::min({ s->sizer.size(), s->window, std::max<std::size_t>(PROXYTHING_MUX_FRAME_SIZE, m_pool.buffer_size()) });
+	
+	// Data that's in the page cache can be read right here; only reads that
+	// would have to wait for the disk go through fs_service
+	boost::system::error_code ec;
+	std::size_t read = s->file->read_some_nowait(asio::buffer(chunk->data(), size), ec);
+	if (ec != asio::error::would_block) {
+		file_read(s, chunk, ec, read);
+		return;
+	}
+	
+	s->file->async_read_some(asio::buffer(chunk->data(), size), m_strand.wrap([this, self, s, chunk](const boost::system::error_code &ec, std::size_t size) {
+		file_read(s, chunk, ec, size);
+	}));
+}
+
+void mux_session::file_read(stream_ptr s, chunk_pool::chunk_ptr chunk, const boost::system::error_code &ec, std::size_t size)
+{
+	if (s->closed) {
+		return;
+	}
+	
+	if (size) {
+		s->sizer.update(size);
+		
+		frame f;
+		encode_header(f.header.data(), s->id, frame_type::data, size);
+		f.payload = chunk->buffer(size);
+		f.chunk = chunk;
+		f.s = s;
+		
+		s->offset += size;
+		s->window -= size;
+		send(std::move(f));
+		return;
+	}
+	
+	s->busy = false;
+	if (ec && ec != asio::error::eof) {
+		BOOST_LOG_TRIVIAL(error) << "Couldn't read from cache: " << ec;
+		end(s, "Cache read failed");
+		return;
+	}
+	
+	if (!s->fill) {
+		end(s);
+		return;
+	}
+	
+	// The fill may belong to another core's IO service; resume on this one,
+	// in the client's strand
+	auto self = shared_from_this();
+	s->busy = true;
+	s->fill->async_wait(s->offset, m_strand.wrap([this, self, s](const boost::system::error_code &ec, std::size_t available, bool done) {
+		if (s->closed) {
+			return;
+		}
+		
+		s->busy = false;
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Fill failed: " << ec;
+			end(s, "Fetch failed");
+		} else if (available > s->offset) {
+			pump(s);
+		} else {
+			end(s);
+		}
+	}));
+}
+
+void mux_session::end(stream_ptr s, const std::string &error)
+{
+	BOOST_LOG_TRIVIAL(debug) << "Stream " << s->id << " ended" << (error.empty() ? "" : ": " + error);
+	
+	s->closed = true;
+	auto it = m_streams.find(s->id);
+	if (it != m_streams.end() && it->second == s) {
+		m_streams.erase(it);
+	}
+	
+	frame f;
+	if (error.empty()) {
+		encode_header(f.header.data(), s->id, frame_type::end, 0);
+	} else {
+		f.text = std::make_shared<std::string>(error);
+		encode_header(f.header.data(), s->id, frame_type::error, f.text->size());
+		f.payload = asio::buffer(*f.text);
+	}
+	send(std::move(f));
+}
+
+void mux_session::send(frame f)
+{
+	m_queue.push_back(std::move(f));
+	flush();
+}
+
+void mux_session::flush()
+{
+	if (m_closed || m_writing || m_queue.empty()) {
+		return;
+	}
+	
+	std::vector<asio::const_buffer> buffers;
+	while (!m_queue.empty() && m_sending.size() < PROXYTHING_MUX_WRITE_BATCH) {
+		m_sending.push_back(std::move(m_queue.front()));
+		m_queue.pop_front();
+	}
+	for (auto &f : m_sending) {
+		buffers.push_back(asio::buffer(f.header));
+		if (asio::buffer_size(f.payload)) {
+			buffers.push_back(f.payload);
+		}
+	}
+	
+	m_writing = true;
+	auto self = shared_from_this();
+	async_write(m_client->socket(), buffers, m_strand.wrap(recycle([this, self](const boost::system::error_code &ec, std::size_t size) {
+		m_writing = false;
+		
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't write frames: " << ec;
+			close();
+			return;
+		}
+		
+		BOOST_LOG_TRIVIAL(trace) << "Sent " << m_sending.size() << " frames, " << size << " bytes";
+		
+		// Each stream sent gets to queue its next frame behind everyone else's
+		std::vector<frame> sent;
+		sent.swap(m_sending);
+		for (auto &f : sent) {
+			if (f.s) {
+				f.s->busy = false;
+				pump(f.s);
+			}
+		}
+		flush();
+	})));
+}
+
+void mux_session::close()
+{
+	if (m_closed) {
+		return;
+	}
+	
+	BOOST_LOG_TRIVIAL(debug) << "Closing multiplexed session";
+	
+	m_closed = true;
+	for (auto &it : m_streams) {
+		it.second->closed = true;
+	}
+	m_streams.clear();
+	m_queue.clear();
+	
+	boost::system::error_code ignored;
+	m_client->socket().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+}
@@ -0,0 +1,202 @@
+#include <proxything/parser.h>
+#include <string>
+
+using namespace proxything;
+
+namespace
+{
+	class parser_category : public boost::system::error_category
+	{
+	public:
+		const char* name() const noexcept override
+		{
+			return "proxything.parser";
+		}
+		
+		std::string message(int ev) const override
+		{
+			switch (static_cast<parser::error>(ev)) {
+				case parser::missing_port: return "Format: IP:port or hostname:port";
+				case parser::invalid_address: return "Given address is not valid";
+				case parser::invalid_port: return "Port is not a valid number";
+				case parser::port_out_of_range: return "Valid ports are 1-65535";
+			}
+			return "Unknown parse error";
+		}
+	};
+	
+	/**
+	 * Parses a dotted-quad IPv4 address, rejecting leading zeroes like
+	 * inet_pton() does.
+	 */
+	bool parse_v4(const char *p, const char *end, asio::ip::address_v4::bytes_type &bytes)
+	{
+		for (std::size_t i = 0; i < bytes.size(); i++) {
+			if (i > 0) {
+				if (p == end || *p != '.') {
+					return false;
+				}
+				p++;
+			}
+			
+			const char *start = p;
+			unsigned int value = 0;
+			while (p != end && p - start < 3 && *p >= '0' && *p <= '9') {
+				value = value * 10 + (*p++ - '0');
+			}
+			if (p == start || value > 255 || (*start == '0' && p - start > 1)) {
+				return false;
+			}
+			bytes[i] = value;
+		}
+		
+		return p == end;
+	}
+	
+	/**
+	 * Checks whether a name is a valid hostname, per RFC 1123: dot-separated
+	 * labels of up to 63 letters, digits and hyphens, not starting or ending
+	 * with a hyphen, up to 253 characters in all (plus an optional trailing
+	 * dot). All-numeric names are rejected, since no top-level domain is.
+	 */
+	bool valid_hostname(const char *p, const char *end)
+	{
+		if (p != end && *(end - 1) == '.') {
+			end--;
+		}
+		if (p == end || end - p > 253) {
+			return false;
+		}
+		
+		bool numeric = true;
+		while (p != end) {
+			const char *label = p;
+			numeric = true;
+			for (; p != end && *p != '.'; p++) {
+				char c = *p;
+				if (c >= '0' && c <= '9') {
+					continue;
+				}
+				numeric = false;
+				if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-')) {
+					return false;
+				}
+			}
+			
+			if (p == label || p - label > 63 || *label == '-' || *(p - 1) == '-') {
+				return false;
+			}
+			if (p != end) {
+				p++;
+				if (p == end) {
+					return false;
+				}
+			}
+		}
+		
+		return !numeric;
+	}
+	
+	/**
+	 * Parses a port number.
+	 */
+	boost::system::error_code parse_port(const char *p, const char *end, unsigned short &port)
+	{
+		if (p == end) {
+			return parser::invalid_port;
+		}
+		
+		// Anything past five digits is out of range anyways, so stop counting
+		// there instead of overflowing
+		unsigned long value = 0;
+		for (; p != end; p++) {
+			if (*p < '0' || *p > '9') {
+				return parser::invalid_port;
+			}
+			if (value <= 65535) {
+				value = value * 10 + (*p - '0');
+			}
+		}
+		
+		if (value < 1 || value > 65535) {
+			return parser::port_out_of_range;
+		}
+		port = value;
+		return boost::system::error_code();
+	}
+}
+
+const boost::system::error_category& parser::category()
+{
+	static parser_category instance;
+	return instance;
+}
+
+parser::target parser::parse_target(const char *begin, const char *end, boost::system::error_code &ec)
+{
+	target t;
+	
+	// Find the : delimiting the address and port
+	const char *colon = begin != end ? static_cast<const char*>(::memrchr(begin, ':', end - begin)) : nullptr;
+	if (!colon) {
+		ec = missing_port;
+		return t;
+	}
+	
+	// Handle [bracketed] IPv6 addresses
+	const char *address_begin = begin, *address_end = colon;
+	if (address_end - address_begin >= 2 && *address_begin == '[' && *(address_end - 1) == ']') {
+		address_begin++;
+		address_end--;
+	}
+	
+	// IPv4 addresses are parsed by hand; IPv6 ones (with scope IDs and all) by
+	// inet_pton(), which needs a terminated copy, made on the stack; anything
+	// else had better be a hostname
+	asio::ip::address address;
+	asio::ip::address_v4::bytes_type v4;
+	std::size_t size = address_end - address_begin;
+	if (parse_v4(address_begin, address_end, v4)) {
+		address = asio::ip::address_v4(v4);
+	} else if (size > 0 && std::memchr(address_begin, ':', size)) {
+		char buf[64];
+		boost::system::error_code v6_ec;
+		asio::ip::address_v6 v6;
+		if (size < sizeof(buf)) {
+			std::memcpy(buf, address_begin, size);
+			buf[size] = '\0';
+			v6 = asio::ip::address_v6::from_string(buf, v6_ec);
+		}
+		if (size >= sizeof(buf) || v6_ec) {
+			ec = invalid_address;
+			return t;
+		}
+		address = v6;
+	} else if (address_begin == begin && valid_hostname(address_begin, address_end)) {
+		t.host_begin = address_begin;
+		t.host_end = address_end;
+	} else {
+		ec = invalid_address;
+		return t;
+	}
+	
+	unsigned short port = 0;
+	if ((ec = parse_port(colon + 1, end, port))) {
+		t.host_begin = t.host_end = nullptr;
+		return t;
+	}
+	
+	ec = boost::system::error_code();
+	t.endpoint = asio::ip::tcp::endpoint(address, port);
+	return t;
+}
+
+asio::ip::tcp::endpoint parser::parse_endpoint(const char *begin, const char *end, boost::system::error_code &ec)
+{
+	target t = parse_target(begin, end, ec);
+	if (!ec && t.has_host()) {
+		ec = invalid_address;
+	}
+	
+	return ec ? asio::ip::tcp::endpoint() : t.endpoint;
+}
@@ -1,20 +1,27 @@
 #include <proxything/proxy_server.h>
 #include <proxything/client_connection.h>
+#include <proxything/recycler.h>
 #include <boost/log/trivial.hpp>
 #include <memory>
 
 using namespace proxything;
 
+/// SO_REUSEPORT, which asio has no option class for
+typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port_option;
+
 proxy_server::proxy_server(asio::io_service &service):
 	m_service(service), m_acceptor(m_service) { }
 
 proxy_server::~proxy_server() { }
 
-void proxy_server::listen(const std::string &host, unsigned short port)
+void proxy_server::listen(const std::string &host, unsigned short port, bool reuse_port)
 {
 	asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string(host), port);
 	m_acceptor.open(endpoint.protocol());
 	m_acceptor.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+	if (reuse_port) {
+		m_acceptor.set_option(reuse_port_option(true));
+	}
 	m_acceptor.bind(endpoint);
 	m_acceptor.listen();
 	
@@ -27,8 +34,10 @@ void proxy_server::accept()
 	
 	auto self = shared_from_this();
 	
-	auto client = std::make_shared<client_connection>(m_service, self);
-	m_acceptor.async_accept(client->socket(), [&, client](const boost::system::error_code &ec) {
+	// Connections come and go at a rate where the allocator shows up; they're
+	// recycled on each thread instead
+	auto client = std::allocate_shared<client_connection>(recycling_allocator<client_connection>(), m_service, self);
+	m_acceptor.async_accept(client->socket(), recycle([&, client](const boost::system::error_code &ec) {
 		if (ec) {
 			BOOST_LOG_TRIVIAL(warning) << "Error accepting connection: " << ec;
 			accept();
@@ -39,5 +48,5 @@ void proxy_server::accept()
 		client->connected();
 		
 		accept();
-	});
+	}));
 }
@@ -0,0 +1,115 @@
+#include <proxything/recycler.h>
+#include <proxything/config.h>
+#include <new>
+#include <vector>
+
+using namespace proxything;
+
+const std::size_t recycler::granularity;
+
+namespace
+{
+	/// Number of size classes kept on the free lists
+	const std::size_t num_classes = (PROXYTHING_RECYCLER_MAX_SIZE + recycler::granularity - 1) / recycler::granularity;
+	
+	/**
+	 * A thread's free lists.
+	 */
+	struct cache
+	{
+		std::vector<void*> free[num_classes];	///< Freed blocks, by size class
+		
+		~cache()
+		{
+			for (auto &blocks : free) {
+				for (void *p : blocks) {
+					::operator delete(p);
+				}
+			}
+		}
+	};
+	
+	/**
+	 * Frees a thread's cache when it exits.
+	 */
+	struct cache_owner
+	{
+		cache *owned = nullptr;	///< The thread's cache
+		
+		~cache_owner();
+	};
+	
+	// Plain pointers, so they're still safe to look at after the owner's been
+	// destroyed, eg. by other thread_local destructors freeing blocks
+	thread_local cache *t_cache = nullptr;
+	thread_local bool t_exited = false;
+	
+	cache_owner::~cache_owner()
+	{
+		t_cache = nullptr;
+		t_exited = true;
+		delete owned;
+	}
+	
+	/// Returns the calling thread's cache, or nullptr if it's exiting
+	cache* local_cache()
+	{
+		if (t_cache || t_exited) {
+			return t_cache;
+		}
+		
+		static thread_local cache_owner owner;
+		owner.owned = t_cache = new cache();
+		return t_cache;
+	}
+}
+
+void* recycler::allocate(std::size_t size)
+{
+	if (!size || size > PROXYTHING_RECYCLER_MAX_SIZE) {
+		return ::operator new(size);
+	}
+	
+	std::size_t index = (size - 1) / granularity;
+	if (cache *c = local_cache()) {
+		auto &blocks = c->free[index];
+		if (!blocks.empty()) {
+			void *p = blocks.back();
+			blocks.pop_back();
+			return p;
+		}
+	}
+	
+	return ::operator new((index + 1) * granularity);
+}
+
+void recycler::deallocate(void *p, std::size_t size)
+{
+	if (!p) {
+		return;
+	}
+	
+	if (size && size <= PROXYTHING_RECYCLER_MAX_SIZE) {
+		std::size_t index = (size - 1) / granularity;
+		if (cache *c = local_cache()) {
+			auto &blocks = c->free[index];
+			if ((blocks.size() + 1) * (index + 1) * granularity <= PROXYTHING_RECYCLER_BYTES) {
+				blocks.push_back(p);
+				return;
+			}
+		}
+	}
+	
+	::operator delete(p);
+}
+
+std::size_t recycler::cached()
+{
+	std::size_t count = 0;
+	if (cache *c = local_cache()) {
+		for (auto &blocks : c->free) {
+			count += blocks.size();
+		}
+	}
+	return count;
+}
@@ -1,14 +1,27 @@
 #include <proxything/remote_connection.h>
 #include <proxything/client_connection.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/cache_manager.h>
+#include <proxything/upstream_health.h>
 #include <proxything/fs_entry.h>
+#include <proxything/file_responder.h>
+#include <proxything/recycler.h>
 #include <proxything/config.h>
 #include <boost/log/trivial.hpp>
+#include <algorithm>
 
 using namespace proxything;
 
-remote_connection::remote_connection(asio::io_service &service, std::shared_ptr<client_connection> client, std::shared_ptr<fs_entry> cache_file):
-	m_service(service), m_socket(m_service), m_client(client),
-	m_cache_file(cache_file), m_buf(PROXYTHING_REMOTE_BUFFER_SIZE)
+remote_connection::remote_connection(asio::io_service &service, asio::ip::tcp::endpoint endpoint, std::shared_ptr<client_connection> client):
+	m_service(service), m_socket(m_service),
+	m_strand(client ? client->strand() : asio::io_service::strand(service)), m_endpoint(endpoint),
+	m_timer(service), m_health(asio::use_service<upstream_health>(service)),
+	m_committed(false), m_cache_writing(false), m_finished(false), m_throttled(false),
+	m_pool(asio::use_service<chunk_pool>(m_service)), m_sizer(m_pool),
+	m_memory(asio::use_service<memory_cache>(m_service)),
+	m_client(client), m_backlog(0), m_sent(0), m_writing(false), m_behind(false),
+	m_received(0), m_keep_body(true),
+	m_filled(0), m_done(false)
 {
 	BOOST_LOG_TRIVIAL(trace) << "Remote Connection created";
 }
@@ -17,19 +30,118 @@ remote_connection::~remote_connection()
 {
 	BOOST_LOG_TRIVIAL(trace) << "Remote Connection destroyed";
 	
+	if (m_committed || !m_cache_file) {
+		return;
+	}
+	
+	// The fill never finished, so whatever made it into the file is junk.
 	// Pass a surrogate pointer to m_cache_file to the lambda to keep the file
 	// in existence as it's being closed; shared_from_this() would work too,
 	// but would keep the entire connection object in memory for no good reason
 	auto cache_file_ptr = m_cache_file;
-	m_cache_file->async_close([cache_file_ptr](const boost::system::error_code &ec) {
+	m_cache_file->async_discard([cache_file_ptr](const boost::system::error_code &ec) {
 		if (ec) {
-			BOOST_LOG_TRIVIAL(warning) << "Failed to commit cache: " << ec;
-		} else {
-			BOOST_LOG_TRIVIAL(trace) << "Cache committed";
+			BOOST_LOG_TRIVIAL(warning) << "Failed to discard cache: " << ec;
 		}
 	});
 }
 
+std::shared_ptr<remote_connection> remote_connection::fetch(asio::io_service &service, asio::ip::tcp::endpoint endpoint, std::shared_ptr<client_connection> client)
+{
+	if (!asio::use_service<upstream_health>(service).available(endpoint)) {
+		BOOST_LOG_TRIVIAL(info) << "Not fetching from " << endpoint << ", it's down";
+		return nullptr;
+	}
+	
+	// Claim the endpoint before creating the cache file, so that concurrent
+	// misses end up sharing a single fetch
+	auto remote = std::allocate_shared<remote_connection>(recycling_allocator<remote_connection>(), service, endpoint, client);
+	auto fetch = asio::use_service<fetch_registry>(service).insert(endpoint, remote);
+	if (fetch != remote) {
+		return fetch;
+	}
+	
+	asio::use_service<cache_manager>(service).async_create(endpoint, remote->m_strand.wrap([remote](const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		// Without a cache file, there's nowhere for the fill to go, or for
+		// clients joining it to read from
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Cache error: " << ec;
+			remote->fail(ec, "Couldn't create cache file");
+			return;
+		}
+		
+		remote->start(f);
+	}));
+	
+	return remote;
+}
+
+void remote_connection::start(std::shared_ptr<fs_entry> cache_file)
+{
+	BOOST_LOG_TRIVIAL(info) << "Connecting to remote: " << m_endpoint.address().to_string() << ":" << m_endpoint.port();
+	BOOST_LOG_TRIVIAL(debug) << "Caching to: " << cache_file->filename();
+	
+	m_cache_file = cache_file;
+	
+	auto self = shared_from_this();
+	m_timer.expires_from_now(std::chrono::milliseconds(PROXYTHING_CONNECT_TIMEOUT));
+	m_timer.async_wait(m_strand.wrap(recycle([this, self](const boost::system::error_code &ec) {
+		// The deadline's moved out of the way once connected, even if this
+		// was already queued up to run by then
+		if (m_timer.expires_at() <= asio::steady_timer::clock_type::now()) {
+			boost::system::error_code ignored;
+			m_socket.close(ignored);
+		}
+	})));
+	
+	m_socket.async_connect(m_endpoint, m_strand.wrap(recycle([this, self](const boost::system::error_code &ec) {
+		if (ec || !m_socket.is_open()) {
+			// Closing the socket on timeout fails the connect as aborted
+			bool timed_out = m_timer.expires_at() <= asio::steady_timer::clock_type::now();
+			m_timer.cancel();
+			refused(timed_out ? asio::error::timed_out : ec);
+			return;
+		}
+		
+		m_timer.expires_at(asio::steady_timer::time_point::max());
+		m_health.succeeded(m_endpoint);
+		connected();
+	})));
+}
+
+void remote_connection::refused(const boost::system::error_code &ec)
+{
+	BOOST_LOG_TRIVIAL(error) << "Couldn't connect to " << m_endpoint << ": " << ec.message();
+	m_health.failed(m_endpoint);
+	
+	fail(ec, "Couldn't connect to upstream");
+	commit();
+}
+
+void remote_connection::fail(const boost::system::error_code &ec, const std::string &msg)
+{
+	// There's nothing to wait for, so requests from here on can fail fast
+	asio::use_service<fetch_registry>(m_service).erase(m_endpoint, this);
+	
+	std::shared_ptr<client_connection> client;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_error = ec;
+		client.swap(m_client);
+		notify();
+	}
+	
+	// Nothing's been sent to the client yet, so it can be told why, unless
+	// it's since switched to pipelining; then it's cut off, like on errors
+	// mid-fill
+	if (client && !client->pipelined()) {
+		client->reject(0, msg);
+	} else if (client) {
+		boost::system::error_code ignored;
+		client->socket().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+	}
+}
+
 void remote_connection::connected()
 {
 	BOOST_LOG_TRIVIAL(trace) << "Remote connection acknowledged";
@@ -37,13 +149,93 @@ void remote_connection::connected()
 	read_and_deliver();
 }
 
+void remote_connection::async_wait(std::size_t offset, WaitHandler cb)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_waiters.push_back(waiter{offset, cb});
+	notify();
+}
+
+void remote_connection::async_open_reader(asio::io_service &service, OpenHandler cb)
+{
+	auto self = shared_from_this();
+	async_wait(0, service.wrap([this, self, &service, cb](const boost::system::error_code &ec, std::size_t available, bool done) {
+		if (ec) {
+			cb(ec, nullptr);
+			return;
+		}
+		
+		// Once committed, the data is at the final filename; if the commit
+		// happens between here and the open, fall back to that as well
+		std::string filename = m_cache_file->filename();
+		std::string path = done ? filename : m_cache_file->path();
+		
+		auto f = std::make_shared<fs_entry>(service);
+		f->async_open(path, [f, filename, path, cb](const boost::system::error_code &ec) {
+			if (ec == boost::system::errc::no_such_file_or_directory && path != filename) {
+				f->async_open(filename, [f, cb](const boost::system::error_code &ec) {
+					cb(ec, f);
+				});
+			} else {
+				cb(ec, f);
+			}
+		});
+	}));
+}
+
 void remote_connection::read_and_deliver()
+{
+	// With fill writes backed up, don't read faster than this fill's own
+	// writes go through; write_cache() picks up again once one's done
+	auto scheduler = asio::use_service<fs_service>(m_service).scheduler();
+	if (m_cache_writing && scheduler && scheduler->backlogged(fs_service::io_class::background)) {
+		BOOST_LOG_TRIVIAL(trace) << "Disk backlogged, waiting for cache writes...";
+		m_throttled = true;
+		return;
+	}
+	
+	auto chunk = m_pool.try_acquire(m_sizer.size());
+	if (chunk) {
+		read_into(chunk);
+		return;
+	}
+	
+	// Stop reading until writes free up some of the budget; a copy of the
+	// body kept for the memory cache shouldn't be what everyone's waiting on,
+	// and neither should chunks queued up for a client that isn't taking them,
+	// so it catches up from the cache file instead
+	BOOST_LOG_TRIVIAL(trace) << "Buffer budget used up, waiting...";
+	bool behind = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_keep_body = false;
+		m_body.clear();
+		
+		if (m_client && !m_behind && !m_queue.empty()) {
+			BOOST_LOG_TRIVIAL(debug) << "Client " << m_backlog << " bytes behind when the budget ran out";
+			m_behind = true;
+			m_queue.clear();
+			m_backlog = 0;
+			behind = true;
+		}
+	}
+	if (behind) {
+		deliver();
+	}
+	
+	auto self = shared_from_this();
+	m_pool.async_acquire(m_sizer.size(), m_strand.wrap([this, self](chunk_pool::chunk_ptr chunk) {
+		read_into(chunk);
+	}));
+}
+
+void remote_connection::read_into(chunk_pool::chunk_ptr chunk)
 {
 	BOOST_LOG_TRIVIAL(debug) << "Reading from remote...";
 	
 	auto self = shared_from_this();
 	
-	async_read(m_socket, m_buf, [this, self](const boost::system::error_code &ec, std::size_t size) {
+	m_socket.async_read_some(chunk->buffer(), m_strand.wrap(recycle([this, self, chunk](const boost::system::error_code &ec, std::size_t size) {
 		if (ec) {
 			if (ec == asio::error::eof) {
 				BOOST_LOG_TRIVIAL(debug) << "Remote connection closed";
@@ -53,38 +245,261 @@ void remote_connection::read_and_deliver()
 		}
 		
 		BOOST_LOG_TRIVIAL(trace) << "Received " << size << " bytes";
-		BOOST_LOG_TRIVIAL(trace) << "Buffer size: " << m_buf.size();
 		
 		if (size) {
-			auto cache_buf = std::make_shared<asio::streambuf>(size);
-			buffer_copy(cache_buf->prepare(size), m_buf.data(), size);
-			cache_buf->commit(size);
-			async_write(*m_cache_file, *cache_buf, [this, cache_buf](const boost::system::error_code &ec, std::size_t size) {
-				if (ec) {
-					BOOST_LOG_TRIVIAL(warning) << "Couldn't write to " << m_cache_file->filename() << ": " << ec;
-				} else {
-					BOOST_LOG_TRIVIAL(trace) << "Cached " << size << " bytes";
-				}
-			});
+			// Reads that fill their chunk get a bigger one next time
+			m_sizer.update(size);
 			
-			async_write(m_client->socket(), m_buf, [this, self](const boost::system::error_code &ec, std::size_t size) {
-				if (ec) {
-					if (ec == asio::error::eof) {
-						BOOST_LOG_TRIVIAL(debug) << "Client connection closed during write";
-					} else {
-						BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+			// The cache write and the client write reference the same chunk,
+			// which goes back to the pool once they're both done with it
+			m_cache_queue.push_back(piece{chunk, size});
+			write_cache();
+			
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_client && !m_behind) {
+					m_queue.push_back(piece{chunk, size});
+					m_backlog += size;
+					
+					// Rather than hold on to ever more chunks for a slow
+					// client, let it catch up from the cache file; it's
+					// always allowed a couple of reads, however big they get
+					if (m_backlog > std::max<std::size_t>(PROXYTHING_CLIENT_BACKLOG, 2 * chunk->capacity())) {
+						BOOST_LOG_TRIVIAL(debug) << "Client fell " << m_backlog << " bytes behind";
+						m_behind = true;
+						m_queue.clear();
+						m_backlog = 0;
 					}
 				}
 				
-				BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
-				BOOST_LOG_TRIVIAL(trace) << "Buffer size: " << m_buf.size();
+				m_received += size;
+				if (m_keep_body && m_memory.admits(m_received)) {
+					m_body.push_back(piece{chunk, size});
+				} else {
+					m_keep_body = false;
+					m_body.clear();
+				}
+			}
+			
+			deliver();
+		}
+		
+		if (ec) {
+			if (ec != asio::error::eof) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_error) {
+					m_error = ec;
+				}
 				
-				if (!ec) {
-					read_and_deliver();
+				// Cut the client off too, like readers of the cache file
+				if (m_client) {
+					boost::system::error_code ignored;
+					m_client->socket().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+					m_client.reset();
+					m_queue.clear();
+					m_backlog = 0;
+				}
+			}
+			
+			// Whatever's still being written mustn't end up queued behind
+			// the file being closed
+			m_finished = true;
+			if (!m_cache_writing) {
+				commit();
+			}
+		} else {
+			read_and_deliver();
+		}
+	})));
+}
+
+void remote_connection::write_cache()
+{
+	if (m_cache_writing || m_cache_queue.empty()) {
+		return;
+	}
+	
+	// Big chunks are written in several goes, which would interleave with
+	// those of the next chunk if they were written concurrently
+	m_cache_writing = true;
+	piece p = m_cache_queue.front();
+	m_cache_queue.pop_front();
+	
+	auto self = shared_from_this();
+	async_write(*m_cache_file, p.chunk->buffer(p.size), m_strand.wrap([this, self, p](const boost::system::error_code &ec, std::size_t size) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			
+			if (ec) {
+				BOOST_LOG_TRIVIAL(warning) << "Couldn't write to " << m_cache_file->filename() << ": " << ec;
+				if (!m_error) {
+					m_error = ec;
 				}
-			});
-		} else if (!ec) {
+			} else {
+				BOOST_LOG_TRIVIAL(trace) << "Cached " << size << " bytes";
+			}
+			
+			m_filled += size;
+			notify();
+		}
+		
+		m_cache_writing = false;
+		if (!m_cache_queue.empty()) {
+			write_cache();
+		} else if (m_finished) {
+			commit();
+		}
+		
+		if (m_throttled) {
+			m_throttled = false;
 			read_and_deliver();
 		}
+	}));
+}
+
+void remote_connection::deliver()
+{
+	std::shared_ptr<client_connection> client;
+	piece p;
+	bool behind;
+	std::size_t sent;
+	
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		
+		if (m_writing || !m_client || (m_queue.empty() && !m_behind)) {
+			return;
+		}
+		
+		// Only once the last write is done, so the socket has one writer
+		behind = m_behind;
+		sent = m_sent;
+		if (behind) {
+			client.swap(m_client);
+		} else {
+			client = m_client;
+			p = m_queue.front();
+			m_queue.pop_front();
+			m_backlog -= p.size;
+			m_writing = true;
+		}
+	}
+	
+	if (behind) {
+		hand_off(client, sent);
+		return;
+	}
+	
+	auto self = shared_from_this();
+	client->expect_write();
+	async_write(client->socket(), p.chunk->buffer(p.size), m_strand.wrap(recycle([this, self, client, p](const boost::system::error_code &ec, std::size_t size) {
+		client->wrote();
+		if (ec) {
+			if (ec == asio::error::eof) {
+				BOOST_LOG_TRIVIAL(debug) << "Client connection closed during write";
+			} else {
+				BOOST_LOG_TRIVIAL(error) << "Couldn't write response: " << ec;
+			}
+			
+			// Let go of the client, but keep filling the cache
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_client.reset();
+			m_queue.clear();
+			m_backlog = 0;
+			m_writing = false;
+			return;
+		}
+		
+		BOOST_LOG_TRIVIAL(trace) << "Sent " << size << " bytes";
+		
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_sent += size;
+			m_writing = false;
+		}
+		
+		deliver();
+	})));
+}
+
+void remote_connection::hand_off(std::shared_ptr<client_connection> client, std::size_t offset)
+{
+	BOOST_LOG_TRIVIAL(info) << "Serving the rest of the response from the cache file, from " << offset;
+	
+	// The responder keeps the fill alive, just like for anyone joining it
+	auto self = shared_from_this();
+	async_open_reader(m_service, m_strand.wrap([this, self, client, offset](const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+		if (ec) {
+			BOOST_LOG_TRIVIAL(error) << "Couldn't open cache file to catch up from: " << ec;
+			boost::system::error_code ignored;
+			client->socket().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+			return;
+		}
+		
+		std::allocate_shared<file_responder>(recycling_allocator<file_responder>(), m_service, client, f, self, offset)->start();
+	}));
+}
+
+void remote_connection::notify()
+{
+	for (auto it = m_waiters.begin(); it != m_waiters.end();) {
+		if (m_filled > it->offset || m_done || m_error) {
+			m_service.post(std::bind(it->cb, m_error, m_filled, m_done));
+			it = m_waiters.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void remote_connection::commit()
+{
+	m_committed = true;
+	
+	boost::system::error_code error;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		error = m_error;
+	}
+	
+	// A failed fill leaves the cache as it was; the next request tries again
+	auto self = shared_from_this();
+	auto done = m_strand.wrap([this, self, error](const boost::system::error_code &ec) {
+		if (error) {
+			BOOST_LOG_TRIVIAL(debug) << "Cache fill discarded";
+		} else if (ec) {
+			BOOST_LOG_TRIVIAL(warning) << "Failed to commit cache: " << ec;
+		} else {
+			BOOST_LOG_TRIVIAL(trace) << "Cache committed";
+			asio::use_service<cache_manager>(m_service).insert(m_endpoint, m_filled);
+		}
+		
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			
+			// Whatever was in memory before is stale now either way
+			if (!ec && !m_error && m_keep_body) {
+				auto data = std::make_shared<std::vector<char>>();
+				data->reserve(m_received);
+				for (auto &p : m_body) {
+					data->insert(data->end(), p.chunk->data(), p.chunk->data() + p.size);
+				}
+				m_memory.insert(m_endpoint, data);
+			} else {
+				m_memory.erase(m_endpoint);
+			}
+			m_body.clear();
+			
+			m_done = true;
+			notify();
+		}
+		
+		asio::use_service<fetch_registry>(m_service).erase(m_endpoint, this);
 	});
+	
+	if (error) {
+		m_cache_file->async_discard(done);
+	} else {
+		m_cache_file->async_close(done);
+	}
 }
@@ -0,0 +1,86 @@
+#include <proxything/upstream_health.h>
+#include <boost/log/trivial.hpp>
+#include <algorithm>
+
+using namespace proxything;
+
+asio::io_service::id upstream_health::id;
+
+upstream_health::upstream_health(asio::io_service &service, std::chrono::milliseconds backoff, std::chrono::milliseconds max_backoff):
+	asio::io_service::service(service), m_primary(nullptr),
+	m_backoff(backoff), m_max_backoff(max_backoff) { }
+
+upstream_health::upstream_health(asio::io_service &service, upstream_health &primary):
+	asio::io_service::service(service), m_primary(&primary),
+	m_backoff(primary.m_backoff), m_max_backoff(primary.m_max_backoff) { }
+
+bool upstream_health::available(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		return m_primary->available(endpoint);
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	auto it = m_entries.find(endpoint);
+	return it == m_entries.end() || it->second.down_until <= clock::now();
+}
+
+std::chrono::milliseconds upstream_health::failed(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		return m_primary->failed(endpoint);
+	}
+	
+	auto now = clock::now();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	// Forget upstreams that are up again to make room; they'll start over
+	// from the shortest backoff if they fail again
+	if (m_entries.size() >= PROXYTHING_UPSTREAM_HEALTH_SIZE && !m_entries.count(endpoint)) {
+		for (auto it = m_entries.begin(); it != m_entries.end();) {
+			if (it->second.down_until <= now) {
+				it = m_entries.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	
+	auto &e = m_entries.emplace(endpoint, entry{0, now}).first->second;
+	e.failures++;
+	
+	auto backoff = m_backoff;
+	for (unsigned int i = 1; i < e.failures && backoff < m_max_backoff; i++) {
+		backoff *= 2;
+	}
+	backoff = std::min(backoff, m_max_backoff);
+	e.down_until = now + backoff;
+	
+	BOOST_LOG_TRIVIAL(warning) << "Upstream " << endpoint << " down for " << backoff.count() << " ms, after " << e.failures << " failure(s)";
+	return backoff;
+}
+
+void upstream_health::succeeded(const asio::ip::tcp::endpoint &endpoint)
+{
+	if (m_primary) {
+		m_primary->succeeded(endpoint);
+		return;
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	
+	if (m_entries.erase(endpoint)) {
+		BOOST_LOG_TRIVIAL(info) << "Upstream " << endpoint << " is back up";
+	}
+}
+
+std::size_t upstream_health::size()
+{
+	if (m_primary) {
+		return m_primary->size();
+	}
+	
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
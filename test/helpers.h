@@ -0,0 +1,209 @@
+#ifndef PROXYTHING_TEST_HELPERS_H
+#define PROXYTHING_TEST_HELPERS_H
+
+#include <catch.hpp>
+#include <proxything/proxy_server.h>
+#include <proxything/cache_manager.h>
+#include <proxything/dns_cache.h>
+#include <proxything/util.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+namespace proxything
+{
+	namespace test
+	{
+		/**
+		 * An upstream server, serving the same payload to every connection.
+		 */
+		struct upstream
+		{
+			upstream(asio::io_service &service, std::vector<char> payload, unsigned short port = 0):
+				service(service), acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+				payload(std::move(payload)), connections(0) { }
+			
+			/// Accepts connections until the acceptor's closed
+			void accept()
+			{
+				auto socket = std::make_shared<asio::ip::tcp::socket>(service);
+				acceptor.async_accept(*socket, [this, socket](const boost::system::error_code &ec) {
+					if (ec) {
+						return;
+					}
+					
+					connections++;
+					async_write(*socket, asio::buffer(payload), [socket](const boost::system::error_code &ec, std::size_t size) { });
+					accept();
+				});
+			}
+			
+			/// Returns the port it's listening on
+			unsigned short port() const
+			{
+				return acceptor.local_endpoint().port();
+			}
+			
+			/// Returns a target for it, eg. for mux requests
+			std::string target() const
+			{
+				return "127.0.0.1:" + std::to_string(port());
+			}
+			
+			/// Returns a command requesting it
+			std::string command() const
+			{
+				return target() + "\r\n";
+			}
+			
+			asio::io_service &service;
+			asio::ip::tcp::acceptor acceptor;
+			std::vector<char> payload;
+			std::atomic<std::size_t> connections;
+		};
+		
+		/**
+		 * Makes blocking reads on a socket give up after 10s, so a response
+		 * that goes missing fails a test rather than hanging it.
+		 */
+		inline void set_timeout(asio::ip::tcp::socket &socket)
+		{
+			timeval timeout = { 10, 0 };
+			::setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		}
+		
+		/**
+		 * Stubs out DNS: "upstream.test" resolves to the loopback address,
+		 * and nothing else resolves at all.
+		 */
+		inline void stub_dns(asio::io_service &service)
+		{
+			asio::use_service<dns_cache>(service).set_lookup([](const std::string &host, dns_cache::LookupHandler cb) {
+				if (host == "upstream.test") {
+					cb(boost::system::error_code(), { asio::ip::address_v4::loopback() }, std::chrono::seconds(-1));
+				} else {
+					cb(asio::error::host_not_found, {}, std::chrono::seconds(-1));
+				}
+			});
+		}
+		
+		/**
+		 * A proxy with a cache in a temporary directory, and a client socket.
+		 * 
+		 * Services and upstreams are set up on service before start(); the
+		 * destructor stops everything and removes the cache directory.
+		 */
+		struct proxy_fixture
+		{
+			proxy_fixture():
+				dir(util::tmp_path()), server(std::make_shared<proxy_server>(service)), socket(client_service)
+			{
+				fs::create_directories(dir);
+				asio::add_service(service, new cache_manager(service, dir));
+			}
+			
+			~proxy_fixture()
+			{
+				socket.close();
+				stop();
+				upstreams.clear();
+				fs::remove_all(dir);
+			}
+			
+			/// Adds an upstream running on service, accepting connections
+			upstream& add_upstream(std::vector<char> payload)
+			{
+				upstreams.emplace_back(new upstream(service, std::move(payload)));
+				upstreams.back()->accept();
+				return *upstreams.back();
+			}
+			
+			/// Starts the server, with threads running service
+			void start(std::size_t num_threads = 1)
+			{
+				server->listen("127.0.0.1", 0);
+				server->accept();
+				for (std::size_t i = 0; i < num_threads; i++) {
+					threads.emplace_back([this]{ service.run(); });
+				}
+			}
+			
+			/// Stops the server's threads
+			void stop()
+			{
+				service.stop();
+				for (auto &thread : threads) {
+					thread.join();
+				}
+				threads.clear();
+			}
+			
+			/// Connects socket to the server, optionally shrinking its receive buffer
+			void connect(std::size_t receive_buffer_size = 0)
+			{
+				socket.open(asio::ip::tcp::v4());
+				if (receive_buffer_size) {
+					socket.set_option(asio::socket_base::receive_buffer_size(receive_buffer_size));
+				}
+				socket.connect(server->acceptor().local_endpoint());
+				set_timeout(socket);
+			}
+			
+			asio::io_service service;							///< Server's IO service
+			fs::path dir;										///< Cache directory
+			std::shared_ptr<proxy_server> server;				///< Server
+			std::vector<std::unique_ptr<upstream>> upstreams;	///< Upstreams on service
+			std::vector<std::thread> threads;					///< Threads running service
+			
+			asio::io_service client_service;					///< Client socket's IO service
+			asio::ip::tcp::socket socket;						///< Client socket
+		};
+		
+		/**
+		 * Reads a line, without the CRLF.
+		 */
+		inline std::string read_line(asio::ip::tcp::socket &socket, asio::streambuf &buf)
+		{
+			asio::read_until(socket, buf, "\r\n");
+			std::istream in(&buf);
+			std::string line;
+			std::getline(in, line);
+			line.pop_back();
+			return line;
+		}
+		
+		/**
+		 * Reads a framed response; returns the error line instead, if any.
+		 */
+		inline std::string read_framed(asio::ip::tcp::socket &socket, asio::streambuf &buf)
+		{
+			std::string data;
+			for (;;) {
+				std::string line = read_line(socket, buf);
+				if (line.compare(0, 6, "ERROR:") == 0) {
+					return line;
+				}
+				
+				std::size_t size = std::stoul(line, nullptr, 16);
+				if (buf.size() < size + 2) {
+					asio::read(socket, buf, asio::transfer_exactly(size + 2 - buf.size()));
+				}
+				
+				const char *begin = asio::buffer_cast<const char*>(buf.data());
+				data.append(begin, size);
+				CHECK(std::string(begin + size, 2) == "\r\n");
+				buf.consume(size + 2);
+				
+				if (!size) {
+					return data;
+				}
+			}
+		}
+	}
+}
+
+#endif
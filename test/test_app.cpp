@@ -2,6 +2,14 @@
 #include <proxything/app.h>
 #include <proxything/proxy_server.h>
 #include <proxything/fs_service.h>
+#include <proxything/fs_entry.h>
+#include <proxything/chunk_pool.h>
+#include <proxything/memory_cache.h>
+#include <proxything/cache_janitor.h>
+#include <proxything/cache_manager.h>
+#include <proxything/dns_cache.h>
+#include <proxything/config.h>
+#include <proxything/util.h>
 #include <iostream>
 
 using namespace proxything;
@@ -57,11 +65,21 @@ SCENARIO("argument parsing works")
 			
 			THEN("the arg map should have only default values in it")
 			{
-				REQUIRE(args.size() == 3);
+				REQUIRE(args.size() == 13);
 				
 				CHECK(args["threads"].as<unsigned int>() == 1);
 				CHECK(args["host"].as<std::string>() == "127.0.0.1");
 				CHECK(args["port"].as<unsigned short>() == 12345);
+				CHECK(args["fs-backend"].as<std::string>() == "threaded");
+				CHECK(args["fs-threads"].as<unsigned int>() == PROXYTHING_FS_THREADS);
+				CHECK(args["buffer-size"].as<std::size_t>() == PROXYTHING_REMOTE_BUFFER_SIZE);
+				CHECK(args["max-buffer-size"].as<std::size_t>() == PROXYTHING_REMOTE_MAX_BUFFER_SIZE);
+				CHECK(args["max-buffered-bytes"].as<std::size_t>() == PROXYTHING_BUFFER_BUDGET);
+				CHECK(args["memory-cache-bytes"].as<std::size_t>() == PROXYTHING_MEMORY_CACHE_SIZE);
+				CHECK(args["cache-max-bytes"].as<std::size_t>() == PROXYTHING_CACHE_MAX_BYTES);
+				CHECK(args["cache-max-entries"].as<std::size_t>() == PROXYTHING_CACHE_MAX_ENTRIES);
+				CHECK(args["dns-ttl"].as<unsigned int>() == PROXYTHING_DNS_TTL);
+				CHECK(args["dns-negative-ttl"].as<unsigned int>() == PROXYTHING_DNS_NEGATIVE_TTL);
 			}
 		}
 	}
@@ -83,6 +101,16 @@ SCENARIO("argument parsing works")
 		}
 	}
 	
+	GIVEN("an unknown filesystem backend")
+	{
+		args_helper helper({"--fs-backend", "gibberish"});
+		
+		THEN("parsing should fail")
+		{
+			CHECK_THROWS_AS(a.parse_args(helper.argc, helper.argv), boost::program_options::error);
+		}
+	}
+	
 	GIVEN("a long-form flag")
 	{
 		args_helper helper({"--help"});
@@ -117,6 +145,237 @@ SCENARIO("service initialization works")
 		{
 			asio::has_service<fs_service>(a.service());
 		}
+		
+		THEN("it should use the threaded backend")
+		{
+			CHECK(asio::use_service<fs_service>(a.service()).backend() == fs_service::backend_type::threaded);
+			CHECK(asio::use_service<fs_service>(a.service()).num_threads() == PROXYTHING_FS_THREADS);
+		}
+		
+		THEN("it should have the default in-memory cache budget")
+		{
+			CHECK(asio::use_service<memory_cache>(a.service()).capacity() == PROXYTHING_MEMORY_CACHE_SIZE);
+		}
+	}
+	
+	WHEN("an in-memory cache budget is given")
+	{
+		args_helper args({"--memory-cache-bytes", "1000"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("it should be used")
+		{
+			CHECK(asio::use_service<memory_cache>(a.service()).capacity() == 1000);
+		}
+	}
+	
+	WHEN("disk cache limits are given")
+	{
+		args_helper args({"--cache-max-bytes", "1000", "--cache-max-entries", "10"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("they should be used")
+		{
+			CHECK(asio::use_service<cache_janitor>(a.service()).max_bytes() == 1000);
+			CHECK(asio::use_service<cache_janitor>(a.service()).max_entries() == 10);
+		}
+	}
+	
+	WHEN("buffer sizes are given")
+	{
+		args_helper args({"--buffer-size", "3000", "--max-buffer-size", "65536"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("they should be used, rounded up to a size class")
+		{
+			CHECK(asio::use_service<chunk_pool>(a.service()).buffer_size() == 4096);
+			CHECK(asio::use_service<chunk_pool>(a.service()).max_buffer_size() == 65536);
+		}
+	}
+	
+	WHEN("a buffer budget is given")
+	{
+		args_helper args({"--max-buffered-bytes", "1048576"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("it should be used")
+		{
+			CHECK(asio::use_service<chunk_pool>(a.service()).budget() == 1048576);
+		}
+	}
+	
+	WHEN("DNS cache TTLs are given")
+	{
+		args_helper args({"--dns-ttl", "30", "--dns-negative-ttl", "2"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("they should be used")
+		{
+			CHECK(asio::use_service<dns_cache>(a.service()).ttl() == std::chrono::seconds(30));
+			CHECK(asio::use_service<dns_cache>(a.service()).negative_ttl() == std::chrono::seconds(2));
+		}
+	}
+	
+	WHEN("a number of disk IO threads is requested")
+	{
+		args_helper args({"--fs-threads", "3"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("it should start that many")
+		{
+			CHECK(asio::use_service<fs_service>(a.service()).num_threads() == 3);
+		}
+	}
+	
+	WHEN("the uring backend is requested")
+	{
+		args_helper args({"--fs-backend", "uring"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("it should use it if supported, or fall back")
+		{
+			auto expected = fs_service::supported(fs_service::backend_type::uring) ? fs_service::backend_type::uring : fs_service::backend_type::threaded;
+			CHECK(asio::use_service<fs_service>(a.service()).backend() == expected);
+		}
+	}
+	
+	WHEN("a shard per core is requested")
+	{
+		args_helper args({"--threads", "3", "--shard-per-core", "--fs-threads", "4"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("each thread should get its own IO service")
+		{
+			REQUIRE(a.num_shards() == 3);
+			CHECK(&a.shard_service(0) == &a.service());
+			CHECK(&a.shard_service(1) != &a.service());
+			CHECK(&a.shard_service(2) != &a.shard_service(1));
+		}
+		
+		THEN("they should share the disk IO threads")
+		{
+			auto &primary = asio::use_service<fs_service>(a.service());
+			CHECK(primary.num_threads() == 4);
+			for (std::size_t i = 1; i < a.num_shards(); i++) {
+				auto &shard = asio::use_service<fs_service>(a.shard_service(i));
+				CHECK(shard.backend() == primary.backend());
+				CHECK(shard.scheduler() == primary.scheduler());
+			}
+		}
+		
+		THEN("they should share the memory cache")
+		{
+			asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string("127.0.0.1"), 80);
+			auto data = std::make_shared<const std::vector<char>>(10, 'x');
+			asio::use_service<memory_cache>(a.shard_service(1)).insert(endpoint, data);
+			
+			CHECK(asio::use_service<memory_cache>(a.shard_service(0)).find(endpoint) == data);
+			CHECK(asio::use_service<memory_cache>(a.shard_service(2)).find(endpoint) == data);
+			CHECK(asio::use_service<memory_cache>(a.shard_service(2)).count() == 1);
+		}
+		
+		THEN("they should share the disk cache index")
+		{
+			asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string("127.0.0.1"), 80);
+			asio::use_service<cache_manager>(a.shard_service(2)).insert(endpoint, 10);
+			
+			cache_index::record record;
+			CHECK(asio::use_service<cache_manager>(a.shard_service(1)).index().find(endpoint, record));
+			CHECK(&asio::use_service<cache_manager>(a.shard_service(1)).index() == &asio::use_service<cache_manager>(a.service()).index());
+			
+			asio::use_service<cache_manager>(a.shard_service(0)).erase(record.filename);
+		}
+		
+		THEN("they should share the buffer budget and sizes")
+		{
+			CHECK(asio::use_service<chunk_pool>(a.shard_service(1)).budget() == PROXYTHING_BUFFER_BUDGET);
+			CHECK(asio::use_service<chunk_pool>(a.shard_service(1)).max_buffer_size() == PROXYTHING_REMOTE_MAX_BUFFER_SIZE);
+			
+			auto chunk = asio::use_service<chunk_pool>(a.shard_service(1)).acquire();
+			CHECK(asio::use_service<chunk_pool>(a.shard_service(2)).buffered() == chunk->capacity());
+			CHECK(asio::use_service<chunk_pool>(a.service()).buffered() == chunk->capacity());
+		}
+		
+		THEN("they should share the DNS cache")
+		{
+			CHECK(asio::use_service<dns_cache>(a.shard_service(1)).ttl() == std::chrono::seconds(PROXYTHING_DNS_TTL));
+			
+			std::size_t lookups = 0;
+			asio::use_service<dns_cache>(a.shard_service(2)).set_lookup([&](const std::string &host, dns_cache::LookupHandler cb) {
+				lookups++;
+				cb(boost::system::error_code(), { asio::ip::address::from_string("10.0.0.1") }, std::chrono::seconds(-1));
+			});
+			
+			asio::ip::address resolved;
+			for (std::size_t i = 0; i < a.num_shards(); i++) {
+				asio::use_service<dns_cache>(a.shard_service(i)).async_resolve("example.com", [&](const boost::system::error_code &ec, asio::ip::address address) {
+					resolved = address;
+				});
+				a.shard_service(0).poll();
+				a.shard_service(0).reset();
+				a.shard_service(i).poll();
+				a.shard_service(i).reset();
+			}
+			
+			CHECK(lookups == 1);
+			CHECK(resolved.to_string() == "10.0.0.1");
+			CHECK(asio::use_service<dns_cache>(a.shard_service(1)).size() == 1);
+		}
+	}
+	
+	WHEN("a shard per core is requested with the uring backend")
+	{
+		args_helper args({"--threads", "2", "--shard-per-core", "--fs-backend", "uring"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		auto expected = fs_service::supported(fs_service::backend_type::uring) ? fs_service::backend_type::uring : fs_service::backend_type::threaded;
+		REQUIRE(a.num_shards() == 2);
+		
+		THEN("each shard should get a working ring of its own")
+		{
+			util::tmp_file file("Lorem ipsum dolor sit amet");
+			for (std::size_t i = 0; i < a.num_shards(); i++) {
+				auto &shard = asio::use_service<fs_service>(a.shard_service(i));
+				CHECK(shard.backend() == expected);
+				
+				fs_entry entry(a.shard_service(i));
+				boost::system::error_code open_ec, read_ec;
+				std::string content(26, '\0');
+				entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+					open_ec = ec;
+					if (ec) { return; }
+					
+					async_read(entry, asio::buffer(&content[0], content.size()), [&](const boost::system::error_code &ec, std::size_t size) {
+						read_ec = ec;
+					});
+				});
+				a.shard_service(i).run();
+				a.shard_service(i).reset();
+				
+				CHECK_FALSE(open_ec);
+				CHECK_FALSE(read_ec);
+				CHECK(content == "Lorem ipsum dolor sit amet");
+			}
+		}
+		
+		THEN("disk IO shouldn't be scheduled by priority")
+		{
+			if (expected == fs_service::backend_type::uring) {
+				CHECK(asio::use_service<fs_service>(a.shard_service(0)).scheduler() == nullptr);
+				CHECK(asio::use_service<fs_service>(a.shard_service(1)).scheduler() == nullptr);
+			}
+		}
+	}
+	
+	WHEN("no shards are requested")
+	{
+		args_helper args({"--threads", "3"});
+		a.init_services(a.parse_args(args.argc, args.argv));
+		
+		THEN("all threads should share one IO service")
+		{
+			CHECK(a.num_shards() == 0);
+		}
 	}
 }
 
@@ -148,6 +407,24 @@ SCENARIO("server initialization works")
 			CHECK(a.server()->acceptor().local_endpoint().port() == 12346);
 		}
 	}
+	
+	WHEN("the server is initialized with a shard per core")
+	{
+		args_helper args({"--threads", "2", "--shard-per-core", "--port", "12347"});
+		auto parsed = a.parse_args(args.argc, args.argv);
+		a.init_services(parsed);
+		a.init_server(parsed);
+		
+		THEN("each shard should listen on the same port")
+		{
+			REQUIRE(a.num_shards() == 2);
+			for (std::size_t i = 0; i < a.num_shards(); i++) {
+				REQUIRE(a.shard_server(i));
+				CHECK(&a.shard_server(i)->service() == &a.shard_service(i));
+				CHECK(a.shard_server(i)->acceptor().local_endpoint().port() == 12347);
+			}
+		}
+	}
 }
 
 SCENARIO("thread initialization works")
@@ -0,0 +1,100 @@
+#include <catch.hpp>
+#include <proxything/cache_janitor.h>
+#include <proxything/fs_service.h>
+#include <proxything/config.h>
+#include <proxything/util.h>
+#include <fstream>
+
+using namespace proxything;
+
+namespace
+{
+	std::string make_file(const fs::path &dir, int n, std::size_t size = 10)
+	{
+		std::string filename = (dir / (PROXYTHING_CACHE_PREFIX + std::to_string(n))).string();
+		std::ofstream(filename) << std::string(size, 'x');
+		return filename;
+	}
+}
+
+SCENARIO("the disk cache is kept within its limits")
+{
+	asio::io_service service;
+	fs::path dir = util::tmp_path();
+	fs::create_directories(dir);
+	
+	GIVEN("a limit on the number of entries")
+	{
+		cache_janitor janitor(service, 0, 3);
+		
+		WHEN("more files than that are added")
+		{
+			std::vector<std::string> files;
+			for (int i = 0; i < 5; i++) {
+				files.push_back(make_file(dir, i));
+				janitor.insert(files.back(), 10);
+			}
+			service.run();
+			
+			THEN("the oldest ones should be deleted")
+			{
+				CHECK(janitor.count() == 3);
+				CHECK(janitor.evictions() == 2);
+				CHECK_FALSE(fs::exists(files[0]));
+				CHECK_FALSE(fs::exists(files[1]));
+				CHECK(fs::exists(files[2]));
+				CHECK(fs::exists(files[3]));
+				CHECK(fs::exists(files[4]));
+			}
+		}
+		
+		WHEN("a file is hit before more are added")
+		{
+			std::vector<std::string> files;
+			for (int i = 0; i < 3; i++) {
+				files.push_back(make_file(dir, i));
+				janitor.insert(files.back(), 10);
+			}
+			janitor.touch(files[0]);
+			for (int i = 3; i < 5; i++) {
+				files.push_back(make_file(dir, i));
+				janitor.insert(files.back(), 10);
+			}
+			service.run();
+			
+			THEN("it should be kept over files that were never hit")
+			{
+				CHECK(fs::exists(files[0]));
+				CHECK_FALSE(fs::exists(files[1]));
+				CHECK_FALSE(fs::exists(files[2]));
+				CHECK(fs::exists(files[3]));
+				CHECK(fs::exists(files[4]));
+			}
+		}
+	}
+	
+	GIVEN("a limit on the total size")
+	{
+		cache_janitor janitor(service, 25, 0);
+		
+		WHEN("more than that is added")
+		{
+			std::vector<std::string> files;
+			for (int i = 0; i < 3; i++) {
+				files.push_back(make_file(dir, i));
+				janitor.insert(files.back(), 10);
+			}
+			service.run();
+			
+			THEN("enough should be deleted to fit")
+			{
+				CHECK(janitor.size() == 20);
+				CHECK_FALSE(fs::exists(files[0]));
+				CHECK(fs::exists(files[1]));
+				CHECK(fs::exists(files[2]));
+			}
+		}
+	}
+	
+	fs::remove_all(dir);
+}
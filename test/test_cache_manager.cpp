@@ -0,0 +1,188 @@
+#include <catch.hpp>
+#include <proxything/cache_manager.h>
+#include <proxything/cache_janitor.h>
+#include <proxything/fs_entry.h>
+#include <proxything/util.h>
+#include <ctime>
+#include <fstream>
+
+using namespace proxything;
+
+namespace
+{
+	asio::ip::tcp::endpoint endpoint_for(const std::string &address, unsigned short port)
+	{
+		return asio::ip::tcp::endpoint(asio::ip::address::from_string(address), port);
+	}
+}
+
+SCENARIO("cache filenames map back to endpoints")
+{
+	asio::io_service service;
+	cache_manager cache(service);
+	
+	GIVEN("an IPv4 endpoint")
+	{
+		auto endpoint = endpoint_for("127.0.0.1", 1234);
+		
+		THEN("it should survive the round trip")
+		{
+			asio::ip::tcp::endpoint parsed;
+			REQUIRE(cache_manager::endpoint_for(cache.filename_for(endpoint), parsed));
+			CHECK(parsed == endpoint);
+		}
+	}
+	
+	GIVEN("an IPv6 endpoint")
+	{
+		auto endpoint = endpoint_for("2001:db8::1", 80);
+		
+		THEN("it should survive the round trip")
+		{
+			asio::ip::tcp::endpoint parsed;
+			REQUIRE(cache_manager::endpoint_for((cache.path() / cache.filename_for(endpoint)).string(), parsed));
+			CHECK(parsed == endpoint);
+		}
+	}
+	
+	GIVEN("IPv6 endpoints with as many separators as an IPv4 one")
+	{
+		auto short_v6 = endpoint_for("1::2:3", 80);
+		auto mapped_v4 = endpoint_for("::ffff:1.2.3.4", 80);
+		
+		THEN("they should survive the round trip")
+		{
+			asio::ip::tcp::endpoint parsed;
+			REQUIRE(cache_manager::endpoint_for(cache.filename_for(short_v6), parsed));
+			CHECK(parsed == short_v6);
+			REQUIRE(cache_manager::endpoint_for(cache.filename_for(mapped_v4), parsed));
+			CHECK(parsed == mapped_v4);
+		}
+		
+		THEN("they should be told apart by the family in their filenames")
+		{
+			CHECK(cache.filename_for(short_v6) == PROXYTHING_CACHE_PREFIX "v6-1--2-3_80");
+			CHECK(cache.filename_for(mapped_v4) != cache.filename_for(endpoint_for("::ffff:1:2:3:4", 80)));
+		}
+		
+		THEN("untagged IPv6 filenames from older versions should still be read")
+		{
+			asio::ip::tcp::endpoint parsed;
+			REQUIRE(cache_manager::endpoint_for(PROXYTHING_CACHE_PREFIX "1--2-3_80", parsed));
+			CHECK(parsed == short_v6);
+		}
+	}
+	
+	GIVEN("other filenames")
+	{
+		THEN("they should be rejected")
+		{
+			asio::ip::tcp::endpoint parsed;
+			CHECK_FALSE(cache_manager::endpoint_for("proxything-1234-abcd", parsed));
+			CHECK_FALSE(cache_manager::endpoint_for(PROXYTHING_CACHE_PREFIX "127-0-0-1_", parsed));
+			CHECK_FALSE(cache_manager::endpoint_for(PROXYTHING_CACHE_PREFIX "127-0-0-1_99999", parsed));
+			CHECK_FALSE(cache_manager::endpoint_for(PROXYTHING_CACHE_PREFIX "gibberish_80", parsed));
+		}
+	}
+}
+
+SCENARIO("the cache is indexed in memory")
+{
+	asio::io_service service;
+	fs::path dir = util::tmp_path();
+	fs::create_directories(dir);
+	
+	GIVEN("existing cache files")
+	{
+		auto cache_ptr = new cache_manager(service, dir);
+		asio::add_service(service, cache_ptr);
+		cache_manager &cache = *cache_ptr;
+		
+		std::vector<std::string> files;
+		for (unsigned short port = 1; port <= 3; port++) {
+			files.push_back((dir / cache.filename_for(endpoint_for("127.0.0.1", port))).string());
+			std::ofstream(files.back()) << std::string(10, 'x');
+			fs::last_write_time(files.back(), std::time(nullptr) - 100 + port);
+		}
+		std::ofstream((dir / "unrelated").string()) << "x";
+		
+		WHEN("they're scanned")
+		{
+			asio::add_service(service, new cache_janitor(service, 0, 2));
+			cache.scan(2);
+			
+			THEN("they should be indexed")
+			{
+				cache_index::record record;
+				REQUIRE(cache.index().find(endpoint_for("127.0.0.1", 3), record));
+				CHECK(record.filename == files[2]);
+				CHECK(record.size == 10);
+			}
+			
+			THEN("unrelated files should be ignored")
+			{
+				CHECK(cache.index().size() == 3);
+			}
+			
+			THEN("the least recently modified ones should be evicted")
+			{
+				service.run();
+				CHECK(cache.index().size() == 2);
+				CHECK_FALSE(fs::exists(files[0]));
+				CHECK(fs::exists(files[1]));
+				CHECK(fs::exists(files[2]));
+				CHECK(fs::exists(dir / "unrelated"));
+			}
+		}
+		
+		WHEN("they're looked up")
+		{
+			cache.scan(2);
+			
+			bool hit_1 = false, hit_2 = true;
+			std::shared_ptr<fs_entry> f_1, f_2;
+			cache.async_lookup(endpoint_for("127.0.0.1", 1), [&](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+				hit_1 = hit;
+				f_1 = f;
+			});
+			cache.async_lookup(endpoint_for("127.0.0.1", 4), [&](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+				hit_2 = hit;
+				f_2 = f;
+			});
+			service.run();
+			
+			THEN("indexed files should be hits")
+			{
+				CHECK(hit_1);
+				REQUIRE(f_1);
+				CHECK(f_1->filename() == files[0]);
+			}
+			
+			THEN("others should be misses")
+			{
+				CHECK_FALSE(hit_2);
+				CHECK_FALSE(f_2);
+			}
+		}
+		
+		WHEN("one is deleted behind the index' back")
+		{
+			cache.scan(1);
+			fs::remove(files[0]);
+			
+			bool hit_1 = true;
+			cache.async_lookup(endpoint_for("127.0.0.1", 1), [&](bool hit, const boost::system::error_code &ec, std::shared_ptr<fs_entry> f) {
+				hit_1 = hit;
+			});
+			service.run();
+			
+			THEN("it should be a miss, and be forgotten")
+			{
+				CHECK_FALSE(hit_1);
+				CHECK(cache.index().size() == 2);
+			}
+		}
+	}
+	
+	fs::remove_all(dir);
+}
@@ -0,0 +1,314 @@
+#include <catch.hpp>
+#include <proxything/chunk_pool.h>
+#include <proxything/config.h>
+#include <vector>
+
+using namespace proxything;
+
+SCENARIO("chunks are recycled")
+{
+	asio::io_service service;
+	chunk_pool &pool = asio::use_service<chunk_pool>(service);
+	
+	GIVEN("a chunk")
+	{
+		auto chunk = pool.acquire();
+		char *data = chunk->data();
+		
+		THEN("it should be the right size")
+		{
+			CHECK(chunk->capacity() == PROXYTHING_REMOTE_BUFFER_SIZE);
+			CHECK(asio::buffer_size(chunk->buffer()) == PROXYTHING_REMOTE_BUFFER_SIZE);
+			CHECK(asio::buffer_size(chunk->buffer(10)) == 10);
+		}
+		
+		WHEN("it's still referenced")
+		{
+			auto ref = chunk;
+			chunk.reset();
+			
+			THEN("it should not be back in the pool")
+			{
+				CHECK(pool.free_chunks() == 0);
+			}
+		}
+		
+		WHEN("all references are dropped")
+		{
+			auto ref = chunk;
+			chunk.reset();
+			ref.reset();
+			
+			THEN("it should be back in the pool")
+			{
+				CHECK(pool.free_chunks() == 1);
+			}
+			
+			THEN("it should be reused")
+			{
+				auto again = pool.acquire();
+				CHECK(again->data() == data);
+				CHECK(pool.free_chunks() == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("chunks count towards a budget")
+{
+	asio::io_service service;
+	chunk_pool pool(service, 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+	
+	THEN("nothing should be buffered yet")
+	{
+		CHECK(pool.budget() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+		CHECK(pool.buffered() == 0);
+		CHECK(pool.peak_buffered() == 0);
+	}
+	
+	GIVEN("chunks using up the budget")
+	{
+		auto a = pool.try_acquire();
+		auto b = pool.try_acquire();
+		REQUIRE(a);
+		REQUIRE(b);
+		
+		THEN("they should be counted")
+		{
+			CHECK(pool.buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+			CHECK(pool.peak_buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+		}
+		
+		THEN("no more should be handed out")
+		{
+			CHECK_FALSE(pool.try_acquire());
+		}
+		
+		THEN("acquire() should hand one out anyway")
+		{
+			auto c = pool.acquire();
+			CHECK(c);
+			CHECK(pool.buffered() == 3 * PROXYTHING_REMOTE_BUFFER_SIZE);
+		}
+		
+		WHEN("a chunk is waited for")
+		{
+			std::vector<chunk_pool::chunk_ptr> got;
+			pool.async_acquire(0, [&](chunk_pool::chunk_ptr chunk) { got.push_back(chunk); });
+			pool.async_acquire(0, [&](chunk_pool::chunk_ptr chunk) { got.push_back(chunk); });
+			service.poll();
+			service.reset();
+			
+			THEN("the waiters should be held off")
+			{
+				CHECK(got.empty());
+				CHECK(pool.waiting() == 2);
+				CHECK_FALSE(pool.try_acquire());
+			}
+			
+			AND_WHEN("a chunk is released")
+			{
+				char *data = a->data();
+				a.reset();
+				service.poll();
+				service.reset();
+				
+				THEN("the first waiter should get it")
+				{
+					REQUIRE(got.size() == 1);
+					CHECK(got[0]->data() == data);
+					CHECK(pool.waiting() == 1);
+					CHECK(pool.buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+				}
+				
+				AND_WHEN("another one is released")
+				{
+					b.reset();
+					service.poll();
+					service.reset();
+					
+					THEN("the second waiter should get it")
+					{
+						CHECK(got.size() == 2);
+						CHECK(pool.waiting() == 0);
+					}
+				}
+			}
+		}
+		
+		WHEN("they're released")
+		{
+			a.reset();
+			b.reset();
+			
+			THEN("they should no longer be counted")
+			{
+				CHECK(pool.buffered() == 0);
+				CHECK(pool.peak_buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+			}
+			
+			THEN("a chunk should be handed out right away")
+			{
+				chunk_pool::chunk_ptr got;
+				pool.async_acquire(0, [&](chunk_pool::chunk_ptr chunk) { got = chunk; });
+				CHECK_FALSE(got);
+				
+				service.poll();
+				CHECK(got);
+			}
+		}
+	}
+	
+	GIVEN("a budget smaller than a chunk")
+	{
+		chunk_pool tiny(service, 1);
+		
+		THEN("a chunk should still be handed out when none are in use")
+		{
+			auto a = tiny.try_acquire();
+			CHECK(a);
+			CHECK_FALSE(tiny.try_acquire());
+		}
+	}
+	
+	GIVEN("a pool sharing the budget")
+	{
+		asio::io_service other_service;
+		chunk_pool other(other_service, pool);
+		
+		THEN("chunks from either should count towards it")
+		{
+			auto a = pool.try_acquire();
+			auto b = other.try_acquire();
+			CHECK(pool.buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+			CHECK(other.buffered() == 2 * PROXYTHING_REMOTE_BUFFER_SIZE);
+			CHECK_FALSE(other.try_acquire());
+		}
+		
+		THEN("releasing a chunk to one should wake waiters on the other")
+		{
+			auto a = pool.try_acquire();
+			auto b = pool.try_acquire();
+			
+			chunk_pool::chunk_ptr got;
+			other.async_acquire(0, [&](chunk_pool::chunk_ptr chunk) { got = chunk; });
+			a.reset();
+			
+			service.poll();
+			CHECK_FALSE(got);
+			other_service.poll();
+			CHECK(got);
+		}
+	}
+}
+
+SCENARIO("chunks come in size classes")
+{
+	asio::io_service service;
+	chunk_pool pool(service, 0, 4096, 64 * 1024);
+	
+	THEN("sizes should be rounded up to powers of two")
+	{
+		CHECK(chunk_pool::round_size(0) == PROXYTHING_CHUNK_MIN_SIZE);
+		CHECK(chunk_pool::round_size(1) == PROXYTHING_CHUNK_MIN_SIZE);
+		CHECK(chunk_pool::round_size(4096) == 4096);
+		CHECK(chunk_pool::round_size(4097) == 8192);
+		CHECK(pool.acquire(5000)->capacity() == 8192);
+	}
+	
+	THEN("chunks should default to the buffer size")
+	{
+		CHECK(pool.buffer_size() == 4096);
+		CHECK(pool.max_buffer_size() == 64 * 1024);
+		CHECK(pool.acquire()->capacity() == 4096);
+	}
+	
+	GIVEN("released chunks of different sizes")
+	{
+		char *small = nullptr, *large = nullptr;
+		{
+			auto a = pool.acquire(4096);
+			auto b = pool.acquire(16384);
+			small = a->data();
+			large = b->data();
+		}
+		CHECK(pool.free_chunks() == 2);
+		
+		THEN("each should only be reused for its own size")
+		{
+			auto a = pool.acquire(16384);
+			auto b = pool.acquire(4096);
+			CHECK(a->data() == large);
+			CHECK(b->data() == small);
+			CHECK(pool.free_chunks() == 0);
+		}
+	}
+	
+	GIVEN("a sizer")
+	{
+		chunk_pool::sizer sizer(pool);
+		
+		THEN("it should start at the buffer size")
+		{
+			CHECK(sizer.size() == 4096);
+		}
+		
+		WHEN("reads keep filling the buffer")
+		{
+			for (int i = 0; i < 10; i++) {
+				sizer.update(sizer.size());
+			}
+			
+			THEN("it should grow up to the maximum")
+			{
+				CHECK(sizer.size() == 64 * 1024);
+			}
+			
+			AND_WHEN("a single read comes up short")
+			{
+				sizer.update(100);
+				
+				THEN("it should stay the same")
+				{
+					CHECK(sizer.size() == 64 * 1024);
+				}
+			}
+			
+			AND_WHEN("reads keep coming up short")
+			{
+				for (int i = 0; i < 20; i++) {
+					sizer.update(100);
+				}
+				
+				THEN("it should shrink back down to the buffer size")
+				{
+					CHECK(sizer.size() == 4096);
+				}
+			}
+			
+			AND_WHEN("reads use more than a quarter of the buffer")
+			{
+				for (int i = 0; i < 20; i++) {
+					sizer.update(sizer.size() / 2);
+				}
+				
+				THEN("it should stay the same")
+				{
+					CHECK(sizer.size() == 64 * 1024);
+				}
+			}
+		}
+	}
+	
+	GIVEN("a pool with growing turned off")
+	{
+		chunk_pool fixed(service, 0, 8192, 8192);
+		chunk_pool::sizer sizer(fixed);
+		sizer.update(sizer.size());
+		
+		THEN("the sizer should stay put")
+		{
+			CHECK(sizer.size() == 8192);
+		}
+	}
+}
@@ -1,9 +1,41 @@
 #include <catch.hpp>
 #include <proxything/proxy_server.h>
 #include <proxything/client_connection.h>
+#include <proxything/cache_manager.h>
+#include <proxything/dns_cache.h>
+#include <proxything/upstream_health.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/chunk_pool.h>
+#include <proxything/fs_entry.h>
+#include <proxything/fs_service.h>
+#include <proxything/util.h>
+#include <atomic>
+#include <functional>
 #include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "helpers.h"
 
 using namespace proxything;
+using namespace proxything::test;
+
+/**
+ * Asks the kernel to drop a directory's files from the page cache.
+ * 
+ * It doesn't always let go of all the pages; tests try again then.
+ */
+static void drop_page_cache(const fs::path &dir)
+{
+	for (auto it = fs::directory_iterator(dir); it != fs::directory_iterator(); ++it) {
+		int fd = ::open(it->path().c_str(), O_RDONLY);
+		REQUIRE(fd != -1);
+		::fdatasync(fd);
+		::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		::close(fd);
+	}
+}
 
 SCENARIO("commands can be parsed")
 {
@@ -109,3 +141,624 @@ SCENARIO("commands can be parsed")
 		}
 	}
 }
+
+SCENARIO("commands can be pipelined")
+{
+	proxy_fixture proxy;
+	
+	// One response fits in memory, the other only on disk
+	std::vector<char> small(1000, 's');
+	std::vector<char> large(300 * 1024, 'l');
+	auto &small_upstream = proxy.add_upstream(small);
+	auto &large_upstream = proxy.add_upstream(large);
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	asio::streambuf buf;
+	
+	GIVEN("a pipelined connection")
+	{
+		asio::write(socket, asio::buffer(std::string("PIPELINE\r\n")));
+		REQUIRE(read_line(socket, buf) == "OK");
+		
+		WHEN("several commands are sent at once")
+		{
+			std::string cmds = large_upstream.command() + small_upstream.command() + "gibberish\r\n" + large_upstream.command() + small_upstream.command();
+			asio::write(socket, asio::buffer(cmds));
+			
+			THEN("the responses should come back framed, in order")
+			{
+				CHECK(read_framed(socket, buf) == std::string(large.begin(), large.end()));
+				CHECK(read_framed(socket, buf) == std::string(small.begin(), small.end()));
+				CHECK(read_framed(socket, buf) == "ERROR: Format: IP:port or hostname:port");
+				CHECK(read_framed(socket, buf) == std::string(large.begin(), large.end()));
+				CHECK(read_framed(socket, buf) == std::string(small.begin(), small.end()));
+			}
+		}
+	}
+	
+}
+
+SCENARIO("commands can name a host")
+{
+	proxy_fixture proxy;
+	stub_dns(proxy.service);
+	
+	std::vector<char> small(1000, 's');
+	auto &small_upstream = proxy.add_upstream(small);
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	asio::streambuf buf;
+	
+	std::string port = std::to_string(small_upstream.port());
+	
+	GIVEN("a hostname that resolves")
+	{
+		asio::write(socket, asio::buffer("upstream.test:" + port + "\r\n"));
+		
+		THEN("it should be fetched from the address it resolves to")
+		{
+			std::string response(small.size(), '\0');
+			asio::read(socket, asio::buffer(&response[0], response.size()));
+			CHECK(response == std::string(small.begin(), small.end()));
+		}
+	}
+	
+	GIVEN("a hostname that doesn't resolve")
+	{
+		asio::write(socket, asio::buffer("nowhere.test:" + port + "\r\n"));
+		
+		THEN("an error should be returned")
+		{
+			CHECK(read_line(socket, buf) == "ERROR: Couldn't resolve nowhere.test");
+		}
+	}
+	
+	GIVEN("a pipelined connection")
+	{
+		asio::write(socket, asio::buffer(std::string("PIPELINE\r\n")));
+		REQUIRE(read_line(socket, buf) == "OK");
+		
+		WHEN("hostnames are mixed with other commands")
+		{
+			asio::write(socket, asio::buffer("nowhere.test:" + port + "\r\nupstream.test:" + port + "\r\n" + small_upstream.command()));
+			
+			THEN("the responses should still come back in order")
+			{
+				CHECK(read_framed(socket, buf) == "ERROR: Couldn't resolve nowhere.test");
+				CHECK(read_framed(socket, buf) == std::string(small.begin(), small.end()));
+				CHECK(read_framed(socket, buf) == std::string(small.begin(), small.end()));
+			}
+		}
+	}
+	
+}
+
+SCENARIO("upstreams refusing connections are backed off from")
+{
+	proxy_fixture proxy;
+	auto &service = proxy.service;
+	auto &dir = proxy.dir;
+	asio::add_service(service, new upstream_health(service, std::chrono::milliseconds(200), std::chrono::milliseconds(1000)));
+	
+	// Grab a port nothing's listening on
+	unsigned short port;
+	{
+		asio::ip::tcp::acceptor acceptor(service, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		port = acceptor.local_endpoint().port();
+	}
+	std::string cmd = "127.0.0.1:" + std::to_string(port) + "\r\n";
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	asio::streambuf buf;
+	
+	GIVEN("a request for an upstream that's down")
+	{
+		asio::write(socket, asio::buffer(cmd));
+		REQUIRE(read_line(socket, buf) == "ERROR: Couldn't connect to upstream");
+		
+		THEN("nothing should have been cached")
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			CHECK(fs::is_empty(dir));
+		}
+		
+		THEN("requests for it should fail right away")
+		{
+			asio::write(socket, asio::buffer(cmd + cmd));
+			CHECK(read_line(socket, buf) == "ERROR: Upstream unavailable");
+			CHECK(read_line(socket, buf) == "ERROR: Upstream unavailable");
+		}
+		
+		WHEN("it comes back up")
+		{
+			asio::io_service upstream_service;
+			std::vector<char> small(1000, 's');
+			upstream revived(upstream_service, small, port);
+			revived.accept();
+			std::thread upstream_thread([&]{ upstream_service.run(); });
+			
+			THEN("it should be fetched from again once the backoff is over")
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(250));
+				asio::write(socket, asio::buffer(cmd));
+				
+				std::string response(small.size(), '\0');
+				asio::read(socket, asio::buffer(&response[0], response.size()));
+				CHECK(response == std::string(small.begin(), small.end()));
+				CHECK(asio::use_service<upstream_health>(service).size() == 0);
+			}
+			
+			upstream_service.stop();
+			upstream_thread.join();
+		}
+	}
+	
+	GIVEN("a pipelined connection")
+	{
+		asio::write(socket, asio::buffer(std::string("PIPELINE\r\n")));
+		REQUIRE(read_line(socket, buf) == "OK");
+		
+		WHEN("requests for an upstream that's down are sent")
+		{
+			asio::write(socket, asio::buffer(cmd));
+			std::string first = read_framed(socket, buf);
+			asio::write(socket, asio::buffer(cmd));
+			std::string second = read_framed(socket, buf);
+			
+			THEN("the first should fail to connect, the next one right away")
+			{
+				CHECK(first == "ERROR: Fetch failed");
+				CHECK(second == "ERROR: Upstream unavailable");
+			}
+		}
+	}
+	
+}
+
+SCENARIO("requests fail when their cache file can't be created")
+{
+	proxy_fixture proxy;
+	auto &upstream = proxy.add_upstream(std::vector<char>(1000, 'x'));
+	auto &other = proxy.add_upstream(std::vector<char>(1000, 'y'));
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	asio::streambuf buf;
+	
+	// Make sure the connection's been accepted before running out
+	asio::write(socket, asio::buffer(other.command()));
+	std::vector<char> response(other.payload.size());
+	asio::read(socket, asio::buffer(response));
+	REQUIRE(response == other.payload);
+	
+	// ...and that its fill's let go of its descriptors
+	auto &registry = asio::use_service<fetch_registry>(proxy.service);
+	for (int i = 0; i < 1000 && registry.size(); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(registry.size() == 0);
+	
+	GIVEN("no file descriptors to spare")
+	{
+		// Cap descriptors at the lowest free one, and take up any that are
+		// freed below it, so opening anything fails
+		struct rlimit limit;
+		REQUIRE(::getrlimit(RLIMIT_NOFILE, &limit) == 0);
+		int lowest = ::dup(0);
+		REQUIRE(lowest != -1);
+		::close(lowest);
+		
+		struct rlimit capped = limit;
+		capped.rlim_cur = lowest;
+		REQUIRE(::setrlimit(RLIMIT_NOFILE, &capped) == 0);
+		
+		std::vector<int> spare;
+		auto take_spare = [&]{
+			for (int fd; (fd = ::dup(0)) != -1;) {
+				spare.push_back(fd);
+			}
+		};
+		auto release = [&]{
+			for (int fd : spare) {
+				::close(fd);
+			}
+			spare.clear();
+			::setrlimit(RLIMIT_NOFILE, &limit);
+		};
+		take_spare();
+		
+		WHEN("a miss is requested")
+		{
+			asio::write(socket, asio::buffer(upstream.command()));
+			std::string line = read_line(socket, buf);
+			release();
+			
+			THEN("it should be rejected, and the fetch dropped")
+			{
+				CHECK(line == "ERROR: Couldn't create cache file");
+				CHECK(registry.size() == 0);
+			}
+		}
+		
+		release();
+	}
+}
+
+SCENARIO("slow clients don't hold up fills")
+{
+	proxy_fixture proxy;
+	
+	// Far more than the client's allowed to fall behind by, in a pattern that
+	// shows up anything out of order
+	std::vector<char> large(8 * 1024 * 1024);
+	for (std::size_t i = 0; i < large.size(); i++) {
+		large[i] = static_cast<char>(i * 31 % 251);
+	}
+	auto &large_upstream = proxy.add_upstream(large);
+	
+	proxy.start();
+	proxy.connect(4096);
+	auto &socket = proxy.socket;
+	
+	GIVEN("a client that isn't reading")
+	{
+		asio::write(socket, asio::buffer(large_upstream.command()));
+		
+		THEN("the fill should finish without it")
+		{
+			auto &registry = asio::use_service<fetch_registry>(proxy.service);
+			for (int i = 0; i < 1000 && (registry.size() || fs::is_empty(proxy.dir)); i++) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			CHECK(registry.size() == 0);
+			CHECK_FALSE(fs::is_empty(proxy.dir));
+			
+			// Then it should still get the whole response, in order
+			std::vector<char> response(large.size());
+			asio::read(socket, asio::buffer(response));
+			CHECK(response == large);
+		}
+	}
+	
+}
+
+SCENARIO("fills are held back while cache writes are backlogged")
+{
+	proxy_fixture proxy;
+	
+	std::vector<char> large(4 * 1024 * 1024);
+	for (std::size_t i = 0; i < large.size(); i++) {
+		large[i] = static_cast<char>(i * 31 % 251);
+	}
+	auto &large_upstream = proxy.add_upstream(large);
+	
+	// One worker, kept busy with reads, so fill writes have to queue up;
+	// backlogged whenever one does
+	auto &fs = *new fs_service(proxy.service, fs_service::backend_type::threaded, 1);
+	asio::add_service(proxy.service, &fs);
+	REQUIRE(fs.scheduler());
+	fs.scheduler()->set_queue_limit(fs_service::io_class::background, 1);
+	
+	util::tmp_file file(std::string(64 * 1024, 'x'));
+	fs_entry reader(proxy.service);
+	std::vector<char> buf(64 * 1024);
+	std::atomic<bool> reading(true), stopped(false);
+	std::function<void()> read_again = [&]{
+		reader.seek(0);
+		reader.async_read_some(asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+			if (!ec && reading) {
+				read_again();
+			} else {
+				stopped = true;
+			}
+		});
+	};
+	reader.async_open(file.path(), [&](const boost::system::error_code &ec) {
+		if (!ec) {
+			read_again();
+		} else {
+			stopped = true;
+		}
+	});
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	
+	GIVEN("a request for a large object")
+	{
+		asio::write(socket, asio::buffer(large_upstream.command()));
+		
+		THEN("the whole response should still be sent, and cached")
+		{
+			std::vector<char> response(large.size());
+			asio::read(socket, asio::buffer(response));
+			CHECK(response == large);
+			
+			auto &registry = asio::use_service<fetch_registry>(proxy.service);
+			for (int i = 0; i < 1000 && registry.size(); i++) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			CHECK(registry.size() == 0);
+			CHECK_FALSE(fs::is_empty(proxy.dir));
+		}
+	}
+	
+	// The reads mustn't outlive what they read into
+	reading = false;
+	for (int i = 0; i < 1000 && !stopped; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(stopped);
+}
+
+SCENARIO("cache hits are sent without blocking on the disk")
+{
+	proxy_fixture proxy;
+	
+	// Too big for the in-memory tier, so hits are sent from the cache file
+	std::vector<char> payload(1024 * 1024, 'x');
+	auto &upstream = proxy.add_upstream(payload);
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	auto &fs = asio::use_service<fs_service>(proxy.service);
+	
+	asio::write(socket, asio::buffer(upstream.command()));
+	std::vector<char> response(payload.size());
+	asio::read(socket, asio::buffer(response));
+	REQUIRE(response == payload);
+	
+	auto &registry = asio::use_service<fetch_registry>(proxy.service);
+	for (int i = 0; i < 1000 && registry.size(); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(registry.size() == 0);
+	
+	std::size_t nowait_reads = fs.nowait_reads();
+	std::size_t fallback_reads = fs.fallback_reads();
+	std::size_t worker_ops = fs.scheduler()->stats(fs_service::io_class::foreground).latency.count();
+	
+	GIVEN("a cache file in the page cache")
+	{
+		WHEN("it's requested")
+		{
+			asio::write(socket, asio::buffer(upstream.command()));
+			std::vector<char> response(payload.size());
+			asio::read(socket, asio::buffer(response));
+			
+			THEN("it should be sent with sendfile(), without reading it")
+			{
+				CHECK(response == payload);
+				CHECK(fs.nowait_reads() == nowait_reads);
+				CHECK(fs.fallback_reads() == fallback_reads);
+				
+				// Only opened through the disk IO threads
+				CHECK(fs.scheduler()->stats(fs_service::io_class::foreground).latency.count() - worker_ops == 1);
+			}
+		}
+	}
+	
+	GIVEN("a cache file that's been dropped from the page cache")
+	{
+		WHEN("it's requested")
+		{
+			std::vector<char> response(payload.size());
+			std::size_t ops = 0;
+			for (int i = 0; i < 10 && ops <= 1; i++) {
+				drop_page_cache(proxy.dir);
+				std::size_t before = fs.scheduler()->stats(fs_service::io_class::foreground).latency.count();
+				asio::write(socket, asio::buffer(upstream.command()));
+				asio::read(socket, asio::buffer(response));
+				ops = fs.scheduler()->stats(fs_service::io_class::foreground).latency.count() - before;
+			}
+			
+			THEN("it should be read through the disk IO threads")
+			{
+				CHECK(response == payload);
+				CHECK(ops > 1);
+			}
+		}
+	}
+}
+
+SCENARIO("cache hits read from their files stay within the buffer budget")
+{
+	proxy_fixture proxy;
+	
+	auto pool = new chunk_pool(proxy.service, 64 * 1024, 4096, 16 * 1024);
+	asio::add_service(proxy.service, pool);
+	
+	std::vector<char> payload(1024 * 1024, 'x');
+	auto &upstream = proxy.add_upstream(payload);
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	
+	asio::write(socket, asio::buffer(upstream.command()));
+	std::vector<char> response(payload.size());
+	asio::read(socket, asio::buffer(response));
+	REQUIRE(response == payload);
+	
+	auto &registry = asio::use_service<fetch_registry>(proxy.service);
+	for (int i = 0; i < 1000 && registry.size(); i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	REQUIRE(registry.size() == 0);
+	
+	GIVEN("a used up budget")
+	{
+		auto held = pool->acquire(pool->budget());
+		
+		WHEN("a cache file that isn't in the page cache is requested")
+		{
+			// Hits still in the page cache are sent with sendfile(), which
+			// doesn't need a buffer; try again if it came back too soon
+			for (int i = 0; i < 10 && !pool->waiting(); i++) {
+				drop_page_cache(proxy.dir);
+				asio::write(socket, asio::buffer(upstream.command()));
+				for (int j = 0; j < 100 && !pool->waiting(); j++) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				if (!pool->waiting()) {
+					asio::read(socket, asio::buffer(response));
+				}
+			}
+			
+			THEN("its reads should wait for the budget, then go through")
+			{
+				REQUIRE(pool->waiting() == 1);
+				held = nullptr;
+				
+				asio::read(socket, asio::buffer(response));
+				CHECK(response == payload);
+				CHECK(pool->peak_buffered() <= pool->budget() + pool->max_buffer_size());
+			}
+		}
+	}
+}
+
+SCENARIO("stalled clients don't hold on to the buffer budget")
+{
+	proxy_fixture proxy;
+	
+	// Less than a client's allowed to fall behind by, so only handing it off
+	// when the budget runs out frees any of it up
+	auto pool = new chunk_pool(proxy.service, 64 * 1024, 4096, 16 * 1024);
+	asio::add_service(proxy.service, pool);
+	
+	std::vector<char> large(8 * 1024 * 1024, 'x');
+	auto &large_upstream = proxy.add_upstream(large);
+	auto &small_upstream = proxy.add_upstream(std::vector<char>(64 * 1024, 'y'));
+	
+	proxy.start();
+	proxy.connect(4096);
+	
+	GIVEN("a client that isn't reading")
+	{
+		asio::write(proxy.socket, asio::buffer(large_upstream.command()));
+		for (int i = 0; i < 1000 && pool->peak_buffered() + 16 * 1024 <= pool->budget(); i++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		REQUIRE(pool->peak_buffered() + 16 * 1024 > pool->budget());
+		
+		// Give the socket buffers time to fill up, so the client's stalled
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		
+		WHEN("another client requests something else")
+		{
+			asio::ip::tcp::socket other(proxy.client_service);
+			other.connect(proxy.server->acceptor().local_endpoint());
+			set_timeout(other);
+			asio::write(other, asio::buffer(small_upstream.command()));
+			
+			THEN("its fetch should still finish, without waiting for the stalled client to time out")
+			{
+				auto start = std::chrono::steady_clock::now();
+				std::vector<char> response(small_upstream.payload.size());
+				boost::system::error_code ec;
+				asio::read(other, asio::buffer(response), ec);
+				CHECK_FALSE(ec);
+				CHECK(response == small_upstream.payload);
+				CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(PROXYTHING_CLIENT_WRITE_TIMEOUT / 2));
+			}
+			
+			THEN("so should the stalled client's")
+			{
+				auto &registry = asio::use_service<fetch_registry>(proxy.service);
+				for (int i = 0; i < 1000 && registry.size(); i++) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+				CHECK(registry.size() == 0);
+			}
+		}
+	}
+}
+
+#ifdef PROXYTHING_HAVE_COROUTINES
+SCENARIO("connections can be served by coroutines")
+{
+	proxy_fixture proxy;
+	stub_dns(proxy.service);
+	
+	std::vector<char> small(1000, 's');
+	std::vector<char> large(300 * 1024, 'l');
+	auto &small_upstream = proxy.add_upstream(small);
+	auto &large_upstream = proxy.add_upstream(large);
+	
+	proxy.server->set_coroutines(true);
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	asio::streambuf buf;
+	
+	auto fetch = [&](const std::string &cmd, std::size_t size) {
+		asio::write(socket, asio::buffer(cmd));
+		std::string response(size, '\0');
+		asio::read(socket, asio::buffer(&response[0], response.size()));
+		return response;
+	};
+	
+	GIVEN("requests for objects, one after the other")
+	{
+		THEN("they should be fetched, then served from the cache")
+		{
+			for (int i = 0; i < 3; i++) {
+				CHECK(fetch(small_upstream.command(), small.size()) == std::string(small.begin(), small.end()));
+				CHECK(fetch(large_upstream.command(), large.size()) == std::string(large.begin(), large.end()));
+				
+				// Let the fills finish, so the next round hits the cache
+				auto &registry = asio::use_service<fetch_registry>(proxy.service);
+				for (int j = 0; j < 100 && registry.size(); j++) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				}
+			}
+		}
+	}
+	
+	GIVEN("hostnames")
+	{
+		std::string port = std::to_string(small_upstream.port());
+		
+		THEN("they should be resolved, or rejected")
+		{
+			CHECK(fetch("upstream.test:" + port + "\r\n", small.size()) == std::string(small.begin(), small.end()));
+			asio::write(socket, asio::buffer("nowhere.test:" + port + "\r\n"));
+			CHECK(read_line(socket, buf) == "ERROR: Couldn't resolve nowhere.test");
+		}
+	}
+	
+	GIVEN("an invalid command")
+	{
+		asio::write(socket, asio::buffer(std::string("gibberish\r\n")));
+		
+		THEN("an error should be returned, and the connection carry on")
+		{
+			CHECK(read_line(socket, buf) == "ERROR: Format: IP:port or hostname:port");
+			CHECK(fetch(small_upstream.command(), small.size()) == std::string(small.begin(), small.end()));
+		}
+	}
+	
+	GIVEN("a pipelined connection")
+	{
+		asio::write(socket, asio::buffer(std::string("PIPELINE\r\n") + small_upstream.command() + large_upstream.command()));
+		
+		THEN("it should be handed over to the callbacks")
+		{
+			REQUIRE(read_line(socket, buf) == "OK");
+			CHECK(read_framed(socket, buf) == std::string(small.begin(), small.end()));
+			CHECK(read_framed(socket, buf) == std::string(large.begin(), large.end()));
+		}
+	}
+	
+}
+#endif
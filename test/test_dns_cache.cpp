@@ -0,0 +1,306 @@
+#include <catch.hpp>
+#include <proxything/dns_cache.h>
+#include <string>
+#include <vector>
+
+using namespace proxything;
+
+namespace
+{
+	/**
+	 * A stub lookup function, answering from a fixed set of names.
+	 */
+	struct stub_lookup
+	{
+		/// Answers lookups right away, or holds on to them if deferred
+		void operator()(const std::string &host, dns_cache::LookupHandler cb)
+		{
+			lookups.push_back(host);
+			if (deferred) {
+				pending.push_back(std::make_pair(host, cb));
+			} else {
+				answer(host, cb);
+			}
+		}
+		
+		/// Answers a lookup
+		void answer(const std::string &host, dns_cache::LookupHandler cb)
+		{
+			if (host == "example.com") {
+				cb(boost::system::error_code(), { asio::ip::address::from_string("10.0.0.1"), asio::ip::address::from_string("10.0.0.2") }, ttl);
+			} else {
+				cb(asio::error::host_not_found, {}, ttl);
+			}
+		}
+		
+		/// Answers all deferred lookups
+		void flush()
+		{
+			auto answering = std::move(pending);
+			pending.clear();
+			for (auto &p : answering) {
+				answer(p.first, p.second);
+			}
+		}
+		
+		bool deferred = false;
+		std::chrono::seconds ttl = std::chrono::seconds(-1);
+		std::vector<std::string> lookups;
+		std::vector<std::pair<std::string, dns_cache::LookupHandler>> pending;
+	};
+	
+	/**
+	 * A result of async_resolve().
+	 */
+	struct result
+	{
+		bool done = false;
+		boost::system::error_code ec;
+		asio::ip::address address;
+	};
+	
+	dns_cache::ResolveHandler store(result &r)
+	{
+		return [&r](const boost::system::error_code &ec, asio::ip::address address) {
+			r.done = true;
+			r.ec = ec;
+			r.address = address;
+		};
+	}
+	
+	void poll(asio::io_service &service)
+	{
+		service.poll();
+		service.reset();
+	}
+}
+
+SCENARIO("hostnames are resolved through a cache")
+{
+	asio::io_service service;
+	auto stub = std::make_shared<stub_lookup>();
+	
+	GIVEN("a cache with the default TTLs")
+	{
+		auto cache = new dns_cache(service);
+		asio::add_service(service, cache);
+		cache->set_lookup([stub](const std::string &host, dns_cache::LookupHandler cb) { (*stub)(host, cb); });
+		
+		WHEN("a name is resolved")
+		{
+			result r;
+			cache->async_resolve("example.com", store(r));
+			
+			THEN("the callback shouldn't run inline")
+			{
+				CHECK_FALSE(r.done);
+			}
+			
+			poll(service);
+			
+			THEN("it should resolve to the first address")
+			{
+				REQUIRE(r.done);
+				CHECK_FALSE(r.ec);
+				CHECK(r.address.to_string() == "10.0.0.1");
+			}
+			
+			THEN("resolving it again should be answered from the cache")
+			{
+				result again;
+				cache->async_resolve("example.com", store(again));
+				poll(service);
+				
+				REQUIRE(again.done);
+				CHECK(again.address.to_string() == "10.0.0.1");
+				CHECK(stub->lookups.size() == 1);
+				CHECK(cache->size() == 1);
+			}
+			
+			THEN("clearing the cache should make it look the name up again")
+			{
+				cache->clear();
+				CHECK(cache->size() == 0);
+				
+				result again;
+				cache->async_resolve("example.com", store(again));
+				poll(service);
+				
+				REQUIRE(again.done);
+				CHECK(stub->lookups.size() == 2);
+			}
+		}
+		
+		WHEN("a name can't be resolved")
+		{
+			result r;
+			cache->async_resolve("nowhere.test", store(r));
+			poll(service);
+			
+			THEN("the callback should get the error")
+			{
+				REQUIRE(r.done);
+				CHECK(r.ec == asio::error::host_not_found);
+			}
+			
+			THEN("the failure should be cached too")
+			{
+				result again;
+				cache->async_resolve("nowhere.test", store(again));
+				poll(service);
+				
+				REQUIRE(again.done);
+				CHECK(again.ec == asio::error::host_not_found);
+				CHECK(stub->lookups.size() == 1);
+			}
+		}
+		
+		WHEN("a name is resolved several times while it's being looked up")
+		{
+			stub->deferred = true;
+			result r1, r2, r3;
+			cache->async_resolve("example.com", store(r1));
+			cache->async_resolve("example.com", store(r2));
+			cache->async_resolve("example.com", store(r3));
+			poll(service);
+			
+			THEN("it should only be looked up once")
+			{
+				CHECK(stub->lookups.size() == 1);
+				CHECK_FALSE(r1.done);
+				
+				stub->flush();
+				poll(service);
+				
+				CHECK(r1.done);
+				CHECK(r2.done);
+				CHECK(r3.done);
+				CHECK(r3.address.to_string() == "10.0.0.1");
+			}
+		}
+		
+		WHEN("the lookup says not to cache the result")
+		{
+			stub->ttl = std::chrono::seconds(0);
+			result r1, r2;
+			cache->async_resolve("example.com", store(r1));
+			poll(service);
+			cache->async_resolve("example.com", store(r2));
+			poll(service);
+			
+			THEN("it should be looked up every time")
+			{
+				CHECK(r2.done);
+				CHECK(stub->lookups.size() == 2);
+			}
+		}
+		WHEN("more names are resolved than fit in the cache")
+		{
+			for (std::size_t i = 0; i <= PROXYTHING_DNS_CACHE_SIZE; i++) {
+				result r;
+				cache->async_resolve("host" + std::to_string(i) + ".test", store(r));
+				poll(service);
+			}
+			
+			THEN("it should have made room for a batch of them at once")
+			{
+				CHECK(cache->size() == PROXYTHING_DNS_CACHE_SIZE - PROXYTHING_DNS_CACHE_EVICT_BATCH + 1);
+			}
+			
+			THEN("the oldest entries should have been evicted")
+			{
+				result r;
+				cache->async_resolve("host" + std::to_string(PROXYTHING_DNS_CACHE_EVICT_BATCH - 1) + ".test", store(r));
+				poll(service);
+				
+				CHECK(stub->lookups.size() == PROXYTHING_DNS_CACHE_SIZE + 2);
+			}
+			
+			THEN("newer entries should still be cached")
+			{
+				result r;
+				cache->async_resolve("host" + std::to_string(PROXYTHING_DNS_CACHE_EVICT_BATCH) + ".test", store(r));
+				poll(service);
+				
+				CHECK(stub->lookups.size() == PROXYTHING_DNS_CACHE_SIZE + 1);
+			}
+			
+			THEN("more names should fit without evicting anything else")
+			{
+				for (std::size_t i = 0; i < PROXYTHING_DNS_CACHE_EVICT_BATCH - 1; i++) {
+					result r;
+					cache->async_resolve("more" + std::to_string(i) + ".test", store(r));
+					poll(service);
+				}
+				
+				CHECK(cache->size() == PROXYTHING_DNS_CACHE_SIZE);
+			}
+		}
+	}
+	
+	GIVEN("a cache with a TTL of 0")
+	{
+		auto cache = new dns_cache(service, std::chrono::seconds(0));
+		asio::add_service(service, cache);
+		cache->set_lookup([stub](const std::string &host, dns_cache::LookupHandler cb) { (*stub)(host, cb); });
+		
+		WHEN("a name is resolved twice")
+		{
+			result r1, r2;
+			cache->async_resolve("example.com", store(r1));
+			poll(service);
+			cache->async_resolve("example.com", store(r2));
+			poll(service);
+			
+			THEN("it should be looked up both times")
+			{
+				CHECK(r1.done);
+				CHECK(r2.done);
+				CHECK(stub->lookups.size() == 2);
+			}
+		}
+		
+		WHEN("a name can't be resolved")
+		{
+			result r1, r2;
+			cache->async_resolve("nowhere.test", store(r1));
+			poll(service);
+			cache->async_resolve("nowhere.test", store(r2));
+			poll(service);
+			
+			THEN("the failure should still be cached")
+			{
+				CHECK(r2.ec == asio::error::host_not_found);
+				CHECK(stub->lookups.size() == 1);
+			}
+		}
+	}
+	
+	GIVEN("a cache shared with another IO service")
+	{
+		asio::io_service other;
+		auto primary = new dns_cache(service);
+		asio::add_service(service, primary);
+		auto secondary = new dns_cache(other, *primary);
+		asio::add_service(other, secondary);
+		secondary->set_lookup([stub](const std::string &host, dns_cache::LookupHandler cb) { (*stub)(host, cb); });
+		
+		WHEN("a name is resolved through both")
+		{
+			result r1, r2;
+			secondary->async_resolve("example.com", store(r1));
+			poll(service);
+			poll(other);
+			primary->async_resolve("example.com", store(r2));
+			poll(service);
+			
+			THEN("it should only be looked up once")
+			{
+				CHECK(r1.done);
+				CHECK(r2.done);
+				CHECK(stub->lookups.size() == 1);
+				CHECK(secondary->size() == 1);
+			}
+		}
+	}
+}
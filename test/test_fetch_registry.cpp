@@ -0,0 +1,75 @@
+#include <catch.hpp>
+#include <proxything/fetch_registry.h>
+#include <proxything/remote_connection.h>
+
+using namespace proxything;
+
+SCENARIO("concurrent fetches are coalesced")
+{
+	asio::io_service service;
+	fetch_registry &registry = asio::use_service<fetch_registry>(service);
+	asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string("127.0.0.1"), 1234);
+	
+	GIVEN("a registered fetch")
+	{
+		auto remote = std::make_shared<remote_connection>(service, endpoint, nullptr);
+		REQUIRE(registry.insert(endpoint, remote) == remote);
+		
+		THEN("it should be found")
+		{
+			CHECK(registry.find(endpoint) == remote);
+			CHECK(registry.size() == 1);
+		}
+		
+		THEN("other endpoints should not find it")
+		{
+			asio::ip::tcp::endpoint other(asio::ip::address::from_string("127.0.0.1"), 1235);
+			CHECK(registry.find(other) == nullptr);
+		}
+		
+		WHEN("another fetch is registered for the same endpoint")
+		{
+			auto other = std::make_shared<remote_connection>(service, endpoint, nullptr);
+			auto fetch = registry.insert(endpoint, other);
+			
+			THEN("the first one should be returned")
+			{
+				CHECK(fetch == remote);
+				CHECK(registry.find(endpoint) == remote);
+			}
+			
+			THEN("erasing the other one should do nothing")
+			{
+				registry.erase(endpoint, other.get());
+				CHECK(registry.find(endpoint) == remote);
+			}
+		}
+		
+		WHEN("it's erased")
+		{
+			registry.erase(endpoint, remote.get());
+			
+			THEN("it should be gone")
+			{
+				CHECK(registry.find(endpoint) == nullptr);
+				CHECK(registry.size() == 0);
+			}
+		}
+		
+		WHEN("it's destroyed")
+		{
+			remote.reset();
+			
+			THEN("it should not be found")
+			{
+				CHECK(registry.find(endpoint) == nullptr);
+			}
+			
+			THEN("a new fetch should take its place")
+			{
+				auto other = std::make_shared<remote_connection>(service, endpoint, nullptr);
+				CHECK(registry.insert(endpoint, other) == other);
+			}
+		}
+	}
+}
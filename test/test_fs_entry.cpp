@@ -1,6 +1,9 @@
 #include <catch.hpp>
 #include <proxything/fs_entry.h>
+#include <proxything/recycler.h>
 #include <proxything/util.h>
+#include <memory>
+#include <thread>
 
 using namespace proxything;
 
@@ -66,6 +69,40 @@ SCENARIO("files can be opened")
 			}
 		}
 		
+		WHEN("it's read into multiple buffers")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, read_ec;
+			std::size_t read_size;
+			std::vector<char> buf_1(5), buf_2(6);
+			std::vector<asio::mutable_buffer> bufs = { asio::buffer(buf_1), asio::buffer(buf_2) };
+			entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				entry.async_read_some(bufs, [&](const boost::system::error_code &ec, std::size_t size) {
+					read_ec = ec;
+					read_size = size;
+					
+					entry.async_close();
+				});
+			});
+			service.run();
+			
+			THEN("it shouldn't error")
+			{
+				REQUIRE_FALSE(open_ec);
+				REQUIRE_FALSE(read_ec);
+			}
+			
+			THEN("it should fill the buffers in order")
+			{
+				REQUIRE(read_size == 11);
+				CHECK(std::string(buf_1.begin(), buf_1.end()) == "Lorem");
+				CHECK(std::string(buf_2.begin(), buf_2.end()) == " ipsum");
+			}
+		}
+		
 		WHEN("it's written to")
 		{
 			fs_entry entry(service);
@@ -113,6 +150,7 @@ SCENARIO("files can be opened")
 			fs_entry entry(service);
 			boost::system::error_code open_ec, write_ec, close_ec;
 			bool exists_1, exists_2, exists_3;
+			std::string temp_path, temp_content;
 			
 			std::string buf_str("This is a test string.");
 			std::vector<char> buf(buf_str.begin(), buf_str.end());
@@ -128,6 +166,10 @@ SCENARIO("files can be opened")
 					
 					exists_2 = fs::exists(path);
 					
+					temp_path = entry.path();
+					std::ifstream temp_stream(temp_path);
+					temp_content.assign(std::istreambuf_iterator<char>(temp_stream), std::istreambuf_iterator<char>());
+					
 					entry.async_close([&](const boost::system::error_code &ec) {
 						close_ec = ec;
 						
@@ -150,6 +192,471 @@ SCENARIO("files can be opened")
 				CHECK_FALSE(exists_2);
 				CHECK(exists_3);
 			}
+			
+			THEN("its data should be readable from path() while it's written")
+			{
+				CHECK(temp_path != path);
+				CHECK(temp_content == buf_str);
+			}
+		}
+		
+		WHEN("an atomic write can't be moved into place")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, close_ec;
+			std::string temp_path;
+			bool temp_exists = true;
+			
+			entry.async_open_atomic(path + "/missing", [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				temp_path = entry.path();
+				entry.async_close([&](const boost::system::error_code &ec) {
+					close_ec = ec;
+					
+					temp_exists = fs::exists(temp_path);
+				});
+			});
+			service.run();
+			
+			THEN("closing it should fail")
+			{
+				REQUIRE_FALSE(open_ec);
+				CHECK(close_ec);
+			}
+			
+			THEN("the temporary file shouldn't be left behind")
+			{
+				CHECK_FALSE(temp_exists);
+			}
+		}
+		
+		WHEN("an atomic write is discarded")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, write_ec, discard_ec;
+			std::string temp_path;
+			bool exists = true, temp_exists = true;
+			
+			std::string buf_str("This is a test string.");
+			std::vector<char> buf(buf_str.begin(), buf_str.end());
+			
+			entry.async_open_atomic(path, [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				temp_path = entry.path();
+				async_write(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					write_ec = ec;
+					
+					entry.async_discard([&](const boost::system::error_code &ec) {
+						discard_ec = ec;
+						
+						exists = fs::exists(path);
+						temp_exists = fs::exists(temp_path);
+					});
+				});
+			});
+			service.run();
+			
+			THEN("it shouldn't error")
+			{
+				REQUIRE_FALSE(open_ec);
+				REQUIRE_FALSE(write_ec);
+				REQUIRE_FALSE(discard_ec);
+			}
+			
+			THEN("neither it nor the temporary file should exist")
+			{
+				CHECK_FALSE(exists);
+				CHECK_FALSE(temp_exists);
+			}
+		}
+		
+		try {
+			fs::remove(path);
+		} catch(fs::filesystem_error &e) {
+			// Do nothing
+		}
+	}
+}
+
+SCENARIO("file operations take completion tokens")
+{
+	asio::io_service service;
+	
+	GIVEN("a file")
+	{
+		util::tmp_file file("Lorem ipsum dolor sit amet");
+		
+		WHEN("it's read using futures")
+		{
+			std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+			std::thread thread([&]{ service.run(); });
+			
+			fs_entry entry(service);
+			std::vector<char> buf(5);
+			entry.async_open(file.path(), asio::use_future).get();
+			std::size_t size = entry.async_read_some(asio::buffer(buf), asio::use_future).get();
+			entry.async_close(asio::use_future).get();
+			
+			work.reset();
+			thread.join();
+			
+			THEN("it should read the correct data")
+			{
+				REQUIRE(size == 5);
+				CHECK(std::string(buf.begin(), buf.end()) == "Lorem");
+			}
+		}
+		
+		WHEN("it's read with a strand-wrapped handler")
+		{
+			asio::io_service::strand strand(service);
+			fs_entry entry(service);
+			std::vector<char> buf(5);
+			bool in_strand = false;
+			entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				entry.async_read_some(asio::buffer(buf), strand.wrap([&](const boost::system::error_code &ec, std::size_t size) {
+					in_strand = strand.running_in_this_thread();
+					entry.async_close();
+				}));
+			});
+			service.run();
+			
+			THEN("the handler should run in the strand")
+			{
+				CHECK(in_strand);
+			}
+		}
+		
+		WHEN("it's read with recycled handlers")
+		{
+			fs_entry entry(service);
+			std::vector<char> buf(1);
+			std::size_t before = 0, after = 0;
+			entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				entry.async_read_some(asio::buffer(buf), recycle([&](const boost::system::error_code &ec, std::size_t size) {
+					before = recycler::cached();
+					entry.async_read_some(asio::buffer(buf), recycle([&](const boost::system::error_code &ec, std::size_t size) {
+						after = recycler::cached();
+						entry.async_close();
+					}));
+				}));
+			});
+			service.run();
+			
+			THEN("each read should reuse the memory of the last")
+			{
+				CHECK(before > 0);
+				CHECK(after == before);
+			}
+		}
+		
+		WHEN("the service is destroyed before an operation's handler is called")
+		{
+			std::weak_ptr<int> token;
+			bool called = false;
+			{
+				asio::io_service other;
+				fs_entry entry(other);
+				auto p = std::make_shared<int>(0);
+				token = p;
+				entry.async_open(file.path(), [p, &called](const boost::system::error_code &ec) {
+					called = true;
+				});
+				
+				// Let the worker finish with the entry, so only the handler's
+				// left pending
+				auto scheduler = asio::use_service<fs_service>(other).scheduler();
+				REQUIRE(scheduler);
+				while (!scheduler->stats(fs_service::io_class::foreground).completed) {
+					std::this_thread::yield();
+				}
+			}
+			
+			THEN("the handler should be freed without being called")
+			{
+				CHECK_FALSE(called);
+				CHECK(token.expired());
+			}
+		}
+	}
+}
+
+SCENARIO("files in the page cache can be read without waiting for the disk")
+{
+	asio::io_service service;
+	
+	GIVEN("a file that's just been written")
+	{
+		util::tmp_file file("Lorem ipsum dolor sit amet");
+		
+		WHEN("it's read without waiting")
+		{
+			std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(service));
+			std::thread thread([&]{ service.run(); });
+			
+			fs_entry entry(service);
+			entry.async_open(file.path(), asio::use_future).get();
+			
+			std::vector<char> buf(5);
+			boost::system::error_code ec;
+			std::size_t size = entry.read_some_nowait(asio::buffer(buf), ec);
+			
+			// Whatever's left must be readable either way
+			std::vector<char> rest(64);
+			std::size_t rest_size;
+			if (ec == asio::error::would_block) {
+				rest_size = async_read(entry, asio::buffer(rest), asio::use_future).get();
+			} else {
+				rest_size = entry.read_some_nowait(asio::buffer(rest), ec);
+			}
+			entry.async_close(asio::use_future).get();
+			
+			work.reset();
+			thread.join();
+			
+			auto &fs = asio::use_service<fs_service>(service);
+			
+			THEN("it should be read right away, or be left for the backend")
+			{
+				if (ec == asio::error::would_block) {
+					WARN("RWF_NOWAIT is not supported, skipping");
+					CHECK(size == 0);
+					CHECK(fs.fallback_reads() == 1);
+				} else {
+					CHECK(std::string(buf.begin(), buf.begin() + size) == "Lorem");
+					CHECK(std::string(rest.begin(), rest.begin() + rest_size) == " ipsum dolor sit amet");
+					CHECK(fs.nowait_reads() == 2);
+				}
+			}
+		}
+	}
+}
+
+SCENARIO("files can be used through io_uring")
+{
+	if (!fs_service::supported(fs_service::backend_type::uring)) {
+		WARN("io_uring is not supported, skipping");
+		return;
+	}
+	
+	asio::io_service service;
+	auto fs = new fs_service(service, fs_service::backend_type::uring);
+	asio::add_service<fs_service>(service, fs);
+	REQUIRE(fs->backend() == fs_service::backend_type::uring);
+	
+	GIVEN("a file")
+	{
+		util::tmp_file file("Lorem ipsum dolor sit amet");
+		
+		WHEN("it's read into an allocated buffer")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, read_ec, close_ec;
+			std::size_t read_size;
+			asio::mutable_buffer buf = fs->allocate_buffer(1024);
+			entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				async_read(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					read_ec = ec;
+					read_size = size;
+					
+					entry.async_close([&](const boost::system::error_code &ec) {
+						close_ec = ec;
+					});
+				});
+			});
+			service.run();
+			
+			std::string content(asio::buffer_cast<char*>(buf), read_size);
+			fs->deallocate_buffer(buf);
+			
+			THEN("it shouldn't error")
+			{
+				REQUIRE_FALSE(open_ec);
+				REQUIRE(read_ec == asio::error::eof);
+				REQUIRE_FALSE(close_ec);
+			}
+			
+			THEN("it should read the correct data")
+			{
+				REQUIRE(content == "Lorem ipsum dolor sit amet");
+			}
+		}
+		
+		WHEN("it's read without waiting")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, read_ec;
+			entry.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				char buf[64];
+				entry.read_some_nowait(asio::buffer(buf), read_ec);
+			});
+			service.run();
+			
+			THEN("it should be left to the ring, and counted as such")
+			{
+				REQUIRE_FALSE(open_ec);
+				CHECK(read_ec == asio::error::would_block);
+				CHECK(fs->nowait_reads() == 0);
+				CHECK(fs->fallback_reads() == 1);
+			}
+		}
+	}
+	
+	GIVEN("a path")
+	{
+		std::string path = util::tmp_path();
+		
+		WHEN("it's atomically written")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, write_ec, close_ec;
+			bool exists_1, exists_2;
+			
+			std::string buf_str("This is a test string.");
+			std::vector<char> buf(buf_str.begin(), buf_str.end());
+			
+			entry.async_open_atomic(path, [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				async_write(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					write_ec = ec;
+					
+					exists_1 = fs::exists(path);
+					
+					entry.async_close([&](const boost::system::error_code &ec) {
+						close_ec = ec;
+						
+						exists_2 = fs::exists(path);
+					});
+				});
+			});
+			service.run();
+			
+			THEN("it shouldn't error")
+			{
+				REQUIRE_FALSE(open_ec);
+				REQUIRE_FALSE(write_ec);
+				REQUIRE_FALSE(close_ec);
+			}
+			
+			THEN("it should not exist until it's closed")
+			{
+				CHECK_FALSE(exists_1);
+				CHECK(exists_2);
+			}
+			
+			THEN("it should have the right contents")
+			{
+				std::ifstream f(path);
+				std::string content((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+				REQUIRE(content == "This is a test string.");
+			}
+		}
+		
+		WHEN("an atomic write can't be moved into place")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, close_ec;
+			std::string temp_path;
+			bool temp_exists = true;
+			
+			entry.async_open_atomic(path + "/missing", [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				temp_path = entry.path();
+				entry.async_close([&](const boost::system::error_code &ec) {
+					close_ec = ec;
+					
+					temp_exists = fs::exists(temp_path);
+				});
+			});
+			service.run();
+			
+			THEN("closing it should fail")
+			{
+				REQUIRE_FALSE(open_ec);
+				CHECK(close_ec);
+			}
+			
+			THEN("the temporary file shouldn't be left behind")
+			{
+				CHECK_FALSE(temp_exists);
+			}
+		}
+		
+		WHEN("an atomic write is discarded")
+		{
+			fs_entry entry(service);
+			boost::system::error_code open_ec, write_ec, discard_ec;
+			std::string temp_path;
+			bool exists = true, temp_exists = true;
+			
+			std::string buf_str("This is a test string.");
+			std::vector<char> buf(buf_str.begin(), buf_str.end());
+			
+			entry.async_open_atomic(path, [&](const boost::system::error_code &ec) {
+				open_ec = ec;
+				if (ec) { return; }
+				
+				temp_path = entry.path();
+				async_write(entry, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					write_ec = ec;
+					
+					entry.async_discard([&](const boost::system::error_code &ec) {
+						discard_ec = ec;
+						
+						exists = fs::exists(path);
+						temp_exists = fs::exists(temp_path);
+					});
+				});
+			});
+			service.run();
+			
+			THEN("it shouldn't error")
+			{
+				REQUIRE_FALSE(open_ec);
+				REQUIRE_FALSE(write_ec);
+				REQUIRE_FALSE(discard_ec);
+			}
+			
+			THEN("neither it nor the temporary file should exist")
+			{
+				CHECK_FALSE(exists);
+				CHECK_FALSE(temp_exists);
+			}
+		}
+		
+		WHEN("more operations are started at once than fit in the ring")
+		{
+			std::size_t n = PROXYTHING_URING_ENTRIES * 4;
+			std::size_t done = 0, missing = 0;
+			for (std::size_t i = 0; i < n; i++) {
+				fs->async_remove(path, [&](const boost::system::error_code &ec) {
+					done++;
+					if (ec == boost::system::errc::no_such_file_or_directory) {
+						missing++;
+					}
+				});
+			}
+			service.run();
+			
+			THEN("they should all complete")
+			{
+				CHECK(done == n);
+				CHECK(missing == n);
+			}
 		}
 		
 		try {
@@ -0,0 +1,391 @@
+#include <catch.hpp>
+#include <proxything/impl/fs_scheduler.h>
+#include <proxything/fs_entry.h>
+#include <proxything/util.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace proxything;
+using impl::fs_scheduler;
+
+namespace
+{
+	/**
+	 * A task that records when it's started.
+	 */
+	struct recording_task : fs_scheduler::task
+	{
+		recording_task(fs_scheduler::io_class cls, std::vector<fs_scheduler::io_class> &started):
+			started(started)
+		{
+			this->cls = cls;
+			this->start = [](fs_scheduler::task *t) {
+				static_cast<recording_task*>(t)->started.push_back(t->cls);
+			};
+		}
+		
+		std::vector<fs_scheduler::io_class> &started;
+	};
+	
+	/**
+	 * A task that records its number when it's started, and finishes right
+	 * away.
+	 */
+	struct numbered_task : fs_scheduler::task
+	{
+		numbered_task(fs_scheduler &scheduler, std::size_t n, std::mutex &mutex, std::vector<std::size_t> &started):
+			scheduler(scheduler), n(n), mutex(mutex), started(started)
+		{
+			this->start = [](fs_scheduler::task *t) {
+				// Give other threads a chance to start theirs meanwhile
+				std::this_thread::yield();
+				
+				auto self = static_cast<numbered_task*>(t);
+				{
+					std::lock_guard<std::mutex> lock(self->mutex);
+					self->started.push_back(self->n);
+				}
+				self->scheduler.finish(self->cls);
+			};
+		}
+		
+		fs_scheduler &scheduler;
+		std::size_t n;
+		std::mutex &mutex;
+		std::vector<std::size_t> &started;
+	};
+}
+
+SCENARIO("queue latencies are recorded in histograms")
+{
+	fs_scheduler::histogram h;
+	
+	GIVEN("some latencies")
+	{
+		h.record(std::chrono::nanoseconds(500));
+		h.record(std::chrono::microseconds(1));
+		h.record(std::chrono::microseconds(3));
+		h.record(std::chrono::microseconds(100));
+		
+		THEN("they should be in power-of-two buckets")
+		{
+			CHECK(h.count() == 4);
+			CHECK(h.bucket(0) == 1);
+			CHECK(h.bucket(1) == 1);
+			CHECK(h.bucket(2) == 1);
+			CHECK(h.bucket(7) == 1);
+		}
+		
+		THEN("percentiles should be the upper bounds of their buckets")
+		{
+			CHECK(h.percentile(0.25) == std::chrono::microseconds(1));
+			CHECK(h.percentile(0.5) == std::chrono::microseconds(2));
+			CHECK(h.percentile(0.99) == std::chrono::microseconds(128));
+		}
+	}
+	
+	GIVEN("nothing")
+	{
+		THEN("percentiles should be 0")
+		{
+			CHECK(h.percentile(0.5) == std::chrono::microseconds(0));
+		}
+	}
+}
+
+SCENARIO("disk operations are scheduled by priority class")
+{
+	typedef fs_scheduler::io_class io_class;
+	
+	std::vector<io_class> started;
+	std::deque<recording_task> tasks;
+	auto submit = [&](fs_scheduler &scheduler, io_class cls, std::size_t n) {
+		for (std::size_t i = 0; i < n; i++) {
+			tasks.emplace_back(cls, started);
+			scheduler.submit(&tasks.back());
+		}
+	};
+	
+	GIVEN("a scheduler with one slot, and operations of every class queued")
+	{
+		fs_scheduler scheduler(1);
+		scheduler.set_weight(io_class::foreground, 4);
+		scheduler.set_weight(io_class::background, 2);
+		scheduler.set_weight(io_class::maintenance, 1);
+		
+		// Hold the slot, so the rest queue up
+		submit(scheduler, io_class::foreground, 1);
+		submit(scheduler, io_class::maintenance, 7);
+		submit(scheduler, io_class::background, 14);
+		submit(scheduler, io_class::foreground, 28);
+		
+		THEN("only one should be started")
+		{
+			CHECK(started.size() == 1);
+			CHECK(scheduler.stats(io_class::foreground).queued == 28);
+		}
+		
+		WHEN("they finish one at a time")
+		{
+			for (int i = 0; i < 49; i++) {
+				scheduler.finish(started.back());
+			}
+			
+			THEN("classes should get turns in proportion to their weights")
+			{
+				REQUIRE(started.size() == 50);
+				
+				std::vector<io_class> first(started.begin() + 1, started.begin() + 36);
+				CHECK(std::count(first.begin(), first.end(), io_class::foreground) == 20);
+				CHECK(std::count(first.begin(), first.end(), io_class::background) == 10);
+				CHECK(std::count(first.begin(), first.end(), io_class::maintenance) == 5);
+			}
+			
+			THEN("their queue latencies should be recorded")
+			{
+				CHECK(scheduler.stats(io_class::foreground).latency.count() == 29);
+				CHECK(scheduler.stats(io_class::background).latency.count() == 14);
+				CHECK(scheduler.stats(io_class::maintenance).latency.count() == 7);
+				CHECK(scheduler.stats(io_class::background).completed == 14);
+			}
+		}
+	}
+	
+	GIVEN("a scheduler with more slots than a class may use")
+	{
+		fs_scheduler scheduler(4);
+		scheduler.set_depth(io_class::background, 2);
+		submit(scheduler, io_class::background, 4);
+		
+		THEN("only that many of its operations should be started")
+		{
+			CHECK(started.size() == 2);
+			CHECK(scheduler.stats(io_class::background).in_flight == 2);
+		}
+		
+		THEN("other classes should still get the remaining slots")
+		{
+			submit(scheduler, io_class::foreground, 4);
+			CHECK(started.size() == 4);
+			CHECK(scheduler.stats(io_class::foreground).queued == 2);
+		}
+		
+		THEN("raising the limit should start more")
+		{
+			scheduler.set_depth(io_class::background, 3);
+			CHECK(started.size() == 3);
+		}
+		
+		THEN("draining should start everything")
+		{
+			submit(scheduler, io_class::maintenance, 2);
+			scheduler.drain();
+			CHECK(started.size() == 6);
+			
+			submit(scheduler, io_class::foreground, 1);
+			CHECK(started.size() == 7);
+		}
+	}
+	
+	GIVEN("a scheduler with a class limited in queue length")
+	{
+		fs_scheduler scheduler(4);
+		scheduler.set_depth(io_class::background, 1);
+		scheduler.set_queue_limit(io_class::background, 2);
+		submit(scheduler, io_class::background, 2);
+		
+		THEN("it shouldn't be backlogged under the limit")
+		{
+			CHECK(started.size() == 1);
+			CHECK_FALSE(scheduler.backlogged(io_class::background));
+		}
+		
+		THEN("it should be backlogged at the limit")
+		{
+			submit(scheduler, io_class::background, 1);
+			CHECK(scheduler.backlogged(io_class::background));
+			CHECK_FALSE(scheduler.backlogged(io_class::foreground));
+		}
+		
+		THEN("removing the limit should clear the backlog")
+		{
+			submit(scheduler, io_class::background, 4);
+			scheduler.set_queue_limit(io_class::background, 0);
+			CHECK_FALSE(scheduler.backlogged(io_class::background));
+		}
+		
+		WHEN("its backlog keeps growing past the limit")
+		{
+			submit(scheduler, io_class::background, 100);
+			submit(scheduler, io_class::foreground, 3);
+			
+			THEN("everything should still be queued")
+			{
+				CHECK(scheduler.stats(io_class::background).queued == 101);
+				CHECK(scheduler.stats(io_class::background).over_limit == 99);
+			}
+			
+			THEN("it should stay within its depth limit")
+			{
+				CHECK(scheduler.stats(io_class::background).in_flight == 1);
+			}
+			
+			THEN("foreground operations should still be started right away")
+			{
+				CHECK(started.size() == 4);
+				CHECK(scheduler.stats(io_class::foreground).in_flight == 3);
+				CHECK(scheduler.stats(io_class::foreground).latency.percentile(1.0) <= std::chrono::microseconds(1024));
+			}
+			
+			THEN("it should work off the backlog as operations finish")
+			{
+				for (int i = 0; i < 101; i++) {
+					scheduler.finish(io_class::background);
+				}
+				CHECK(scheduler.stats(io_class::background).completed == 101);
+				CHECK(scheduler.stats(io_class::background).in_flight == 1);
+				CHECK_FALSE(scheduler.backlogged(io_class::background));
+			}
+		}
+	}
+	
+	GIVEN("operations submitted from several threads at once")
+	{
+		const std::size_t num_threads = 4, per_thread = 2000;
+		fs_scheduler scheduler(2);
+		
+		std::mutex mutex;
+		std::vector<std::vector<std::size_t>> started_by(num_threads);
+		std::deque<numbered_task> numbered;
+		for (std::size_t i = 0; i < num_threads; i++) {
+			for (std::size_t n = 0; n < per_thread; n++) {
+				numbered.emplace_back(scheduler, n, mutex, started_by[i]);
+			}
+		}
+		
+		std::vector<std::thread> threads;
+		for (std::size_t i = 0; i < num_threads; i++) {
+			threads.emplace_back([&, i]{
+				for (std::size_t n = 0; n < per_thread; n++) {
+					scheduler.submit(&numbered[i * per_thread + n]);
+				}
+			});
+		}
+		for (auto &thread : threads) {
+			thread.join();
+		}
+		
+		THEN("each thread's should be started in the order they were submitted")
+		{
+			for (auto &s : started_by) {
+				REQUIRE(s.size() == per_thread);
+				CHECK(std::is_sorted(s.begin(), s.end()));
+			}
+			CHECK(scheduler.stats(io_class::foreground).completed == num_threads * per_thread);
+		}
+	}
+}
+
+SCENARIO("fs_service runs file operations through the scheduler")
+{
+	asio::io_service service;
+	auto &fs = asio::use_service<fs_service>(service);
+	REQUIRE(fs.scheduler());
+	
+	GIVEN("a file and a path")
+	{
+		util::tmp_file file("Lorem ipsum dolor sit amet");
+		std::string path = util::tmp_path();
+		
+		WHEN("one is read, the other written as a background entry, and removed")
+		{
+			fs_entry reader(service), writer(service);
+			writer.set_io_class(fs_service::io_class::background);
+			
+			std::vector<char> buf(26);
+			std::string data("data");
+			std::size_t read_size = 0, written_size = 0;
+			boost::system::error_code remove_ec;
+			reader.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				async_read(reader, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					read_size = size;
+					reader.async_close();
+				});
+			});
+			writer.async_open(path, std::ios_base::out|std::ios_base::trunc, [&](const boost::system::error_code &ec) {
+				async_write(writer, asio::buffer(data), [&](const boost::system::error_code &ec, std::size_t size) {
+					written_size = size;
+					writer.async_close([&](const boost::system::error_code &ec) {
+						fs.async_remove(path, [&](const boost::system::error_code &ec) {
+							remove_ec = ec;
+						});
+					});
+				});
+			});
+			service.run();
+			
+			THEN("they should be done")
+			{
+				CHECK(read_size == 26);
+				CHECK(written_size == 4);
+				CHECK_FALSE(remove_ec);
+			}
+			
+			THEN("each should be scheduled in its class")
+			{
+				// Workers may not have marked the last one finished yet, but
+				// they've all been let through
+				CHECK(fs.scheduler()->stats(fs_service::io_class::foreground).latency.count() >= 3);
+				CHECK(fs.scheduler()->stats(fs_service::io_class::background).latency.count() == 3);
+				CHECK(fs.scheduler()->stats(fs_service::io_class::maintenance).latency.count() == 1);
+			}
+		}
+		
+		WHEN("background writes back up past the queue limit while a file is read")
+		{
+			fs.scheduler()->set_queue_limit(fs_service::io_class::background, 4);
+			
+			fs_entry reader(service), writer(service);
+			writer.set_io_class(fs_service::io_class::background);
+			
+			std::string data(4096, 'x');
+			std::size_t written = 0;
+			writer.async_open(path, std::ios_base::out|std::ios_base::trunc, [&](const boost::system::error_code &ec) {
+				REQUIRE_FALSE(ec);
+				for (int i = 0; i < 64; i++) {
+					writer.async_write_some(asio::buffer(data), [&](const boost::system::error_code &ec, std::size_t size) {
+						if (!ec) {
+							written++;
+						}
+					});
+				}
+			});
+			
+			std::vector<char> buf(26);
+			std::size_t read_size = 0;
+			reader.async_open(file.path(), [&](const boost::system::error_code &ec) {
+				async_read(reader, asio::buffer(buf), [&](const boost::system::error_code &ec, std::size_t size) {
+					read_size = size;
+				});
+			});
+			service.run();
+			
+			THEN("every write should still go through")
+			{
+				CHECK(written == 64);
+				CHECK(fs.scheduler()->stats(fs_service::io_class::background).latency.count() >= 65);
+			}
+			
+			THEN("the read should still go through")
+			{
+				CHECK(read_size == 26);
+				CHECK(fs.scheduler()->stats(fs_service::io_class::foreground).latency.percentile(0.99) <= std::chrono::milliseconds(100));
+			}
+			
+			::unlink(path.c_str());
+		}
+	}
+}
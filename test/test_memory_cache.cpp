@@ -0,0 +1,182 @@
+#include <catch.hpp>
+#include <proxything/memory_cache.h>
+
+using namespace proxything;
+
+namespace
+{
+	asio::ip::tcp::endpoint endpoint_for(unsigned short port)
+	{
+		return asio::ip::tcp::endpoint(asio::ip::address::from_string("127.0.0.1"), port);
+	}
+	
+	memory_cache::buffer_ptr object(std::size_t size, char c = 'x')
+	{
+		return std::make_shared<std::vector<char>>(size, c);
+	}
+}
+
+SCENARIO("hot objects are cached in memory")
+{
+	asio::io_service service;
+	memory_cache cache(service, 1000);
+	
+	GIVEN("an object")
+	{
+		auto data = object(10);
+		REQUIRE(cache.insert(endpoint_for(1), data));
+		
+		THEN("it should be found")
+		{
+			CHECK(cache.find(endpoint_for(1)) == data);
+			CHECK(cache.find(endpoint_for(2)) == nullptr);
+			CHECK(cache.size() == 10);
+			CHECK(cache.count() == 1);
+		}
+		
+		WHEN("it's replaced")
+		{
+			auto other = object(20, 'y');
+			REQUIRE(cache.insert(endpoint_for(1), other));
+			
+			THEN("the new data should be found")
+			{
+				CHECK(cache.find(endpoint_for(1)) == other);
+				CHECK(cache.size() == 20);
+				CHECK(cache.count() == 1);
+			}
+		}
+		
+		WHEN("it's erased")
+		{
+			cache.erase(endpoint_for(1));
+			
+			THEN("it should be gone")
+			{
+				CHECK(cache.find(endpoint_for(1)) == nullptr);
+				CHECK(cache.size() == 0);
+			}
+			
+			THEN("readers should keep their reference")
+			{
+				CHECK(data->size() == 10);
+			}
+		}
+	}
+	
+	GIVEN("an object that's too large")
+	{
+		THEN("it should not be cached")
+		{
+			CHECK_FALSE(cache.insert(endpoint_for(1), object(500)));
+			CHECK(cache.find(endpoint_for(1)) == nullptr);
+		}
+	}
+	
+	GIVEN("a disabled cache")
+	{
+		memory_cache disabled(service, 0);
+		
+		THEN("nothing should be cached")
+		{
+			CHECK_FALSE(disabled.insert(endpoint_for(1), object(0)));
+		}
+	}
+	
+	GIVEN("more objects than fit")
+	{
+		for (unsigned short port = 1; port <= 500; port++) {
+			cache.insert(endpoint_for(port), object(10));
+		}
+		
+		THEN("it should stay within its budget")
+		{
+			CHECK(cache.size() <= 1000);
+			CHECK(cache.find(endpoint_for(500)) != nullptr);
+		}
+	}
+	
+	GIVEN("a hot object, followed by a scan")
+	{
+		cache.insert(endpoint_for(1), object(10));
+		cache.find(endpoint_for(1));
+		
+		for (unsigned short port = 2; port <= 500; port++) {
+			cache.insert(endpoint_for(port), object(10));
+		}
+		
+		THEN("the hot object should survive")
+		{
+			CHECK(cache.find(endpoint_for(1)) != nullptr);
+		}
+		
+		THEN("the start of the scan should not")
+		{
+			CHECK(cache.find(endpoint_for(2)) == nullptr);
+		}
+	}
+	
+	GIVEN("an object that was recently evicted")
+	{
+		for (unsigned short port = 1; port <= 150; port++) {
+			cache.insert(endpoint_for(port), object(10));
+		}
+		REQUIRE(cache.find(endpoint_for(1)) == nullptr);
+		
+		WHEN("it's inserted again")
+		{
+			cache.insert(endpoint_for(1), object(10));
+			
+			for (unsigned short port = 151; port <= 500; port++) {
+				cache.insert(endpoint_for(port), object(10));
+			}
+			
+			THEN("it should have gone into the main queue, and survive a scan")
+			{
+				CHECK(cache.find(endpoint_for(1)) != nullptr);
+			}
+		}
+	}
+	
+	GIVEN("an object that was evicted again after a ghost hit")
+	{
+		// A hot set filling the main queue, so the ghost queue remembers
+		// more keys than the small queue holds
+		for (unsigned short port = 1000; port < 1090; port++) {
+			cache.insert(endpoint_for(port), object(10));
+			cache.find(endpoint_for(port));
+		}
+		
+		cache.insert(endpoint_for(1), object(10));
+		for (unsigned short port = 2; port <= 20; port++) {
+			cache.insert(endpoint_for(port), object(10));
+		}
+		REQUIRE(cache.find(endpoint_for(1)) == nullptr);
+		
+		cache.insert(endpoint_for(1), object(10));
+		cache.erase(endpoint_for(1));
+		
+		cache.insert(endpoint_for(1), object(10));
+		for (unsigned short port = 21; port <= 40; port++) {
+			cache.insert(endpoint_for(port), object(10));
+		}
+		REQUIRE(cache.find(endpoint_for(1)) == nullptr);
+		
+		WHEN("its first eviction has aged out of the ghost queue, but not its second")
+		{
+			for (unsigned short port = 41; port <= 120; port++) {
+				cache.insert(endpoint_for(port), object(10));
+			}
+			
+			cache.insert(endpoint_for(1), object(10));
+			for (unsigned short port = 2000; port < 2300; port++) {
+				cache.insert(endpoint_for(port), object(10));
+			}
+			
+			THEN("it should still have gone into the main queue")
+			{
+				CHECK(cache.find(endpoint_for(1)) != nullptr);
+			}
+		}
+	}
+}
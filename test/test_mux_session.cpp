@@ -0,0 +1,316 @@
+#include <catch.hpp>
+#include <proxything/proxy_server.h>
+#include <proxything/mux_session.h>
+#include <proxything/chunk_pool.h>
+#include <proxything/cache_manager.h>
+#include <proxything/dns_cache.h>
+#include <proxything/fetch_registry.h>
+#include <proxything/fs_service.h>
+#include <proxything/config.h>
+#include <proxything/util.h>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include "helpers.h"
+
+using namespace proxything;
+using namespace proxything::test;
+
+namespace
+{
+	typedef mux_session::frame_type frame_type;
+	
+	/**
+	 * A received frame.
+	 */
+	struct frame
+	{
+		std::uint32_t id;
+		frame_type type;
+		std::string payload;
+	};
+	
+	void write_frame(asio::ip::tcp::socket &socket, std::uint32_t id, frame_type type, const std::string &payload = "")
+	{
+		char header[mux_session::header_size];
+		mux_session::encode_header(header, id, type, payload.size());
+		asio::write(socket, std::vector<asio::const_buffer>{ asio::buffer(header), asio::buffer(payload) });
+	}
+	
+	void write_window(asio::ip::tcp::socket &socket, std::uint32_t id, std::uint32_t increment)
+	{
+		std::string payload = { char(increment >> 24), char(increment >> 16), char(increment >> 8), char(increment) };
+		write_frame(socket, id, frame_type::window, payload);
+	}
+	
+	frame read_frame(asio::ip::tcp::socket &socket)
+	{
+		char header[mux_session::header_size];
+		asio::read(socket, asio::buffer(header));
+		
+		frame f;
+		std::uint32_t size;
+		mux_session::decode_header(header, f.id, f.type, size);
+		f.payload.resize(size);
+		asio::read(socket, asio::buffer(&f.payload[0], size));
+		return f;
+	}
+	
+	/**
+	 * Returns whether anything arrives on the socket within a short while.
+	 */
+	bool quiet(asio::ip::tcp::socket &socket)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		return socket.available() == 0;
+	}
+}
+
+SCENARIO("clients can multiplex requests over one connection")
+{
+	proxy_fixture proxy;
+	stub_dns(proxy.service);
+	
+	// The large response doesn't fit in one stream's window
+	std::vector<char> small(1000, 's');
+	std::vector<char> large(PROXYTHING_MUX_WINDOW + 44 * 1024, 'l');
+	auto &small_upstream = proxy.add_upstream(small);
+	auto &large_upstream = proxy.add_upstream(large);
+	
+	proxy.start();
+	proxy.connect();
+	auto &socket = proxy.socket;
+	
+	GIVEN("a multiplexed connection")
+	{
+		asio::write(socket, asio::buffer(std::string(PROXYTHING_MUX_PREAMBLE "\r\n")));
+		std::string ack(sizeof(PROXYTHING_MUX_PREAMBLE "\r\n") - 1, '\0');
+		asio::read(socket, asio::buffer(&ack[0], ack.size()));
+		REQUIRE(ack == PROXYTHING_MUX_PREAMBLE "\r\n");
+		
+		WHEN("a large and a small object are requested at once")
+		{
+			write_frame(socket, 1, frame_type::request, large_upstream.target());
+			write_frame(socket, 3, frame_type::request, small_upstream.target());
+			
+			// Hold off on granting the large one more window until the small
+			// one's done, so it has to wait its turn
+			std::map<std::uint32_t, std::string> received;
+			std::size_t large_when_small_ended = 0;
+			std::size_t ended = 0;
+			while (ended < 2) {
+				frame f = read_frame(socket);
+				REQUIRE((f.type == frame_type::data || f.type == frame_type::end));
+				
+				if (f.type == frame_type::data) {
+					received[f.id] += f.payload;
+					continue;
+				}
+				
+				ended++;
+				if (f.id == 3) {
+					large_when_small_ended = received[1].size();
+					write_window(socket, 1, large.size());
+				}
+			}
+			
+			THEN("both responses should be complete")
+			{
+				CHECK(received[1] == std::string(large.begin(), large.end()));
+				CHECK(received[3] == std::string(small.begin(), small.end()));
+			}
+			
+			THEN("the small one shouldn't have waited on the large one")
+			{
+				CHECK(large_when_small_ended <= PROXYTHING_MUX_WINDOW);
+			}
+		}
+		
+		WHEN("a stream runs out of window")
+		{
+			write_frame(socket, 1, frame_type::request, large_upstream.target());
+			
+			std::string received;
+			while (received.size() < PROXYTHING_MUX_WINDOW) {
+				frame f = read_frame(socket);
+				REQUIRE(f.type == frame_type::data);
+				received += f.payload;
+			}
+			
+			THEN("nothing more should be sent until it's granted more")
+			{
+				CHECK(received.size() == PROXYTHING_MUX_WINDOW);
+				CHECK(quiet(socket));
+				
+				write_window(socket, 1, large.size());
+				frame f;
+				while ((f = read_frame(socket)).type == frame_type::data) {
+					received += f.payload;
+				}
+				CHECK(f.type == frame_type::end);
+				CHECK(received == std::string(large.begin(), large.end()));
+			}
+			
+			THEN("it should be possible to cancel it")
+			{
+				write_frame(socket, 1, frame_type::cancel);
+				write_window(socket, 1, large.size());
+				write_frame(socket, 3, frame_type::request, small_upstream.target());
+				
+				std::string small_received;
+				frame f;
+				while ((f = read_frame(socket)).type == frame_type::data) {
+					CHECK(f.id == 3);
+					small_received += f.payload;
+				}
+				CHECK(f.id == 3);
+				CHECK(f.type == frame_type::end);
+				CHECK(small_received == std::string(small.begin(), small.end()));
+				CHECK(quiet(socket));
+			}
+		}
+		
+		WHEN("a cached object is requested again")
+		{
+			std::size_t largest_frame = 0;
+			auto fetch = [&](std::uint32_t id) {
+				write_frame(socket, id, frame_type::request, large_upstream.target());
+				write_window(socket, id, large.size());
+				std::string received;
+				frame f;
+				largest_frame = 0;
+				while ((f = read_frame(socket)).type == frame_type::data) {
+					received += f.payload;
+					largest_frame = std::max(largest_frame, f.payload.size());
+				}
+				CHECK(f.type == frame_type::end);
+				return received;
+			};
+			
+			auto &fs = asio::use_service<fs_service>(proxy.service);
+			auto &registry = asio::use_service<fetch_registry>(proxy.service);
+			fetch(1);
+			for (int i = 0; i < 1000 && registry.size(); i++) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(registry.size() == 0);
+			
+			std::size_t nowait_reads = fs.nowait_reads();
+			std::string received = fetch(3);
+			
+			THEN("it should be read from the page cache")
+			{
+				CHECK(received == std::string(large.begin(), large.end()));
+				CHECK(fs.nowait_reads() > nowait_reads);
+			}
+			
+			THEN("its frames should grow while reads keep filling them")
+			{
+				CHECK(largest_frame == PROXYTHING_MUX_FRAME_SIZE);
+			}
+		}
+		
+		WHEN("a cached file is requested while the buffer budget's used up")
+		{
+			auto fetch = [&](std::uint32_t id, const std::string &target, std::size_t size) {
+				write_frame(socket, id, frame_type::request, target);
+				write_window(socket, id, size);
+				std::string received;
+				frame f;
+				while ((f = read_frame(socket)).type == frame_type::data) {
+					received += f.payload;
+				}
+				CHECK(f.type == frame_type::end);
+				return received;
+			};
+			
+			// Cache both first; the small one ends up in memory
+			auto &registry = asio::use_service<fetch_registry>(proxy.service);
+			fetch(1, large_upstream.target(), large.size());
+			fetch(3, small_upstream.target(), small.size());
+			for (int i = 0; i < 1000 && registry.size(); i++) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			REQUIRE(registry.size() == 0);
+			
+			auto &pool = asio::use_service<chunk_pool>(proxy.service);
+			auto held = pool.acquire(pool.budget());
+			
+			write_frame(socket, 5, frame_type::request, large_upstream.target());
+			write_window(socket, 5, large.size());
+			for (int i = 0; i < 1000 && !pool.waiting(); i++) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+			}
+			
+			THEN("it should wait for the budget, without holding up other streams")
+			{
+				CHECK(pool.waiting() == 1);
+				CHECK(fetch(7, small_upstream.target(), small.size()) == std::string(small.begin(), small.end()));
+				
+				held = nullptr;
+				std::string received;
+				frame f;
+				while ((f = read_frame(socket)).type == frame_type::data) {
+					CHECK(f.id == 5);
+					received += f.payload;
+				}
+				CHECK(f.type == frame_type::end);
+				CHECK(received == std::string(large.begin(), large.end()));
+			}
+		}
+		
+		WHEN("an invalid target is requested")
+		{
+			write_frame(socket, 1, frame_type::request, "gibberish");
+			
+			THEN("the stream should end with an error")
+			{
+				frame f = read_frame(socket);
+				CHECK(f.id == 1);
+				CHECK(f.type == frame_type::error);
+				CHECK(f.payload == "Format: IP:port or hostname:port");
+			}
+		}
+		
+		WHEN("targets name hosts")
+		{
+			write_frame(socket, 1, frame_type::request, "nowhere.test:80");
+			write_frame(socket, 3, frame_type::request, "upstream.test:" + std::to_string(small_upstream.port()));
+			
+			THEN("they should be resolved first")
+			{
+				std::map<std::uint32_t, std::string> received;
+				std::map<std::uint32_t, frame_type> ended;
+				while (ended.size() < 2) {
+					frame f = read_frame(socket);
+					if (f.type == frame_type::data) {
+						received[f.id] += f.payload;
+					} else {
+						ended[f.id] = f.type;
+						if (f.type == frame_type::error) {
+							CHECK(f.payload == "Couldn't resolve nowhere.test");
+						}
+					}
+				}
+				
+				CHECK(ended[1] == frame_type::error);
+				CHECK(ended[3] == frame_type::end);
+				CHECK(received[3] == std::string(small.begin(), small.end()));
+			}
+		}
+		
+		WHEN("the client breaks the protocol")
+		{
+			write_frame(socket, 0, frame_type::request, small_upstream.target());
+			
+			THEN("the connection should be closed")
+			{
+				char c;
+				boost::system::error_code ec;
+				asio::read(socket, asio::buffer(&c, 1), ec);
+				CHECK(ec == asio::error::eof);
+			}
+		}
+	}
+	
+}
@@ -0,0 +1,187 @@
+#include <catch.hpp>
+#include <proxything/parser.h>
+#include <string>
+#include <vector>
+
+using namespace proxything;
+
+namespace
+{
+	asio::ip::tcp::endpoint parse(const std::string &target, boost::system::error_code &ec)
+	{
+		return parser::parse_endpoint(target.data(), target.data() + target.size(), ec);
+	}
+}
+
+SCENARIO("lines can be found in a buffer")
+{
+	GIVEN("a buffer with a couple of lines in it")
+	{
+		std::string buf = "127.0.0.1:1234\r\n[::1]:80\r\npartial";
+		const char *begin = buf.data(), *end = buf.data() + buf.size();
+		
+		THEN("each line end should be found in turn")
+		{
+			const char *first = parser::find_line_end(begin, end);
+			REQUIRE(first == begin + 15);
+			const char *second = parser::find_line_end(first + 1, end);
+			REQUIRE(second == begin + 25);
+			CHECK(parser::find_line_end(second + 1, end) == nullptr);
+		}
+	}
+	
+	GIVEN("an empty buffer")
+	{
+		std::string buf;
+		
+		THEN("no line should be found")
+		{
+			CHECK(parser::find_line_end(buf.data(), buf.data()) == nullptr);
+		}
+	}
+}
+
+SCENARIO("endpoints can be parsed without throwing")
+{
+	boost::system::error_code ec;
+	
+	GIVEN("valid targets")
+	{
+		THEN("they should be parsed")
+		{
+			auto ep = parse("10.0.255.1:65535", ec);
+			CHECK_FALSE(ec);
+			CHECK(ep.address().to_string() == "10.0.255.1");
+			CHECK(ep.port() == 65535);
+			
+			ep = parse("0.0.0.0:1", ec);
+			CHECK_FALSE(ec);
+			CHECK(ep.address().to_string() == "0.0.0.0");
+			CHECK(ep.port() == 1);
+			
+			ep = parse("::1:80", ec);
+			CHECK_FALSE(ec);
+			CHECK(ep.address().to_string() == "::1");
+			
+			ep = parse("[::ffff:1.2.3.4]:80", ec);
+			CHECK_FALSE(ec);
+			CHECK(ep.address().is_v6());
+		}
+	}
+	
+	GIVEN("invalid targets")
+	{
+		THEN("each should be rejected with the right error")
+		{
+			parse("", ec);
+			CHECK(ec == parser::missing_port);
+			parse("127.0.0.1", ec);
+			CHECK(ec == parser::missing_port);
+			
+			parse(":80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("[]:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("1.2.3:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("1.2.3.4.5:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("1.2.3.256:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("1.2.3.04:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("1.2.3.1234:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse(" 1.2.3.4:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("[1.2.3.4:80", ec);
+			CHECK(ec == parser::invalid_address);
+			parse("[" + std::string(100, ':') + "]:80", ec);
+			CHECK(ec == parser::invalid_address);
+			
+			parse("1.2.3.4:", ec);
+			CHECK(ec == parser::invalid_port);
+			parse("1.2.3.4:8o", ec);
+			CHECK(ec == parser::invalid_port);
+			parse("1.2.3.4: 80", ec);
+			CHECK(ec == parser::invalid_port);
+			
+			parse("1.2.3.4:0", ec);
+			CHECK(ec == parser::port_out_of_range);
+			parse("1.2.3.4:65536", ec);
+			CHECK(ec == parser::port_out_of_range);
+			parse("1.2.3.4:99999999999999999999999", ec);
+			CHECK(ec == parser::port_out_of_range);
+		}
+		
+		THEN("errors should carry a message")
+		{
+			parse("nope", ec);
+			CHECK(ec.message() == "Format: IP:port or hostname:port");
+		}
+	}
+	
+	GIVEN("a target in the middle of a buffer")
+	{
+		std::string buf = "xx127.0.0.1:8080yy";
+		
+		THEN("only the given range should be parsed")
+		{
+			auto ep = parser::parse_endpoint(buf.data() + 2, buf.data() + buf.size() - 2, ec);
+			CHECK_FALSE(ec);
+			CHECK(ep.port() == 8080);
+		}
+	}
+}
+
+SCENARIO("targets can name a host to be resolved")
+{
+	boost::system::error_code ec;
+	
+	GIVEN("a hostname and port")
+	{
+		std::string buf = "upstream-1.example.com:8080";
+		auto target = parser::parse_target(buf.data(), buf.data() + buf.size(), ec);
+		
+		THEN("the hostname should point into the buffer")
+		{
+			REQUIRE_FALSE(ec);
+			REQUIRE(target.has_host());
+			CHECK(std::string(target.host_begin, target.host_end) == "upstream-1.example.com");
+			CHECK(target.endpoint.port() == 8080);
+		}
+	}
+	
+	GIVEN("an address and port")
+	{
+		std::string buf = "127.0.0.1:80";
+		auto target = parser::parse_target(buf.data(), buf.data() + buf.size(), ec);
+		
+		THEN("there should be no hostname")
+		{
+			REQUIRE_FALSE(ec);
+			CHECK_FALSE(target.has_host());
+			CHECK(target.endpoint.address().to_string() == "127.0.0.1");
+		}
+	}
+	
+	GIVEN("invalid hostnames")
+	{
+		THEN("each should be rejected")
+		{
+			for (std::string buf : std::vector<std::string>{ "-abc.com:80", "abc-.com:80", "a..b:80", "a_b.com:80", "[localhost]:80", "1.2.3:80", std::string(64, 'a') + ".com:80" }) {
+				parser::parse_target(buf.data(), buf.data() + buf.size(), ec);
+				CHECK(ec == parser::invalid_address);
+			}
+		}
+	}
+	
+	GIVEN("a hostname where an endpoint is expected")
+	{
+		THEN("it should be rejected")
+		{
+			parse("localhost:80", ec);
+			CHECK(ec == parser::invalid_address);
+		}
+	}
+}
@@ -23,5 +23,18 @@ SCENARIO("listening works")
 				CHECK(server.acceptor().local_endpoint().port() == port);
 			}
 		}
+		
+		WHEN("another server shares the port")
+		{
+			proxy_server other(service);
+			server.listen(host, port, true);
+			other.listen(host, port, true);
+			
+			THEN("both should be listening on it")
+			{
+				CHECK(server.acceptor().local_endpoint().port() == port);
+				CHECK(other.acceptor().local_endpoint().port() == port);
+			}
+		}
 	}
 }
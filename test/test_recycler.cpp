@@ -0,0 +1,148 @@
+#include <catch.hpp>
+#include <proxything/recycler.h>
+#include <proxything/config.h>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace proxything;
+
+SCENARIO("blocks are recycled on each thread")
+{
+	GIVEN("a freed block")
+	{
+		void *p = recycler::allocate(100);
+		std::size_t before = recycler::cached();
+		recycler::deallocate(p, 100);
+		
+		THEN("it should be kept")
+		{
+			CHECK(recycler::cached() == before + 1);
+		}
+		
+		THEN("it should be reused for blocks of the same size class")
+		{
+			void *q = recycler::allocate(recycler::granularity + 1);
+			CHECK(q == p);
+			CHECK(recycler::cached() == before);
+			recycler::deallocate(q, recycler::granularity + 1);
+		}
+		
+		THEN("it should not be reused for other sizes")
+		{
+			void *q = recycler::allocate(10);
+			CHECK(q != p);
+			recycler::deallocate(q, 10);
+		}
+		
+		THEN("other threads should have their own blocks")
+		{
+			void *q = nullptr;
+			std::thread([&]{
+				q = recycler::allocate(100);
+				recycler::deallocate(q, 100);
+			}).join();
+			CHECK(q != p);
+		}
+	}
+	
+	GIVEN("a block too big to recycle")
+	{
+		std::size_t before = recycler::cached();
+		void *p = recycler::allocate(PROXYTHING_RECYCLER_MAX_SIZE + 1);
+		recycler::deallocate(p, PROXYTHING_RECYCLER_MAX_SIZE + 1);
+		
+		THEN("it should go back to the heap")
+		{
+			CHECK(recycler::cached() == before);
+		}
+	}
+	
+	GIVEN("more freed blocks than a thread keeps")
+	{
+		std::size_t before = recycler::cached();
+		std::vector<void*> blocks;
+		for (std::size_t i = 0; i <= PROXYTHING_RECYCLER_BYTES / PROXYTHING_RECYCLER_MAX_SIZE; i++) {
+			blocks.push_back(recycler::allocate(PROXYTHING_RECYCLER_MAX_SIZE));
+		}
+		for (void *p : blocks) {
+			recycler::deallocate(p, PROXYTHING_RECYCLER_MAX_SIZE);
+		}
+		
+		THEN("the rest should go back to the heap")
+		{
+			CHECK(recycler::cached() == before + PROXYTHING_RECYCLER_BYTES / PROXYTHING_RECYCLER_MAX_SIZE);
+		}
+	}
+}
+
+SCENARIO("objects can be allocated from the recycler")
+{
+	GIVEN("a shared object")
+	{
+		auto a = std::allocate_shared<int>(recycling_allocator<int>(), 42);
+		int *address = a.get();
+		CHECK(*a == 42);
+		
+		WHEN("it's released and another's allocated")
+		{
+			a.reset();
+			auto b = std::allocate_shared<int>(recycling_allocator<int>(), 43);
+			
+			THEN("it should reuse the memory")
+			{
+				CHECK(b.get() == address);
+				CHECK(*b == 43);
+			}
+		}
+	}
+}
+
+SCENARIO("asio handlers can be allocated from the recycler")
+{
+	asio::io_service service;
+	
+	GIVEN("a recycled handler")
+	{
+		int calls = 0;
+		service.post(recycle([&]{ calls++; }));
+		std::size_t before = recycler::cached();
+		service.run();
+		
+		THEN("it should be called")
+		{
+			CHECK(calls == 1);
+		}
+		
+		THEN("its operation should be freed to the recycler")
+		{
+			CHECK(recycler::cached() == before + 1);
+		}
+		
+		WHEN("another one is posted")
+		{
+			service.reset();
+			service.post(recycle([&]{ calls++; }));
+			
+			THEN("it should reuse the memory")
+			{
+				CHECK(recycler::cached() == before);
+				service.run();
+				CHECK(calls == 2);
+			}
+		}
+	}
+	
+	GIVEN("a recycled handler in a strand")
+	{
+		asio::io_service::strand strand(service);
+		bool in_strand = false;
+		service.post(strand.wrap(recycle([&]{ in_strand = strand.running_in_this_thread(); })));
+		service.run();
+		
+		THEN("it should still run in the strand")
+		{
+			CHECK(in_strand);
+		}
+	}
+}
@@ -0,0 +1,108 @@
+#include <catch.hpp>
+#include <proxything/proxy_server.h>
+#include <proxything/cache_manager.h>
+#include <proxything/util.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "helpers.h"
+
+using namespace proxything;
+using namespace proxything::test;
+
+namespace
+{
+	/**
+	 * Returns the response an upstream serves; unique per upstream.
+	 */
+	std::vector<char> payload_for(std::size_t i, std::size_t size)
+	{
+		std::vector<char> payload(size);
+		for (std::size_t j = 0; j < size; j++) {
+			payload[j] = static_cast<char>(i * 31 + j);
+		}
+		return payload;
+	}
+}
+
+SCENARIO("the proxy can be hammered from several threads")
+{
+	proxy_fixture proxy;
+	
+	GIVEN("a proxy running on several threads, and a few upstreams")
+	{
+		const std::size_t num_threads = 4;
+		const std::size_t num_upstreams = 8;
+		const std::size_t num_clients = 16;
+		const std::size_t requests_per_client = 16;
+		
+		// Half of the responses fit in memory, the other half only on disk
+		asio::io_service upstream_service;
+		std::vector<std::unique_ptr<upstream>> upstreams;
+		for (std::size_t i = 0; i < num_upstreams; i++) {
+			upstreams.emplace_back(new upstream(upstream_service, payload_for(i, i % 2 ? 1024 : 512 * 1024)));
+			upstreams.back()->accept();
+		}
+		std::vector<std::string> commands;
+		for (auto &up : upstreams) {
+			commands.push_back(up->command());
+		}
+		std::thread upstream_thread([&]{ upstream_service.run(); });
+		
+		proxy.start(num_threads);
+		auto proxy_endpoint = proxy.server->acceptor().local_endpoint();
+		
+		WHEN("clients request them all at once, over and over")
+		{
+			std::atomic<std::size_t> good(0);
+			std::vector<std::thread> clients;
+			for (std::size_t c = 0; c < num_clients; c++) {
+				clients.emplace_back([&, c]{
+					asio::io_service client_service;
+					asio::ip::tcp::socket socket(client_service);
+					boost::system::error_code ec;
+					socket.connect(proxy_endpoint, ec);
+					if (ec) {
+						return;
+					}
+					
+					set_timeout(socket);
+					
+					for (std::size_t r = 0; r < requests_per_client; r++) {
+						std::size_t i = (c + r) % num_upstreams;
+						auto &up = *upstreams[i];
+						asio::write(socket, asio::buffer(commands[i]), ec);
+						
+						std::vector<char> response(up.payload.size());
+						asio::read(socket, asio::buffer(response), ec);
+						if (ec || response != up.payload) {
+							return;
+						}
+						good++;
+					}
+				});
+			}
+			for (auto &client : clients) {
+				client.join();
+			}
+			
+			THEN("every response should be complete and correct")
+			{
+				CHECK(good == num_clients * requests_per_client);
+			}
+			
+			THEN("each upstream should only have been fetched once")
+			{
+				for (auto &up : upstreams) {
+					CHECK(up->connections == 1);
+				}
+			}
+		}
+		
+		proxy.stop();
+		
+		upstream_service.stop();
+		upstream_thread.join();
+	}
+}
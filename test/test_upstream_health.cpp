@@ -0,0 +1,89 @@
+#include <catch.hpp>
+#include <proxything/upstream_health.h>
+#include <thread>
+
+using namespace proxything;
+
+SCENARIO("failing upstreams are backed off from")
+{
+	asio::io_service service;
+	auto health = new upstream_health(service, std::chrono::milliseconds(50), std::chrono::milliseconds(150));
+	asio::add_service(service, health);
+	asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string("127.0.0.1"), 1234);
+	asio::ip::tcp::endpoint other(asio::ip::address::from_string("127.0.0.1"), 1235);
+	
+	GIVEN("an upstream that's never failed")
+	{
+		THEN("it should be available")
+		{
+			CHECK(health->available(endpoint));
+			CHECK(health->size() == 0);
+		}
+	}
+	
+	GIVEN("an upstream that's failed once")
+	{
+		REQUIRE(health->failed(endpoint) == std::chrono::milliseconds(50));
+		
+		THEN("it should be down")
+		{
+			CHECK_FALSE(health->available(endpoint));
+			CHECK(health->size() == 1);
+		}
+		
+		THEN("other upstreams should not be affected")
+		{
+			CHECK(health->available(other));
+		}
+		
+		THEN("it should be available again once the backoff is over")
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(60));
+			CHECK(health->available(endpoint));
+		}
+		
+		WHEN("it fails again")
+		{
+			auto second = health->failed(endpoint);
+			auto third = health->failed(endpoint);
+			auto fourth = health->failed(endpoint);
+			
+			THEN("the backoff should double, up to the limit")
+			{
+				CHECK(second == std::chrono::milliseconds(100));
+				CHECK(third == std::chrono::milliseconds(150));
+				CHECK(fourth == std::chrono::milliseconds(150));
+			}
+		}
+		
+		WHEN("it's connected to successfully")
+		{
+			health->succeeded(endpoint);
+			
+			THEN("it should be forgotten")
+			{
+				CHECK(health->available(endpoint));
+				CHECK(health->size() == 0);
+				CHECK(health->failed(endpoint) == std::chrono::milliseconds(50));
+			}
+		}
+	}
+	
+	GIVEN("a tracker sharing this one")
+	{
+		asio::io_service other_service;
+		auto shared = new upstream_health(other_service, *health);
+		asio::add_service(other_service, shared);
+		
+		WHEN("an upstream fails through it")
+		{
+			shared->failed(endpoint);
+			
+			THEN("it should be down for both")
+			{
+				CHECK_FALSE(health->available(endpoint));
+				CHECK_FALSE(shared->available(endpoint));
+			}
+		}
+	}
+}